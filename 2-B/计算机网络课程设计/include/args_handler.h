@@ -1,16 +1,41 @@
 #ifndef ARGS_HANDLER_H
 #define ARGS_HANDLER_H
 #include <stdint.h>
+#include <netinet/in.h>
+#include "../include/upstream.h"
+#include "../include/cluster.h"
 
 #define DEFAULT_DEBUG_LEVEL 0
 #define DEFAULT_DNS_SERVER_ADDR "10.3.9.4"
 #define DEFAULT_LOCAL_FILE_ADDR "dnsrelay.txt"
+#define DEFAULT_WORKERS 1
+#define DEFAULT_BATCH 64
 
 typedef struct {
-    // 参数结构体，包含调试等级、dns服务器地址、本地文件地址
+    // 参数结构体，包含调试等级、dns服务器地址、本地文件地址、工作线程数、每次系统调用收发的报文数、缓存大小、
+    // 与DNS服务器通信的端口数、对冲请求的百分位、过期答复的应答时限、查询日志文件、指标服务的套接字、监听端口、
+    // 每个工作线程的报文缓冲区数、截断的答复是否经TCP重新查询、EDNS的UDP载荷大小、共享内存缓存、集群中的节点
     int debug_level;
-    uint32_t dns_server_addr;
+    struct sockaddr_in upstreams[MAX_UPSTREAMS]; // dns服务器地址
+    int upstream_cnt;
     char *local_file_addr;
+    int workers;
+    int batch;
+    int cache_size; // 单位MB
+    int upstream_ports; // 每个工作线程的端口数
+    int hedge_percentile; // 0表示不发对冲请求
+    int max_stale; // 缓存过期后可继续应答的秒数
+    char *query_log; // 二进制查询日志文件，NULL表示不记录
+    char *metrics_socket; // 输出Prometheus指标的UNIX域套接字，NULL表示不开启
+    uint16_t listen_port; // 接收客户端请求的UDP端口
+    int packets; // 每个工作线程的报文缓冲区数，同时限制进行中的请求数
+    int tcp; // 答复被截断时是否经TCP向同一台服务器重新查询
+    uint16_t edns_size; // 向客户端与DNS服务器声明、并按此收发的EDNS UDP载荷大小
+    char *shared_cache; // 同一主机上各进程共享的缓存所在的POSIX共享内存名称，NULL表示不共享
+    int shared_cache_size; // 创建共享内存缓存时的大小，单位MB
+    struct sockaddr_in peers[MAX_PEERS + 1]; // 集群中其他节点接收请求的地址，配置的列表可含本节点，解析后去掉
+    int peer_cnt; // 其他节点数，0表示不组成集群
+    struct sockaddr_in cluster_self; // 本节点在集群中的地址，即其他节点配置的地址，默认127.0.0.1与监听端口
 } arguments;
 
 extern arguments args; // 全局变量，供其他文件使用
@@ -0,0 +1,66 @@
+/**
+ * @file cache.h
+ * @brief DNS服务器答复的缓存，按(qname, qtype, qclass)与请求的CD、DO位索引，遵循答复中的TTL；热门条目到期前预取，过期后在限定时间内
+ * 保留，照常查询DNS服务器，查询失败或迟迟不答复时才以旧答复应答（RFC 8767）；可选地以共享内存缓存作为同一主机上各进程共用的第二级缓存
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../include/dns_parser.h"
+#include "../include/shm_cache.h"
+
+#define DEFAULT_CACHE_SIZE 64 // 默认缓存总大小，单位MB，由各工作线程平分
+#define MAX_CACHE_TTL 86400 // 缓存时间上限，单位秒
+#define MAX_TTL_FIELDS 64 // 一条答复中最多记录的TTL字段数，超出则不缓存
+#define DEFAULT_MAX_STALE 86400 // 过期条目可继续应答的默认秒数，RFC 8767建议1到3天
+#define STALE_TTL 30 // 过期答复中的TTL，RFC 8767建议30秒
+#define STALE_WAIT_MS 1800 // 缓存中有过期的答复时等待DNS服务器答复的时间，超过后以过期的答复应答，RFC 8767建议1.8秒
+#define HOT_HITS 8 // 一个TTL内命中达到该次数的条目为热门条目
+#define PREFETCH_PERCENT 10 // 热门条目剩余TTL不足原TTL的该百分比时预取
+
+#define CACHE_MISS 0 // 未命中
+#define CACHE_FRESH 1 // 命中，无需刷新
+#define CACHE_REFRESH 2 // 命中，应在后台刷新：热门条目即将过期
+#define CACHE_STALE 3 // 条目已过期但仍在可应答的时间内，构造的答复留待查询DNS服务器失败时使用
+#define CACHE_SHARED 4 // 与命中的结果按位或：条目是刚从共享内存缓存取入的
+
+typedef struct cache_entry {
+    struct cache_entry *hnext; // 哈希桶中的下一条
+    struct cache_entry *prev, *next; // LRU链表，表头为最近使用
+    uint32_t hash;
+    uint16_t qtype;
+    uint16_t qclass;
+    uint8_t dnssec; // DNSSEC_CD与DNSSEC_DO，带DNSSEC记录的答复不交给未要求的客户端，反之亦然
+    uint64_t stored; // 存入时间，单调时钟毫秒数
+    uint64_t expire; // 过期时间
+    uint32_t hits; // 存入后的命中次数
+    size_t size; // 占用的内存
+    uint16_t len; // 答复报文长度
+    uint16_t opt_len; // 答复末尾OPT记录的长度，0表示没有
+    uint8_t name_len; // 域名长度，含结尾的0
+    uint8_t ttl_cnt; // TTL字段数
+    unsigned char data[]; // 各TTL字段在答复报文中的偏移（uint16_t），随后是域名与答复报文
+} cache_entry; // 缓存条目
+
+typedef struct {
+    cache_entry **buckets; // 哈希桶
+    uint32_t mask; // 桶数减1
+    uint32_t count; // 条目数
+    size_t used; // 已用内存
+    size_t budget; // 内存上限
+    uint32_t max_stale; // 过期后可继续应答的秒数，0表示不用过期的答复应答
+    unsigned char opt[OPT_LEN]; // 条目没有OPT记录而请求有时附上的OPT记录，声明中继的UDP载荷大小
+    shm_cache *shared; // 各进程共享的第二级缓存，NULL表示不共享
+    cache_entry lru; // LRU链表的哨兵
+} answer_cache; // 答复缓存，每个工作线程一份
+
+extern void cache_init(answer_cache *c, size_t budget, uint32_t max_stale, uint16_t udp_size,
+                       shm_cache *shared); // 初始化缓存
+extern int cache_lookup(answer_cache *c, const question_t *q, const unsigned char *request, unsigned char *out,
+                        int limit, uint64_t now, int *len); // 查找缓存并构造答复，返回CACHE_MISS等
+extern void cache_store(answer_cache *c, const question_t *q, const unsigned char *msg, int len,
+                        uint64_t now); // 缓存DNS服务器的答复
+
+#endif
@@ -0,0 +1,34 @@
+/**
+ * @file cluster.h
+ * @brief 集群模式的一致性哈希环：各节点按地址在环上放置若干虚拟节点，域名由环上顺时针方向最近的节点负责；
+ *        节点列表相同的节点得到相同的环，增删一个节点只影响它相邻的区间
+ */
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "../include/upstream.h"
+
+#define MAX_PEERS MAX_UPSTREAMS // 最多配置的其他节点数，与DNS服务器一样用upstream_set记录RTT与丢包
+#define PEER_BASE MAX_UPSTREAMS // 槽中发往其他节点的记录为PEER_BASE加节点下标，与DNS服务器的下标区分
+#define CLUSTER_VNODES 64 // 每个节点在环上的虚拟节点数，使各节点负责的区间大致均匀
+#define CLUSTER_SELF (-1) // 由本节点负责
+#define CLUSTER_MARK 0x4 // 报文头z字段中保留的Z位，标记其他节点代为查询的请求，收到时不再转给其他节点
+#define PEER_RETRY_MS 1000 // 其他节点超时未答复后，在此期间不再向它查询，单位毫秒
+
+typedef struct {
+    uint32_t point; // 在环上的位置
+    int member; // 所属的节点，CLUSTER_SELF或其他节点的下标
+} ring_point; // 环上的一个虚拟节点
+
+typedef struct {
+    ring_point points[(MAX_PEERS + 1) * CLUSTER_VNODES]; // 按位置排序
+    int cnt;
+} hash_ring; // 一致性哈希环，初始化后只读，各工作线程共用
+
+extern void ring_init(hash_ring *r, const struct sockaddr_in *self, const struct sockaddr_in *peers,
+                      int peer_cnt); // 由本节点与其他节点的地址构造环
+extern int ring_owner(const hash_ring *r, uint32_t hash); // 负责该域名哈希的节点
+
+#endif
@@ -1,17 +1,19 @@
-/**
- * @file consts.h
- * @brief 常量定义
- */
-#ifndef CONSTS_H
-#define CONSTS_H
-
-// 最大域名长度
-#define MAX_NAME_LEN 255
-// DNS端口
-#define DNS_PORT 53
-// 最大消息长度
-#define MAX_MSG_LEN 512
-// 超时时间
-#define TIMEOUT 2
-
-#endif
+/**
+ * @file consts.h
+ * @brief 常量定义
+ */
+#ifndef CONSTS_H
+#define CONSTS_H
+
+// 最大域名长度
+#define MAX_NAME_LEN 255
+// 一个域名最多的标签数
+#define MAX_LABELS 128
+// DNS端口
+#define DNS_PORT 53
+// 不带EDNS时UDP报文的最大长度
+#define MAX_MSG_LEN 512
+// 转发请求的最终超时时间，单位秒，期间按RTO重传
+#define TIMEOUT 2
+
+#endif
@@ -1,35 +1,68 @@
-#ifndef DNS_PARSER_H
-#define DNS_PARSER_H
-
-#include "../include/structs.h"
-
-#define REJECT 0
-#define ACCEPT 1
-
-extern char *name_parse(const char *buf); // 解析域名
-extern void fill_header(Header *to_fill, const Header *src, int type); // 填充头部
-extern void construct_RR(unsigned char *rr, uint32_t result); // 构造资源记录
-extern void construct_response(unsigned char *response, Header *response_head, const unsigned char *buf, int len,
-                               const unsigned char *rr); // 构造响应报文
-
-#define TYPE uint16_t
-#define A 1
-#define NS 2
-#define MD 3
-#define MF 4
-#define CNAME 5
-#define SOA 6
-#define MB 7
-#define MG 8
-#define MR 9
-#define NULL_R 10
-#define WKS 11
-#define PTR 12
-#define HINFO 13
-#define MINFO 14
-#define MX 15
-#define TXT 16
-#define AAAA 28
-extern TYPE get_question_type(const unsigned char *question); // 获取Question字段类型
-
-#endif
+#ifndef DNS_PARSER_H
+#define DNS_PARSER_H
+
+#include "../include/structs.h"
+#include "../include/consts.h"
+
+#define REJECT 0
+#define ACCEPT 1
+
+#define OPT_LEN 11 // 不带选项的OPT记录长度
+#define DEFAULT_EDNS_SIZE 1232 // 默认的EDNS UDP载荷大小，避免IP分片
+#define BADVERS 16 // EDNS版本不支持的扩展RCODE（RFC 6891）
+#define DNSSEC_CD 0x1 // 报文头的CD位，请求不要求DNS服务器做DNSSEC验证
+#define DNSSEC_DO 0x2 // OPT记录的DO位，请求要求答复带DNSSEC记录（RFC 3225）
+#define HEADER_CD 0x1 // 报文头z字段中CD位的位置
+
+typedef struct {
+    unsigned char name[MAX_NAME_LEN + 1]; // 转为小写的线上格式域名，以0结尾
+    int name_len; // 域名长度，含结尾的0
+    uint8_t label_offs[MAX_LABELS]; // 各标签的长度字节在name中的偏移
+    int label_cnt; // 标签数
+    uint32_t hash; // 点分形式域名的FNV-1a哈希，与记录表的哈希一致
+    uint16_t qtype;
+    uint16_t qclass;
+    int end; // Question段之后第一个字节在报文中的偏移
+    uint16_t udp_size; // OPT记录声明的UDP载荷大小，不小于512；0表示报文没有OPT记录
+    uint8_t edns_version; // OPT记录中的EDNS版本
+    int opt_off; // OPT记录在报文中的偏移
+    int opt_len; // OPT记录的长度
+    uint8_t dnssec; // DNSSEC_CD与DNSSEC_DO，决定答复中有哪些记录，与域名、类型、类一起作为缓存的键
+} question_t; // 解析出的Question字段，用作缓存的键
+
+extern void name_to_text(const question_t *q, char *text); // 转为点分形式的域名，仅用于输出调试信息
+extern void fill_header(Header *to_fill, const Header *src, int type); // 填充头部
+extern void construct_RR(unsigned char *rr, uint32_t result); // 构造资源记录
+extern int construct_RR_data(unsigned char *rr, uint16_t type, const void *rdata,
+                             uint16_t rdlength); // 构造任意类型的资源记录，返回长度
+extern int text_to_name(const char *text, unsigned char *name); // 点分形式的域名转为线上格式
+extern void construct_response(unsigned char *response, Header *response_head, const unsigned char *buf, int len,
+                               const unsigned char *rr); // 构造响应报文
+extern int truncate_reply(unsigned char *msg, const question_t *q); // 截断为只含Question段的答复并设置TC位
+extern int write_opt(unsigned char *p, uint16_t udp_size, uint8_t ext_rcode); // 构造不带选项的OPT记录，返回长度
+
+#define TYPE uint16_t
+#define A 1
+#define NS 2
+#define MD 3
+#define MF 4
+#define CNAME 5
+#define SOA 6
+#define MB 7
+#define MG 8
+#define MR 9
+#define NULL_R 10
+#define WKS 11
+#define PTR 12
+#define HINFO 13
+#define MINFO 14
+#define MX 15
+#define TXT 16
+#define AAAA 28
+#define OPT 41
+extern const char *type_name(TYPE type); // 类型名称
+extern int parse_question(const unsigned char *msg, int len, question_t *q); // 解析并校验报文的第一个Question
+extern int skip_name(const unsigned char *msg, int len, int pos); // 跳过可能含压缩指针的域名
+extern int parse_edns(const unsigned char *msg, int len, question_t *q); // 找出附加段中的OPT记录（RFC 6891）
+
+#endif
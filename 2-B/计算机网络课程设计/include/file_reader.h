@@ -1,18 +1,67 @@
-#ifndef FILE_READER_H
-#define FILE_READER_H
-
-#include <stdint.h>
-#define MAX_ENTRY_LEN 10000
-#define MAX_ADDR_LEN 15
-
-typedef struct {
-    uint32_t addr;
-    char *name;
-} pair; // （地址，域名）结构体
-
-extern pair pairs[MAX_ENTRY_LEN]; // （地址，域名）数组
-extern uint32_t entries_cnt; // 文件中的记录数
-extern void load_file(); // 加载文件，将文件中的数据读入内存
-extern uint32_t find_entry(char *name); // 在内存中查找name对应的地址
-
-#endif
+#ifndef FILE_READER_H
+#define FILE_READER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../include/suffix_trie.h"
+#include "../include/dns_parser.h"
+#define MAX_ADDR_LEN 39 // IPv6地址文本的最大长度
+#define MAX_LOCAL_RRS 32 // 一个域名最多的A记录数与AAAA记录数
+#define LOCAL_A 0 // 答复模板中A记录的下标
+#define LOCAL_AAAA 1 // 答复模板中AAAA记录的下标
+
+#define DB_MAGIC "DNSRLYDB" // 预编译记录库的文件标识
+#define DB_VERSION 4 // 预编译记录库的格式版本
+
+typedef struct {
+    uint32_t hash; // 域名的哈希值，查找时先比较哈希，避免访问域名字节
+    uint32_t name_off; // 域名在字节区中的偏移，0表示空槽
+    uint32_t record_off; // 预先构造的答复在字节区中的偏移
+} entry_slot; // 哈希表的槽
+
+typedef struct {
+    Header header; // 答复的报文头，发送时只需填入请求的id、opcode、rd与回答数
+    uint16_t size; // 模板总长度，加载时据此合并相同的模板
+    uint16_t blocked; // 是否屏蔽，屏蔽时只返回报文头
+    uint16_t cname_len; // data开头的CNAME记录长度，0表示没有；有CNAME时A与AAAA记录是其目标的记录
+    uint16_t rr_off[2]; // A与AAAA记录在data中的偏移，每种记录连续存放，发送时轮转
+    uint16_t rr_cnt[2]; // A与AAAA记录数
+    unsigned char data[]; // 预先构造的资源记录，域名均为指向Question的指针0xc00c
+} local_record; // 一个域名的答复模板，存放在字节区中，按4字节对齐，内容相同的模板共用一份
+
+typedef struct {
+    entry_slot *slots; // 开放定址的哈希表，线性探测
+    uint32_t mask; // 槽数减1，槽数为2的幂
+    uint32_t count; // 记录数
+    char *pool; // 字节区，存放域名与答复模板，域名均转为小写并以'\0'结尾
+    uint32_t pool_len; // 字节区已用长度
+    uint32_t pool_cap; // 字节区容量
+    suffix_trie trie; // 后缀规则，精确匹配的记录优先
+    void *map_base; // 由预编译记录库映射而来时为映射的起始地址，否则为NULL
+    size_t map_len; // 映射长度
+} table_t; // 本地记录表
+
+typedef struct {
+    char magic[8]; // DB_MAGIC
+    uint32_t version; // DB_VERSION
+    uint32_t mask; // 槽数减1
+    uint32_t count; // 记录数
+    uint32_t pool_len; // 字节区长度
+    uint32_t node_cnt; // 后缀字典树的节点数
+    uint32_t labels_len; // 后缀字典树的标签区长度
+    uint64_t slots_off; // 槽数组在文件中的偏移
+    uint64_t pool_off; // 字节区在文件中的偏移
+    uint64_t nodes_off; // 字典树节点数组在文件中的偏移
+    uint64_t labels_off; // 字典树标签区在文件中的偏移
+} db_header; // 预编译记录库的文件头，其后依次是槽数组、字节区、字典树节点与标签区，整数均为本机字节序
+
+extern _Atomic(table_t *) table; // 当前的本地记录表，重新加载时整体替换，读者无需加锁
+extern void load_file(); // 加载文件，将文件中的数据读入内存
+extern table_t *reload_file(); // 重新加载文件并替换当前记录表，返回被替换的旧表
+extern int table_load(table_t *t, const char *path); // 加载文本文件或预编译记录库
+extern int table_save(const table_t *t, const char *path); // 将记录表写为预编译记录库
+extern void table_free(table_t *t); // 释放记录表
+extern const local_record *find_entry(const question_t *q); // 在内存中查找Question中域名对应的答复模板
+
+#endif
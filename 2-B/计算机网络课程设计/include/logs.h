@@ -9,12 +9,14 @@
 #include <stdio.h>
 
 // 打印带时间的调试信息
-// 定义成宏是为了方便参数传递
+// 定义成宏是为了方便参数传递，多个工作线程同时调用，因此使用localtime_r
+// 宏内的局部变量带后缀，避免遮蔽调用处的同名变量
 #define print_with_time(fmt, ...) do { \
-                        time_t t = time(NULL); \
-                        struct tm *info = localtime(&t); \
-                        printf("%d/%d/%d %02d:%02d:%02d ", info->tm_year + 1900, info->tm_mon + 1, \
-                                info->tm_mday, info->tm_hour, info->tm_min, info->tm_sec); \
+                        time_t log_now_ = time(NULL); \
+                        struct tm log_tm_; \
+                        localtime_r(&log_now_, &log_tm_); \
+                        printf("%d/%d/%d %02d:%02d:%02d ", log_tm_.tm_year + 1900, log_tm_.tm_mon + 1, \
+                                log_tm_.tm_mday, log_tm_.tm_hour, log_tm_.tm_min, log_tm_.tm_sec); \
                         printf(fmt "\n", ##__VA_ARGS__); \
                     } while (0)
 
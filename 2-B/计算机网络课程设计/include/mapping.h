@@ -1,24 +1,87 @@
-#ifndef MAPPING_H
-#define MAPPING_H
-
-#include <arpa/inet.h>
-#include "../include/structs.h"
-
-//  用于表示bool类型，但是增加了deleted状态
-#define bool uint8_t
-#define false 0
-#define true 1
-#define deleted 2
-
-typedef struct {
-    uint16_t id;
-    struct sockaddr_in addr;
-    bool is_arrived; // 用来表示计时器超时前是否收到dns服务器的回复，deleted表示超时但未收到，将这一映射删除
-} Map; // 用于映射id
-
-extern Map map[UINT16_MAX]; // 用于映射id
-
-extern uint16_t convert_id_to_cnt(Header *h, struct sockaddr_in cli_addr);
-extern bool convert_cnt_to_id(Header *head, struct sockaddr_in *local_cli_addr);
-
-#endif
\ No newline at end of file
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include "../include/structs.h"
+#include "../include/dns_parser.h"
+#include "../include/upstream.h"
+
+//  用于表示bool类型，但是增加了deleted状态
+#define bool uint8_t
+#define false 0
+#define true 1
+#define deleted 2
+
+#define MAX_UPSTREAM_PORTS 16 // 每个工作线程与DNS服务器通信的最大端口数
+#define DEFAULT_UPSTREAM_PORTS 4
+#define SLOTS_PER_PORT 65536 // 每个端口可用的id数
+#define MAX_TRIES 8 // 一个请求最多发送的次数，含对冲与重传
+#define STALE_NONE 0 // 缓存中没有同一Question过期的答复
+#define STALE_WAITING 1 // 缓存中有过期的答复，查询失败或到stale_at仍未答复时以它应答
+#define STALE_SERVED 2 // 已以过期的答复应答客户端，请求只用于刷新缓存
+#define MAX_WAITERS 256 // 一个进行中的请求最多合并的等待者数，超出的相同请求被丢弃，一个迟迟不答复的域名不会占满等待者池
+
+typedef struct {
+    _Atomic uint32_t gen; // 代数，每次分配与释放都加1，奇数表示使用中
+    uint32_t next; // 空闲链表中下一个槽的下标加1，0表示链表结束
+    uint16_t id; // 客户端请求的id
+    uint16_t qtype; // 请求的类型
+    uint16_t qclass; // 请求的类
+    uint8_t dnssec; // 请求的CD与DO位，DNSSEC_CD与DNSSEC_DO的组合，答复按它缓存
+    uint8_t rd; // 请求的RD位，与dnssec一起决定能否合并
+    uint32_t hash; // 请求域名的哈希，用于核对答复的Question
+    struct sockaddr_in addr; // 客户端地址
+    uint16_t udp_size; // 客户端OPT记录声明的UDP载荷大小，0表示请求没有OPT记录
+    uint8_t tries; // 已发送的次数
+    uint8_t rto_upstream; // 当前重传定时器所对应的DNS服务器
+    uint8_t tcp; // 答复被截断、已改经TCP向rto_upstream查询，不再对冲与重传
+    uint8_t sent_to[MAX_TRIES]; // 每次发往的DNS服务器
+    uint32_t sent_off[MAX_TRIES]; // 每次发送相对首次发送的时间，单位微秒
+    uint16_t query_len; // 请求报文长度
+    uint64_t sent_at; // 首次发送的时间，单调时钟微秒数
+    uint64_t retry_at; // 重传时间，单调时钟毫秒数
+    uint64_t deadline; // 最终超时时间，单调时钟毫秒数
+    unsigned char *query; // 请求报文，id已替换，对冲与重传时重发；缓冲区来自工作线程的报文缓冲区池，随请求交给槽
+    uint32_t waiters; // 合并到该请求的其他客户端，等待者链表头的下标加1，0表示没有
+    uint16_t waiter_cnt; // 等待者数，达到MAX_WAITERS后不再合并
+    uint8_t stale; // STALE_NONE、STALE_WAITING或STALE_SERVED
+    uint64_t stale_at; // 以过期的答复应答的时间，单调时钟毫秒数
+} pending_slot; // 一个等待DNS服务器答复的请求
+
+typedef struct {
+    uint32_t next; // 链表中下一个等待者的下标加1
+    uint16_t id; // 客户端请求的id
+    uint8_t name_len; // 域名长度
+    uint16_t udp_size; // 客户端OPT记录声明的UDP载荷大小，0表示请求没有OPT记录
+    struct sockaddr_in addr; // 客户端地址
+    unsigned char name[MAX_NAME_LEN + 1]; // 客户端请求中的域名，保留原有的大小写
+} pending_waiter; // 与进行中的请求问题相同、等待同一答复的客户端
+
+typedef struct {
+    pending_slot *slots; // 槽数组，下标的高位是端口序号，低16位是发给DNS服务器的id
+    uint32_t cap; // 槽数
+    _Atomic uint64_t free_head; // 空闲链表头，高32位是防ABA的版本号，低32位是槽下标加1
+    uint32_t *inflight; // 按Question索引进行中的请求，开放寻址，元素为槽下标加1，只由所属的工作线程访问
+    uint32_t inflight_mask;
+    pending_waiter *waiters; // 等待者池，只由所属的工作线程访问
+    uint32_t waiter_cap;
+    uint32_t waiter_free; // 空闲等待者链表头的下标加1
+} pending_table; // 待答复请求表，槽的分配与释放无锁
+
+extern void pending_init(pending_table *t, int ports); // 初始化待答复请求表
+extern uint32_t pending_alloc(pending_table *t, const question_t *q, unsigned char *query, int len,
+                              struct sockaddr_in cli_addr, uint32_t *gen); // 分配槽并接管请求缓冲区，表满时返回UINT32_MAX
+extern pending_slot *pending_get(pending_table *t, uint32_t index, uint32_t gen); // 取出仍是该代的槽
+extern uint32_t pending_find(const pending_table *t, const question_t *q,
+                             const unsigned char *query); // 查找Question与CD、DO、RD位都相同的进行中的请求
+extern bool pending_wait(pending_table *t, uint32_t index, const unsigned char *query, uint16_t udp_size,
+                         struct sockaddr_in cli_addr); // 客户端等待进行中的请求的答复
+extern void pending_release_waiters(pending_table *t, uint32_t head); // 答复分发完后释放等待者
+extern pending_slot *pending_match(pending_table *t, uint32_t index, const question_t *q, int from,
+                                   uint32_t *gen); // 核对答复的来源与Question，不释放槽
+extern bool pending_complete(pending_table *t, uint32_t index, const question_t *q, int from,
+                             pending_slot *out); // 收到答复，核对来源与Question后释放槽
+extern bool pending_timeout(pending_table *t, uint32_t index, uint32_t gen); // 超时处理
+
+#endif
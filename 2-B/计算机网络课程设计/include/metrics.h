@@ -0,0 +1,53 @@
+/**
+ * @file metrics.h
+ * @brief 运行指标：HDR风格的延迟直方图，以及通过UNIX域套接字输出Prometheus文本格式的指标服务
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 4 // 每个2的幂区间分为2^HIST_SUB_BITS个桶，相对误差不超过1/16
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB) // 覆盖0到2^32微秒
+
+#define LAT_LOCAL 0 // 本地记录应答，包括拦截
+#define LAT_CACHE 1 // 缓存应答
+#define LAT_UPSTREAM 2 // 经DNS服务器答复，包括合并的请求与超时的SERVFAIL
+#define LAT_KINDS 3
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS]; // 各桶的样本数
+    uint64_t sum; // 样本之和，微秒
+    uint64_t total; // 样本数
+} latency_hist; // 对数线性的延迟直方图，只由所属的工作线程写，读取方容忍读到稍旧的值
+
+/**
+ * @brief 微秒数所在的桶：小于HIST_SUB时每微秒一个桶，之后每个2的幂区间等分为HIST_SUB个桶
+ */
+static inline int hist_bucket(uint64_t us) {
+    if (us > UINT32_MAX)
+        us = UINT32_MAX;
+    if (us < HIST_SUB)
+        return (int) us;
+    const int e = 63 - __builtin_clzll(us);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int) ((us >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * @brief 记录n个相同的样本，只有一次数组下标计算与三次加法
+ */
+static inline void hist_add(latency_hist *h, const uint64_t us, const uint64_t n) {
+    h->counts[hist_bucket(us)] += n;
+    h->sum += us * n;
+    h->total += n;
+}
+
+extern uint64_t hist_upper(int bucket); // 桶中样本的上界，微秒
+extern void hist_merge(latency_hist *to, const latency_hist *from); // 把一个直方图累加到另一个
+extern uint64_t hist_quantile(const latency_hist *h, double q); // 分位数的上界，微秒
+extern int metrics_start(const char *path, void (*render)(FILE *out)); // 在UNIX域套接字上启动指标服务
+extern void metrics_stop(); // 停止指标服务并删除套接字文件
+
+#endif
@@ -1,9 +1,99 @@
-#ifndef NETWORK_H
-#define NETWORK_H
-
-#include <arpa/inet.h>
-
-extern void network_init(); // 初始化网络相关部分
-extern void main_process(); // 主处理函数
-
-#endif
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "../include/consts.h"
+#include "../include/mapping.h"
+#include "../include/timer.h"
+#include "../include/cache.h"
+#include "../include/upstream.h"
+#include "../include/querylog.h"
+#include "../include/metrics.h"
+#include "../include/packet_pool.h"
+#include "../include/tcp_conn.h"
+#include "../include/cluster.h"
+
+#define MAX_WORKERS 64 // 最大工作线程数
+#define MAX_BATCH 64 // recvmmsg/sendmmsg一次最多处理的报文数
+#define MAX_IOVS 5 // 发送的报文最多由几段组成：报文头、请求中的Question段、轮转后的两段本地记录、OPT记录
+
+typedef struct {
+    uint64_t received; // 收到的客户端请求数
+    uint64_t local_hits; // 本地命中并直接答复的请求数
+    uint64_t cache_hits; // 缓存命中并直接答复的请求数
+    uint64_t shared_hits; // 缓存命中中，条目取自其他进程存入共享内存缓存的答复的请求数
+    uint64_t blocked; // 被屏蔽的请求数
+    uint64_t forwarded; // 转发给DNS服务器的请求数
+    uint64_t responses; // 转发回客户端的DNS服务器答复数
+    uint64_t timeouts; // 最终超时仍未收到答复、以服务器失败答复客户端的请求数
+    uint64_t overflows; // 待答复请求表已满而丢弃的请求数
+    uint64_t coalesced; // 合并到进行中的同一请求、未单独转发的请求数
+    uint64_t waiter_overflows; // 进行中的同一请求的等待者已达上限而丢弃的请求数
+    uint64_t refreshes; // 后台预取即将过期的热门条目的请求数
+    uint64_t stale_answers; // DNS服务器答复失败或迟迟不答复、以缓存中过期的答复应答的请求数
+    uint64_t hedges; // 发出的对冲请求数
+    uint64_t retransmits; // 重传的请求数
+    uint64_t recv_calls; // 接收系统调用次数
+    uint64_t send_calls; // 发送系统调用次数
+    uint64_t send_drops; // 发送失败被丢弃的报文数
+    uint64_t pool_exhausted; // 报文缓冲区池已空而丢弃的请求数
+    uint64_t tcp_queries; // 答复被截断、改经TCP重新查询的请求数
+    uint64_t tcp_connects; // 发起的TCP连接数
+    uint64_t tcp_failures; // 连接失败，或断开时仍有未答复请求的次数
+    uint64_t peer_queries; // 缓存未命中、先向负责该域名的其他节点查询的请求数
+    uint64_t peer_answers; // 其他节点答复、转发回客户端的答复数
+    uint64_t peer_failures; // 其他节点超时未答复或答复被截断、改为转发给DNS服务器的请求数
+    uint64_t peer_requests; // 其他节点代为查询、由本节点负责的请求数
+} stats_t; // 工作线程统计信息，只由所属的工作线程写，指标服务读取时容忍读到稍旧的值
+
+typedef struct {
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    struct sockaddr_in addrs[MAX_BATCH];
+    int current; // 正在处理的报文下标，其缓冲区被待答复请求表接管时换上新的缓冲区
+} recv_batch; // 一次recvmmsg接收的报文，缓冲区来自工作线程的报文缓冲区池
+
+typedef struct {
+    int fd; // 发送使用的套接字
+    int len; // 已排队的报文数
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH][MAX_IOVS]; // 第一段总是bufs中的报文，其余段可指向接收缓冲区或本地记录表
+    struct sockaddr_in addrs[MAX_BATCH];
+    unsigned char bufs[MAX_BATCH][MAX_PACKET_LEN]; // 缓存命中时答复整个复制到这里，须容纳EDNS大小的答复
+} send_queue; // 待发送的报文，满或一批报文处理完后用sendmmsg一次发出，发出前外部的段须保持有效
+
+typedef struct worker_t {
+    int index; // 工作线程编号
+    pthread_t tid;
+    _Atomic uint64_t epoch; // 最近一次开始处理事件时看到的全局纪元，0表示阻塞等待中、不引用本地记录表
+    int udpfd; // 接收客户端请求的套接字，各线程通过SO_REUSEPORT绑定同一端口
+    int upfds[MAX_UPSTREAM_PORTS]; // 与DNS服务器通信的套接字，各占一个端口，保证答复回到发出请求的线程
+    int epfd; // epoll实例
+    int timerfd; // 超时定时器，到期时间始终为堆顶的deadline
+    uint64_t armed_deadline; // timerfd当前设定的到期时间，0表示未设定
+    timer_heap timers; // 待答复请求的超时定时器
+    answer_cache cache; // DNS服务器答复的缓存
+    _Alignas(64) stats_t stats; // 统计信息，独占缓存行，与其他线程读写的字段不共享
+    latency_hist latency[LAT_KINDS]; // 各来源答复的延迟直方图
+    uint32_t batch_answers[LAT_KINDS]; // 本批中本地与缓存应答的请求数，一批处理完后按同一延迟计入直方图
+    packet_pool packets; // 报文缓冲区池，接收与待答复的请求共用
+    recv_batch rx; // 接收缓冲区
+    send_queue client_q; // 发往客户端的报文
+    send_queue *server_q; // 发往DNS服务器的报文，每个端口一个队列
+    pending_table pending; // 待答复请求表
+    uint32_t rotation; // 本地多条记录轮转发送的计数
+    qlog_ring *qlog; // 查询日志的环形缓冲区，NULL表示不记录
+    uint64_t batch_at; // 本批报文的接收时间，单调时钟微秒数
+    upstream_set upstreams; // 各DNS服务器的RTT与丢包估计
+    tcp_conn *tcp; // 与各DNS服务器的持久TCP连接，答复被截断时经此重新查询
+    upstream_set peers; // 集群中其他节点的RTT与丢包估计，RTT包括其缓存未命中时查询DNS服务器的时间
+    uint64_t peer_down_until[MAX_PEERS]; // 其他节点超时未答复后，在此之前不再向它查询，单调时钟毫秒数
+} worker_t; // 工作线程，热路径上的状态均为线程私有
+
+extern void network_init(); // 初始化网络相关部分
+extern void main_process(); // 主处理函数
+
+#endif
@@ -0,0 +1,42 @@
+/**
+ * @file packet_pool.h
+ * @brief 报文缓冲区池：每个工作线程一个，缓冲区大小固定、总数固定，启动时一次分配，运行中不再调用malloc
+ */
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_PACKET_LEN 4096 // 缓冲区大小，足以容纳EDNS协商的UDP报文
+#define DEFAULT_PACKETS 16384 // 每个工作线程的默认缓冲区数
+#define MIN_PACKETS 128 // 至少容纳一批接收的报文与若干进行中的请求
+#define MAX_PACKETS 1048576
+
+typedef struct {
+    unsigned char *base; // 全部缓冲区，连续存放
+    unsigned char **free; // 空闲缓冲区栈，后放回的先取出，刚用过的缓冲区多半还在CPU缓存中
+    uint32_t free_cnt; // 空闲缓冲区数
+    uint32_t cap; // 缓冲区总数
+} packet_pool; // 报文缓冲区池，只由所属的工作线程修改，指标服务读取空闲数时容忍读到稍旧的值
+
+extern void packet_pool_init(packet_pool *p, uint32_t count); // 分配count个缓冲区
+
+/**
+ * @brief 取出一个缓冲区，所有权交给调用方，用完须放回
+ * @return 缓冲区，池空时返回NULL
+ */
+static inline unsigned char *packet_get(packet_pool *p) {
+    if (p->free_cnt == 0)
+        return NULL;
+    return p->free[--p->free_cnt];
+}
+
+/**
+ * @brief 放回一个缓冲区
+ */
+static inline void packet_put(packet_pool *p, unsigned char *buf) {
+    p->free[p->free_cnt++] = buf;
+}
+
+#endif
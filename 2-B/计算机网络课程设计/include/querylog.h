@@ -0,0 +1,63 @@
+/**
+ * @file querylog.h
+ * @brief 二进制查询日志：每个工作线程一个无锁的单生产者单消费者环形缓冲区，由后台写线程批量写入文件
+ */
+#ifndef QUERYLOG_H
+#define QUERYLOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define QLOG_MAGIC "DNSRLYQL" // 查询日志的文件标识
+#define QLOG_VERSION 1 // 查询日志的格式版本
+#define QLOG_NAME_LEN 96 // 记录中域名的最大长度，超出部分截断
+#define QLOG_RING_SIZE 65536 // 每个环形缓冲区的记录数，须为2的幂
+#define QLOG_FLUSH_MS 10 // 写线程没有记录可写时的等待毫秒数
+
+#define QLOG_LOCAL 0 // 本地记录应答
+#define QLOG_BLOCKED 1 // 本地记录拦截
+#define QLOG_CACHE 2 // 缓存应答
+#define QLOG_UPSTREAM 3 // DNS服务器答复
+#define QLOG_COALESCED 4 // 合并到进行中的同一请求，随其答复分发
+#define QLOG_SERVFAIL 5 // DNS服务器超时，以SERVFAIL应答
+#define QLOG_PEER 6 // 集群中其他节点答复
+
+typedef struct {
+    uint64_t time_us; // 收到请求的时间，Unix时间的微秒数
+    uint32_t latency_us; // 从收到请求到答复进入发送队列的微秒数
+    uint32_t client_addr; // 客户端IPv4地址，网络字节序
+    uint16_t client_port; // 客户端端口，网络字节序
+    uint16_t qtype; // 请求类型
+    uint8_t rcode; // 答复的RCODE
+    uint8_t path; // 答复的来源，QLOG_LOCAL等
+    uint8_t worker; // 工作线程编号
+    uint8_t upstream; // 答复的DNS服务器下标，其他节点答复时为节点下标，不经过DNS服务器时为NO_UPSTREAM
+    uint8_t name_len; // 线上格式域名的完整长度，超过QLOG_NAME_LEN时只保存前QLOG_NAME_LEN字节
+    uint8_t reserved[7];
+    unsigned char name[QLOG_NAME_LEN]; // 线上格式的域名
+} qlog_record; // 一条查询日志，定长128字节，文件中紧跟在qlog_header之后，整数按本机字节序保存
+
+typedef struct {
+    char magic[8]; // QLOG_MAGIC
+    uint32_t version; // QLOG_VERSION
+    uint32_t record_size; // 每条记录的字节数
+} qlog_header; // 查询日志的文件头，追加写入已有的文件时不重复写
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head; // 下一条记录的写入位置，只由工作线程修改
+    _Alignas(64) _Atomic uint64_t tail; // 下一条记录的读取位置，只由写线程修改
+    _Alignas(64) _Atomic uint64_t dropped; // 环满时丢弃的记录数
+    int worker; // 所属的工作线程编号
+    qlog_record slots[QLOG_RING_SIZE];
+} qlog_ring; // 一个工作线程的查询日志环形缓冲区，工作线程写满时丢弃新记录，不等待
+
+extern int qlog_open(const char *path, int workers); // 打开查询日志文件，为每个工作线程分配环形缓冲区
+extern qlog_ring *qlog_ring_of(int worker); // 工作线程的环形缓冲区，未开启查询日志时返回NULL
+extern void qlog_start(); // 启动写线程
+extern void qlog_stop(); // 停止写线程，写出剩余的记录
+extern void qlog_append(qlog_ring *r, uint64_t arrived, const struct sockaddr_in *client, const unsigned char *name,
+                        int name_len, uint16_t qtype, uint8_t rcode, uint8_t path,
+                        uint8_t upstream); // 追加一条记录，arrived为收到请求时的单调时钟微秒数
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * @file shm_cache.h
+ * @brief 同一主机上多个中继进程共享的答复缓存，位于POSIX共享内存中：组相联的桶，每个槽由顺序锁保护，
+ *        读不加锁，写只占用单个槽，写者异常退出留下的锁超时后由其他写者接管；进程退出后共享内存保留，重新启动的进程直接命中
+ */
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "../include/dns_parser.h"
+
+#define SHM_MAGIC 0x64727363 // 共享内存缓存的标识
+#define SHM_VERSION 4 // 布局版本，与已存在的共享内存不一致时拒绝使用
+#define SHM_HEADER_LEN 64 // 头部占用的字节数，槽从此处开始
+#define SHM_WAYS 4 // 每个桶的槽数
+#define SHM_SLOT_SIZE 2048 // 每个槽的字节数，含槽头；放不下的答复只缓存在进程内
+#define DEFAULT_SHM_SIZE 64 // 默认共享内存大小，单位MB
+#define SHM_READ_TRIES 4 // 读到正在写的槽时重试的次数
+#define SHM_WAIT_MS 1000 // 等待其他进程初始化共享内存的时间
+#define SHM_STUCK_MS 1000 // 槽被加锁超过此时间仍未写完时视为写者已异常退出，由下一个写者接管
+
+typedef struct {
+    _Atomic uint64_t lock; // 顺序锁：低32位是序号，奇数表示正在写，0表示从未写过；正在写时高32位是加锁的时间，
+                           // 单调时钟毫秒数的低32位，与序号一同被CAS写入，用于判定序号停在奇数的槽
+    uint32_t hash; // (qname, qtype, qclass, dnssec)的哈希
+    uint16_t qtype;
+    uint16_t qclass;
+    uint8_t dnssec; // DNSSEC_CD与DNSSEC_DO
+    uint16_t len; // 答复报文长度
+    uint16_t opt_len; // 答复末尾OPT记录的长度，0表示没有
+    uint8_t name_len; // 域名长度，含结尾的0
+    uint64_t stored; // 存入时间，单调时钟毫秒数，同一主机上的进程共用
+    uint64_t expire; // 过期时间
+    unsigned char data[]; // 域名与答复报文，报文的id为0
+} shm_slot; // 共享内存中的一个槽
+
+typedef struct {
+    _Atomic uint32_t magic; // 创建者初始化完成后写入SHM_MAGIC
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t ways;
+    uint64_t buckets; // 桶数，2的幂
+} shm_header; // 共享内存的头部
+
+typedef struct {
+    shm_header *header; // 映射的起始地址
+    unsigned char *slots; // 第一个槽
+    uint64_t mask; // 桶数减1
+    size_t size; // 映射的大小
+} shm_cache; // 进程内的映射，各工作线程共用
+
+typedef struct {
+    uint64_t stored;
+    uint64_t expire;
+    uint16_t len;
+    uint16_t opt_len;
+} shm_entry; // 从共享内存取出的答复的信息
+
+extern int shm_cache_open(shm_cache *c, const char *name, size_t size); // 打开或创建共享内存缓存
+extern int shm_cache_get(const shm_cache *c, const question_t *q, uint32_t hash, unsigned char *msg,
+                         shm_entry *e); // 取出与Question匹配的答复
+extern void shm_cache_put(shm_cache *c, const question_t *q, uint32_t hash, const unsigned char *msg,
+                          const shm_entry *e); // 存入答复，槽正被写时放弃，被加锁过久时接管
+
+#endif
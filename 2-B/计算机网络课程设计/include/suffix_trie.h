@@ -0,0 +1,45 @@
+/**
+ * @file suffix_trie.h
+ * @brief 域名后缀规则（如*.ads.example.com），按标签逆序组织成紧凑的字典树
+ */
+#ifndef SUFFIX_TRIE_H
+#define SUFFIX_TRIE_H
+
+#include <stdint.h>
+#include "../include/consts.h"
+
+typedef struct {
+    uint32_t label_off; // 标签在标签区中的偏移，标签区中每个标签以长度字节开头
+    uint32_t first_child; // 第一个子节点的下标，同一节点的子节点连续存放并按标签排序
+    uint32_t child_cnt : 31; // 子节点数
+    uint32_t has_rule : 1; // 是否有以该节点结尾的规则
+    uint32_t value; // 规则的值，由调用方解释，本地记录表中为答复在字节区中的偏移
+} trie_node; // 字典树节点，每个节点16字节
+
+typedef struct {
+    trie_node *nodes; // 节点数组，下标0为根，没有规则时为NULL
+    uint32_t node_cnt; // 节点数
+    unsigned char *labels; // 标签区，相同的标签只存一份
+    uint32_t labels_len; // 标签区长度
+} suffix_trie; // 后缀规则字典树
+
+typedef struct {
+    uint32_t *label_offs; // 各规则的标签偏移，逆序（从顶级域开始）
+    uint32_t label_offs_len, label_offs_cap;
+    struct trie_rule *rules; // 规则
+    uint32_t rule_cnt, rule_cap;
+    unsigned char *labels; // 标签区
+    uint32_t labels_len, labels_cap;
+    uint32_t *intern; // 标签去重用的哈希表，元素为标签偏移加1，0表示空
+    uint32_t intern_mask, intern_cnt;
+} trie_builder; // 字典树的构建器，只在加载文件时使用
+
+extern int trie_builder_init(trie_builder *b); // 初始化构建器
+extern int trie_builder_add(trie_builder *b, const char *suffix, uint32_t value); // 加入一条规则，suffix不含“*.”，内存不足返回-2
+extern int trie_build(trie_builder *b, suffix_trie *trie); // 生成字典树并释放构建器
+extern void trie_builder_free(trie_builder *b); // 释放构建器，加载失败时使用
+extern int trie_valid(const suffix_trie *trie); // 检查从文件映射的字典树的标签与子节点都在范围内
+extern int trie_lookup(const suffix_trie *trie, const unsigned char *name, const uint8_t *label_offs, int n,
+                       uint32_t *value); // 按线上格式的域名查找最长的匹配规则
+
+#endif
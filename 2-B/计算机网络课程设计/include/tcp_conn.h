@@ -0,0 +1,42 @@
+/**
+ * @file tcp_conn.h
+ * @brief 与DNS服务器的持久TCP连接：报文前加两字节长度（RFC 1035 4.2.2），多个请求流水线发出，答复可乱序到达（RFC 7766）
+ */
+#ifndef TCP_CONN_H
+#define TCP_CONN_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define TCP_OUT_CAP 65536 // 待写出数据的上限，写满时不再经该连接查询
+#define TCP_IN_CAP (2 * 65538) // 读缓冲区大小，至少容纳一个最长的报文及其长度
+#define TCP_RETRY_MS 1000 // 连接失败后再次尝试的间隔，单位毫秒
+#define TCP_MAX_TAGS 1024 // 记录最近写入的请求数，连接断开时据此找出未答复的请求
+
+typedef struct {
+    int fd; // 套接字，-1表示未连接
+    uint8_t connecting; // 非阻塞connect尚未完成
+    uint8_t want_write; // 是否在epoll中关注可写事件
+    uint32_t outstanding; // 已写入、尚未收到答复的请求数
+    uint64_t retry_at; // 连接失败后，在此之前不再尝试，单调时钟毫秒数
+    unsigned char *out; // 待写出的数据，首次连接时分配
+    uint32_t out_len;
+    unsigned char *in; // 已读入的数据，首次连接时分配
+    uint32_t in_len;
+    uint32_t in_off; // 已取出的报文之后的偏移
+    uint64_t tags[TCP_MAX_TAGS]; // 最近写入的请求的标记，环形覆盖，由调用方解释
+    uint32_t tag_cnt; // 写入的请求总数
+} tcp_conn; // 一条TCP连接，只由所属的工作线程访问
+
+extern void tcp_conn_init(tcp_conn *c); // 初始化为未连接
+extern int tcp_conn_open(tcp_conn *c, const struct sockaddr_in *addr); // 发起非阻塞连接，返回套接字
+extern int tcp_conn_connected(tcp_conn *c); // 可写时确认连接是否建立
+extern int tcp_conn_queue(tcp_conn *c, const unsigned char *msg, int len,
+                          uint64_t tag); // 把一个报文加入待写出的数据
+extern int tcp_conn_flush(tcp_conn *c); // 尽量写出待写出的数据
+extern int tcp_conn_read(tcp_conn *c); // 读入已到达的数据
+extern unsigned char *tcp_conn_next(tcp_conn *c, int *len); // 取出下一个完整的报文，可原地修改
+extern void tcp_conn_compact(tcp_conn *c); // 丢弃已取出的报文，为继续读入腾出空间
+extern void tcp_conn_close(tcp_conn *c, uint64_t retry_at); // 关闭连接，丢弃未写出与未取出的数据
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file timer.h
+ * @brief 基于最小堆的定时器，用于管理转发请求的超时
+ */
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint64_t deadline; // 到期时间，单调时钟毫秒数
+    uint32_t index; // 到期时要处理的槽下标
+    uint32_t gen; // 设置定时器时槽的代数
+} timer_entry; // 定时器条目
+
+typedef struct {
+    timer_entry *heap; // 按deadline排列的最小堆
+    uint32_t size;
+    uint32_t capacity;
+} timer_heap; // 定时器堆
+
+extern uint64_t now_ms(); // 获取当前单调时钟毫秒数
+extern uint64_t now_us(); // 获取当前单调时钟微秒数
+extern void timer_push(timer_heap *h, uint64_t deadline, uint32_t index, uint32_t gen); // 加入定时器
+extern const timer_entry *timer_top(const timer_heap *h); // 最早到期的定时器，堆空时返回NULL
+extern void timer_pop(timer_heap *h); // 删除最早到期的定时器
+
+#endif
@@ -0,0 +1,43 @@
+/**
+ * @file upstream.h
+ * @brief 上游DNS服务器的RTT与丢包估计，用于选择最快的服务器、决定对冲请求与重传的时机
+ */
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+
+#define MAX_UPSTREAMS 8 // 最多配置的DNS服务器数
+#define RTT_BUCKETS 40 // RTT直方图的桶数，桶的上界按根号2倍增长
+#define DEFAULT_HEDGE_PERCENTILE 95 // 默认在超过该百分位的RTT后发出对冲请求
+#define NO_UPSTREAM 0xff
+#define MIN_RTO 10000 // 重传超时的下限，单位微秒
+#define MAX_RTO 1000000 // 重传超时的上限
+#define INITIAL_RTO 200000 // 尚无RTT样本时的重传超时
+
+typedef struct {
+    double srtt; // RTT的指数加权平均，单位微秒，0表示尚无样本
+    double rttvar; // RTT的平均偏差
+    double loss; // 丢包率的指数加权平均
+    uint32_t hist[RTT_BUCKETS]; // RTT直方图，定期减半以跟上变化
+    uint32_t samples; // 直方图中的样本数
+    uint64_t sent; // 发出的请求数，含对冲请求
+    uint64_t answered; // 先于其他服务器答复的请求数
+    uint64_t lost; // 超时未答复的请求数
+} upstream_t; // 一个DNS服务器的统计信息
+
+typedef struct {
+    upstream_t up[MAX_UPSTREAMS];
+    int cnt; // DNS服务器数
+    uint64_t picks; // 选择次数，用于定期探测其他服务器
+} upstream_set; // 工作线程看到的各DNS服务器
+
+extern void upstream_init(upstream_set *s, int cnt); // 初始化
+extern int upstream_pick(upstream_set *s, int exclude); // 选择预期最快的服务器
+extern void upstream_answered(upstream_set *s, int i, uint64_t rtt_us); // 记录一次答复
+extern void upstream_ambiguous(upstream_set *s, int i); // 记录一次无法确定RTT的答复
+extern void upstream_lost(upstream_set *s, int i); // 记录一次超时
+extern uint64_t upstream_hedge_delay(const upstream_set *s, int i, int percentile); // 对冲请求的等待时间，单位微秒
+extern uint64_t upstream_rto(const upstream_set *s, int i); // 重传超时，单位微秒
+
+#endif
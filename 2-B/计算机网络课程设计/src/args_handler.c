@@ -4,19 +4,88 @@
  */
 #include "../include/args_handler.h"
 #include "../include/logs.h"
+#include "../include/network.h"
+#include "../include/cache.h"
 #include <argp.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stdlib.h>
 
 arguments args; // 全局变量，保存命令行参数，包括调试等级、dns服务器地址、本地文件地址
+static int file_given; // 是否已指定本地文件
+static int self_given; // 是否已指定本节点在集群中的地址
 
 static struct argp_option argp_options[] = {
     // 命令行参数选项
     {0, 'd', 0, 0, "Use \"-d\" to display debugging info, or \"-dd\" to display more detailed info."}, // -d选项
+    {"workers", 'j', "N", 0, "Run N workers, each pinned to a core with its own SO_REUSEPORT socket."}, // -j选项
+    {"batch", 'b', "N", 0, "Receive and send up to N datagrams per syscall (1-64, default 64)."}, // -b选项
+    {"cache-size", 'm', "MB", 0, "Memory budget of the answer cache shared by all workers (default 64, 0 disables)."}, // -m选项
+    {"server", 's', "ADDR[:PORT]", 0, "Add an upstream DNS server; may be repeated (up to 8). The fastest one is used."}, // -s选项
+    {"hedge", 'H', "PCT", 0, "Send a hedged query to another server once a query exceeds this RTT percentile (1-99, default 95, 0 disables)."}, // -H选项
+    {"max-stale", 'S', "SEC", 0, "Serve expired cache entries for up to SEC seconds while refreshing them (default 86400, 0 disables)."}, // -S选项
+    {"upstream-ports", 'u', "N", 0, "Source ports per worker for upstream queries, each allowing 65536 in flight (1-16, default 4)."}, // -u选项
+    {"query-log", 'l', "FILE", 0, "Append a binary record of every answered query to FILE; decode it with dnsrelay-qlog."}, // -l选项
+    {"metrics", 'M', "PATH", 0, "Serve Prometheus metrics on the UNIX-domain socket PATH (plain or HTTP GET)."}, // -M选项
+    {"port", 'P', "PORT", 0, "Listen for clients on UDP port PORT (default 53)."}, // -P选项
+    {"packets", 'B', "N", 0, "Preallocate N packet buffers per worker; bounds the queries in flight (128-1048576, default 16384)."}, // -B选项
+    {"no-tcp", 'T', 0, 0, "Relay truncated answers as they are instead of re-querying the server over TCP."}, // -T选项
+    {"edns-size", 'e', "BYTES", 0, "EDNS UDP payload size advertised to clients and servers (512-4096, default 1232)."}, // -e选项
+    {"shared-cache", 'C', "NAME[:MB]", 0, "Share cached answers with other relays on this host through the POSIX shared memory NAME, created with MB megabytes if missing (default 64)."}, // -C选项
+    {"peer", 'N', "ADDR[:PORT]", 0, "Add a cluster node; may be repeated (up to 8 besides this one). Each name is owned by one node, which the others ask before going upstream; giving every node the same list, this one included, is fine."}, // -N选项
+    {"cluster-self", 'I', "ADDR[:PORT]", 0, "Address under which the other cluster nodes know this one (default 127.0.0.1 and the listen port)."}, // -I选项
     {0}
 };
 
+/**
+ * @brief 解析形如ip或ip:port的地址，省略端口时为53
+ * @param arg 地址
+ * @param addr 输出地址
+ * @return 成功返回0
+ */
+static int parse_addr(const char *arg, struct sockaddr_in *addr) {
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strchr(arg, ':');
+    const size_t len = colon ? (size_t) (colon - arg) : strlen(arg);
+    long port = DNS_PORT;
+    if (len >= sizeof(ip))
+        return -1;
+    memcpy(ip, arg, len);
+    ip[len] = '\0';
+    if (colon) {
+        char *end;
+        port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port < 1 || port > UINT16_MAX)
+            return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t) port);
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+/**
+ * @brief 解析DNS服务器地址并加入列表
+ * @param arguments 参数结构体
+ * @param arg 地址
+ * @return 成功返回0
+ */
+static int add_upstream(arguments *arguments, const char *arg) {
+    if (arguments->upstream_cnt == MAX_UPSTREAMS ||
+        parse_addr(arg, &arguments->upstreams[arguments->upstream_cnt]) < 0)
+        return -1;
+    arguments->upstream_cnt++;
+    return 0;
+}
+
+/**
+ * @brief 两个地址是否相同
+ */
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
 /**
  * @brief 命令行参数解析器
  * @param key 选项
@@ -35,20 +104,172 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                 return ARGP_ERR_UNKNOWN;
             }
             break;
+        // -j选项
+        case 'j': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < 1 || n > MAX_WORKERS) {
+                argp_error(state, "workers should be between 1 and %d", MAX_WORKERS);
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->workers = (int) n;
+            break;
+        }
+        // -b选项
+        case 'b': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < 1 || n > MAX_BATCH) {
+                argp_error(state, "batch should be between 1 and %d", MAX_BATCH);
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->batch = (int) n;
+            break;
+        }
+        // -m选项
+        case 'm': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < 0 || n > 1024 * 1024) {
+                argp_error(state, "incorrect cache size");
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->cache_size = (int) n;
+            break;
+        }
+        // -s选项
+        case 's':
+            if (add_upstream(arguments, arg) < 0) {
+                argp_error(state, "incorrect server address or too many servers");
+                return ARGP_ERR_UNKNOWN;
+            }
+            break;
+        // -H选项
+        case 'H': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < 0 || n > 99) {
+                argp_error(state, "hedge percentile should be between 0 and 99");
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->hedge_percentile = (int) n;
+            break;
+        }
+        // -S选项
+        case 'S': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < 0 || n > 7 * 86400) {
+                argp_error(state, "max stale should be between 0 and %d", 7 * 86400);
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->max_stale = (int) n;
+            break;
+        }
+        // -u选项
+        case 'u': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < 1 || n > MAX_UPSTREAM_PORTS) {
+                argp_error(state, "upstream ports should be between 1 and %d", MAX_UPSTREAM_PORTS);
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->upstream_ports = (int) n;
+            break;
+        }
+        // -l选项
+        case 'l':
+            arguments->query_log = arg;
+            break;
+        // -M选项
+        case 'M':
+            arguments->metrics_socket = arg;
+            break;
+        // -P选项
+        case 'P': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < 1 || n > 65535) {
+                argp_error(state, "port should be between 1 and 65535");
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->listen_port = (uint16_t) n;
+            break;
+        }
+        // -T选项
+        case 'T':
+            arguments->tcp = 0;
+            break;
+        // -B选项
+        case 'B': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < MIN_PACKETS || n > MAX_PACKETS) {
+                argp_error(state, "packet buffers should be between %d and %d", MIN_PACKETS, MAX_PACKETS);
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->packets = (int) n;
+            break;
+        }
+        // -e选项
+        case 'e': {
+            char *end;
+            const long n = strtol(arg, &end, 10);
+            if (*end != '\0' || n < MAX_MSG_LEN || n > MAX_PACKET_LEN) {
+                argp_error(state, "edns size should be between %d and %d", MAX_MSG_LEN, MAX_PACKET_LEN);
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->edns_size = (uint16_t) n;
+            break;
+        }
+        // -C选项
+        case 'C': {
+            char *colon = strchr(arg, ':');
+            if (colon) {
+                char *end;
+                const long n = strtol(colon + 1, &end, 10);
+                if (*end != '\0' || n < 1 || n > 1024 * 1024) {
+                    argp_error(state, "incorrect shared cache size");
+                    return ARGP_ERR_UNKNOWN;
+                }
+                arguments->shared_cache_size = (int) n;
+                *colon = '\0';
+            }
+            if (arg[0] == '\0' || strchr(arg + 1, '/')) {
+                argp_error(state, "incorrect shared cache name");
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->shared_cache = arg;
+            break;
+        }
+        // -N选项
+        case 'N':
+            if (arguments->peer_cnt == MAX_PEERS + 1 || parse_addr(arg, &arguments->peers[arguments->peer_cnt]) < 0) {
+                argp_error(state, "incorrect peer address or too many peers");
+                return ARGP_ERR_UNKNOWN;
+            }
+            arguments->peer_cnt++;
+            break;
+        // -I选项
+        case 'I':
+            if (parse_addr(arg, &arguments->cluster_self) < 0) {
+                argp_error(state, "incorrect cluster address");
+                return ARGP_ERR_UNKNOWN;
+            }
+            self_given = 1;
+            break;
         // 其他参数
         case ARGP_KEY_ARG:
-            if (state->arg_num == 0) {
-                // 第一个参数是dns服务器地址
-                uint32_t t = inet_addr(arg);
-                if (t == UINT32_MAX) {
+            if (state->arg_num == 0 && strspn(arg, "0123456789.:") == strlen(arg)) {
+                // 第一个参数形如地址时是dns服务器地址，与-s相同
+                if (add_upstream(arguments, arg) < 0) {
                     argp_error(state, "incorrect ip address");
                     return ARGP_ERR_UNKNOWN;
-                } else {
-                    arguments->dns_server_addr = t;
                 }
-            } else if (state->arg_num == 1) {
-                // 第二个参数是本地文件地址
+            } else if (!file_given) {
+                // 之后是本地文件地址，可以是文本文件或dnsrelay-compile生成的预编译记录库；用-s指定服务器时可省略地址
                 arguments->local_file_addr = arg;
+                file_given = 1;
             } else {
                 // 参数过多
                 argp_error(state, "too many arguments");
@@ -63,8 +284,8 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 static struct argp argp = {
     .options = argp_options,
     .parser = parse_opt,
-    .args_doc = "[-d|-dd][dns-server-ipaddr][filename]",
-    .doc = "A dns relay.",
+    .args_doc = "[-d|-dd][-j N][-b N][-m MB][-S SEC][-u N][-s ADDR[:PORT]]...[-H PCT][-l FILE][-M PATH][-P PORT][-B N][-T][-e BYTES][-C NAME[:MB]][-N ADDR[:PORT]]...[-I ADDR[:PORT]][dns-server-ipaddr[:port]][filename]",
+    .doc = "A dns relay. The local file is either a text file or a database built by dnsrelay-compile.",
 };
 
 /**
@@ -75,10 +296,37 @@ static struct argp argp = {
 void args_init(int argc, char *argv[]) {
     // 默认值
     args.debug_level = DEFAULT_DEBUG_LEVEL;
-    args.dns_server_addr = inet_addr(DEFAULT_DNS_SERVER_ADDR);
     args.local_file_addr = DEFAULT_LOCAL_FILE_ADDR;
+    args.workers = DEFAULT_WORKERS;
+    args.batch = DEFAULT_BATCH;
+    args.cache_size = DEFAULT_CACHE_SIZE;
+    args.upstream_ports = DEFAULT_UPSTREAM_PORTS;
+    args.hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
+    args.max_stale = DEFAULT_MAX_STALE;
+    args.listen_port = DNS_PORT;
+    args.packets = DEFAULT_PACKETS;
+    args.tcp = 1;
+    args.edns_size = DEFAULT_EDNS_SIZE;
+    args.shared_cache_size = DEFAULT_SHM_SIZE;
     // 解析命令行参数
     argp_parse(&argp, argc, argv, 0, 0, &args);
+    if (args.upstream_cnt == 0)
+        add_upstream(&args, DEFAULT_DNS_SERVER_ADDR);
+    if (!self_given) {
+        parse_addr("127.0.0.1", &args.cluster_self);
+        args.cluster_self.sin_port = htons(args.listen_port);
+    }
+    // 各节点可使用同一份节点列表，去掉其中的本节点
+    int peers = 0;
+    for (int i = 0; i < args.peer_cnt; i++) {
+        if (!same_addr(&args.peers[i], &args.cluster_self))
+            args.peers[peers++] = args.peers[i];
+    }
+    args.peer_cnt = peers;
+    if (args.peer_cnt > MAX_PEERS) {
+        log_always("Too many cluster peers, at most %d besides this node", MAX_PEERS);
+        exit(-1);
+    }
     // 打印信息
     printf("----------------------------------------------\n"
         "----------DNS RELAY  VERSION 0.1--------------\n"
@@ -86,8 +334,24 @@ void args_init(int argc, char *argv[]) {
         "----------------------------------------------\n"
     );
     log_always("Debug level is %d", args.debug_level);
-    struct in_addr addr;
-    memcpy(&addr, &args.dns_server_addr, sizeof (args.dns_server_addr));
-    log_always("DNS server is %s", inet_ntoa(addr));
+    for (int i = 0; i < args.upstream_cnt; i++)
+        log_always("DNS server is %s:%d", inet_ntoa(args.upstreams[i].sin_addr), ntohs(args.upstreams[i].sin_port));
     log_always("Local file in %s", args.local_file_addr);
+    log_always("Listening on port %d", args.listen_port);
+    log_always("Packet buffers per worker: %d", args.packets);
+    log_always("Truncated answers: %s", args.tcp ? "re-query over TCP" : "relay as they are");
+    log_always("EDNS UDP payload size: %d", args.edns_size);
+    if (args.shared_cache)
+        log_always("Shared cache: %s", args.shared_cache);
+    log_always("Workers: %d, batch: %d, cache: %d MB, max stale: %d s, upstream ports: %d, hedge percentile: %d",
+               args.workers, args.batch, args.cache_size, args.max_stale, args.upstream_ports, args.hedge_percentile);
+    if (args.peer_cnt > 0) {
+        log_always("Cluster node %s:%d", inet_ntoa(args.cluster_self.sin_addr), ntohs(args.cluster_self.sin_port));
+        for (int i = 0; i < args.peer_cnt; i++)
+            log_always("Cluster peer %s:%d", inet_ntoa(args.peers[i].sin_addr), ntohs(args.peers[i].sin_port));
+    }
+    if (args.query_log)
+        log_always("Query log in %s", args.query_log);
+    if (args.metrics_socket)
+        log_always("Metrics on %s", args.metrics_socket);
 }
@@ -0,0 +1,358 @@
+/**
+ * @file cache.c
+ * @brief DNS服务器答复的缓存：肯定答复按答案中最小的TTL缓存，NXDOMAIN/NODATA按RFC 2308用SOA缓存，
+ * 超出内存上限时淘汰最久未使用的条目；命中次数多的条目在过期前提示调用方预取，过期的条目按RFC 8767继续应答一段时间
+ */
+#include "../include/cache.h"
+#include "../include/logs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 1024
+
+/**
+ * @brief 计算(qname, qtype, qclass, dnssec)的FNV-1a哈希，在解析时算好的域名哈希上继续计算
+ */
+static uint32_t key_hash(const question_t *q) {
+    uint32_t h = q->hash;
+    h = (h ^ q->qtype) * 16777619u;
+    h = (h ^ q->qclass) * 16777619u;
+    h = (h ^ q->dnssec) * 16777619u;
+    return h;
+}
+
+static uint16_t *entry_offsets(cache_entry *e) {
+    return (uint16_t *) e->data;
+}
+
+static unsigned char *entry_name(cache_entry *e) {
+    return e->data + e->ttl_cnt * sizeof(uint16_t);
+}
+
+static unsigned char *entry_msg(cache_entry *e) {
+    return entry_name(e) + e->name_len;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void write32(unsigned char *p, const uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/**
+ * @brief 初始化缓存
+ * @param c 缓存
+ * @param budget 内存上限，单位字节，0表示不缓存
+ * @param max_stale 过期后可继续应答的秒数
+ * @param udp_size 答复中OPT记录声明的UDP载荷大小
+ * @param shared 各进程共享的第二级缓存，NULL表示不共享
+ */
+void cache_init(answer_cache *c, const size_t budget, const uint32_t max_stale, const uint16_t udp_size,
+                shm_cache *shared) {
+    c->buckets = calloc(INITIAL_BUCKETS, sizeof(cache_entry *));
+    if (!c->buckets) {
+        perror("calloc failed");
+        exit(-1);
+    }
+    c->mask = INITIAL_BUCKETS - 1;
+    c->count = 0;
+    c->used = 0;
+    c->budget = budget;
+    c->max_stale = max_stale;
+    write_opt(c->opt, udp_size, 0);
+    c->shared = shared;
+    c->lru.prev = c->lru.next = &c->lru;
+}
+
+static void lru_unlink(cache_entry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void lru_push_front(answer_cache *c, cache_entry *e) {
+    e->next = c->lru.next;
+    e->prev = &c->lru;
+    c->lru.next->prev = e;
+    c->lru.next = e;
+}
+
+/**
+ * @brief 从缓存中删除条目
+ */
+static void remove_entry(answer_cache *c, cache_entry *e) {
+    cache_entry **pp = &c->buckets[e->hash & c->mask];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(e);
+    c->used -= e->size;
+    c->count--;
+    free(e);
+}
+
+/**
+ * @brief 条目数超过桶数时桶数翻倍
+ */
+static void grow(answer_cache *c) {
+    const uint32_t n = (c->mask + 1) * 2;
+    cache_entry **buckets = calloc(n, sizeof(cache_entry *));
+    if (!buckets)
+        return; // 扩容失败只影响查找速度
+    for (uint32_t i = 0; i <= c->mask; i++) {
+        cache_entry *e = c->buckets[i];
+        while (e) {
+            cache_entry *next = e->hnext;
+            e->hnext = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->mask = n - 1;
+}
+
+/**
+ * @brief 查找与Question匹配的条目
+ */
+static cache_entry *find(const answer_cache *c, const question_t *q, const uint32_t hash) {
+    for (cache_entry *e = c->buckets[hash & c->mask]; e; e = e->hnext) {
+        if (e->hash == hash && e->qtype == q->qtype && e->qclass == q->qclass && e->dnssec == q->dnssec &&
+            e->name_len == q->name_len && memcmp(entry_name(e), q->name, q->name_len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 解析答复中的资源记录，找出各TTL字段的偏移与应缓存的时间
+ * @param msg 答复报文
+ * @param len 报文长度
+ * @param pos 第一条资源记录的偏移
+ * @param offsets 输出TTL字段偏移
+ * @param cnt 输出TTL字段数
+ * @return 应缓存的秒数，不应缓存返回0
+ */
+static uint32_t parse_ttl(const unsigned char *msg, const int len, int pos, uint16_t *offsets, int *cnt) {
+    const Header *h = (const Header *) msg;
+    const int ancount = ntohs(h->ancount);
+    const int total = ancount + ntohs(h->nscount) + ntohs(h->arcount);
+    uint32_t answer_ttl = UINT32_MAX, negative_ttl = UINT32_MAX;
+    *cnt = 0;
+    for (int i = 0; i < total; i++) {
+        pos = skip_name(msg, len, pos);
+        if (pos < 0 || pos + 10 > len)
+            return 0;
+        const uint16_t type = (msg[pos] << 8) + msg[pos + 1];
+        const uint32_t ttl = read32(msg + pos + 4);
+        const int rdlength = (msg[pos + 8] << 8) + msg[pos + 9];
+        const int rdata = pos + 10;
+        if (rdata + rdlength > len)
+            return 0;
+        // OPT记录的TTL字段是扩展标志，不递减
+        if (type != OPT) {
+            if (*cnt == MAX_TTL_FIELDS)
+                return 0;
+            offsets[(*cnt)++] = pos + 4;
+        }
+        if (i < ancount) {
+            if (ttl < answer_ttl)
+                answer_ttl = ttl;
+        } else if (i < total - ntohs(h->arcount) && type == SOA) {
+            // RFC 2308：否定答复的缓存时间取SOA记录的TTL与MINIMUM字段的较小值
+            const int end = rdata + rdlength;
+            if (rdlength < 22)
+                return 0;
+            const uint32_t minimum = read32(msg + end - 4);
+            negative_ttl = ttl < minimum ? ttl : minimum;
+        }
+        pos = rdata + rdlength;
+    }
+    uint32_t ttl;
+    if (h->rcode == 0 && ancount > 0)
+        ttl = answer_ttl;
+    else if (negative_ttl != UINT32_MAX)
+        ttl = negative_ttl; // NXDOMAIN或NODATA
+    else
+        return 0; // 没有SOA的否定答复不缓存
+    return ttl > MAX_CACHE_TTL ? MAX_CACHE_TTL : ttl;
+}
+
+/**
+ * @brief 加入条目，替换同一Question的旧条目，超出内存上限时淘汰最久未使用的条目
+ * @param c 缓存
+ * @param q 答复的Question
+ * @param hash (qname, qtype, qclass, dnssec)的哈希
+ * @param msg 答复报文
+ * @param len 报文长度
+ * @param opt_len 答复末尾OPT记录的长度
+ * @param offsets TTL字段偏移
+ * @param cnt TTL字段数
+ * @param stored 存入时间
+ * @param expire 过期时间
+ * @return 新条目，内存不足时返回NULL
+ */
+static cache_entry *insert(answer_cache *c, const question_t *q, const uint32_t hash, const unsigned char *msg,
+                           const int len, const int opt_len, const uint16_t *offsets, const int cnt,
+                           const uint64_t stored, const uint64_t expire) {
+    const size_t size = sizeof(cache_entry) + cnt * sizeof(uint16_t) + q->name_len + len;
+    if (size > c->budget)
+        return NULL;
+    cache_entry *old = find(c, q, hash);
+    if (old)
+        remove_entry(c, old);
+    // 超出内存上限时淘汰最久未使用的条目
+    while (c->used + size > c->budget && c->lru.prev != &c->lru)
+        remove_entry(c, c->lru.prev);
+    cache_entry *e = malloc(size);
+    if (!e)
+        return NULL;
+    e->hash = hash;
+    e->qtype = q->qtype;
+    e->qclass = q->qclass;
+    e->dnssec = q->dnssec;
+    e->stored = stored;
+    e->expire = expire;
+    e->hits = 0;
+    e->size = size;
+    e->len = len;
+    e->opt_len = opt_len;
+    e->name_len = q->name_len;
+    e->ttl_cnt = cnt;
+    memcpy(entry_offsets(e), offsets, cnt * sizeof(uint16_t));
+    memcpy(entry_name(e), q->name, q->name_len);
+    memcpy(entry_msg(e), msg, len);
+    ((Header *) entry_msg(e))->id = 0;
+    e->hnext = c->buckets[hash & c->mask];
+    c->buckets[hash & c->mask] = e;
+    lru_push_front(c, e);
+    c->used += size;
+    if (++c->count > c->mask + 1)
+        grow(c);
+    return e;
+}
+
+/**
+ * @brief 进程内没有条目时从共享内存缓存取入，保留原来的存入与过期时间，TTL照常按已缓存的时间递减
+ * @param c 缓存
+ * @param q 请求的Question
+ * @param hash (qname, qtype, qclass, dnssec)的哈希
+ * @param now 当前时间
+ * @return 取入的条目，未命中或已过了可应答的时间返回NULL
+ */
+static cache_entry *adopt_shared(answer_cache *c, const question_t *q, const uint32_t hash, const uint64_t now) {
+    unsigned char msg[SHM_SLOT_SIZE];
+    shm_entry se;
+    if (shm_cache_get(c->shared, q, hash, msg, &se) < 0 || now >= se.expire + (uint64_t) c->max_stale * 1000)
+        return NULL;
+    uint16_t offsets[MAX_TTL_FIELDS];
+    int cnt;
+    if (parse_ttl(msg, se.len, q->end, offsets, &cnt) == 0)
+        return NULL;
+    return insert(c, q, hash, msg, se.len, se.opt_len, offsets, cnt, se.stored, se.expire);
+}
+
+/**
+ * @brief 查找缓存，命中时构造答复：恢复请求的id与域名大小写，TTL减去已缓存的时间，过期的答复TTL为STALE_TTL；
+ *        请求没有OPT记录时去掉答复中的OPT记录，有时确保答复带OPT记录（RFC 6891 7）；
+ *        答复超过客户端可接收的长度时只返回设置了TC位的Question段，客户端改用TCP时不必再等DNS服务器
+ * @param c 缓存
+ * @param q 请求的Question，含parse_edns解析出的EDNS字段
+ * @param request 请求报文
+ * @param out 答复缓冲区，至少limit字节
+ * @param limit 客户端可接收的答复长度
+ * @param now 当前时间
+ * @param len 输出答复长度
+ * @return CACHE_MISS、CACHE_FRESH、CACHE_REFRESH或CACHE_STALE，条目刚从共享内存缓存取入时再按位或上CACHE_SHARED
+ */
+int cache_lookup(answer_cache *c, const question_t *q, const unsigned char *request, unsigned char *out,
+                 const int limit, const uint64_t now, int *len) {
+    const uint32_t hash = key_hash(q);
+    cache_entry *e = find(c, q, hash);
+    int shared = 0;
+    if (!e && c->shared && (e = adopt_shared(c, q, hash, now)) != NULL)
+        shared = CACHE_SHARED;
+    if (!e)
+        return CACHE_MISS;
+    const int stale = now >= e->expire;
+    if (stale && now >= e->expire + (uint64_t) c->max_stale * 1000) {
+        remove_entry(c, e);
+        return CACHE_MISS;
+    }
+    e->hits++;
+    lru_unlink(e);
+    lru_push_front(c, e);
+    const unsigned char *msg = entry_msg(e);
+    const int body = e->len - e->opt_len; // 不含OPT记录的部分
+    const int full_opt = q->udp_size ? e->opt_len ? e->opt_len : OPT_LEN : 0; // 完整答复附上的OPT记录的长度
+    const int fits = body + full_opt <= limit;
+    // 截断的答复附上中继的OPT记录：答复中的OPT记录可能带有很长的选项（如填充），附在Question段后会超出limit
+    const int opt_len = q->udp_size ? fits ? full_opt : OPT_LEN : 0;
+    const unsigned char *opt = fits && e->opt_len ? msg + body : c->opt;
+    memcpy(out, msg, fits ? body : (int) sizeof(Header));
+    Header *h = (Header *) out;
+    h->id = ((const Header *) request)->id;
+    h->rd = ((const Header *) request)->rd;
+    memcpy(out + sizeof(Header), request + sizeof(Header), q->end - sizeof(Header));
+    int n;
+    if (fits) {
+        const uint32_t elapsed = (now - e->stored) / 1000;
+        const uint16_t *offsets = entry_offsets(e);
+        for (int i = 0; i < e->ttl_cnt; i++) {
+            const uint32_t ttl = read32(out + offsets[i]);
+            write32(out + offsets[i], stale ? STALE_TTL : ttl > elapsed ? ttl - elapsed : 0);
+        }
+        if (e->opt_len)
+            h->arcount = htons(ntohs(h->arcount) - 1);
+        n = body;
+    } else {
+        n = truncate_reply(out, q);
+    }
+    if (opt_len) {
+        memcpy(out + n, opt, opt_len);
+        h->arcount = htons(ntohs(h->arcount) + 1);
+        n += opt_len;
+    }
+    *len = n;
+    // 过期的条目由调用方照常查询，失败时再用构造的答复；剩余TTL不多的热门条目照常应答，在后台刷新
+    if (stale)
+        return CACHE_STALE | shared;
+    if (e->hits >= HOT_HITS && (e->expire - now) * 100 <= (e->expire - e->stored) * PREFETCH_PERCENT)
+        return CACHE_REFRESH | shared;
+    return CACHE_FRESH | shared;
+}
+
+/**
+ * @brief 缓存DNS服务器的答复，只缓存NOERROR与NXDOMAIN且未截断的答复，包括经TCP取得的长答复；
+ *        带OPT记录的答复要求OPT记录在最后，应答时可直接去掉；开启共享内存缓存时同时存入
+ * @param c 缓存
+ * @param q 答复的Question，含parse_edns解析出的EDNS字段
+ * @param msg 答复报文
+ * @param len 报文长度
+ * @param now 当前时间
+ */
+void cache_store(answer_cache *c, const question_t *q, const unsigned char *msg, const int len,
+                 const uint64_t now) {
+    const Header *h = (const Header *) msg;
+    if (c->budget == 0 || h->tc || (h->rcode != 0 && h->rcode != 3) || ntohs(h->qdcount) != 1 ||
+        (q->udp_size && q->opt_off + q->opt_len != len))
+        return;
+    uint16_t offsets[MAX_TTL_FIELDS];
+    int cnt;
+    const uint32_t ttl = parse_ttl(msg, len, q->end, offsets, &cnt);
+    if (ttl == 0)
+        return;
+    const uint32_t hash = key_hash(q);
+    const shm_entry se = {now, now + (uint64_t) ttl * 1000, (uint16_t) len, q->udp_size ? (uint16_t) q->opt_len : 0};
+    insert(c, q, hash, msg, len, se.opt_len, offsets, cnt, se.stored, se.expire);
+    // 同一主机上的其他中继进程由此共享答复
+    if (c->shared)
+        shm_cache_put(c->shared, q, hash, msg, &se);
+    log_detailed("Cache answer for %u seconds", ttl);
+}
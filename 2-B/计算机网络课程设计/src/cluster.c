@@ -0,0 +1,81 @@
+/**
+ * @file cluster.c
+ * @brief 集群模式的一致性哈希环：虚拟节点的位置是"地址:端口#序号"的哈希，只取决于节点地址，与配置的顺序无关
+ */
+#include "../include/cluster.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief 32位混合函数（MurmurHash3的fmix32），使相近的FNV哈希在环上分散
+ */
+static uint32_t mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * @brief 在环上放置一个节点的虚拟节点
+ */
+static void place(hash_ring *r, const struct sockaddr_in *addr, const int member) {
+    char key[INET_ADDRSTRLEN + 16];
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    for (int i = 0; i < CLUSTER_VNODES; i++) {
+        const int n = snprintf(key, sizeof(key), "%s:%d#%d", ip, ntohs(addr->sin_port), i);
+        uint32_t h = 2166136261u;
+        for (int k = 0; k < n; k++)
+            h = (h ^ (unsigned char) key[k]) * 16777619u;
+        r->points[r->cnt].point = mix(h);
+        r->points[r->cnt++].member = member;
+    }
+}
+
+/**
+ * @brief 按位置排序
+ */
+static int point_cmp(const void *a, const void *b) {
+    const ring_point *x = a, *y = b;
+    if (x->point != y->point)
+        return x->point < y->point ? -1 : 1;
+    return 0;
+}
+
+/**
+ * @brief 由本节点与其他节点的地址构造环，其他节点中不应包含本节点
+ * @param r 环
+ * @param self 本节点在集群中的地址
+ * @param peers 其他节点的地址
+ * @param peer_cnt 其他节点数
+ */
+void ring_init(hash_ring *r, const struct sockaddr_in *self, const struct sockaddr_in *peers, const int peer_cnt) {
+    r->cnt = 0;
+    place(r, self, CLUSTER_SELF);
+    for (int p = 0; p < peer_cnt; p++)
+        place(r, &peers[p], p);
+    qsort(r->points, r->cnt, sizeof(ring_point), point_cmp);
+}
+
+/**
+ * @brief 负责该域名哈希的节点：环上位置不小于哈希的第一个虚拟节点所属的节点，超过最大位置时绕回第一个
+ * @param r 环
+ * @param hash 点分形式域名的FNV-1a哈希，同一域名的各类型请求由同一节点负责
+ * @return CLUSTER_SELF或其他节点的下标
+ */
+int ring_owner(const hash_ring *r, const uint32_t hash) {
+    const uint32_t h = mix(hash);
+    int lo = 0, hi = r->cnt;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (r->points[mid].point < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return r->points[lo == r->cnt ? 0 : lo].member;
+}
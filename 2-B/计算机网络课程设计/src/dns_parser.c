@@ -1,157 +1,300 @@
-/**
- * @file dns_parser.c
- * @brief DNS报文解析
- */
-#include "../include/dns_parser.h"
-#include "../include/consts.h"
-#include "../include/logs.h"
-#include <string.h>
-#include <stdlib.h>
-
-
-/**
- * @brief 从原始以标签长度分隔的域名中解析出以点分隔的域名
- * @param buf 待解析的缓冲区
- * @return 域名，形如baidu.com
- */
-char *name_parse(const char *buf) {
-    int i = 0;
-    char *name = (char *) calloc(MAX_NAME_LEN, sizeof(char));
-    while (buf[i] != '\0') {
-        strncat(name, buf + i + 1, (int) buf[i]);
-        strcat(name, ".");
-        i += (int) buf[i] + 1;
-    }
-    /* 5 b a i d u 3 c o m 0
-       b a i d u . c o m .  */
-    name[i - 1] = '\0';
-    return name;
-}
-
-/**
- * @brief 根据请求报文头填充应答报文头
- * @param to_fill 待填充的报文头
- * @param src 请求报文头
- * @param type 类型，REFUSE表示拒绝，ACCEPT表示接受
- */
-void fill_header(Header *to_fill, const Header *src, const int type) {
-    memset(to_fill, 0, sizeof(Header));
-    to_fill->id = src->id;
-    to_fill->qr = 1; // qr=1，表示是响应报文
-    to_fill->opcode = src->opcode;
-    to_fill->aa = 0;
-    to_fill->tc = 0;
-    to_fill->rd = src->rd;
-    to_fill->ra = 1;
-    to_fill->z = 0;
-    if (type == REJECT) {
-        to_fill->rcode = 5; // 5表示拒绝
-    } else {
-        to_fill->rcode = 0;
-        to_fill->qdcount = src->qdcount;
-        to_fill->ancount = htons(1);
-    }
-}
-
-/**
- * @brief 构造RR
- * @param rr 待填充的RR
- * @param result 查询结果
- */
-void construct_RR(unsigned char *rr, const uint32_t result) {
-    RR rr_without_name_and_rdata = {
-        .type = htons(1), // A记录
-        .class = htons(1), // IN，因特网
-        .ttl = htonl(60), // 保留1分钟
-        .rdlength = htons(4), // rdata长度为4
-    };
-    rr[0] = 0xc0;
-    rr[1] = 0x0c; /* 0xc00c表示指针指向name，具体地，0b1100000000001100，11是标志，后面是偏移量 */
-    memcpy(rr + 2, ((char *) &rr_without_name_and_rdata) + sizeof(unsigned char *), 10); /* 跳过name */
-    memcpy(rr + 12, &result, 4);
-}
-
-/**
- * @brief 构造响应报文
- * @param response 待填充的响应报文
- * @param response_head 响应报文头
- * @param buf 请求报文
- * @param len 请求报文长度
- * @param rr 资源记录
- */
-void construct_response(unsigned char *response, Header *response_head, const unsigned char *buf, const int len,
-                        const unsigned char *rr) {
-    memcpy(response, (char *) response_head, sizeof(Header));
-    memcpy(response + sizeof(Header), buf + sizeof(Header), len - sizeof(Header));
-    memcpy(response + len, rr, 16);
-}
-
-/**
- * @brief 获取Question字段类型
- * @param question Question字段
- */
-TYPE get_question_type(const unsigned char *question) {
-    int i = 0;
-    while (question[i] != '\0') {
-        i += question[i] + 1;
-    }
-    i++;
-    TYPE type = (question[i] << 8) + question[i + 1];
-    switch (type) {
-        case A:
-            log_detailed("Question type: A");
-            break;
-        case NS:
-            log_detailed("Question type: NS");
-            break;
-        case MD:
-            log_detailed("Question type: MD");
-            break;
-        case MF:
-            log_detailed("Question type: MF");
-            break;
-        case CNAME:
-            log_detailed("Question type: CNAME");
-            break;
-        case SOA:
-            log_detailed("Question type: SOA");
-            break;
-        case MB:
-            log_detailed("Question type: MB");
-            break;
-        case MG:
-            log_detailed("Question type: MG");
-            break;
-        case MR:
-            log_detailed("Question type: MR");
-            break;
-        case NULL_R:
-            log_detailed("Question type: NULL");
-            break;
-        case WKS:
-            log_detailed("Question type: WKS");
-            break;
-        case PTR:
-            log_detailed("Question type: PTR");
-            break;
-        case HINFO:
-            log_detailed("Question type: HINFO");
-            break;
-        case MINFO:
-            log_detailed("Question type: MINFO");
-            break;
-        case MX:
-            log_detailed("Question type: MX");
-            break;
-        case TXT:
-            log_detailed("Question type: TXT");
-            break;
-        case AAAA:
-            log_detailed("Question type: AAAA");
-            break;
-        default:
-            log_detailed("Question type: Unknown");
-            break;
-    }
-    return type;
-}
\ No newline at end of file
+/**
+ * @file dns_parser.c
+ * @brief DNS报文解析
+ */
+#include "../include/dns_parser.h"
+#include "../include/consts.h"
+#include <string.h>
+#include <ctype.h>
+
+
+/**
+ * @brief 把解析出的线上格式域名转为点分形式
+ * @param q 解析出的Question
+ * @param text 输出缓冲区，至少MAX_NAME_LEN字节
+ */
+void name_to_text(const question_t *q, char *text) {
+    int n = 0;
+    for (int i = 0; i < q->label_cnt; i++) {
+        const unsigned char *label = q->name + q->label_offs[i];
+        if (i > 0)
+            text[n++] = '.';
+        memcpy(text + n, label + 1, label[0]);
+        n += label[0];
+    }
+    /* 5 b a i d u 3 c o m 0
+       b a i d u . c o m    */
+    text[n] = '\0';
+}
+
+/**
+ * @brief 根据请求报文头填充应答报文头
+ * @param to_fill 待填充的报文头
+ * @param src 请求报文头
+ * @param type 类型，REFUSE表示拒绝，ACCEPT表示接受
+ */
+void fill_header(Header *to_fill, const Header *src, const int type) {
+    memset(to_fill, 0, sizeof(Header));
+    to_fill->id = src->id;
+    to_fill->qr = 1; // qr=1，表示是响应报文
+    to_fill->opcode = src->opcode;
+    to_fill->aa = 0;
+    to_fill->tc = 0;
+    to_fill->rd = src->rd;
+    to_fill->ra = 1;
+    to_fill->z = 0;
+    if (type == REJECT) {
+        to_fill->rcode = 5; // 5表示拒绝
+    } else {
+        to_fill->rcode = 0;
+        to_fill->qdcount = src->qdcount;
+        to_fill->ancount = htons(1);
+    }
+}
+
+/**
+ * @brief 构造RR
+ * @param rr 待填充的RR
+ * @param result 查询结果
+ */
+void construct_RR(unsigned char *rr, const uint32_t result) {
+    construct_RR_data(rr, A, &result, 4);
+}
+
+/**
+ * @brief 构造任意类型的RR，域名为指向Question中域名的指针
+ * @param rr 待填充的RR，至少12 + rdlength字节
+ * @param type 类型
+ * @param rdata 资源数据，已是网络字节序
+ * @param rdlength 资源数据长度
+ * @return RR的长度
+ */
+int construct_RR_data(unsigned char *rr, const uint16_t type, const void *rdata, const uint16_t rdlength) {
+    RR rr_without_name_and_rdata = {
+        .type = htons(type),
+        .class = htons(1), // IN，因特网
+        .ttl = htonl(60), // 保留1分钟
+        .rdlength = htons(rdlength),
+    };
+    rr[0] = 0xc0;
+    rr[1] = 0x0c; /* 0xc00c表示指针指向name，具体地，0b1100000000001100，11是标志，后面是偏移量 */
+    memcpy(rr + 2, ((char *) &rr_without_name_and_rdata) + sizeof(unsigned char *), 10); /* 跳过name */
+    memcpy(rr + 12, rdata, rdlength);
+    return 12 + rdlength;
+}
+
+/**
+ * @brief 把点分形式的域名转为线上格式，不改变大小写
+ * @param text 点分形式的域名，可以以点结尾
+ * @param name 输出缓冲区，至少MAX_NAME_LEN字节
+ * @return 线上格式的长度，含结尾的0；域名不合法返回-1
+ */
+int text_to_name(const char *text, unsigned char *name) {
+    int n = 0;
+    const char *label = text;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        const int len = dot ? (int) (dot - label) : (int) strlen(label);
+        if (len == 0 || len > 63 || n + len + 2 > MAX_NAME_LEN)
+            return -1;
+        name[n++] = (unsigned char) len;
+        memcpy(name + n, label, len);
+        n += len;
+        if (!dot)
+            break;
+        label = dot + 1;
+    }
+    name[n++] = 0;
+    return n;
+}
+
+/**
+ * @brief 构造响应报文
+ * @param response 待填充的响应报文
+ * @param response_head 响应报文头
+ * @param buf 请求报文
+ * @param len 请求报文长度
+ * @param rr 资源记录
+ */
+void construct_response(unsigned char *response, Header *response_head, const unsigned char *buf, const int len,
+                        const unsigned char *rr) {
+    memcpy(response, (char *) response_head, sizeof(Header));
+    memcpy(response + sizeof(Header), buf + sizeof(Header), len - sizeof(Header));
+    memcpy(response + len, rr, 16);
+}
+
+/**
+ * @brief 把答复截断为只含Question段并设置TC位，告知客户端改用TCP或更大的缓冲区重新查询（RFC 1035 4.2.1）
+ * @param msg 答复报文，原地修改
+ * @param q 答复的Question
+ * @return 截断后的长度
+ */
+int truncate_reply(unsigned char *msg, const question_t *q) {
+    Header *h = (Header *) msg;
+    h->tc = 1;
+    h->ancount = 0;
+    h->nscount = 0;
+    h->arcount = 0;
+    return q->end;
+}
+
+/**
+ * @brief 构造不带选项的OPT记录：根域名，CLASS字段为UDP载荷大小，TTL字段为扩展RCODE、版本0与标志0
+ * @param p 输出缓冲区，至少OPT_LEN字节
+ * @param udp_size 可接收的UDP载荷大小
+ * @param ext_rcode 扩展RCODE的高8位
+ * @return OPT_LEN
+ */
+int write_opt(unsigned char *p, const uint16_t udp_size, const uint8_t ext_rcode) {
+    memset(p, 0, OPT_LEN);
+    p[2] = OPT;
+    p[3] = udp_size >> 8;
+    p[4] = udp_size;
+    p[5] = ext_rcode;
+    return OPT_LEN;
+}
+
+/**
+ * @brief 获取类型名称
+ * @param type 类型
+ */
+const char *type_name(const TYPE type) {
+    switch (type) {
+        case A:
+            return "A";
+        case NS:
+            return "NS";
+        case MD:
+            return "MD";
+        case MF:
+            return "MF";
+        case CNAME:
+            return "CNAME";
+        case SOA:
+            return "SOA";
+        case MB:
+            return "MB";
+        case MG:
+            return "MG";
+        case MR:
+            return "MR";
+        case NULL_R:
+            return "NULL";
+        case WKS:
+            return "WKS";
+        case PTR:
+            return "PTR";
+        case HINFO:
+            return "HINFO";
+        case MINFO:
+            return "MINFO";
+        case MX:
+            return "MX";
+        case TXT:
+            return "TXT";
+        case AAAA:
+            return "AAAA";
+        default:
+            return "Unknown";
+    }
+}
+
+/**
+ * @brief 解析并校验报文的第一个Question，域名转为小写
+ * @param msg 报文
+ * @param len 报文长度
+ * @param q 解析结果
+ * @return 成功返回0，报文不合法返回-1
+ */
+int parse_question(const unsigned char *msg, const int len, question_t *q) {
+    if (len < (int) sizeof(Header) || ntohs(((const Header *) msg)->qdcount) < 1)
+        return -1;
+    int pos = sizeof(Header), n = 0;
+    uint32_t h = 2166136261u;
+    q->label_cnt = 0;
+    // 一次遍历完成校验、转小写与哈希，哈希按点分形式计算，标签之间补上'.'
+    while (pos < len && msg[pos] != 0) {
+        const int label = msg[pos];
+        // 请求中的域名不应含压缩指针，标签长度不超过63
+        if (label > 63 || pos + label + 1 >= len || n + label + 1 >= MAX_NAME_LEN)
+            return -1;
+        if (n > 0)
+            h = (h ^ '.') * 16777619u;
+        q->label_offs[q->label_cnt++] = (uint8_t) n;
+        q->name[n++] = (unsigned char) label;
+        for (int i = 1; i <= label; i++) {
+            const unsigned char c = (unsigned char) tolower(msg[pos + i]);
+            q->name[n++] = c;
+            h = (h ^ c) * 16777619u;
+        }
+        pos += label + 1;
+    }
+    if (pos + 5 > len)
+        return -1;
+    q->name[n++] = 0;
+    q->name_len = n;
+    q->hash = h;
+    q->qtype = (msg[pos + 1] << 8) + msg[pos + 2];
+    q->qclass = (msg[pos + 3] << 8) + msg[pos + 4];
+    q->end = pos + 5;
+    q->udp_size = 0;
+    q->dnssec = ((const Header *) msg)->z & HEADER_CD ? DNSSEC_CD : 0;
+    return 0;
+}
+
+/**
+ * @brief 跳过报文中可能含压缩指针的域名
+ * @param msg 报文
+ * @param len 报文长度
+ * @param pos 域名起始偏移
+ * @return 域名之后的偏移，报文不合法返回-1
+ */
+int skip_name(const unsigned char *msg, const int len, int pos) {
+    while (pos < len) {
+        if ((msg[pos] & 0xc0) == 0xc0)
+            return pos + 2 <= len ? pos + 2 : -1; // 压缩指针，域名到此结束
+        if (msg[pos] & 0xc0)
+            return -1;
+        if (msg[pos] == 0)
+            return pos + 1;
+        pos += msg[pos] + 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief 在资源记录中找出附加段的OPT记录，记录其UDP载荷大小、版本、DO位与位置；没有OPT记录时udp_size保持为0
+ * @param msg 报文
+ * @param len 报文长度
+ * @param q 已由parse_question解析的Question，原地填写EDNS字段
+ * @return 成功返回0，报文不合法或有多个OPT记录返回-1
+ */
+int parse_edns(const unsigned char *msg, const int len, question_t *q) {
+    const Header *h = (const Header *) msg;
+    const int total = ntohs(h->ancount) + ntohs(h->nscount) + ntohs(h->arcount);
+    const int first_ar = total - ntohs(h->arcount);
+    int pos = q->end;
+    for (int i = 0; i < total; i++) {
+        const int start = pos;
+        pos = skip_name(msg, len, pos);
+        if (pos < 0 || pos + 10 > len)
+            return -1;
+        const uint16_t type = (msg[pos] << 8) + msg[pos + 1];
+        const int end = pos + 10 + ((msg[pos + 8] << 8) + msg[pos + 9]);
+        if (end > len)
+            return -1;
+        if (type == OPT && i >= first_ar) {
+            if (q->udp_size != 0 || msg[start] != 0)
+                return -1; // OPT记录只能有一个，且域名为根
+            const uint16_t size = (msg[pos + 2] << 8) + msg[pos + 3];
+            q->udp_size = size < MAX_MSG_LEN ? MAX_MSG_LEN : size; // 小于512按512处理
+            q->edns_version = msg[pos + 5];
+            if (msg[pos + 6] & 0x80)
+                q->dnssec |= DNSSEC_DO;
+            q->opt_off = start;
+            q->opt_len = end - start;
+        }
+        pos = end;
+    }
+    return 0;
+}
@@ -0,0 +1,672 @@
+/**
+ * @file dnsrelay_bench.c
+ * @brief 压测工具：按域名列表或pcap抓包中的请求循环向中继发送请求，可限定发送速率，
+ * 可顺带启动测试用的上游服务器与中继，统计吞吐量、丢包率与延迟分位数；
+ * 请求可分散发往多个中继，由上游服务器收到的请求数得出中继整体的缓存命中率，用于比较集群与各自独立的中继
+ */
+#include "../include/structs.h"
+#include "../include/consts.h"
+#include "../include/dns_parser.h"
+#include "../include/metrics.h"
+#include "../include/timer.h"
+#include <argp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BATCH 64 // 一次系统调用收发的报文数
+#define BENCH_TIMEOUT 1000000 // 超过该微秒数未答复视为丢失
+#define MAX_IDS 65536
+#define READY_TRIES 30 // 等待中继就绪时的探测次数，每次100毫秒
+#define MAX_RELAYS 9 // 最多的中继数，与中继集群的节点数上限相同
+
+#define LINKTYPE_NULL 0 // BSD环回，4字节协议族
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101 // 直接是IP报文
+#define LINKTYPE_LINUX_SLL 113 // Linux cooked capture
+#define LINKTYPE_LINUX_SLL2 276
+
+typedef struct {
+    char *server; // 中继地址
+    uint16_t ports[MAX_RELAYS]; // 中继端口，多个时请求分散发往各端口
+    int port_cnt;
+    long count; // 请求总数
+    int window; // 未答复请求上限
+    long rate; // 目标发送速率，每秒请求数，0表示不限速
+    char *names_file; // 域名列表
+    char *pcap_file; // pcap抓包文件
+    int stub_port; // 启动的上游服务器的监听端口，0表示不启动
+    int stub_delay; // 上游服务器的答复延迟，单位毫秒
+    int stub_loss; // 上游服务器的丢包率，百分数
+    char *relay_cmds[MAX_RELAYS]; // 启动中继的命令
+    int relay_cnt; // 启动的中继数，0表示不启动
+    int json; // 以一行JSON输出结果
+} bench_args;
+
+static bench_args bargs = {"127.0.0.1", {0}, 0, 100000, 256, 0, NULL, NULL, 0, 0, 0, {NULL}, 0, 0};
+
+static struct argp_option bench_options[] = {
+    {"server", 's', "ADDR", 0, "Relay address (default 127.0.0.1)."},
+    {"port", 'p', "PORT", 0, "Relay port (default 53); may be repeated to spread the queries over several relays."},
+    {"count", 'n', "N", 0, "Number of queries to send (default 100000)."},
+    {"window", 'w', "N", 0, "Maximum outstanding queries (default 256)."},
+    {"rate", 'q', "QPS", 0, "Send at most QPS queries per second (default 0, as fast as the window allows)."},
+    {"pcap", 'P', "FILE", 0, "Replay the DNS queries captured in FILE instead of a names file."},
+    {"stub-port", 'U', "PORT", 0, "Start dnsrelay-stub listening on 127.0.0.1:PORT for the run."},
+    {"stub-delay", 'D', "MS", 0, "Answer delay of the started stub (default 0)."},
+    {"stub-loss", 'L', "PCT", 0, "Loss rate of the started stub (default 0)."},
+    {"relay", 'R', "CMD", 0, "Start the relay with the shell command CMD for the run, and stop it with SIGTERM; "
+                             "may be repeated to start several relays."},
+    {"json", 'J', 0, 0, "Print the result as one line of JSON."},
+    {0}
+};
+
+/**
+ * @brief 解析非负整数参数
+ */
+static long parse_number(struct argp_state *state, const char *arg, const long max, const char *what) {
+    char *end;
+    const long v = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || v < 0 || v > max)
+        argp_error(state, "%s should be between 0 and %ld", what, max);
+    return v;
+}
+
+static error_t parse_bench_opt(int key, char *arg, struct argp_state *state) {
+    bench_args *a = state->input;
+    switch (key) {
+        case 's':
+            a->server = arg;
+            break;
+        case 'p':
+            if (a->port_cnt == MAX_RELAYS)
+                argp_error(state, "at most %d relay ports", MAX_RELAYS);
+            a->ports[a->port_cnt++] = (uint16_t) parse_number(state, arg, 65535, "port");
+            break;
+        case 'n':
+            a->count = parse_number(state, arg, LONG_MAX, "count");
+            break;
+        case 'w':
+            a->window = atoi(arg);
+            if (a->window < 1 || a->window >= MAX_IDS)
+                argp_error(state, "window should be between 1 and %d", MAX_IDS - 1);
+            break;
+        case 'q':
+            a->rate = parse_number(state, arg, 100000000, "rate");
+            break;
+        case 'P':
+            a->pcap_file = arg;
+            break;
+        case 'U':
+            a->stub_port = (int) parse_number(state, arg, 65535, "stub port");
+            break;
+        case 'D':
+            a->stub_delay = (int) parse_number(state, arg, 60000, "stub delay");
+            break;
+        case 'L':
+            a->stub_loss = (int) parse_number(state, arg, 100, "stub loss");
+            break;
+        case 'R':
+            if (a->relay_cnt == MAX_RELAYS)
+                argp_error(state, "at most %d relays", MAX_RELAYS);
+            a->relay_cmds[a->relay_cnt++] = arg;
+            break;
+        case 'J':
+            a->json = 1;
+            break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num > 0 || a->pcap_file)
+                argp_error(state, "too many arguments");
+            a->names_file = arg;
+            break;
+        case ARGP_KEY_END:
+            if (!a->names_file && !a->pcap_file)
+                argp_usage(state);
+            if (a->port_cnt == 0)
+                a->ports[a->port_cnt++] = DNS_PORT;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp bench_argp = {
+    .options = bench_options,
+    .parser = parse_bench_opt,
+    .args_doc = "[NAMES_FILE]",
+    .doc = "Load generator for dnsrelay. NAMES_FILE holds one name per line, optionally followed by a query "
+           "type (A if omitted); lines in dnsrelay.txt format use their last column. With --pcap, the UDP DNS "
+           "queries in a capture are replayed instead.",
+};
+
+typedef struct {
+    uint32_t off; // 在query_data中的偏移
+    uint16_t len; // 报文长度
+} query_ref; // 一个待发送的请求报文，发送时只改写id
+
+static unsigned char *query_data; // 所有请求报文
+static size_t data_len, data_capacity;
+static query_ref *queries;
+static int query_cnt, query_capacity;
+
+/**
+ * @brief 保存一个请求报文
+ */
+static void add_query(const unsigned char *msg, const int len) {
+    if (data_len + len > data_capacity) {
+        data_capacity = data_capacity ? data_capacity * 2 : 65536;
+        query_data = realloc(query_data, data_capacity);
+    }
+    if (query_cnt == query_capacity) {
+        query_capacity = query_capacity ? query_capacity * 2 : 1024;
+        queries = realloc(queries, query_capacity * sizeof(query_ref));
+    }
+    if (!query_data || !queries) {
+        perror("realloc failed");
+        exit(-1);
+    }
+    memcpy(query_data + data_len, msg, len);
+    queries[query_cnt].off = (uint32_t) data_len;
+    queries[query_cnt++].len = (uint16_t) len;
+    data_len += len;
+}
+
+/**
+ * @brief 解析类型名称，如A、AAAA、MX或TYPE65
+ * @return 类型，不是类型名称时返回0
+ */
+static uint16_t parse_type(const char *text) {
+    if (strncasecmp(text, "TYPE", 4) == 0 && text[4] >= '0' && text[4] <= '9')
+        return (uint16_t) atoi(text + 4);
+    for (int t = 1; t < 256; t++) {
+        if (strcasecmp(type_name((TYPE) t), text) == 0)
+            return (uint16_t) t;
+    }
+    return 0;
+}
+
+/**
+ * @brief 构造请求报文
+ * @return 报文长度，域名不合法返回-1
+ */
+static int build_query(unsigned char *msg, const char *name, const uint16_t qtype) {
+    Header *h = (Header *) msg;
+    memset(h, 0, sizeof(Header));
+    h->rd = 1;
+    h->qdcount = htons(1);
+    const int n = text_to_name(name, msg + sizeof(Header));
+    if (n < 0)
+        return -1;
+    int pos = sizeof(Header) + n;
+    msg[pos++] = qtype >> 8;
+    msg[pos++] = qtype & 0xff;
+    msg[pos++] = 0;
+    msg[pos++] = 1;
+    return pos;
+}
+
+/**
+ * @brief 读取域名列表，每行取最后一列；最后一列是类型名称时取前一列为域名
+ */
+static void load_names(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("fopen failed");
+        exit(-1);
+    }
+    char line[1024];
+    unsigned char msg[MAX_MSG_LEN];
+    while (fgets(line, sizeof(line), f)) {
+        char *prev = NULL, *last = NULL;
+        for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            prev = last;
+            last = tok;
+        }
+        uint16_t qtype = A;
+        if (prev && parse_type(last)) {
+            qtype = parse_type(last);
+            last = prev;
+        }
+        int len;
+        if (last && (len = build_query(msg, last, qtype)) > 0)
+            add_query(msg, len);
+    }
+    fclose(f);
+}
+
+/**
+ * @brief 按文件的字节序读取整数
+ */
+static uint32_t pcap_u32(const unsigned char *p, const int swapped) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+/**
+ * @brief 取出一帧中的UDP负载
+ * @param frame 帧
+ * @param len 抓到的长度
+ * @param linktype 链路层类型
+ * @param payload 输出UDP负载的起始位置
+ * @return 负载长度，不是完整的UDP报文返回-1
+ */
+static int udp_payload(const unsigned char *frame, const int len, const uint32_t linktype,
+                       const unsigned char **payload) {
+    int pos;
+    uint16_t proto = 0; // 以太网类型，0表示由IP版本号判断
+    switch (linktype) {
+        case LINKTYPE_NULL:
+            pos = 4;
+            break;
+        case LINKTYPE_ETHERNET:
+            pos = 14;
+            if (len < pos)
+                return -1;
+            proto = frame[12] << 8 | frame[13];
+            while (proto == 0x8100 && len >= pos + 4) { // 802.1Q标签
+                proto = frame[pos + 2] << 8 | frame[pos + 3];
+                pos += 4;
+            }
+            break;
+        case LINKTYPE_RAW:
+        case 12: // 部分系统上LINKTYPE_RAW的编号
+            pos = 0;
+            break;
+        case LINKTYPE_LINUX_SLL:
+            pos = 16;
+            if (len < pos)
+                return -1;
+            proto = frame[14] << 8 | frame[15];
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            pos = 20;
+            if (len < pos)
+                return -1;
+            proto = frame[0] << 8 | frame[1];
+            break;
+        default:
+            return -1;
+    }
+    if (len <= pos || (proto != 0 && proto != 0x0800 && proto != 0x86dd))
+        return -1;
+    const unsigned char *ip = frame + pos;
+    const int ip_len = len - pos;
+    int udp;
+    if (ip[0] >> 4 == 4) {
+        udp = (ip[0] & 0x0f) * 4;
+        // 只取未分片的UDP报文
+        if (ip_len < 20 || ip[9] != 17 || ((ip[6] << 8 | ip[7]) & 0x3fff) != 0)
+            return -1;
+    } else if (ip[0] >> 4 == 6) {
+        udp = 40;
+        // 不处理扩展头
+        if (ip_len < 40 || ip[6] != 17)
+            return -1;
+    } else {
+        return -1;
+    }
+    if (ip_len < udp + 8)
+        return -1;
+    const int n = (ip[udp + 4] << 8 | ip[udp + 5]) - 8;
+    if (n < 0 || udp + 8 + n > ip_len)
+        return -1;
+    *payload = ip + udp + 8;
+    return n;
+}
+
+/**
+ * @brief 读取pcap抓包文件中的DNS请求，只取不超过512字节、能解析出Question的UDP请求
+ */
+static void load_pcap(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("fopen failed");
+        exit(-1);
+    }
+    unsigned char header[24];
+    if (fread(header, sizeof(header), 1, f) != 1) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        exit(-1);
+    }
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    // 微秒与纳秒时间戳两种格式，时间戳不使用
+    const int swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    if (!swapped && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+        fprintf(stderr, "%s: not a pcap file (pcapng is not supported)\n", path);
+        exit(-1);
+    }
+    const uint32_t linktype = pcap_u32(header + 20, swapped) & 0xffff;
+    static unsigned char frame[65536];
+    unsigned char record[16];
+    long frames = 0;
+    while (fread(record, sizeof(record), 1, f) == 1) {
+        const uint32_t caplen = pcap_u32(record + 8, swapped);
+        if (caplen > sizeof(frame) || fread(frame, caplen, 1, f) != 1)
+            break;
+        frames++;
+        const unsigned char *msg;
+        const int len = udp_payload(frame, (int) caplen, linktype, &msg);
+        question_t q;
+        if (len < (int) sizeof(Header) || len > MAX_MSG_LEN || ((const Header *) msg)->qr ||
+            parse_question(msg, len, &q) < 0)
+            continue;
+        add_query(msg, len);
+    }
+    fclose(f);
+    if (query_cnt == 0)
+        fprintf(stderr, "%s: no DNS queries in %ld frames (link type %u)\n", path, frames, linktype);
+}
+
+/**
+ * @brief 启动与本程序同目录的dnsrelay-stub，其标准输出接到管道，退出时输出的统计由read_stub读取
+ * @param out 输出管道的读端
+ * @return 进程号
+ */
+static pid_t start_stub(int *out) {
+    char self[PATH_MAX], stub[PATH_MAX + 16];
+    const ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n < 0) {
+        perror("readlink failed");
+        exit(-1);
+    }
+    self[n] = '\0';
+    snprintf(stub, sizeof(stub), "%s/dnsrelay-stub", dirname(self));
+    char port[16], delay[16], loss[16];
+    snprintf(port, sizeof(port), "%d", bargs.stub_port);
+    snprintf(delay, sizeof(delay), "%d", bargs.stub_delay);
+    snprintf(loss, sizeof(loss), "%d", bargs.stub_loss);
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe failed");
+        exit(-1);
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        exit(-1);
+    }
+    if (pid == 0) {
+        // 上游服务器只在退出时输出一行统计，运行期间不会写满管道
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(stub, "dnsrelay-stub", "-p", port, "-D", delay, "-L", loss, (char *) NULL);
+        perror("exec dnsrelay-stub failed");
+        _exit(127);
+    }
+    close(fds[1]);
+    *out = fds[0];
+    return pid;
+}
+
+/**
+ * @brief 读取已退出的上游服务器输出的统计，原样转到标准错误
+ * @param fd 输出管道的读端
+ * @return 上游服务器收到的UDP与TCP请求数，读不到时返回-1
+ */
+static long read_stub(const int fd) {
+    char text[512];
+    const ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    long received, dropped, answered, tcp;
+    if (n <= 0)
+        return -1;
+    text[n] = '\0';
+    fputs(text, stderr);
+    if (sscanf(text, "received %ld, dropped %ld, answered %ld, tcp queries %ld", &received, &dropped, &answered,
+               &tcp) != 4)
+        return -1;
+    return received + tcp;
+}
+
+/**
+ * @brief 在新的进程组中用shell启动中继，其输出转到标准错误
+ * @param cmd 启动中继的命令
+ * @return 进程号
+ */
+static pid_t start_relay(const char *cmd) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        exit(-1);
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+        perror("exec sh failed");
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+/**
+ * @brief 结束启动的进程并等待其退出，用SIGTERM是因为后台运行时SIGINT可能被忽略
+ */
+static void stop_child(const pid_t pid, const int group) {
+    if (pid <= 0)
+        return;
+    kill(group ? -pid : pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/**
+ * @brief 反复发送第一个请求，直到中继答复
+ * @param fd 套接字
+ * @param addr 中继地址
+ * @return 中继就绪返回0
+ */
+static int wait_ready(const int fd, const struct sockaddr_in *addr) {
+    unsigned char msg[MAX_MSG_LEN];
+    for (int i = 0; i < READY_TRIES; i++) {
+        if (sendto(fd, query_data + queries[0].off, queries[0].len, 0, (const struct sockaddr *) addr,
+                   sizeof(*addr)) < 0 && errno != ECONNREFUSED)
+            perror("send failed");
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 100) > 0) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            const ssize_t n = recvfrom(fd, msg, sizeof(msg), 0, (struct sockaddr *) &from, &from_len);
+            if (n > 0 && from.sin_port == addr->sin_port)
+                return 0;
+            // 中继尚未开始监听时收到端口不可达，接收立即失败，等一会再探测
+            const struct timespec ts = {0, 100 * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+    return -1;
+}
+
+static latency_hist latency; // 已答复请求的延迟
+static long rcodes[16]; // 各RCODE的答复数
+
+int main(int argc, char *argv[]) {
+    argp_parse(&bench_argp, argc, argv, 0, 0, &bargs);
+    if (bargs.pcap_file)
+        load_pcap(bargs.pcap_file);
+    else
+        load_names(bargs.names_file);
+    if (query_cnt == 0) {
+        fprintf(stderr, "no queries to send\n");
+        return -1;
+    }
+
+    // 只有一个中继时连接它，收到的端口不可达使发送失败；多个中继时每个报文指定目的地址
+    const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in relays[MAX_RELAYS];
+    for (int r = 0; r < bargs.port_cnt; r++) {
+        relays[r] = (struct sockaddr_in) {.sin_family = AF_INET, .sin_port = htons(bargs.ports[r])};
+        if (inet_pton(AF_INET, bargs.server, &relays[r].sin_addr) != 1) {
+            fprintf(stderr, "incorrect relay address %s\n", bargs.server);
+            return -1;
+        }
+    }
+    if (fd < 0 || (bargs.port_cnt == 1 && connect(fd, (struct sockaddr *) &relays[0], sizeof(relays[0])) < 0)) {
+        perror("socket setup failed");
+        return -1;
+    }
+    int stub_out = -1;
+    const pid_t stub = bargs.stub_port ? start_stub(&stub_out) : 0;
+    pid_t relay_pids[MAX_RELAYS];
+    for (int r = 0; r < bargs.relay_cnt; r++)
+        relay_pids[r] = start_relay(bargs.relay_cmds[r]);
+    for (int r = 0; (stub || bargs.relay_cnt) && r < bargs.port_cnt; r++) {
+        if (wait_ready(fd, &relays[r]) < 0) {
+            fprintf(stderr, "relay at %s:%d did not answer\n", bargs.server, bargs.ports[r]);
+            for (int k = 0; k < bargs.relay_cnt; k++)
+                stop_child(relay_pids[k], 1);
+            stop_child(stub, 0);
+            return -1;
+        }
+    }
+
+    static uint64_t sent_at[MAX_IDS]; // 每个id的发送时间，0表示空闲
+    static uint64_t scheduled_at[MAX_IDS]; // 每个id的计划发送时间，不限速时与发送时间相同
+    static unsigned char out[BENCH_BATCH][MAX_MSG_LEN], in[BENCH_BATCH][MAX_MSG_LEN];
+    struct mmsghdr out_msgs[BENCH_BATCH], in_msgs[BENCH_BATCH];
+    struct iovec out_iovs[BENCH_BATCH], in_iovs[BENCH_BATCH];
+    memset(out_msgs, 0, sizeof(out_msgs));
+    memset(in_msgs, 0, sizeof(in_msgs));
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        out_iovs[i].iov_base = out[i];
+        out_msgs[i].msg_hdr.msg_iov = &out_iovs[i];
+        out_msgs[i].msg_hdr.msg_iovlen = 1;
+        out_msgs[i].msg_hdr.msg_namelen = bargs.port_cnt > 1 ? sizeof(struct sockaddr_in) : 0;
+        in_iovs[i].iov_base = in[i];
+        in_iovs[i].iov_len = MAX_MSG_LEN;
+        in_msgs[i].msg_hdr.msg_iov = &in_iovs[i];
+        in_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    long sent = 0, answered = 0, lost = 0;
+    uint64_t max_latency = 0;
+    int outstanding = 0;
+    uint16_t next_id = 0;
+    uint32_t oldest = 0; // 检查超时的游标
+    const uint64_t start = now_us();
+    while (answered + lost < bargs.count) {
+        uint64_t now = now_us();
+        // 限速时本轮最多发到计划发送的第due个请求
+        long due = bargs.count;
+        if (bargs.rate > 0) {
+            const long scheduled = (long) ((now - start) * bargs.rate / 1000000) + 1;
+            if (scheduled < due)
+                due = scheduled;
+        }
+        // 补足窗口
+        int n = 0;
+        uint16_t ids[BENCH_BATCH];
+        while (n < BENCH_BATCH && sent + n < due && outstanding + n < bargs.window) {
+            while (sent_at[next_id])
+                next_id++;
+            const long k = sent + n;
+            const query_ref *r = &queries[k % query_cnt];
+            memcpy(out[n], query_data + r->off, r->len);
+            // 每轮换一个中继发送同一请求，各中继都会收到每个域名，否则域名数是中继数的倍数时同一域名总发往同一中继
+            if (bargs.port_cnt > 1)
+                out_msgs[n].msg_hdr.msg_name = &relays[(k + k / query_cnt) % bargs.port_cnt];
+            ((Header *) out[n])->id = htons(next_id);
+            out_iovs[n].iov_len = r->len;
+            // 限速时按计划发送时间计算延迟，发送被窗口推迟的时间也计入，避免低估排队造成的延迟
+            sent_at[next_id] = now;
+            scheduled_at[next_id] = bargs.rate > 0 ? start + (uint64_t) (sent + n) * 1000000 / bargs.rate : now;
+            ids[n++] = next_id++;
+        }
+        if (n > 0) {
+            const int m = sendmmsg(fd, out_msgs, n, 0);
+            const int ok = m < 0 ? 0 : m;
+            // 未发出的请求视为丢失
+            for (int i = ok; i < n; i++)
+                sent_at[ids[i]] = 0;
+            sent += n;
+            lost += n - ok;
+            outstanding += ok;
+        }
+        // 接收答复，限速时最多等到下一个请求的计划发送时间
+        int wait = 0;
+        if (outstanding >= bargs.window || sent == bargs.count)
+            wait = 10;
+        else if (sent >= due)
+            wait = 1;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, wait) > 0) {
+            const int m = recvmmsg(fd, in_msgs, BENCH_BATCH, 0, NULL);
+            now = now_us();
+            for (int i = 0; i < m; i++) {
+                if (in_msgs[i].msg_len < sizeof(Header))
+                    continue;
+                const Header *h = (const Header *) in[i];
+                const uint16_t id = ntohs(h->id);
+                if (sent_at[id]) {
+                    const uint64_t us = now > scheduled_at[id] ? now - scheduled_at[id] : 0;
+                    hist_add(&latency, us, 1);
+                    if (us > max_latency)
+                        max_latency = us;
+                    rcodes[h->rcode]++;
+                    sent_at[id] = 0;
+                    answered++;
+                    outstanding--;
+                }
+            }
+        }
+        // 清理超时的请求
+        now = now_us();
+        for (int i = 0; i < 256; i++, oldest = (oldest + 1) % MAX_IDS) {
+            if (sent_at[oldest] && now > sent_at[oldest] + BENCH_TIMEOUT) {
+                sent_at[oldest] = 0;
+                lost++;
+                outstanding--;
+            }
+        }
+    }
+    const double elapsed = (double) (now_us() - start) / 1000000;
+    close(fd);
+    for (int r = 0; r < bargs.relay_cnt; r++)
+        stop_child(relay_pids[r], 1);
+    stop_child(stub, 0);
+    // 上游服务器收到的请求都是中继的缓存未命中，包括重传与后台刷新
+    const long upstream = stub ? read_stub(stub_out) : -1;
+    const double hit_ratio = upstream >= 0 && answered > 0 ? 1 - (double) upstream / answered : 0.0;
+
+    const double qps = elapsed > 0 ? answered / elapsed : 0.0;
+    const double drop = sent > 0 ? (double) lost / sent : 0.0;
+    const double mean = latency.total > 0 ? (double) latency.sum / latency.total : 0.0;
+    if (bargs.json) {
+        printf("{\"sent\":%ld,\"answered\":%ld,\"lost\":%ld,\"drop_rate\":%.6f,\"elapsed_s\":%.3f,"
+               "\"target_qps\":%ld,\"qps\":%.0f,\"rcode\":{\"noerror\":%ld,\"servfail\":%ld,\"nxdomain\":%ld,"
+               "\"refused\":%ld},\"latency_us\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+               "\"p999\":%lu,\"max\":%lu},\"stub\":{\"port\":%d,\"delay_ms\":%d,\"loss_pct\":%d},"
+               "\"relays\":%d,\"upstream_queries\":%ld,\"hit_ratio\":%.6f}\n",
+               sent, answered, lost, drop, elapsed, bargs.rate, qps, rcodes[0], rcodes[2], rcodes[3], rcodes[5],
+               mean, hist_quantile(&latency, 0.5), hist_quantile(&latency, 0.9), hist_quantile(&latency, 0.99),
+               hist_quantile(&latency, 0.999), max_latency, bargs.stub_port, bargs.stub_delay, bargs.stub_loss,
+               bargs.port_cnt, upstream, hit_ratio);
+    } else {
+        printf("sent %ld, answered %ld, lost %ld (%.3f%%), elapsed %.3fs, %.0f qps\n",
+               sent, answered, lost, drop * 100, elapsed, qps);
+        printf("latency mean %.1f us, p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n", mean,
+               hist_quantile(&latency, 0.5), hist_quantile(&latency, 0.9), hist_quantile(&latency, 0.99),
+               hist_quantile(&latency, 0.999), max_latency);
+        printf("rcode NOERROR %ld, SERVFAIL %ld, NXDOMAIN %ld, REFUSED %ld\n", rcodes[0], rcodes[2], rcodes[3],
+               rcodes[5]);
+        if (upstream >= 0)
+            printf("relays %d, upstream queries %ld, hit ratio %.2f%%\n", bargs.port_cnt, upstream,
+                   hit_ratio * 100);
+    }
+    return 0;
+}
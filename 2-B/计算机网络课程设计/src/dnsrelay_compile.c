@@ -0,0 +1,25 @@
+/**
+ * @file dnsrelay_compile.c
+ * @brief 将dnsrelay.txt编译为可直接mmap的预编译记录库，中继启动时只需一次mmap
+ */
+#include "../include/args_handler.h"
+#include "../include/file_reader.h"
+#include "../include/logs.h"
+#include <stdio.h>
+
+arguments args; // file_reader依赖的全局参数，这里只用到调试等级
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s INPUT OUTPUT\n"
+                "Compile a dnsrelay.txt file into a binary database that dnsrelay can mmap.\n", argv[0]);
+        return 1;
+    }
+    table_t compiled;
+    if (table_load(&compiled, argv[1]) < 0)
+        return 1;
+    if (table_save(&compiled, argv[2]) < 0)
+        return 1;
+    log_always("Compiled %u entries and %u suffix nodes into %s", compiled.count, compiled.trie.node_cnt, argv[2]);
+    return 0;
+}
@@ -0,0 +1,440 @@
+/**
+ * @file dnsrelay_microbench.c
+ * @brief 热路径函数的微基准：报文解析、本地记录查找、答复构造与待答复请求表，
+ * 输出每次操作的纳秒数与内存分配次数
+ */
+#include "../include/args_handler.h"
+#include "../include/dns_parser.h"
+#include "../include/file_reader.h"
+#include "../include/mapping.h"
+#include "../include/timer.h"
+#include <argp.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define QUERY_SET 65536 // 预先生成的请求数，须为2的幂
+#define INFLIGHT 4096 // 待答复请求表基准中同时进行的请求数
+#define ZIPF_MISS_PCT 10 // Zipf分布的查询中不存在的域名所占的百分比
+
+arguments args; // file_reader与mapping依赖的全局参数，这里只用到调试等级
+
+typedef struct {
+    double min_time; // 每个基准至少运行的秒数
+    long max_entries; // 本地记录表的最大规模
+    char *filter; // 只运行名称包含该字符串的基准
+    int json; // 每个基准输出一行JSON
+} microbench_args;
+
+static microbench_args margs = {0.5, 10000000, NULL, 0};
+
+static struct argp_option microbench_options[] = {
+    {"min-time", 't', "SEC", 0, "Run each benchmark for at least SEC seconds (default 0.5)."},
+    {"max-entries", 'N', "N", 0, "Largest local table to build, from 10000 up by powers of 10 (default 10000000)."},
+    {"filter", 'f', "TEXT", 0, "Only run benchmarks whose name contains TEXT."},
+    {"json", 'J', 0, 0, "Print one line of JSON per benchmark."},
+    {0}
+};
+
+static error_t parse_microbench_opt(int key, char *arg, struct argp_state *state) {
+    microbench_args *a = state->input;
+    char *end;
+    switch (key) {
+        case 't':
+            a->min_time = strtod(arg, &end);
+            if (*end != '\0' || a->min_time <= 0)
+                argp_error(state, "min time should be positive");
+            break;
+        case 'N':
+            a->max_entries = strtol(arg, &end, 10);
+            if (*end != '\0' || a->max_entries < 10000 || a->max_entries > 100000000)
+                argp_error(state, "max entries should be between 10000 and 100000000");
+            break;
+        case 'f':
+            a->filter = arg;
+            break;
+        case 'J':
+            a->json = 1;
+            break;
+        case ARGP_KEY_ARG:
+            argp_error(state, "too many arguments");
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp microbench_argp = {
+    .options = microbench_options,
+    .parser = parse_microbench_opt,
+    .doc = "Microbenchmarks for the dnsrelay hot path. Each benchmark is repeated until it has run for the "
+           "minimum time; allocations are counted by wrapping malloc, calloc and realloc at link time.",
+};
+
+// 链接时以--wrap替换，统计被测代码的内存分配
+static uint64_t alloc_count, alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(const size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(const size_t n, const size_t size) {
+    alloc_count++;
+    alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, const size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(p, size);
+}
+
+/**
+ * @brief 阻止编译器把结果当作无用而删掉被测代码
+ */
+static inline void keep(const void *p) {
+    __asm__ volatile("" : : "r"(p) : "memory");
+}
+
+typedef void (*bench_fn)(long iters);
+
+/**
+ * @brief 运行一个基准：迭代次数从1开始按上一轮的耗时放大，直到一轮运行超过最短时间，报告最后一轮的结果
+ * @param name 基准名称
+ * @param fn 运行iters次被测操作的函数
+ */
+static void run_bench(const char *name, const bench_fn fn) {
+    if (margs.filter && !strstr(name, margs.filter))
+        return;
+    long iters = 1;
+    for (;;) {
+        const uint64_t count = alloc_count, bytes = alloc_bytes;
+        const uint64_t start = now_us();
+        fn(iters);
+        const double elapsed = (double) (now_us() - start) / 1e6;
+        if (elapsed >= margs.min_time || iters >= 1L << 40) {
+            const double ns = elapsed * 1e9 / iters;
+            const double allocs = (double) (alloc_count - count) / iters;
+            const double alloc_size = (double) (alloc_bytes - bytes) / iters;
+            if (margs.json)
+                printf("{\"name\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.2f,\"allocs_per_op\":%.4f,"
+                       "\"bytes_per_op\":%.1f}\n", name, iters, ns, allocs, alloc_size);
+            else
+                printf("%-40s %12.2f %14ld %12.4f %12.1f\n", name, ns, iters, allocs, alloc_size);
+            fflush(stdout);
+            return;
+        }
+        // 按耗时估计达到最短时间所需的次数，多留一些余量，每轮最多放大100倍
+        double scale = elapsed > 0 ? margs.min_time * 1.4 / elapsed : 100;
+        if (scale > 100)
+            scale = 100;
+        if (scale < 2)
+            scale = 2;
+        iters = (long) ((double) iters * scale);
+    }
+}
+
+static const char *words[] = {
+    "www", "mail", "api", "cdn", "static", "img", "login", "app", "m", "news", "video", "shop", "cloud", "auth",
+    "edge", "assets", "docs", "blog", "search", "ads", "track", "update", "download", "s3", "gateway", "push",
+    "music", "maps", "pay", "chat", "live", "data",
+};
+static const char *domains[] = {
+    "google", "baidu", "qq", "taobao", "example", "github", "microsoft", "apple", "amazonaws", "akamaiedge",
+    "cloudflare", "bilibili", "weibo", "jd", "netflix", "facebook", "bupt", "zhihu", "douyin", "alicdn",
+};
+static const char *tlds[] = {"com", "com", "com", "com", "net", "net", "org", "cn", "cn", "edu.cn", "io", "com.cn"};
+
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+/**
+ * @brief xorshift64*伪随机数，结果可复现
+ */
+static uint64_t rng() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1d;
+}
+
+/**
+ * @brief 生成第i个域名，形如api3k9.cdn.example.com，同一i总是得到同一个域名，不同i的域名互不相同
+ * @param i 序号
+ * @param text 输出缓冲区，至少MAX_NAME_LEN字节
+ */
+static void make_name(const uint64_t i, char *text) {
+    uint64_t h = i * 0x9e3779b97f4a7c15 + 1;
+    h ^= h >> 29;
+    const char *word = words[h % COUNT_OF(words)];
+    const char *domain = domains[(h >> 8) % COUNT_OF(domains)];
+    const char *tld = tlds[(h >> 16) % COUNT_OF(tlds)];
+    // 约一半的域名多一级标签
+    if ((h >> 24) & 1)
+        snprintf(text, MAX_NAME_LEN, "%s%lx.%s.%s.%s", word, (unsigned long) i, words[(h >> 32) % COUNT_OF(words)],
+                 domain, tld);
+    else
+        snprintf(text, MAX_NAME_LEN, "%s%lx.%s.%s", word, (unsigned long) i, domain, tld);
+}
+
+/**
+ * @brief 随机改变部分字母的大小写，模拟0x20编码的请求
+ */
+static void mix_case(char *text) {
+    for (char *p = text; *p; p++) {
+        if (*p >= 'a' && *p <= 'z' && rng() % 4 == 0)
+            *p = (char) (*p - 'a' + 'A');
+    }
+}
+
+/**
+ * @brief 构造请求报文
+ * @return 报文长度
+ */
+static int make_query(unsigned char *msg, const char *name, const uint16_t qtype) {
+    Header *h = (Header *) msg;
+    memset(h, 0, sizeof(Header));
+    h->id = (uint16_t) rng();
+    h->rd = 1;
+    h->qdcount = htons(1);
+    int pos = sizeof(Header) + text_to_name(name, msg + sizeof(Header));
+    msg[pos++] = qtype >> 8;
+    msg[pos++] = qtype & 0xff;
+    msg[pos++] = 0;
+    msg[pos++] = 1;
+    return pos;
+}
+
+/**
+ * @brief 按近似s=1的Zipf分布抽取0到n-1的排名，排名越小越常被抽到
+ */
+static uint64_t zipf(const uint64_t n) {
+    const double u = (double) (rng() >> 11) / (double) (1ULL << 53);
+    const uint64_t r = (uint64_t) exp(u * log((double) n + 1)) - 1;
+    return r < n ? r : n - 1;
+}
+
+static unsigned char queries[QUERY_SET][MAX_MSG_LEN]; // 预先生成的请求报文
+static int query_lens[QUERY_SET];
+static question_t questions[QUERY_SET]; // 对应的Question
+
+/**
+ * @brief 生成一组请求并解析出Question
+ * @param entries 本地记录表中的域名数，0表示只按域名分布生成，不对应某张表
+ * @param uniform 是否均匀抽取，否则按Zipf分布抽取并混入不存在的域名
+ * @param miss 是否全部使用不存在的域名
+ */
+static void make_queries(const uint64_t entries, const int uniform, const int miss) {
+    char name[MAX_NAME_LEN];
+    for (int i = 0; i < QUERY_SET; i++) {
+        const uint64_t n = entries ? entries : 1000000;
+        uint64_t k = uniform ? rng() % n : zipf(n);
+        if (miss || (!uniform && rng() % 100 < ZIPF_MISS_PCT))
+            k += n; // 表中只有前n个域名
+        make_name(k, name);
+        mix_case(name);
+        // 约五分之一是AAAA请求
+        query_lens[i] = make_query(queries[i], name, rng() % 5 == 0 ? AAAA : A);
+        if (parse_question(queries[i], query_lens[i], &questions[i]) < 0) {
+            fprintf(stderr, "generated an invalid query for %s\n", name);
+            exit(-1);
+        }
+    }
+}
+
+static void bm_parse_question(const long iters) {
+    question_t q;
+    for (long i = 0; i < iters; i++) {
+        const int k = (int) (i & (QUERY_SET - 1));
+        parse_question(queries[k], query_lens[k], &q);
+        keep(&q);
+    }
+}
+
+static void bm_find_entry(const long iters) {
+    for (long i = 0; i < iters; i++)
+        keep(find_entry(&questions[i & (QUERY_SET - 1)]));
+}
+
+static void bm_fill_header(const long iters) {
+    Header h;
+    for (long i = 0; i < iters; i++) {
+        fill_header(&h, (const Header *) queries[i & (QUERY_SET - 1)], ACCEPT);
+        keep(&h);
+    }
+}
+
+static void bm_construct_RR(const long iters) {
+    unsigned char rr[16];
+    for (long i = 0; i < iters; i++) {
+        construct_RR(rr, (uint32_t) i);
+        keep(rr);
+    }
+}
+
+static void bm_construct_response(const long iters) {
+    static unsigned char response[MAX_MSG_LEN];
+    unsigned char rr[16];
+    construct_RR(rr, 0x0100007f);
+    for (long i = 0; i < iters; i++) {
+        const int k = (int) (i & (QUERY_SET - 1));
+        Header h;
+        fill_header(&h, (const Header *) queries[k], ACCEPT);
+        construct_response(response, &h, queries[k], questions[k].end, rr);
+        keep(response);
+    }
+}
+
+static pending_table pending;
+static const struct sockaddr_in client = {.sin_family = AF_INET};
+
+/**
+ * @brief 为请求分配槽并登记一次发往0号服务器的发送，与转发时的处理一致
+ */
+static uint32_t forward(const int k) {
+    uint32_t gen;
+    const uint32_t index = pending_alloc(&pending, &questions[k], queries[k], query_lens[k], client, &gen);
+    if (index == UINT32_MAX) {
+        fprintf(stderr, "pending table full\n");
+        exit(-1);
+    }
+    pending_slot *s = pending_get(&pending, index, gen);
+    s->sent_to[s->tries++] = 0;
+    return index;
+}
+
+static void bm_pending_alloc_complete(const long iters) {
+    pending_slot out;
+    for (long i = 0; i < iters; i++) {
+        const int k = (int) (i & (QUERY_SET - 1));
+        pending_complete(&pending, forward(k), &questions[k], 0, &out);
+        keep(&out);
+    }
+}
+
+static void bm_pending_alloc_timeout(const long iters) {
+    for (long i = 0; i < iters; i++) {
+        const int k = (int) (i & (QUERY_SET - 1));
+        const uint32_t index = forward(k);
+        pending_timeout(&pending, index, atomic_load(&pending.slots[index].gen));
+    }
+}
+
+static uint32_t inflight[INFLIGHT]; // pending_find基准中进行中的请求
+
+static void bm_pending_find_hit(const long iters) {
+    uint32_t found = 0;
+    for (long i = 0; i < iters; i++)
+        found += pending_find(&pending, &questions[i & (INFLIGHT - 1)], queries[i & (INFLIGHT - 1)]);
+    keep(&found);
+}
+
+static void bm_pending_find_miss(const long iters) {
+    uint32_t found = 0;
+    for (long i = 0; i < iters; i++)
+        found += pending_find(&pending, &questions[i & (QUERY_SET - 1)], queries[i & (QUERY_SET - 1)]);
+    keep(&found);
+}
+
+static void bm_pending_wait_release(const long iters) {
+    for (long i = 0; i < iters; i++) {
+        const uint32_t index = inflight[i & (INFLIGHT - 1)];
+        pending_wait(&pending, index, queries[i & (INFLIGHT - 1)], 0, client);
+        pending_release_waiters(&pending, pending.slots[index].waiters);
+        pending.slots[index].waiters = 0;
+        pending.slots[index].waiter_cnt = 0;
+    }
+}
+
+/**
+ * @brief 生成有n个域名的文本文件并加载为当前记录表
+ * @return 加载所用的秒数
+ */
+static double build_table(const long n) {
+    char path[] = "/tmp/dnsrelay-microbench-XXXXXX";
+    const int fd = mkstemp(path);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!f) {
+        perror("mkstemp failed");
+        exit(-1);
+    }
+    char name[MAX_NAME_LEN];
+    for (long i = 0; i < n; i++) {
+        make_name((uint64_t) i, name);
+        // 少量屏蔽与多地址记录，其余各有一个IPv4地址
+        if (i % 50 == 0)
+            fprintf(f, "0.0.0.0 %s\n", name);
+        else
+            fprintf(f, "10.%ld.%ld.%ld %s\n", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, name);
+        if (i % 20 == 1)
+            fprintf(f, "2001:db8::%lx %s\n", i & 0xffff, name);
+    }
+    fclose(f);
+    table_t *t = calloc(1, sizeof(table_t));
+    const uint64_t start = now_us();
+    const int ret = t ? table_load(t, path) : -1;
+    unlink(path);
+    if (ret < 0) {
+        fprintf(stderr, "failed to load the generated table\n");
+        exit(-1);
+    }
+    atomic_store(&table, t);
+    return (double) (now_us() - start) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    argp_parse(&microbench_argp, argc, argv, 0, 0, &margs);
+    if (!margs.json)
+        printf("%-40s %12s %14s %12s %12s\n", "Benchmark", "ns/op", "Iterations", "allocs/op", "bytes/op");
+
+    // 与表无关的基准使用同一组按Zipf分布生成的请求
+    make_queries(0, 0, 0);
+    run_bench("parse_question", bm_parse_question);
+    run_bench("fill_header", bm_fill_header);
+    run_bench("construct_RR", bm_construct_RR);
+    run_bench("construct_response", bm_construct_response);
+
+    // 待答复请求表：INFLIGHT个请求保持进行中，其余请求与其Question不同
+    pending_init(&pending, DEFAULT_UPSTREAM_PORTS);
+    run_bench("pending_alloc+complete", bm_pending_alloc_complete);
+    run_bench("pending_alloc+timeout", bm_pending_alloc_timeout);
+    for (int i = 0; i < INFLIGHT; i++)
+        inflight[i] = forward(i);
+    run_bench("pending_find/hit", bm_pending_find_hit);
+    run_bench("pending_wait+release", bm_pending_wait_release);
+    make_queries(0, 0, 1);
+    run_bench("pending_find/miss", bm_pending_find_miss);
+
+    // 本地记录表从1万条到max_entries条，每次扩大10倍
+    for (long n = 10000; n <= margs.max_entries; n *= 10) {
+        // 三种查询分布：Zipf分布并混入不存在的域名、均匀分布、全部不存在
+        static const char *kinds[] = {"zipf", "uniform", "miss"};
+        char names[3][64];
+        int wanted = 0;
+        for (int k = 0; k < 3; k++) {
+            snprintf(names[k], sizeof(names[k]), "find_entry/%s/%ld", kinds[k], n);
+            wanted |= !margs.filter || strstr(names[k], margs.filter);
+        }
+        if (!wanted)
+            continue;
+        const double load = build_table(n);
+        fprintf(stderr, "loaded %ld entries in %.2fs\n", n, load);
+        for (int k = 0; k < 3; k++) {
+            make_queries((uint64_t) n, k >= 1, k == 2);
+            run_bench(names[k], bm_find_entry);
+        }
+        table_free(atomic_exchange(&table, NULL));
+    }
+    return 0;
+}
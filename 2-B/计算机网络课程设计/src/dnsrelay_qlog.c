@@ -0,0 +1,117 @@
+/**
+ * @file dnsrelay_qlog.c
+ * @brief 查询日志解码工具：把dnsrelay -l写出的二进制查询日志转为每行一条的文本
+ */
+#include "../include/querylog.h"
+#include "../include/dns_parser.h"
+#include "../include/upstream.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RECORDS_PER_READ 1024
+
+static const char *path_names[] = {"local", "blocked", "cache", "upstream", "coalesced", "servfail", "peer"};
+static const char *rcode_names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+
+/**
+ * @brief 把记录中的线上格式域名转为点分形式，被截断的域名以“...”结尾
+ * @param r 记录
+ * @param text 输出缓冲区，至少MAX_NAME_LEN + 4字节
+ */
+static void record_name(const qlog_record *r, char *text) {
+    const int len = r->name_len < QLOG_NAME_LEN ? r->name_len : QLOG_NAME_LEN;
+    int pos = 0, n = 0;
+    while (pos < len && r->name[pos] != 0 && pos + 1 + r->name[pos] <= len) {
+        if (n > 0)
+            text[n++] = '.';
+        memcpy(text + n, r->name + pos + 1, r->name[pos]);
+        n += r->name[pos];
+        pos += r->name[pos] + 1;
+    }
+    if (n == 0)
+        text[n++] = '.';
+    if (r->name_len > QLOG_NAME_LEN) {
+        memcpy(text + n, "...", 3);
+        n += 3;
+    }
+    text[n] = '\0';
+}
+
+/**
+ * @brief 输出一条记录
+ */
+static void print_record(const qlog_record *r) {
+    char name[MAX_NAME_LEN + 4], when[32], client[INET_ADDRSTRLEN], upstream[8] = "-";
+    const time_t sec = (time_t) (r->time_us / 1000000);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    record_name(r, name);
+    const struct in_addr addr = {r->client_addr};
+    inet_ntop(AF_INET, &addr, client, sizeof(client));
+    if (r->upstream != NO_UPSTREAM)
+        snprintf(upstream, sizeof(upstream), "%d", r->upstream);
+    const char *type = type_name(r->qtype);
+    char type_num[16];
+    if (strcmp(type, "Unknown") == 0) {
+        snprintf(type_num, sizeof(type_num), "TYPE%d", r->qtype);
+        type = type_num;
+    }
+    char rcode_num[16];
+    const char *rcode;
+    if (r->rcode < sizeof(rcode_names) / sizeof(rcode_names[0])) {
+        rcode = rcode_names[r->rcode];
+    } else {
+        snprintf(rcode_num, sizeof(rcode_num), "RCODE%d", r->rcode);
+        rcode = rcode_num;
+    }
+    printf("%s.%06u %s:%d %s %s %s %s %uus worker=%d upstream=%s\n", when, (unsigned) (r->time_us % 1000000),
+           client, ntohs(r->client_port), name, type, rcode,
+           r->path < sizeof(path_names) / sizeof(path_names[0]) ? path_names[r->path] : "?", r->latency_us,
+           r->worker, upstream);
+}
+
+/**
+ * @brief 解码一个查询日志文件
+ * @return 成功返回0
+ */
+static int decode(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!f) {
+        perror("fopen failed");
+        return -1;
+    }
+    qlog_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, QLOG_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != QLOG_VERSION || h.record_size != sizeof(qlog_record)) {
+        fprintf(stderr, "%s: not a query log or incompatible version\n", path);
+        if (f != stdin)
+            fclose(f);
+        return -1;
+    }
+    static qlog_record records[RECORDS_PER_READ];
+    size_t n;
+    while ((n = fread(records, sizeof(qlog_record), RECORDS_PER_READ, f)) > 0) {
+        for (size_t i = 0; i < n; i++)
+            print_record(&records[i]);
+    }
+    if (f != stdin)
+        fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s FILE...\n"
+                "Decode binary query logs written by dnsrelay -l; \"-\" reads standard input.\n", argv[0]);
+        return 1;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        if (decode(argv[i]) < 0)
+            ret = 1;
+    }
+    return ret;
+}
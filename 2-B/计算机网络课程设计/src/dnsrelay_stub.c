@@ -0,0 +1,348 @@
+/**
+ * @file dnsrelay_stub.c
+ * @brief 测试用的上游DNS服务器：对A记录请求返回固定地址，可设置答复延迟与丢包率，用于在本机验证多服务器选择与对冲；
+ *        同一端口也接受TCP连接，长答复经UDP发送时截断，用于验证截断后改经TCP的查询；
+ *        请求带OPT记录时答复也带，UDP答复按请求声明的载荷大小截断，用于验证EDNS
+ */
+#include "../include/structs.h"
+#include "../include/consts.h"
+#include "../include/dns_parser.h"
+#include "../include/timer.h"
+#include <argp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define STUB_BATCH 64 // 一次系统调用收发的报文数
+#define STUB_MSG_LEN 4096 // UDP报文的最大长度，容纳EDNS大小的请求与答复
+#define MAX_DELAYED 16384 // 等待延迟发送的答复上限
+#define MAX_TCP_CLIENTS 16 // 同时保持的TCP连接数
+#define TCP_BUF_LEN 65538 // TCP连接的读缓冲区，容纳一个最长的报文及其长度
+#define TCP_OUT_LEN (4 * TCP_BUF_LEN) // 一次写出的答复，满时先写出
+#define MAX_RECORDS 4000 // 一个答复最多的A记录数，保证答复不超过65535字节
+
+typedef struct {
+    char *addr; // 监听地址
+    uint16_t port; // 监听端口
+    int delay; // 答复延迟，单位毫秒
+    int loss; // 丢包率，百分数
+    uint32_t answer; // 返回的地址
+    uint32_t ttl; // 返回记录的TTL
+    int records; // A记录请求返回的记录数，地址依次加1
+    int udp_limit; // UDP答复的长度上限，超出时截断并设置TC位；还受请求声明的载荷大小限制
+} stub_args;
+
+static stub_args sargs = {"127.0.0.1", DNS_PORT, 0, 0, 0, 60, 1, STUB_MSG_LEN};
+
+static struct argp_option stub_options[] = {
+    {"addr", 'a', "ADDR", 0, "Listen address (default 127.0.0.1)."},
+    {"port", 'p', "PORT", 0, "Listen port (default 53)."},
+    {"delay", 'D', "MS", 0, "Delay every answer by MS milliseconds (default 0)."},
+    {"loss", 'L', "PCT", 0, "Drop PCT percent of the queries (default 0)."},
+    {"reply", 'r', "ADDR", 0, "Address returned for A queries (default 127.0.0.1)."},
+    {"ttl", 't', "SEC", 0, "TTL of the returned record (default 60)."},
+    {"records", 'c', "N", 0, "Return N consecutive addresses for A queries (default 1)."},
+    {"udp-size", 'u', "BYTES", 0, "Truncate UDP answers longer than BYTES and set TC (default 4096); "
+                                  "the query's EDNS payload size, or 512 without EDNS, applies if smaller."},
+    {0}
+};
+
+static error_t parse_stub_opt(int key, char *arg, struct argp_state *state) {
+    stub_args *a = state->input;
+    switch (key) {
+        case 'a':
+            a->addr = arg;
+            break;
+        case 'p':
+            a->port = (uint16_t) atoi(arg);
+            break;
+        case 'D':
+            a->delay = atoi(arg);
+            if (a->delay < 0)
+                argp_error(state, "delay should not be negative");
+            break;
+        case 'L':
+            a->loss = atoi(arg);
+            if (a->loss < 0 || a->loss > 100)
+                argp_error(state, "loss should be between 0 and 100");
+            break;
+        case 'r':
+            if (inet_pton(AF_INET, arg, &a->answer) != 1)
+                argp_error(state, "incorrect reply address");
+            break;
+        case 't':
+            a->ttl = (uint32_t) strtoul(arg, NULL, 10);
+            break;
+        case 'c':
+            a->records = atoi(arg);
+            if (a->records < 0 || a->records > MAX_RECORDS)
+                argp_error(state, "records should be between 0 and %d", MAX_RECORDS);
+            break;
+        case 'u':
+            a->udp_limit = atoi(arg);
+            if (a->udp_limit < (int) sizeof(Header) || a->udp_limit > STUB_MSG_LEN)
+                argp_error(state, "udp size should be between %d and %d", (int) sizeof(Header), STUB_MSG_LEN);
+            break;
+        case ARGP_KEY_ARG:
+            argp_error(state, "too many arguments");
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp stub_argp = {
+    .options = stub_options,
+    .parser = parse_stub_opt,
+    .doc = "Stub upstream DNS server for testing dnsrelay. Answers A queries with a fixed address "
+           "and other queries with an empty answer, over UDP and pipelined TCP on the same port.",
+};
+
+typedef struct {
+    uint64_t due; // 发送时间，单调时钟微秒数
+    struct sockaddr_in addr; // 客户端地址
+    int len;
+    unsigned char buf[STUB_MSG_LEN];
+} delayed_reply; // 等待发送的答复
+
+static delayed_reply delayed[MAX_DELAYED]; // 按到期顺序排列的环形队列，延迟固定，先入先出即按到期顺序
+static int head, tail;
+
+typedef struct {
+    int fd; // 连接，-1表示空闲
+    int len; // 已读入、尚未处理的数据长度
+    unsigned char in[TCP_BUF_LEN];
+} tcp_client; // 一个TCP客户端
+
+static tcp_client clients[MAX_TCP_CLIENTS];
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+/**
+ * @brief 构造答复，A记录请求附上sargs.records条资源记录，请求带OPT记录时答复也带；
+ *        超过长度上限时截断为只含Question段并设置TC位
+ * @param reply 答复缓冲区，UDP时至少STUB_MSG_LEN字节，TCP时至少TCP_BUF_LEN - 2字节
+ * @param udp 是否经UDP答复，长度上限取sargs.udp_limit与请求声明的载荷大小（没有OPT记录时为512）的较小值
+ * @param query 请求报文
+ * @param len 请求长度
+ * @return 答复长度，请求不合法返回-1
+ */
+static int build_reply(unsigned char *reply, const int udp, const unsigned char *query, const int len) {
+    question_t q;
+    if (parse_question(query, len, &q) < 0 || parse_edns(query, len, &q) < 0)
+        return -1;
+    int limit = TCP_BUF_LEN - 2;
+    if (udp) {
+        limit = q.udp_size ? q.udp_size : MAX_MSG_LEN;
+        if (limit > sargs.udp_limit)
+            limit = sargs.udp_limit;
+    }
+    const int opt_len = q.udp_size ? OPT_LEN : 0;
+    if (q.end + opt_len > limit)
+        return -1;
+    Header h;
+    fill_header(&h, (const Header *) query, ACCEPT);
+    h.qdcount = htons(1);
+    const int cnt = q.qtype == A ? sargs.records : 0;
+    h.ancount = htons(cnt);
+    h.arcount = htons(opt_len ? 1 : 0);
+    memcpy(reply, &h, sizeof(Header));
+    memcpy(reply + sizeof(Header), query + sizeof(Header), q.end - sizeof(Header));
+    int n = q.end + cnt * 16;
+    if (n + opt_len > limit) {
+        n = truncate_reply(reply, &q);
+        ((Header *) reply)->arcount = h.arcount;
+    } else {
+        const uint32_t ttl = htonl(sargs.ttl);
+        for (int i = 0; i < cnt; i++) {
+            unsigned char *rr = reply + q.end + i * 16;
+            construct_RR(rr, htonl(ntohl(sargs.answer) + i));
+            memcpy(rr + 6, &ttl, 4);
+        }
+    }
+    if (opt_len)
+        n += write_opt(reply + n, (uint16_t) sargs.udp_limit, 0);
+    return n;
+}
+
+/**
+ * @brief 接受一个TCP连接，连接数已满时拒绝
+ * @param listen_fd 监听套接字
+ */
+static void accept_client(const int listen_fd) {
+    const int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            clients[i].fd = fd;
+            clients[i].len = 0;
+            return;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief 读入TCP连接上的请求并答复；一次读入的多个请求按相反的顺序答复，用于验证中继按id匹配乱序的答复
+ * @param c 客户端
+ * @return 处理的请求数，连接关闭或出错时返回-1
+ */
+static int serve_client(tcp_client *c) {
+    static unsigned char out[TCP_OUT_LEN];
+    const ssize_t n = read(c->fd, c->in + c->len, TCP_BUF_LEN - c->len);
+    if (n <= 0)
+        return -1;
+    c->len += (int) n;
+    int starts[TCP_BUF_LEN / 14], cnt = 0, pos = 0;
+    while (cnt < (int) (sizeof(starts) / sizeof(starts[0])) && c->len - pos >= 2 &&
+           c->len - pos - 2 >= (c->in[pos] << 8 | c->in[pos + 1])) {
+        starts[cnt++] = pos;
+        pos += 2 + (c->in[pos] << 8 | c->in[pos + 1]);
+    }
+    if (cnt == 0 && c->len == TCP_BUF_LEN)
+        return -1;
+    int out_len = 0;
+    for (int i = cnt - 1; i >= 0; i--) {
+        const unsigned char *query = c->in + starts[i];
+        if (out_len + TCP_BUF_LEN > TCP_OUT_LEN) {
+            if (write(c->fd, out, out_len) != out_len)
+                return -1;
+            out_len = 0;
+        }
+        const int len = build_reply(out + out_len + 2, 0, query + 2, query[0] << 8 | query[1]);
+        if (len < 0)
+            continue;
+        out[out_len] = (unsigned char) (len >> 8);
+        out[out_len + 1] = (unsigned char) len;
+        out_len += 2 + len;
+    }
+    if (out_len > 0 && write(c->fd, out, out_len) != out_len)
+        return -1;
+    memmove(c->in, c->in + pos, c->len - pos);
+    c->len -= pos;
+    return cnt;
+}
+
+int main(int argc, char *argv[]) {
+    inet_pton(AF_INET, "127.0.0.1", &sargs.answer);
+    argp_parse(&stub_argp, argc, argv, 0, 0, &sargs);
+
+    const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(sargs.port)};
+    const int one = 1;
+    if (fd < 0 || listen_fd < 0 || inet_pton(AF_INET, sargs.addr, &addr.sin_addr) != 1 ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        perror("socket setup failed");
+        return -1;
+    }
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++)
+        clients[i].fd = -1;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    static unsigned char in[STUB_BATCH][STUB_MSG_LEN];
+    struct mmsghdr in_msgs[STUB_BATCH], out_msgs[STUB_BATCH];
+    struct iovec in_iovs[STUB_BATCH], out_iovs[STUB_BATCH];
+    struct sockaddr_in in_addrs[STUB_BATCH];
+    memset(in_msgs, 0, sizeof(in_msgs));
+    memset(out_msgs, 0, sizeof(out_msgs));
+    for (int i = 0; i < STUB_BATCH; i++) {
+        in_iovs[i].iov_base = in[i];
+        in_iovs[i].iov_len = STUB_MSG_LEN;
+        in_msgs[i].msg_hdr.msg_iov = &in_iovs[i];
+        in_msgs[i].msg_hdr.msg_iovlen = 1;
+        in_msgs[i].msg_hdr.msg_name = &in_addrs[i];
+        out_msgs[i].msg_hdr.msg_iov = &out_iovs[i];
+        out_msgs[i].msg_hdr.msg_iovlen = 1;
+        out_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    srand((unsigned) now_us());
+
+    long received = 0, dropped = 0, answered = 0, tcp_received = 0;
+    while (!stop) {
+        // 等到下一个答复到期或有新请求
+        int wait = -1;
+        if (head != tail) {
+            const uint64_t now = now_us();
+            wait = delayed[head].due > now ? (int) ((delayed[head].due - now + 999) / 1000) : 0;
+        }
+        struct pollfd pfds[2 + MAX_TCP_CLIENTS] = {{.fd = fd, .events = POLLIN}, {.fd = listen_fd, .events = POLLIN}};
+        for (int i = 0; i < MAX_TCP_CLIENTS; i++)
+            pfds[2 + i] = (struct pollfd) {.fd = clients[i].fd, .events = POLLIN};
+        if (poll(pfds, 2 + MAX_TCP_CLIENTS, wait) <= 0)
+            pfds[0].revents = pfds[1].revents = 0;
+        // TCP的请求立即答复，不受延迟与丢包设置的影响
+        if (pfds[1].revents & POLLIN)
+            accept_client(listen_fd);
+        for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+            if (clients[i].fd < 0 || !pfds[2 + i].revents)
+                continue;
+            const int n = serve_client(&clients[i]);
+            if (n < 0) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            } else {
+                tcp_received += n;
+            }
+        }
+        if (pfds[0].revents & POLLIN) {
+            for (int i = 0; i < STUB_BATCH; i++)
+                in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            const int n = recvmmsg(fd, in_msgs, STUB_BATCH, 0, NULL);
+            for (int i = 0; i < n; i++) {
+                received++;
+                const int next = (tail + 1) % MAX_DELAYED;
+                if (rand() % 100 < sargs.loss || next == head) {
+                    dropped++;
+                    continue;
+                }
+                delayed_reply *r = &delayed[tail];
+                r->len = build_reply(r->buf, 1, in[i], (int) in_msgs[i].msg_len);
+                if (r->len < 0)
+                    continue;
+                r->addr = in_addrs[i];
+                r->due = now_us() + (uint64_t) sargs.delay * 1000;
+                tail = next;
+            }
+        }
+        // 发出已到期的答复
+        const uint64_t now = now_us();
+        int n = 0;
+        for (int i = head; i != tail && n < STUB_BATCH && delayed[i].due <= now; i = (i + 1) % MAX_DELAYED, n++) {
+            out_iovs[n].iov_base = delayed[i].buf;
+            out_iovs[n].iov_len = delayed[i].len;
+            out_msgs[n].msg_hdr.msg_name = &delayed[i].addr;
+        }
+        if (n > 0) {
+            const int m = sendmmsg(fd, out_msgs, n, 0);
+            if (m < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("sendmmsg failed");
+            answered += n;
+            head = (head + n) % MAX_DELAYED;
+        }
+    }
+    printf("received %ld, dropped %ld, answered %ld, tcp queries %ld\n", received, dropped, answered, tcp_received);
+    for (int i = 0; i < MAX_TCP_CLIENTS; i++) {
+        if (clients[i].fd >= 0)
+            close(clients[i].fd);
+    }
+    close(listen_fd);
+    close(fd);
+    return 0;
+}
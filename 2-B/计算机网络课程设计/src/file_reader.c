@@ -1,83 +1,789 @@
-/**
- * @file file_reader.c
- * @brief 从文件中读取数据，从内存中查找name对应的地址
- */
-#include "../include/logs.h"
-#include "../include/file_reader.h"
-#include "../include/args_handler.h"
-#include "../include/consts.h"
-#include <stdio.h>
-#include <arpa/inet.h>
-#include <malloc.h>
-#include <string.h>
-#include <stdlib.h>
-
-pair pairs[MAX_ENTRY_LEN];
-uint32_t entries_cnt = 0;
-
-/**
- * @brief 比较函数，用于qsort和bsearch
- * @param a pair指针
- * @param b 另一个pair指针
- */
-static int cmp(const void *a, const void *b) {
-    return strcmp(((pair *) a)->name, ((pair *) b)->name);
-}
-
-/**
- * @brief 从文件中读取数据
- */
-void load_file() {
-    // 打开文件
-    FILE *local_DNS_file = fopen(args.local_file_addr, "r");
-    if (!local_DNS_file) {
-        perror("fopen failed");
-        exit(-1);
-    }
-
-    char addr_string[MAX_ADDR_LEN + 1]; // 多一个字节存放'\0'
-    char name[MAX_NAME_LEN]; // '\0'已经含在MAX_NAME_LEN中
-
-    memset(addr_string, 0, sizeof(addr_string));
-    memset(name, 0, sizeof(name));
-    log_always("Loading file...");
-    while (fscanf(local_DNS_file, "%s %s\n", addr_string, name) != EOF) {
-        int t = inet_addr(addr_string);
-        if (t == -1) {
-            if (strcmp(addr_string, "255.255.255.255") == 0)
-                pairs[entries_cnt].addr = UINT32_MAX;
-            else
-                log_always("Invalid address: %s", addr_string);
-        } else {
-            pairs[entries_cnt].addr = t;
-        }
-        if (args.debug_level == 2)
-            printf("%s \t: %s\n", addr_string, name);
-        pairs[entries_cnt].name = (char *) calloc(strlen(name) + 1, sizeof(char));
-        memcpy(pairs[entries_cnt].name, name, strlen(name));
-        memset(addr_string, 0, sizeof(addr_string));
-        memset(name, 0, sizeof(name));
-        entries_cnt++;
-    }
-    log_always("Load file success");
-
-    if (fclose(local_DNS_file) == EOF) {
-        perror("fclose failed");
-        exit(-1);
-    }
-
-    qsort(pairs, entries_cnt, sizeof(pair), cmp);
-}
-
-/**
- * @brief 在内存中查找name对应的地址
- */
-uint32_t find_entry(char *name) {
-    log_detailed("Finding in memory...");
-    pair p;
-    p.name = name;
-    pair *res = bsearch(&p, pairs, entries_cnt, sizeof(pair), cmp);
-    if (res != NULL)
-        return res->addr;
-    return UINT32_MAX;
-}
+/**
+ * @file file_reader.c
+ * @brief 从文件中读取数据，从内存中查找name对应的地址
+ */
+#include "../include/logs.h"
+#include "../include/file_reader.h"
+#include "../include/args_handler.h"
+#include "../include/consts.h"
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INITIAL_SLOTS 1024
+#define INITIAL_POOL 65536
+#define INITIAL_RECORDS 64
+#define INITIAL_LINES 1024
+#define MAX_RECORD_LEN 2048 // 一个答复模板的最大长度：CNAME记录加上A与AAAA记录各MAX_LOCAL_RRS条
+
+typedef struct {
+    uint32_t *offs; // 开放定址的哈希表，元素为答复模板的偏移，0表示空
+    uint32_t mask; // 槽数减1
+    uint32_t cnt; // 模板数
+} record_index; // 加载文本文件时查找内容相同的答复模板
+
+typedef struct {
+    uint32_t name_off; // 域名在字节区中的偏移
+    uint32_t hash; // 域名的哈希值
+    uint32_t seq; // 在文件中的顺序
+    uint16_t type; // A、AAAA或CNAME
+    union {
+        uint32_t v4; // A记录的地址
+        unsigned char v6[16]; // AAAA记录的地址
+        uint32_t target_off; // CNAME目标域名在字节区中的偏移
+    };
+} local_line; // 加载文本文件时读到的一行
+
+typedef struct {
+    uint32_t first; // 第一行的下标
+    uint32_t end; // 最后一行的下一个下标
+} line_group; // 同一域名的各行，按在文件中的顺序排列
+
+_Atomic(table_t *) table;
+
+/**
+ * @brief 计算域名的FNV-1a哈希，不区分大小写
+ * @param name 域名
+ */
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (unsigned char) tolower(*name)) * 16777619u;
+    return h;
+}
+
+/**
+ * @brief 比较域名与字节区中的小写域名，不区分大小写
+ */
+static int name_equal(const char *name, const char *stored) {
+    while (*name && tolower(*name) == *stored) {
+        name++;
+        stored++;
+    }
+    return *name == *stored;
+}
+
+/**
+ * @brief 比较线上格式的小写域名与字节区中的点分域名
+ */
+static int wire_equal(const question_t *q, const char *stored) {
+    const unsigned char *p = q->name;
+    while (*p) {
+        if (p != q->name && *stored++ != '.')
+            return 0;
+        if (memcmp(p + 1, stored, *p) != 0)
+            return 0;
+        stored += *p;
+        p += *p + 1;
+    }
+    return *stored == '\0';
+}
+
+/**
+ * @brief 在哈希表中查找域名所在的槽
+ * @param t 记录表
+ * @param name 域名
+ * @param hash 域名的哈希值
+ * @return 域名所在的槽，不存在时返回应插入的空槽
+ */
+static entry_slot *probe(const table_t *t, const char *name, const uint32_t hash) {
+    uint32_t i = hash & t->mask;
+    while (t->slots[i].name_off != 0) {
+        if (t->slots[i].hash == hash && name_equal(name, t->pool + t->slots[i].name_off))
+            break;
+        i = (i + 1) & t->mask;
+    }
+    return &t->slots[i];
+}
+
+/**
+ * @brief 槽数翻倍，哈希值已保存在槽中，无需重新计算
+ * @param t 记录表
+ * @return 成功返回0，内存不足时返回-1，记录表不变
+ */
+static int grow(table_t *t) {
+    const uint32_t n = (t->mask + 1) * 2;
+    entry_slot *slots = calloc(n, sizeof(entry_slot));
+    if (!slots) {
+        perror("calloc failed");
+        return -1;
+    }
+    for (uint32_t i = 0; i <= t->mask; i++) {
+        if (t->slots[i].name_off == 0)
+            continue;
+        uint32_t j = t->slots[i].hash & (n - 1);
+        while (slots[j].name_off != 0)
+            j = (j + 1) & (n - 1);
+        slots[j] = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->mask = n - 1;
+    return 0;
+}
+
+/**
+ * @brief 在字节区末尾预留空间
+ * @param t 记录表
+ * @param len 长度
+ * @param align 起始偏移的对齐字节数
+ * @return 预留空间的偏移，内存不足时返回UINT32_MAX，字节区不变
+ */
+static uint32_t pool_reserve(table_t *t, const uint32_t len, const uint32_t align) {
+    const uint32_t off = (t->pool_len + align - 1) / align * align;
+    if (off + len > t->pool_cap) {
+        uint32_t cap = t->pool_cap;
+        while (off + len > cap)
+            cap *= 2;
+        char *pool = realloc(t->pool, cap);
+        if (!pool) {
+            perror("realloc failed");
+            return UINT32_MAX;
+        }
+        t->pool = pool;
+        t->pool_cap = cap;
+    }
+    memset(t->pool + t->pool_len, 0, off - t->pool_len);
+    t->pool_len = off + len;
+    return off;
+}
+
+/**
+ * @brief 把域名转为小写后存入字节区
+ * @return 域名在字节区中的偏移，内存不足时返回UINT32_MAX
+ */
+static uint32_t pool_add(table_t *t, const char *name) {
+    const uint32_t len = strlen(name) + 1;
+    const uint32_t off = pool_reserve(t, len, 1);
+    if (off == UINT32_MAX)
+        return UINT32_MAX;
+    for (uint32_t i = 0; i < len; i++)
+        t->pool[off + i] = (char) tolower(name[i]);
+    return off;
+}
+
+/**
+ * @brief 计算字节序列的FNV-1a哈希
+ */
+static uint32_t bytes_hash(const void *data, const size_t len) {
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+/**
+ * @brief 把构造好的模板存入字节区，内容相同的模板只存一份
+ * @param t 记录表
+ * @param index 加载期间使用的模板索引
+ * @param r 构造好的模板
+ * @return 模板在字节区中的偏移，内存不足时返回UINT32_MAX
+ */
+static uint32_t record_intern(table_t *t, record_index *index, const local_record *r) {
+    uint32_t i = bytes_hash(r, r->size) & index->mask;
+    while (index->offs[i] != 0) {
+        const local_record *stored = (const local_record *) (t->pool + index->offs[i]);
+        if (stored->size == r->size && memcmp(stored, r, r->size) == 0)
+            return index->offs[i];
+        i = (i + 1) & index->mask;
+    }
+    const uint32_t off = pool_reserve(t, r->size, sizeof(uint32_t));
+    if (off == UINT32_MAX)
+        return UINT32_MAX;
+    memcpy(t->pool + off, r, r->size);
+    index->offs[i] = off;
+    // 装载因子超过1/2时扩容
+    if (++index->cnt * 2 > index->mask + 1) {
+        const uint32_t n = (index->mask + 1) * 2;
+        uint32_t *offs = calloc(n, sizeof(uint32_t));
+        if (!offs) {
+            perror("calloc failed");
+            return UINT32_MAX;
+        }
+        for (uint32_t j = 0; j <= index->mask; j++) {
+            if (index->offs[j] == 0)
+                continue;
+            const local_record *stored = (const local_record *) (t->pool + index->offs[j]);
+            uint32_t k = bytes_hash(stored, stored->size) & (n - 1);
+            while (offs[k] != 0)
+                k = (k + 1) & (n - 1);
+            offs[k] = index->offs[j];
+        }
+        free(index->offs);
+        index->offs = offs;
+        index->mask = n - 1;
+    }
+    return off;
+}
+
+/**
+ * @brief 插入一个域名，域名已存入字节区
+ * @param t 记录表
+ * @param name_off 域名在字节区中的偏移
+ * @param hash 域名的哈希值
+ * @param record_off 答复模板在字节区中的偏移
+ * @return 是否插入，域名已存在时不插入；内存不足时返回-1
+ */
+static int table_insert(table_t *t, const uint32_t name_off, const uint32_t hash, const uint32_t record_off) {
+    // 装载因子不超过1/2，保证探测序列较短
+    if ((t->count + 1) * 2 > t->mask + 1 && grow(t) < 0)
+        return -1;
+    entry_slot *slot = probe(t, t->pool + name_off, hash);
+    if (slot->name_off != 0)
+        return 0;
+    slot->hash = hash;
+    slot->name_off = name_off;
+    slot->record_off = record_off;
+    t->count++;
+    return 1;
+}
+
+/**
+ * @brief 释放加载了一半的记录表，之后记录表为空，可以再交给table_free
+ * @param t 记录表
+ */
+static void table_discard(table_t *t) {
+    free(t->slots);
+    free(t->pool);
+    free(t->trie.nodes);
+    free(t->trie.labels);
+    memset(t, 0, sizeof(table_t));
+}
+
+/**
+ * @brief 初始化空的记录表
+ * @return 成功返回0
+ */
+static int table_init(table_t *t) {
+    memset(t, 0, sizeof(table_t));
+    t->slots = calloc(INITIAL_SLOTS, sizeof(entry_slot));
+    t->mask = INITIAL_SLOTS - 1;
+    t->pool = malloc(INITIAL_POOL);
+    t->pool_cap = INITIAL_POOL;
+    t->pool_len = 1; // 偏移0表示空槽
+    if (!t->slots || !t->pool) {
+        perror("alloc failed");
+        table_discard(t);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 比较两行，同一域名的各行排在一起，并保持在文件中的顺序
+ */
+static int line_cmp(const void *x, const void *y, void *arg) {
+    const table_t *t = arg;
+    const local_line *l1 = x, *l2 = y;
+    if (l1->hash != l2->hash)
+        return l1->hash < l2->hash ? -1 : 1;
+    const int c = strcmp(t->pool + l1->name_off, t->pool + l2->name_off);
+    if (c != 0)
+        return c;
+    return l1->seq < l2->seq ? -1 : l1->seq > l2->seq;
+}
+
+/**
+ * @brief 解析一行，格式为“地址 域名”或“CNAME 目标域名 域名”，地址可以是IPv4或IPv6地址
+ * @param t 记录表，CNAME的目标域名存入其字节区
+ * @param line 一行文本，解析时会被修改
+ * @param l 解析结果
+ * @param out 输出域名
+ * @return 解析成功返回1，空行或格式不对的行返回0，内存不足时返回-1
+ */
+static int parse_line(table_t *t, char *line, local_line *l, const char **out) {
+    char *save;
+    const char *value = strtok_r(line, " \t\r\n", &save);
+    const char *name = strtok_r(NULL, " \t\r\n", &save);
+    if (!value || !name)
+        return 0; // 空行或格式不对的行
+    memset(l, 0, sizeof(local_line));
+    if (strcasecmp(value, "CNAME") == 0) {
+        char *target = (char *) name;
+        unsigned char wire[MAX_NAME_LEN];
+        name = strtok_r(NULL, " \t\r\n", &save);
+        const size_t len = strlen(target);
+        if (len > 1 && target[len - 1] == '.')
+            target[len - 1] = '\0'; // 去掉末尾的点，与记录表中的域名一致
+        if (!name || strncmp(target, "*.", 2) == 0 || text_to_name(target, wire) < 0) {
+            log_always("Invalid CNAME: %s", target);
+            return 0;
+        }
+        l->type = CNAME;
+        l->target_off = pool_add(t, target);
+        if (l->target_off == UINT32_MAX)
+            return -1;
+    } else if (strchr(value, ':')) {
+        if (inet_pton(AF_INET6, value, l->v6) != 1) {
+            log_always("Invalid address: %s", value);
+            return 0;
+        }
+        l->type = AAAA;
+    } else {
+        l->v4 = inet_addr(value);
+        if (strlen(value) > MAX_ADDR_LEN || (l->v4 == UINT32_MAX && strcmp(value, "255.255.255.255") != 0)) {
+            log_always("Invalid address: %s", value);
+            return 0;
+        }
+        l->type = A;
+    }
+    if (strlen(name) >= MAX_NAME_LEN) {
+        log_always("Invalid name: %s", name);
+        return 0;
+    }
+    if (args.debug_level == 2)
+        printf("%s \t: %s\n", value, name);
+    *out = name;
+    return 1;
+}
+
+/**
+ * @brief 把一组行中某种类型的地址逐条构造为资源记录，追加到模板末尾，重复的地址只保留一条
+ * @param r 模板
+ * @param lines 各行
+ * @param g 同一域名的各行
+ * @param type A或AAAA
+ */
+static void append_rrs(local_record *r, const local_line *lines, const line_group *g, const uint16_t type) {
+    const int k = type == AAAA ? LOCAL_AAAA : LOCAL_A;
+    const uint16_t rdlength = type == AAAA ? sizeof(lines->v6) : sizeof(lines->v4);
+    r->rr_off[k] = r->size - sizeof(local_record);
+    for (uint32_t i = g->first; i < g->end && r->rr_cnt[k] < MAX_LOCAL_RRS; i++) {
+        const local_line *l = &lines[i];
+        if (l->type != type || (type == A && l->v4 == 0))
+            continue;
+        int duplicated = 0;
+        for (uint32_t j = g->first; j < i && !duplicated; j++)
+            duplicated = lines[j].type == type && memcmp(lines[j].v6, l->v6, rdlength) == 0;
+        if (duplicated)
+            continue;
+        r->size += construct_RR_data((unsigned char *) r + r->size, type, l->v6, rdlength);
+        r->rr_cnt[k]++;
+    }
+}
+
+/**
+ * @brief 构造一个域名的答复模板：第一行为0.0.0.0时屏蔽；第一行为CNAME时返回CNAME记录，
+ *        目标也是本地的域名时附上目标的地址；否则返回全部A与AAAA记录
+ * @param t 记录表，精确匹配的域名已插入，槽中暂存各域名的组下标
+ * @param index 加载期间使用的模板索引
+ * @param lines 各行
+ * @param groups 各域名的行
+ * @param g 要构造模板的域名
+ * @return 模板在字节区中的偏移，内存不足时返回UINT32_MAX
+ */
+static uint32_t build_record(table_t *t, record_index *index, const local_line *lines, const line_group *groups,
+                             const line_group *g) {
+    uint32_t buf[MAX_RECORD_LEN / sizeof(uint32_t)];
+    local_record *r = (local_record *) buf;
+    memset(buf, 0, sizeof(buf));
+    r->size = sizeof(local_record);
+    Header request;
+    memset(&request, 0, sizeof(Header));
+    request.qdcount = htons(1);
+    // id、opcode、rd与回答数在发送时填入
+    const local_line *first = &lines[g->first];
+    if (first->type == A && first->v4 == 0) {
+        fill_header(&r->header, &request, REJECT);
+        r->blocked = 1;
+        return record_intern(t, index, r);
+    }
+    fill_header(&r->header, &request, ACCEPT);
+    const line_group *target = g;
+    if (first->type == CNAME) {
+        const char *target_name = t->pool + first->target_off;
+        unsigned char wire[MAX_NAME_LEN];
+        r->size += construct_RR_data((unsigned char *) r + r->size, CNAME, wire, text_to_name(target_name, wire));
+        r->cname_len = r->size - sizeof(local_record);
+        // 只追一层：目标是本地的地址记录时才附上
+        const entry_slot *slot = probe(t, target_name, name_hash(target_name));
+        target = slot->name_off != 0 ? &groups[slot->record_off] : NULL;
+        if (target && (lines[target->first].type == CNAME ||
+                       (lines[target->first].type == A && lines[target->first].v4 == 0)))
+            target = NULL;
+    }
+    if (target) {
+        append_rrs(r, lines, target, A);
+        append_rrs(r, lines, target, AAAA);
+    }
+    return record_intern(t, index, r);
+}
+
+/**
+ * @brief 逐行读取文本文件，域名存入字节区
+ * @param t 记录表
+ * @param file 文本文件
+ * @param lines 输出解析出的各行，失败时也由调用者释放
+ * @param line_cnt 输出行数
+ * @return 成功返回0，内存不足时返回-1
+ */
+static int read_lines(table_t *t, FILE *file, local_line **lines, uint32_t *line_cnt) {
+    uint32_t line_cap = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    int ret = 0;
+    while (getline(&line, &cap, file) != -1) {
+        if (*line_cnt == line_cap) {
+            const uint32_t n = line_cap ? line_cap * 2 : INITIAL_LINES;
+            local_line *grown = realloc(*lines, n * sizeof(local_line));
+            if (!grown) {
+                perror("realloc failed");
+                ret = -1;
+                break;
+            }
+            *lines = grown;
+            line_cap = n;
+        }
+        local_line *l = &(*lines)[*line_cnt];
+        const char *name;
+        const int parsed = parse_line(t, line, l, &name);
+        if (parsed == 0)
+            continue;
+        if (parsed < 0 || (l->name_off = pool_add(t, name)) == UINT32_MAX) {
+            ret = -1;
+            break;
+        }
+        l->hash = name_hash(name);
+        l->seq = (*line_cnt)++;
+    }
+    free(line);
+    return ret;
+}
+
+/**
+ * @brief 同一域名的各行合并为一个答复模板，精确匹配的域名插入哈希表，后缀规则加入构建器
+ * @param t 记录表
+ * @param records 模板去重用的索引
+ * @param lines 解析出的各行
+ * @param line_cnt 行数
+ * @param suffixes 后缀规则的构建器
+ * @return 成功返回0，内存不足时返回-1
+ */
+static int build_records(table_t *t, record_index *records, local_line *lines, const uint32_t line_cnt,
+                         trie_builder *suffixes) {
+    // 同一域名的各行排在一起，精确匹配的域名先全部插入，槽中暂存组下标，构造CNAME的模板时据此找到目标
+    qsort_r(lines, line_cnt, sizeof(local_line), line_cmp, t);
+    line_group *groups = malloc((line_cnt + 1) * sizeof(line_group));
+    uint32_t *record_offs = malloc((line_cnt + 1) * sizeof(uint32_t));
+    if (!groups || !record_offs) {
+        perror("malloc failed");
+        free(groups);
+        free(record_offs);
+        return -1;
+    }
+    int ret = 0;
+    uint32_t group_cnt = 0;
+    for (uint32_t i = 0; i < line_cnt && ret == 0;) {
+        uint32_t j = i + 1;
+        while (j < line_cnt && lines[j].hash == lines[i].hash &&
+               strcmp(t->pool + lines[j].name_off, t->pool + lines[i].name_off) == 0)
+            j++;
+        groups[group_cnt].first = i;
+        groups[group_cnt].end = j;
+        if (strncmp(t->pool + lines[i].name_off, "*.", 2) != 0 &&
+            table_insert(t, lines[i].name_off, lines[i].hash, group_cnt) < 0)
+            ret = -1;
+        group_cnt++;
+        i = j;
+    }
+    for (uint32_t g = 0; g < group_cnt && ret == 0; g++) {
+        record_offs[g] = build_record(t, records, lines, groups, &groups[g]);
+        if (record_offs[g] == UINT32_MAX)
+            ret = -1;
+    }
+    if (ret == 0) {
+        for (uint32_t i = 0; i <= t->mask; i++) {
+            if (t->slots[i].name_off != 0)
+                t->slots[i].record_off = record_offs[t->slots[i].record_off];
+        }
+        for (uint32_t g = 0; g < group_cnt && ret == 0; g++) {
+            const char *name = t->pool + lines[groups[g].first].name_off;
+            // 后缀规则，匹配所有子域名
+            if (strncmp(name, "*.", 2) != 0)
+                continue;
+            const int added = trie_builder_add(suffixes, name + 2, record_offs[g]);
+            if (added == -2)
+                ret = -1;
+            else if (added < 0)
+                log_always("Invalid suffix rule: %s", name);
+        }
+    }
+    free(groups);
+    free(record_offs);
+    return ret;
+}
+
+/**
+ * @brief 读取文本文件，同一域名的多行合并为一个答复模板；内存不足时释放已建的部分，不退出进程，重新加载时当前记录表不受影响
+ * @param t 记录表
+ * @param file 文本文件
+ * @return 成功返回0，失败时记录表为空
+ */
+static int load_text(table_t *t, FILE *file) {
+    if (table_init(t) < 0)
+        return -1;
+    trie_builder suffixes;
+    memset(&suffixes, 0, sizeof(trie_builder));
+    record_index records = {calloc(INITIAL_RECORDS, sizeof(uint32_t)), INITIAL_RECORDS - 1, 0};
+    local_line *lines = NULL;
+    uint32_t line_cnt = 0;
+    int ret = -1;
+    if (records.offs && trie_builder_init(&suffixes) == 0 && read_lines(t, file, &lines, &line_cnt) == 0 &&
+        build_records(t, &records, lines, line_cnt, &suffixes) == 0)
+        ret = trie_build(&suffixes, &t->trie);
+    trie_builder_free(&suffixes);
+    free(lines);
+    free(records.offs);
+    if (ret < 0)
+        table_discard(t);
+    return ret;
+}
+
+/**
+ * @brief 检查字节区中的答复模板：对齐、长度与各段记录都在字节区内，发送时不会越界读
+ * @param pool 字节区
+ * @param pool_len 字节区长度
+ * @param off 模板的偏移
+ * @return 合法返回1
+ */
+static int record_valid(const char *pool, const uint32_t pool_len, const uint32_t off) {
+    if (off % sizeof(uint32_t) != 0 || (uint64_t) off + sizeof(local_record) > pool_len)
+        return 0;
+    const local_record *r = (const local_record *) (pool + off);
+    if (r->size < sizeof(local_record) || r->size > MAX_RECORD_LEN || (uint64_t) off + r->size > pool_len)
+        return 0;
+    const uint32_t data_len = r->size - sizeof(local_record);
+    if (r->cname_len > data_len)
+        return 0;
+    for (int k = LOCAL_A; k <= LOCAL_AAAA; k++) {
+        const uint32_t rr_len = k == LOCAL_AAAA ? 28 : 16;
+        if (r->rr_cnt[k] > MAX_LOCAL_RRS || r->rr_off[k] + r->rr_cnt[k] * rr_len > data_len)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief 检查预编译记录库的内容：槽中的域名以'\0'结尾、模板合法，至少有一个空槽使探测能结束，
+ *        字典树的标签、子节点与规则的值都在各自的区域内；文件损坏或被篡改时拒绝加载，不在查找时越界
+ * @param h 文件头，各区域的范围已检查
+ * @param base 映射的起始地址
+ * @return 合法返回1
+ */
+static int db_valid(const db_header *h, const char *base) {
+    const entry_slot *slots = (const entry_slot *) (base + h->slots_off);
+    const char *pool = base + h->pool_off;
+    uint32_t used = 0;
+    for (uint64_t i = 0; i <= h->mask; i++) {
+        if (slots[i].name_off == 0)
+            continue;
+        if (slots[i].name_off >= h->pool_len ||
+            !memchr(pool + slots[i].name_off, '\0', h->pool_len - slots[i].name_off) ||
+            !record_valid(pool, h->pool_len, slots[i].record_off))
+            return 0;
+        used++;
+    }
+    if (used != h->count || used > h->mask)
+        return 0;
+    const suffix_trie trie = {
+        (trie_node *) (base + h->nodes_off), h->node_cnt, (unsigned char *) base + h->labels_off, h->labels_len
+    };
+    if (!trie_valid(&trie))
+        return 0;
+    for (uint32_t i = 0; i < h->node_cnt; i++) {
+        if (trie.nodes[i].has_rule && !record_valid(pool, h->pool_len, trie.nodes[i].value))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief 映射预编译记录库，记录表直接指向映射的内存，多个中继进程共享同一份物理页
+ * @param t 记录表
+ * @param fd 文件描述符
+ * @return 成功返回0
+ */
+static int load_db(table_t *t, const int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat failed");
+        return -1;
+    }
+    const size_t size = st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap failed");
+        return -1;
+    }
+    const db_header *h = base;
+    if (size < sizeof(db_header) || h->version != DB_VERSION || ((h->mask + 1) & h->mask) != 0 ||
+        h->slots_off % sizeof(uint32_t) != 0 ||
+        h->slots_off + ((uint64_t) h->mask + 1) * sizeof(entry_slot) > size ||
+        h->pool_off % sizeof(uint32_t) != 0 || h->pool_off + (uint64_t) h->pool_len > size || h->pool_len == 0 ||
+        h->nodes_off % sizeof(uint32_t) != 0 || h->nodes_off + (uint64_t) h->node_cnt * sizeof(trie_node) > size ||
+        h->labels_off + (uint64_t) h->labels_len > size || !db_valid(h, base)) {
+        log_always("Invalid or incompatible database");
+        munmap(base, size);
+        return -1;
+    }
+    memset(t, 0, sizeof(table_t));
+    t->slots = (entry_slot *) ((char *) base + h->slots_off);
+    t->mask = h->mask;
+    t->count = h->count;
+    t->pool = (char *) base + h->pool_off;
+    t->pool_len = h->pool_len;
+    if (h->node_cnt > 0) {
+        t->trie.nodes = (trie_node *) ((char *) base + h->nodes_off);
+        t->trie.node_cnt = h->node_cnt;
+        t->trie.labels = (unsigned char *) base + h->labels_off;
+        t->trie.labels_len = h->labels_len;
+    }
+    t->map_base = base;
+    t->map_len = size;
+    return 0;
+}
+
+/**
+ * @brief 加载文本文件或预编译记录库，根据文件头的标识区分
+ * @param t 记录表
+ * @param path 文件路径
+ * @return 成功返回0，失败时记录表为空
+ */
+int table_load(table_t *t, const char *path) {
+    memset(t, 0, sizeof(table_t));
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("fopen failed");
+        return -1;
+    }
+    char magic[sizeof(((db_header *) 0)->magic)];
+    int ret;
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, DB_MAGIC, sizeof(magic)) == 0) {
+        ret = load_db(t, fileno(file));
+    } else {
+        rewind(file);
+        ret = load_text(t, file);
+    }
+    if (fclose(file) == EOF) {
+        perror("fclose failed");
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief 将记录表写为预编译记录库，先写临时文件再改名，避免读到写了一半的文件
+ * @param t 记录表
+ * @param path 文件路径
+ * @return 成功返回0
+ */
+int table_save(const table_t *t, const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "wb");
+    if (!file) {
+        perror("fopen failed");
+        return -1;
+    }
+    db_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DB_MAGIC, sizeof(h.magic));
+    h.version = DB_VERSION;
+    h.mask = t->mask;
+    h.count = t->count;
+    h.pool_len = t->pool_len;
+    h.node_cnt = t->trie.node_cnt;
+    h.labels_len = t->trie.labels_len;
+    h.slots_off = sizeof(db_header);
+    h.pool_off = h.slots_off + ((uint64_t) t->mask + 1) * sizeof(entry_slot);
+    // 节点数组按4字节对齐
+    const uint32_t padding = (sizeof(uint32_t) - t->pool_len % sizeof(uint32_t)) % sizeof(uint32_t);
+    h.nodes_off = h.pool_off + t->pool_len + padding;
+    h.labels_off = h.nodes_off + (uint64_t) t->trie.node_cnt * sizeof(trie_node);
+    const char zeros[sizeof(uint32_t)] = {0};
+    const int ok = fwrite(&h, sizeof(h), 1, file) == 1 &&
+                   fwrite(t->slots, sizeof(entry_slot), t->mask + 1, file) == t->mask + 1 &&
+                   fwrite(t->pool, 1, t->pool_len, file) == t->pool_len &&
+                   fwrite(zeros, 1, padding, file) == padding &&
+                   fwrite(t->trie.nodes, sizeof(trie_node), t->trie.node_cnt, file) == t->trie.node_cnt &&
+                   fwrite(t->trie.labels, 1, t->trie.labels_len, file) == t->trie.labels_len;
+    if (fclose(file) == EOF || !ok || rename(tmp, path) < 0) {
+        perror("write database failed");
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放记录表
+ * @param t 记录表
+ */
+void table_free(table_t *t) {
+    if (!t)
+        return;
+    if (t->map_base) {
+        munmap(t->map_base, t->map_len);
+    } else {
+        free(t->slots);
+        free(t->pool);
+        free(t->trie.nodes);
+        free(t->trie.labels);
+    }
+    free(t);
+}
+
+/**
+ * @brief 从文件中读取数据
+ */
+void load_file() {
+    log_always("Loading file...");
+    table_t *t = malloc(sizeof(table_t));
+    if (!t || table_load(t, args.local_file_addr) < 0)
+        exit(-1);
+    atomic_store(&table, t);
+    log_always("Load %s success, %u entries, %u suffix nodes", t->map_base ? "database" : "file", t->count,
+               t->trie.node_cnt);
+}
+
+/**
+ * @brief 重新加载文件，新表建好后原子地替换当前记录表，加载期间查找仍使用旧表
+ * @return 被替换的旧表，调用者须等所有工作线程都不再引用后再释放；加载失败返回NULL，当前记录表不变
+ */
+table_t *reload_file() {
+    log_always("Reloading file...");
+    table_t *t = malloc(sizeof(table_t));
+    if (!t || table_load(t, args.local_file_addr) < 0) {
+        table_free(t);
+        log_always("Reload failed, keep the current table");
+        return NULL;
+    }
+    log_always("Reload %s success, %u entries, %u suffix nodes", t->map_base ? "database" : "file", t->count,
+               t->trie.node_cnt);
+    return atomic_exchange(&table, t);
+}
+
+/**
+ * @brief 在内存中查找Question中域名对应的答复模板，直接比较线上格式的标签，不转换为字符串
+ * @param q 解析出的Question，哈希值已在解析时算好
+ * @return 答复模板，找不到时返回NULL；模板属于当前记录表，在工作线程的纪元内有效
+ */
+const local_record *find_entry(const question_t *q) {
+    log_detailed("Finding in memory...");
+    const table_t *t = atomic_load_explicit(&table, memory_order_acquire);
+    for (uint32_t i = q->hash & t->mask; t->slots[i].name_off != 0; i = (i + 1) & t->mask) {
+        if (t->slots[i].hash == q->hash && wire_equal(q, t->pool + t->slots[i].name_off))
+            return (const local_record *) (t->pool + t->slots[i].record_off);
+    }
+    // 没有精确匹配的记录时再查后缀规则
+    uint32_t record_off;
+    if (trie_lookup(&t->trie, q->name, q->label_offs, q->label_cnt, &record_off))
+        return (const local_record *) (t->pool + record_off);
+    return NULL;
+}
@@ -1,41 +1,327 @@
-#include "../include/mapping.h"
-#include "../include/logs.h"
-
-Map map[UINT16_MAX]; // 用于映射id
-
-int cnt = 0; // 计数器
-
-#define inc(x) x = (x + 1) % UINT16_MAX
-
-/**
- * @brief 将(id, addr)映射到cnt
- * @param h 消息头
- * @param cli_addr 客户端地址
- * @return 映射后的id
- */
-uint16_t convert_id_to_cnt(Header *head, struct sockaddr_in cli_addr) {
-    map[cnt].id = head->id;
-    map[cnt].addr = cli_addr;
-    map[cnt].is_arrived = false;
-    head->id = cnt;
-    inc(cnt);
-    return (cnt ? cnt - 1 : UINT16_MAX);
-}
-
-/**
- * @brief 将cnt映射回(id, addr)
- * @param head 消息头
- * @param local_cli_addr 客户端地址
- * @return 是否成功，超时未收到dns服务器的回复返回0
- */
-bool convert_cnt_to_id(Header *head, struct sockaddr_in *local_cli_addr) {
-    const uint16_t index = head->id;
-    if (map[index].is_arrived == deleted) {
-        log_detailed("Response timeout, drop it");
-        return false;
-    }
-    head->id = map[index].id;
-    map[index].is_arrived = true;
-    *local_cli_addr = map[index].addr;
-    return true;
-}
\ No newline at end of file
+/**
+ * @file mapping.c
+ * @brief 待答复请求表：把(客户端id, 客户端地址)映射到(端口序号, 新id)，槽带有代数，过期的答复与定时器不会误用被复用的槽；
+ * Question相同的请求合并为一个，答复分发给所有等待的客户端
+ */
+#include "../include/mapping.h"
+#include "../include/logs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define INITIAL_WAITERS 256
+
+/**
+ * @brief 把槽放回空闲链表
+ */
+static void free_push(pending_table *t, const uint32_t index) {
+    uint64_t head = atomic_load_explicit(&t->free_head, memory_order_relaxed);
+    uint64_t next;
+    do {
+        t->slots[index].next = (uint32_t) head;
+        next = ((head >> 32) + 1) << 32 | (index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&t->free_head, &head, next, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/**
+ * @brief 从空闲链表取出一个槽
+ * @return 槽下标，链表为空时返回UINT32_MAX
+ */
+static uint32_t free_pop(pending_table *t) {
+    uint64_t head = atomic_load_explicit(&t->free_head, memory_order_acquire);
+    uint64_t next;
+    do {
+        if ((uint32_t) head == 0)
+            return UINT32_MAX;
+        // 版本号随每次修改递增，其他线程在此期间取出又放回同一个槽时CAS也会失败
+        next = ((head >> 32) + 1) << 32 | t->slots[(uint32_t) head - 1].next;
+    } while (!atomic_compare_exchange_weak_explicit(&t->free_head, &head, next, memory_order_acquire,
+                                                    memory_order_acquire));
+    return (uint32_t) head - 1;
+}
+
+/**
+ * @brief 比较请求副本中的域名与Question中的小写域名，请求副本的域名已校验，在其结尾的0处或之前总会结束比较
+ */
+static int same_name(const unsigned char *query, const question_t *q) {
+    for (int i = 0; i < q->name_len; i++) {
+        if (tolower(query[sizeof(Header) + i]) != q->name[i])
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief 把进行中的请求加入合并索引
+ */
+static void inflight_insert(pending_table *t, const uint32_t index) {
+    uint32_t i = t->slots[index].hash & t->inflight_mask;
+    while (t->inflight[i] != 0)
+        i = (i + 1) & t->inflight_mask;
+    t->inflight[i] = index + 1;
+}
+
+/**
+ * @brief 从合并索引中删除请求，后续元素前移，不留墓碑
+ */
+static void inflight_remove(pending_table *t, const uint32_t index) {
+    const uint32_t mask = t->inflight_mask;
+    uint32_t i = t->slots[index].hash & mask;
+    while (t->inflight[i] != index + 1) {
+        if (t->inflight[i] == 0)
+            return;
+        i = (i + 1) & mask;
+    }
+    for (uint32_t j = (i + 1) & mask; t->inflight[j] != 0; j = (j + 1) & mask) {
+        // 元素的理想位置不在(i, j]之间时移到空位i
+        const uint32_t home = t->slots[t->inflight[j] - 1].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            t->inflight[i] = t->inflight[j];
+            i = j;
+        }
+    }
+    t->inflight[i] = 0;
+}
+
+/**
+ * @brief 初始化待答复请求表
+ * @param t 待答复请求表
+ * @param ports 与DNS服务器通信的端口数，每个端口提供65536个id
+ */
+void pending_init(pending_table *t, const int ports) {
+    t->cap = (uint32_t) ports * SLOTS_PER_PORT;
+    t->slots = calloc(t->cap, sizeof(pending_slot));
+    if (!t->slots) {
+        perror("calloc failed");
+        exit(-1);
+    }
+    // 空闲链表按端口轮流排列，连续的请求分散到各个端口上
+    uint32_t prev = 0;
+    for (uint32_t k = 0; k < t->cap; k++) {
+        const uint32_t index = (k % ports) << 16 | (k / ports);
+        if (prev)
+            t->slots[prev - 1].next = index + 1;
+        else
+            atomic_init(&t->free_head, index + 1);
+        prev = index + 1;
+    }
+    // 合并索引的装载因子不超过1/2
+    t->inflight = calloc((size_t) t->cap * 2, sizeof(uint32_t));
+    t->inflight_mask = t->cap * 2 - 1;
+    if (!t->inflight) {
+        perror("calloc failed");
+        exit(-1);
+    }
+}
+
+/**
+ * @brief 为转发给DNS服务器的请求分配槽，请求报文的缓冲区归槽所有，id原地替换
+ * @param t 待答复请求表
+ * @param q 请求的Question，含parse_edns解析出的EDNS字段
+ * @param query 客户端的请求报文，成功时其缓冲区交给槽，由pending_complete或pending_timeout之后的调用方放回
+ * @param len 报文长度
+ * @param cli_addr 客户端地址
+ * @param gen 输出槽的代数，定时器据此判断槽是否已被复用
+ * @return 槽下标，高位是端口序号，低16位是新id；表满时返回UINT32_MAX
+ */
+uint32_t pending_alloc(pending_table *t, const question_t *q, unsigned char *query, const int len,
+                       const struct sockaddr_in cli_addr, uint32_t *gen) {
+    const uint32_t index = free_pop(t);
+    if (index == UINT32_MAX)
+        return UINT32_MAX;
+    pending_slot *s = &t->slots[index];
+    s->query = query;
+    s->query_len = (uint16_t) len;
+    s->id = ((const Header *) query)->id;
+    ((Header *) s->query)->id = htons((uint16_t) index);
+    s->tries = 0;
+    s->tcp = 0;
+    s->waiters = 0;
+    s->waiter_cnt = 0;
+    s->stale = STALE_NONE;
+    s->qtype = q->qtype;
+    s->qclass = q->qclass;
+    s->dnssec = q->dnssec;
+    s->rd = ((const Header *) query)->rd;
+    s->hash = q->hash;
+    s->addr = cli_addr;
+    s->udp_size = q->udp_size;
+    *gen = atomic_load_explicit(&s->gen, memory_order_relaxed) + 1;
+    atomic_store_explicit(&s->gen, *gen, memory_order_release);
+    inflight_insert(t, index);
+    return index;
+}
+
+/**
+ * @brief 查找Question相同的进行中的请求；CD、DO或RD位不同时DNS服务器的答复可能不同，不合并
+ * @param t 待答复请求表
+ * @param q 请求的Question，含parse_edns解析出的DO位
+ * @param query 请求报文，取其中的RD位
+ * @return 槽下标，没有时返回UINT32_MAX
+ */
+uint32_t pending_find(const pending_table *t, const question_t *q, const unsigned char *query) {
+    const uint8_t rd = ((const Header *) query)->rd;
+    for (uint32_t i = q->hash & t->inflight_mask; t->inflight[i] != 0; i = (i + 1) & t->inflight_mask) {
+        const pending_slot *s = &t->slots[t->inflight[i] - 1];
+        if (s->hash == q->hash && s->qtype == q->qtype && s->qclass == q->qclass && s->dnssec == q->dnssec &&
+            s->rd == rd && same_name(s->query, q))
+            return t->inflight[i] - 1;
+    }
+    return UINT32_MAX;
+}
+
+/**
+ * @brief 客户端等待进行中的请求的答复，不再单独转发
+ * @param t 待答复请求表
+ * @param index 进行中的请求的槽下标
+ * @param query 客户端的请求报文，Question已校验
+ * @param udp_size 客户端OPT记录声明的UDP载荷大小，0表示请求没有OPT记录
+ * @param cli_addr 客户端地址
+ * @return 是否成功，等待者池无法扩容时返回false
+ */
+bool pending_wait(pending_table *t, const uint32_t index, const unsigned char *query, const uint16_t udp_size,
+                  const struct sockaddr_in cli_addr) {
+    if (t->waiter_free == 0) {
+        // 等待者池满时容量翻倍，新增的等待者串成空闲链表
+        const uint32_t cap = t->waiter_cap ? t->waiter_cap * 2 : INITIAL_WAITERS;
+        pending_waiter *waiters = realloc(t->waiters, (size_t) cap * sizeof(pending_waiter));
+        if (!waiters) {
+            perror("realloc failed");
+            return false;
+        }
+        for (uint32_t i = t->waiter_cap; i < cap; i++)
+            waiters[i].next = i + 1 < cap ? i + 2 : 0;
+        t->waiters = waiters;
+        t->waiter_free = t->waiter_cap + 1;
+        t->waiter_cap = cap;
+    }
+    const uint32_t w = t->waiter_free;
+    pending_waiter *waiter = &t->waiters[w - 1];
+    t->waiter_free = waiter->next;
+    pending_slot *s = &t->slots[index];
+    waiter->id = ((const Header *) query)->id;
+    waiter->addr = cli_addr;
+    waiter->udp_size = udp_size;
+    // 域名与请求副本中的等长，逐个标签复制
+    int n = 0;
+    while (query[sizeof(Header) + n] != 0)
+        n += query[sizeof(Header) + n] + 1;
+    memcpy(waiter->name, query + sizeof(Header), n + 1);
+    waiter->name_len = (uint8_t) (n + 1);
+    waiter->next = s->waiters;
+    s->waiters = w;
+    s->waiter_cnt++;
+    return true;
+}
+
+/**
+ * @brief 答复分发完后把等待者放回空闲链表
+ * @param t 待答复请求表
+ * @param head 等待者链表头的下标加1
+ */
+void pending_release_waiters(pending_table *t, uint32_t head) {
+    while (head) {
+        pending_waiter *waiter = &t->waiters[head - 1];
+        const uint32_t next = waiter->next;
+        waiter->next = t->waiter_free;
+        t->waiter_free = head;
+        head = next;
+    }
+}
+
+/**
+ * @brief 取出仍是指定代数的槽，供所属的工作线程填写发送信息或处理对冲
+ * @param t 待答复请求表
+ * @param index 槽下标
+ * @param gen 代数
+ * @return 槽，已释放或已被复用时返回NULL
+ */
+pending_slot *pending_get(pending_table *t, const uint32_t index, const uint32_t gen) {
+    pending_slot *s = &t->slots[index];
+    return atomic_load_explicit(&s->gen, memory_order_acquire) == gen ? s : NULL;
+}
+
+/**
+ * @brief 核对DNS服务器的答复：槽在使用中，答复的来源是请求发往过的服务器，Question（含域名）与请求一致
+ * @param t 待答复请求表
+ * @param index 槽下标
+ * @param q 答复的Question
+ * @param from 答复来自的DNS服务器
+ * @param gen 输出槽的代数
+ * @return 槽，超时、重复或与请求不符的答复返回NULL
+ */
+pending_slot *pending_match(pending_table *t, const uint32_t index, const question_t *q, const int from,
+                            uint32_t *gen) {
+    if (index >= t->cap)
+        return NULL;
+    pending_slot *s = &t->slots[index];
+    *gen = atomic_load_explicit(&s->gen, memory_order_acquire);
+    if (*gen % 2 == 0) {
+        log_detailed("Response timeout or duplicated, drop it");
+        return NULL;
+    }
+    int sent = 0;
+    for (int i = 0; i < s->tries; i++)
+        sent |= s->sent_to[i] == from;
+    // 哈希相同的不同域名的答复不能交给客户端，也不能按该域名缓存，因此还要比较域名本身
+    if (s->hash != q->hash || s->qtype != q->qtype || s->qclass != q->qclass || !sent || !same_name(s->query, q)) {
+        log_detailed("Response does not match the request, drop it");
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * @brief 收到DNS服务器的答复，来源与Question都与请求一致时取出请求信息并释放槽
+ * @param t 待答复请求表
+ * @param index 槽下标
+ * @param q 答复的Question
+ * @param from 答复来自的DNS服务器
+ * @param out 输出请求信息，包括客户端的id与地址、每次发往的服务器与发送时间，以及须由调用方放回的请求缓冲区
+ * @return 是否成功，超时、重复或与请求不符的答复返回false
+ */
+bool pending_complete(pending_table *t, const uint32_t index, const question_t *q, const int from,
+                      pending_slot *out) {
+    uint32_t gen;
+    const pending_slot *s = pending_match(t, index, q, from, &gen);
+    if (!s)
+        return false;
+    out->id = s->id;
+    out->qtype = s->qtype;
+    out->addr = s->addr;
+    out->udp_size = s->udp_size;
+    out->tries = s->tries;
+    memcpy(out->sent_to, s->sent_to, sizeof(s->sent_to));
+    memcpy(out->sent_off, s->sent_off, sizeof(s->sent_off));
+    out->sent_at = s->sent_at;
+    out->waiters = s->waiters;
+    out->query = s->query;
+    out->query_len = s->query_len;
+    out->stale = s->stale;
+    // 与超时处理竞争，只有一方能释放槽
+    if (!atomic_compare_exchange_strong_explicit(&t->slots[index].gen, &gen, gen + 1, memory_order_acq_rel,
+                                                 memory_order_relaxed))
+        return false;
+    inflight_remove(t, index);
+    free_push(t, index);
+    return true;
+}
+
+/**
+ * @brief 请求超时，若槽仍是定时器设置时的那一代且未收到答复，释放槽；请求缓冲区仍由槽的query指向，由调用方放回
+ * @param t 待答复请求表
+ * @param index 槽下标
+ * @param gen 定时器记录的代数
+ * @return 是否释放了槽
+ */
+bool pending_timeout(pending_table *t, const uint32_t index, uint32_t gen) {
+    if (!atomic_compare_exchange_strong_explicit(&t->slots[index].gen, &gen, gen + 1, memory_order_acq_rel,
+                                                 memory_order_relaxed))
+        return false;
+    log_detailed("DNS server response timeout");
+    inflight_remove(t, index);
+    free_push(t, index);
+    return true;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file metrics.c
+ * @brief 延迟直方图的汇总，以及指标服务：每个连接输出一次当前指标后关闭，兼容HTTP请求
+ */
+#include "../include/metrics.h"
+#include "../include/logs.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_POLL_MS 200 // 检查是否停止的间隔
+#define METRICS_REQUEST_MS 100 // 等待客户端发来HTTP请求的时间
+
+static int listen_fd = -1; // 指标服务的监听套接字
+static char socket_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static void (*render_metrics)(FILE *out); // 输出全部指标的回调
+static pthread_t server;
+static _Atomic int running; // 指标服务是否继续运行
+
+/**
+ * @brief 桶中样本的上界
+ * @param bucket 桶下标
+ * @return 上界，微秒
+ */
+uint64_t hist_upper(const int bucket) {
+    if (bucket < HIST_SUB)
+        return bucket;
+    const int e = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    const uint64_t m = bucket % HIST_SUB;
+    return ((HIST_SUB + m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/**
+ * @brief 把一个直方图累加到另一个
+ */
+void hist_merge(latency_hist *to, const latency_hist *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+    to->sum += from->sum;
+    to->total += from->total;
+}
+
+/**
+ * @brief 分位数
+ * @param h 直方图
+ * @param q 分位，0到1
+ * @return 分位数所在桶的上界，微秒；没有样本时返回0
+ */
+uint64_t hist_quantile(const latency_hist *h, const double q) {
+    const uint64_t rank = (uint64_t) (q * (double) h->total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return hist_upper(i);
+    }
+    return 0;
+}
+
+/**
+ * @brief 应答一个连接：短暂等待请求，是HTTP请求时加上响应头，否则直接输出指标文本
+ * @param fd 连接
+ */
+static void serve(const int fd) {
+    char request[1024];
+    ssize_t n = 0;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0)
+        n = read(fd, request, sizeof(request));
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) {
+        perror("open_memstream failed");
+        return;
+    }
+    render_metrics(out);
+    fclose(out);
+    char head[128];
+    int head_len = 0;
+    if (n >= 4 && memcmp(request, "GET ", 4) == 0)
+        head_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                "Content-Length: %zu\r\n\r\n", len);
+    if ((head_len > 0 && write(fd, head, head_len) < 0) || write(fd, body, len) < 0)
+        perror("write metrics failed");
+    free(body);
+}
+
+/**
+ * @brief 指标服务线程：逐个接受连接并应答
+ */
+static void *server_loop(void *arg) {
+    (void) arg;
+    while (atomic_load(&running)) {
+        struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+        const int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                perror("accept failed");
+            continue;
+        }
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief 在UNIX域套接字上启动指标服务，已存在的同名套接字（如上次运行遗留的）会被替换，同名的其他文件不会被删除
+ * @param path 套接字路径
+ * @param render 输出全部指标的回调，在指标服务线程中调用
+ * @return 成功返回0
+ */
+int metrics_start(const char *path, void (*render)(FILE *out)) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_always("Metrics socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(socket_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            log_always("Metrics socket path exists and is not a socket: %s", path);
+            return -1;
+        }
+        unlink(path);
+    } else if (errno != ENOENT) {
+        perror("lstat metrics socket failed");
+        return -1;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        perror("metrics socket setup failed");
+        return -1;
+    }
+    render_metrics = render;
+    atomic_store(&running, 1);
+    if (pthread_create(&server, NULL, server_loop, NULL)) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 停止指标服务并删除套接字文件
+ */
+void metrics_stop() {
+    if (listen_fd < 0)
+        return;
+    atomic_store(&running, 0);
+    pthread_join(server, NULL);
+    close(listen_fd);
+    unlink(socket_path);
+    listen_fd = -1;
+}
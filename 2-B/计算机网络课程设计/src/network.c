@@ -1,213 +1,1638 @@
-/**
- * @file network.c
- * @brief 网络相关操作
- */
-#include "../include/network.h"
-#include "../include/args_handler.h"
-#include "../include/logs.h"
-#include "../include/file_reader.h"
-#include "../include/structs.h"
-#include "../include/dns_parser.h"
-#include "../include/consts.h"
-#include "../include/mapping.h"
-#include <ctype.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/types.h>
-#include <stdlib.h>
-#include <string.h>
-#include <pthread.h>
-
-int udpfd; // 数据报套接字
-struct sockaddr_in dns_addr; // DNS服务器地址
-
-/**
- * @brief 初始化用于通信的UDP套接字
- */
-static void init_udp() {
-    // 创建数据报套接字
-    udpfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpfd < 0) {
-        perror("socket failed");
-        exit(-1);
-    }
-    // 创建描述地址的结构体
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(DNS_PORT),
-        .sin_addr.s_addr = INADDR_ANY
-    };
-    // 地址复用
-    int reuse = 1;
-    if (setsockopt(udpfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) {
-        perror("setsockopt failed");
-        exit(-1);
-    }
-    // 将套接字与地址绑定
-    if (bind(udpfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        perror("bind failed");
-        exit(-1);
-    }
-    log_always("Create udp socket success");
-}
-
-/**
- * @brief 初始化DNS服务器地址
- */
-static void init_dns_server() {
-    // 将DNS服务器地址填入结构体
-    dns_addr.sin_family = AF_INET;
-    dns_addr.sin_port = htons(DNS_PORT);
-    dns_addr.sin_addr.s_addr = args.dns_server_addr;
-    log_always("Init dns server address success");
-}
-
-/**
- * @brief 初始化网络相关部分
- */
-void network_init() {
-    init_udp();
-    init_dns_server();
-}
-
-/**
- * @brief 处理来自客户端的消息
- * @param buf 消息缓冲区
- * @param len 消息长度
- * @param cli_addr 客户端地址
- * @param cli_addr_len 客户端地址长度
- */
-static void handle_message(unsigned char *buf, const int len, struct sockaddr_in cli_addr, socklen_t cli_addr_len) {
-    char *name = name_parse((char *) buf + sizeof(Header)); // 找到name
-    log_brief("Request name: %s", name);
-    log_brief("Request id: %d", htons(((Header *) buf)->id));
-    const uint32_t result = find_entry(name); // 在文件中查找name对应的地址
-    free(name); // 释放空间，防止内存泄漏
-    // find_entry的不同结果
-    if (result == UINT32_MAX) {
-        // 如果找不到，转发给DNS服务器
-        log_detailed("No local entry found, send to DNS server");
-        // id变换，(id,addr)->cnt
-        uint16_t this = convert_id_to_cnt((Header *) buf, cli_addr);
-        if(sendto(udpfd, buf, len, 0, (struct sockaddr *) &dns_addr, sizeof(dns_addr)) < 0)
-            perror("sendto failed");
-        // 1s未收到DNS服务器的响应，超时
-        sleep(TIMEOUT);
-        if (map[this].is_arrived == false) {
-            log_detailed("DNS server response timeout");
-            map[this].is_arrived = deleted;
-        }
-    } else if (result == inet_addr("0.0.0.0")) {
-        // 如果找到且为0.0.0.0，屏蔽
-        log_detailed("Find local entry 0.0.0.0, sheild it");
-        const Header *request_head = (Header *) buf;
-        Header response_head;
-        fill_header(&response_head, request_head, REJECT);
-        if (sendto(udpfd, (char *) &response_head, sizeof(response_head), 0,
-            (struct sockaddr *) &cli_addr, cli_addr_len) < 0)
-            perror("sendto failed");
-    } else {
-        // 如果找到且不为0.0.0.0，返回给客户端
-        if (get_question_type(buf + sizeof(Header)) == AAAA) {
-            // 如果是AAAA请求，转发给DNS服务器
-            log_detailed("AAAA request, send to DNS server");
-            // id变换，(id,addr)->cnt
-            uint16_t this = convert_id_to_cnt((Header *) buf, cli_addr);
-            if(sendto(udpfd, buf, len, 0, (struct sockaddr *) &dns_addr, sizeof(dns_addr)) < 0)
-                perror("sendto failed");
-            // 1s未收到DNS服务器的响应，超时
-            sleep(TIMEOUT);
-            if (map[this].is_arrived == false) {
-                log_detailed("DNS server response timeout");
-                map[this].is_arrived = deleted;
-            }
-            return;
-        }
-        log_detailed("Find local entry, send to client");
-        // 构造头
-        const Header *request_head = (Header *) buf;
-        Header response_head;
-        fill_header(&response_head, request_head, ACCEPT);
-        // 构造RR
-        unsigned char rr[16];
-        construct_RR(rr, result);
-        // 构造response
-        unsigned char response[MAX_MSG_LEN];
-        construct_response(response, &response_head, buf, len, rr);
-        if (sendto(udpfd, response, len + 16, 0, (struct sockaddr *) &cli_addr, cli_addr_len) < 0)
-            perror("sendto failed");
-    }
-}
-
-/**
- * @brief 对消息进行分类处理，两类：1）本地请求，2）DNS服务器答复
- * @param arg 参数
- */
-static void *message_classify(void *arg) {
-    pthread_detach(pthread_self()); // 分离线程，使其在结束时自动释放资源
-    // 提取参数
-    unsigned char *buf = ((arg_t *) arg)->buf;
-    const int len = ((arg_t *) arg)->len;
-    const struct sockaddr_in cli_addr = ((arg_t *) arg)->cli_addr;
-    socklen_t cli_addr_len = ((arg_t *) arg)->cli_addr_len;
-    // 分类处理
-    Header *head = (Header *) buf;
-    if (head->qr == 0) {
-        // 本地请求，交给handle_message处理
-        log_brief("Receive local request");
-        handle_message(buf, len, cli_addr, cli_addr_len);
-    } else {
-        // DNS服务器答复，转换id后返回给客户端
-        log_brief("Receive DNS server response, send to client");
-        // id变换，cnt->(id,addr)
-        struct sockaddr_in local_cli_addr;
-        if (convert_cnt_to_id(head, &local_cli_addr))
-            if (sendto(udpfd, buf, len, 0, (struct sockaddr *) &local_cli_addr, sizeof(local_cli_addr)) < 0)
-                perror("sendto failed");
-    }
-    free(buf);
-    free(arg);
-}
-
-/**
- * @brief 主处理函数
- */
-void main_process() {
-    log_always("DNS relay is running...");
-    unsigned char *buf = calloc(MAX_MSG_LEN, sizeof(char));
-    while (true) {
-        memset(buf, 0, MAX_MSG_LEN);
-        struct sockaddr_in cli_addr;
-        socklen_t len = sizeof(struct sockaddr_in);
-        const int recv_len = recvfrom(udpfd, buf, MAX_MSG_LEN, 0, (struct sockaddr *) &cli_addr, &len);
-        if (recv_len < 0) {
-            perror("recvfrom failed");
-        } else {
-            log_detailed("Receive message from %s:%d", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
-            if (args.debug_level == 2) {
-                log_detailed("Message details:");
-                for (int i = 0; i < recv_len; i++) {
-                    printf("%02x ", buf[i]);
-                    if ((i + 1) % 16 == 0)
-                        printf("\n");
-                }
-                printf("\n");
-            }
-            arg_t *arg = malloc(sizeof(arg_t));
-            // 构造message_classify的参数
-            arg->buf = (unsigned char *) calloc(recv_len, sizeof(char));
-            memcpy(arg->buf, buf, recv_len);
-            arg->len = recv_len;
-            arg->cli_addr = cli_addr;
-            arg->cli_addr_len = len;
-            // 新建线程处理
-            pthread_t tid;
-            if (pthread_create(&tid, NULL, message_classify, (void *) arg))
-                perror("pthread_create failed");
-        }
-    }
-}
+/**
+ * @file network.c
+ * @brief 网络相关操作
+ */
+#include "../include/network.h"
+#include "../include/args_handler.h"
+#include "../include/logs.h"
+#include "../include/file_reader.h"
+#include "../include/structs.h"
+#include "../include/dns_parser.h"
+#include "../include/consts.h"
+#include "../include/mapping.h"
+#include "../include/timer.h"
+#include "../include/cache.h"
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define MAX_EVENTS 16 // 一次epoll_wait最多返回的事件数
+#define MAX_BATCHES_PER_EVENT 4 // 每个可读事件最多连续接收的批数，避免饿死定时器
+
+static worker_t *workers[MAX_WORKERS]; // 工作线程
+static int stopfd; // 停止事件，写入后所有工作线程退出事件循环
+static _Atomic uint64_t global_epoch = 1; // 全局纪元，每次替换本地记录表后递增
+static unsigned char relay_opt[OPT_LEN]; // 中继的OPT记录，答复带OPT记录的请求而答复本身没有时附上
+static shm_cache shared_cache; // 同一主机上各进程共享的答复缓存，各工作线程共用一个映射
+static hash_ring ring; // 集群的一致性哈希环，各工作线程共用，不组成集群时不使用
+
+/**
+ * @brief 创建非阻塞的UDP套接字并绑定到指定端口
+ * @param port 端口，0表示由内核分配
+ * @param reuseport 是否开启SO_REUSEPORT，使多个套接字共享同一端口
+ * @return 套接字
+ */
+static int init_udp(const uint16_t port, const int reuseport) {
+    // 创建数据报套接字
+    const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        exit(-1);
+    }
+    // 创建描述地址的结构体
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = INADDR_ANY
+    };
+    // 地址复用
+    int reuse = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) {
+        perror("setsockopt failed");
+        exit(-1);
+    }
+    // 端口复用，内核按四元组把请求分散到各线程的套接字上
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))) {
+        perror("setsockopt failed");
+        exit(-1);
+    }
+    // 将套接字与地址绑定
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind failed");
+        exit(-1);
+    }
+    return fd;
+}
+
+/**
+ * @brief 将文件描述符加入epoll实例，监听可读事件
+ */
+static void watch_fd(const int epfd, const int fd) {
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(-1);
+    }
+}
+
+/**
+ * @brief 初始化发送队列
+ * @param q 发送队列
+ * @param fd 发送使用的套接字
+ */
+static void init_queue(send_queue *q, const int fd) {
+    q->fd = fd;
+    q->len = 0;
+    for (int i = 0; i < MAX_BATCH; i++) {
+        q->iovs[i][0].iov_base = q->bufs[i];
+        q->msgs[i].msg_hdr.msg_iov = q->iovs[i];
+        q->msgs[i].msg_hdr.msg_iovlen = 1;
+        q->msgs[i].msg_hdr.msg_name = &q->addrs[i];
+        q->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+}
+
+/**
+ * @brief 用sendmmsg发出队列中的全部报文
+ * @param w 工作线程
+ * @param q 发送队列
+ */
+static void flush_queue(worker_t *w, send_queue *q) {
+    int sent = 0;
+    while (sent < q->len) {
+        const int n = sendmmsg(q->fd, q->msgs + sent, q->len - sent, 0);
+        w->stats.send_calls++;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("sendmmsg failed");
+            // UDP不保证送达，发送缓冲区满时直接丢弃剩余报文
+            w->stats.send_drops += q->len - sent;
+            break;
+        }
+        sent += n;
+    }
+    q->len = 0;
+}
+
+/**
+ * @brief 在发送队列中预留一个报文，队列已满时先发出
+ * @param w 工作线程
+ * @param q 发送队列
+ * @param addr 目的地址
+ * @return 报文缓冲区，填写后调用queue_commit
+ */
+static unsigned char *queue_reserve(worker_t *w, send_queue *q, const struct sockaddr_in *addr) {
+    if (q->len == args.batch)
+        flush_queue(w, q);
+    q->addrs[q->len] = *addr;
+    q->msgs[q->len].msg_hdr.msg_iovlen = 1;
+    return q->bufs[q->len];
+}
+
+/**
+ * @brief 在预留的报文之后追加一段外部数据，不复制，发出前数据须保持有效
+ * @param q 发送队列
+ * @param base 数据
+ * @param len 数据长度
+ */
+static void queue_attach(send_queue *q, const void *base, const size_t len) {
+    struct msghdr *msg = &q->msgs[q->len].msg_hdr;
+    q->iovs[q->len][msg->msg_iovlen].iov_base = (void *) base;
+    q->iovs[q->len][msg->msg_iovlen].iov_len = len;
+    msg->msg_iovlen++;
+}
+
+/**
+ * @brief 确认预留的报文
+ * @param q 发送队列
+ * @param len 缓冲区中报文的长度，不含追加的外部数据
+ */
+static void queue_commit(send_queue *q, const int len) {
+    q->iovs[q->len][0].iov_len = len;
+    q->len++;
+}
+
+/**
+ * @brief 初始化工作线程：套接字、epoll实例与超时定时器
+ * @param index 工作线程编号
+ * @return 工作线程
+ */
+static worker_t *init_worker(const int index) {
+    // 按缓存行对齐，各线程的统计信息不会落在同一缓存行
+    worker_t *w = aligned_alloc(64, (sizeof(worker_t) + 63) / 64 * 64);
+    if (!w) {
+        perror("aligned_alloc failed");
+        exit(-1);
+    }
+    memset(w, 0, sizeof(worker_t));
+    w->index = index;
+    w->udpfd = init_udp(args.listen_port, true);
+    for (int i = 0; i < args.upstream_ports; i++)
+        w->upfds[i] = init_udp(0, false);
+    w->epfd = epoll_create1(0);
+    if (w->epfd < 0) {
+        perror("epoll_create1 failed");
+        exit(-1);
+    }
+    w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (w->timerfd < 0) {
+        perror("timerfd_create failed");
+        exit(-1);
+    }
+    // 接收缓冲区与发送队列的报文头只需设置一次，接收缓冲区被接管时只换iov_base
+    packet_pool_init(&w->packets, args.packets);
+    for (int i = 0; i < MAX_BATCH; i++) {
+        w->rx.iovs[i].iov_base = packet_get(&w->packets);
+        w->rx.iovs[i].iov_len = MAX_PACKET_LEN;
+        w->rx.msgs[i].msg_hdr.msg_iov = &w->rx.iovs[i];
+        w->rx.msgs[i].msg_hdr.msg_iovlen = 1;
+        w->rx.msgs[i].msg_hdr.msg_name = &w->rx.addrs[i];
+    }
+    cache_init(&w->cache, (size_t) args.cache_size * 1024 * 1024 / args.workers, args.max_stale, args.edns_size,
+               args.shared_cache ? &shared_cache : NULL);
+    init_queue(&w->client_q, w->udpfd);
+    w->server_q = malloc(args.upstream_ports * sizeof(send_queue));
+    if (!w->server_q) {
+        perror("malloc failed");
+        exit(-1);
+    }
+    pending_init(&w->pending, args.upstream_ports);
+    upstream_init(&w->upstreams, args.upstream_cnt);
+    upstream_init(&w->peers, args.peer_cnt);
+    w->tcp = malloc(args.upstream_cnt * sizeof(tcp_conn));
+    if (!w->tcp) {
+        perror("malloc failed");
+        exit(-1);
+    }
+    for (int i = 0; i < args.upstream_cnt; i++)
+        tcp_conn_init(&w->tcp[i]);
+    w->qlog = qlog_ring_of(index);
+    watch_fd(w->epfd, w->udpfd);
+    for (int i = 0; i < args.upstream_ports; i++) {
+        init_queue(&w->server_q[i], w->upfds[i]);
+        watch_fd(w->epfd, w->upfds[i]);
+    }
+    watch_fd(w->epfd, w->timerfd);
+    watch_fd(w->epfd, stopfd);
+    return w;
+}
+
+/**
+ * @brief 将timerfd设定为堆顶的到期时间，堆空时取消设定
+ * @param w 工作线程
+ */
+static void arm_timer(worker_t *w) {
+    const timer_entry *top = timer_top(&w->timers);
+    const uint64_t deadline = top ? top->deadline : 0;
+    if (deadline == w->armed_deadline)
+        return;
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = deadline % 1000 * 1000000;
+    if (timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        perror("timerfd_settime failed");
+    w->armed_deadline = deadline;
+}
+
+/**
+ * @brief 为槽设置定时器
+ * @param w 工作线程
+ * @param index 槽下标
+ * @param gen 槽的代数
+ * @param when 到期时间，单调时钟毫秒数
+ */
+static void schedule(worker_t *w, const uint32_t index, const uint32_t gen, const uint64_t when) {
+    timer_push(&w->timers, when, index, gen);
+    if (w->armed_deadline == 0 || when < w->armed_deadline)
+        arm_timer(w);
+}
+
+/**
+ * @brief 请求发往的目标对应的RTT与丢包估计：下标小于PEER_BASE的是DNS服务器，其余是集群中的其他节点
+ * @param w 工作线程
+ * @param u 目标下标，输出其在估计中的下标
+ * @return 目标所在的估计
+ */
+static upstream_set *estimates_of(worker_t *w, int *u) {
+    if (*u < PEER_BASE)
+        return &w->upstreams;
+    *u -= PEER_BASE;
+    return &w->peers;
+}
+
+/**
+ * @brief 请求发往的目标的地址
+ * @param u 目标下标，DNS服务器或PEER_BASE加节点下标
+ */
+static const struct sockaddr_in *target_addr(const int u) {
+    return u < PEER_BASE ? &args.upstreams[u] : &args.peers[u - PEER_BASE];
+}
+
+/**
+ * @brief 按答复的来源地址找出请求发往的目标
+ * @return 目标下标，不是DNS服务器或其他节点时返回-1
+ */
+static int find_target(const struct sockaddr_in *addr) {
+    for (int u = 0; u < args.upstream_cnt; u++) {
+        if (args.upstreams[u].sin_addr.s_addr == addr->sin_addr.s_addr &&
+            args.upstreams[u].sin_port == addr->sin_port)
+            return u;
+    }
+    for (int p = 0; p < args.peer_cnt; p++) {
+        if (args.peers[p].sin_addr.s_addr == addr->sin_addr.s_addr && args.peers[p].sin_port == addr->sin_port)
+            return PEER_BASE + p;
+    }
+    return -1;
+}
+
+/**
+ * @brief 把槽中的请求发往指定的DNS服务器或其他节点，并记录发送时间
+ * @param w 工作线程
+ * @param index 槽下标
+ * @param s 槽
+ * @param u DNS服务器下标，或PEER_BASE加节点下标
+ * @param now 当前时间，单调时钟微秒数
+ */
+static void send_try(worker_t *w, const uint32_t index, pending_slot *s, const int u, const uint64_t now) {
+    s->sent_to[s->tries] = (uint8_t) u;
+    s->sent_off[s->tries] = (uint32_t) (now - s->sent_at);
+    s->tries++;
+    // 请求缓冲区归槽所有，直接作为报文发出，不复制；缓冲区只在处理DNS服务器答复与超时时放回池中，
+    // 只在处理客户端请求时取出，每批处理完都先发出队列中的报文，因此发出前不会被覆盖
+    queue_reserve(w, &w->server_q[index >> 16], target_addr(u));
+    queue_attach(&w->server_q[index >> 16], s->query, s->query_len);
+    queue_commit(&w->server_q[index >> 16], 0);
+    int i = u;
+    estimates_of(w, &i)->up[i].sent++;
+}
+
+/**
+ * @brief 设置重传时间：发送后等待该服务器的RTO，之后每次重传等待时间翻倍，不超过最终超时时间
+ * @param w 工作线程
+ * @param s 槽
+ * @param u 本次发往的DNS服务器或其他节点
+ * @param backoff 翻倍次数
+ * @param now 当前时间，单调时钟微秒数
+ */
+static void set_retry(worker_t *w, pending_slot *s, const int u, const int backoff, const uint64_t now) {
+    int i = u;
+    const upstream_set *set = estimates_of(w, &i);
+    const uint64_t retry_at = (now + (upstream_rto(set, i) << backoff) + 999) / 1000;
+    s->rto_upstream = (uint8_t) u;
+    s->retry_at = s->tries == MAX_TRIES || retry_at > s->deadline ? s->deadline : retry_at;
+}
+
+/**
+ * @brief 客户端可接收的UDP答复长度：没有OPT记录时为512，有时取其声明与中继的UDP载荷大小的较小值
+ * @param udp_size 客户端OPT记录声明的UDP载荷大小，0表示请求没有OPT记录
+ */
+static int client_limit(const uint16_t udp_size) {
+    if (udp_size == 0)
+        return MAX_MSG_LEN;
+    return udp_size < args.edns_size ? udp_size : args.edns_size;
+}
+
+/**
+ * @brief 按客户端的EDNS状态发出答复：请求没有OPT记录时去掉答复中的OPT记录，有时确保答复带OPT记录（RFC 6891 7）；
+ *        超过客户端可接收的长度时只发出设置了TC位的Question段。答复无需改动时整个引用，
+ *        否则只复制报文头与域名，其余部分直接引用答复
+ * @param w 工作线程
+ * @param reply 答复报文，OPT记录如有则在最后，发出前保持有效
+ * @param len 报文长度
+ * @param opt_len 答复中OPT记录的长度，0表示没有
+ * @param q_end 答复中Question段之后的偏移
+ * @param addr 客户端地址
+ * @param id 客户端请求的id
+ * @param name 客户端请求中的域名，保留原有的大小写
+ * @param name_len 域名长度
+ * @param udp_size 客户端OPT记录声明的UDP载荷大小，0表示请求没有OPT记录
+ */
+static void send_answer(worker_t *w, const unsigned char *reply, const int len, const int opt_len, const int q_end,
+                        const struct sockaddr_in *addr, const uint16_t id, const unsigned char *name,
+                        const int name_len, const uint16_t udp_size) {
+    const int body = len - opt_len;
+    const int extra = udp_size ? opt_len ? opt_len : OPT_LEN : 0; // 完整答复附上的OPT记录的长度
+    const int fits = body + extra <= client_limit(udp_size);
+    unsigned char *out = queue_reserve(w, &w->client_q, addr);
+    if (fits && extra == opt_len && ((const Header *) reply)->id == id && name == reply + sizeof(Header)) {
+        queue_attach(&w->client_q, reply, len);
+        queue_commit(&w->client_q, 0);
+        return;
+    }
+    const int head_len = (int) sizeof(Header) + name_len;
+    Header *h = (Header *) out;
+    memcpy(out, reply, sizeof(Header));
+    h->id = id;
+    memcpy(out + sizeof(Header), name, name_len);
+    if (fits) {
+        if (opt_len)
+            h->arcount = htons(ntohs(h->arcount) - 1);
+        queue_attach(&w->client_q, reply + head_len, body - head_len);
+    } else {
+        h->tc = 1;
+        h->ancount = h->nscount = h->arcount = 0;
+        queue_attach(&w->client_q, reply + head_len, q_end - head_len);
+    }
+    if (extra) {
+        // 截断的答复附上中继的OPT记录，答复中的OPT记录可能带有很长的选项，附上后会超出客户端可接收的长度
+        if (fits && opt_len)
+            queue_attach(&w->client_q, reply + body, opt_len);
+        else
+            queue_attach(&w->client_q, relay_opt, OPT_LEN);
+        h->arcount = htons(ntohs(h->arcount) + 1);
+    }
+    queue_commit(&w->client_q, head_len);
+}
+
+/**
+ * @brief 把答复分发给合并到同一请求的其他客户端，恢复各自的id与域名大小写，按各自的EDNS状态调整，之后释放等待者
+ * @param w 工作线程
+ * @param reply 答复报文，Question与各等待者的相同，OPT记录如有则在最后，发出前保持有效
+ * @param len 报文长度
+ * @param opt_len 答复中OPT记录的长度，0表示没有
+ * @param q_end 答复中Question段之后的偏移
+ * @param waiters 等待者链表头的下标加1
+ * @param s 原请求的槽，查询日志按原请求的发送时间计算等待者的耗时
+ * @param path 查询日志中答复的来源
+ * @param upstream 答复的DNS服务器下标
+ */
+static void fan_out(worker_t *w, const unsigned char *reply, const int len, const int opt_len, const int q_end,
+                    const uint32_t waiters, const pending_slot *s, const uint8_t path, const uint8_t upstream) {
+    const uint64_t now = waiters ? now_us() : 0;
+    for (uint32_t i = waiters; i; i = w->pending.waiters[i - 1].next) {
+        const pending_waiter *waiter = &w->pending.waiters[i - 1];
+        send_answer(w, reply, len, opt_len, q_end, &waiter->addr, waiter->id, waiter->name, waiter->name_len,
+                    waiter->udp_size);
+        hist_add(&w->latency[LAT_UPSTREAM], now - s->sent_at, 1);
+        if (w->qlog)
+            qlog_append(w->qlog, s->sent_at, &waiter->addr, waiter->name, waiter->name_len, s->qtype,
+                        ((const Header *) reply)->rcode, path, upstream);
+    }
+    pending_release_waiters(&w->pending, waiters);
+}
+
+/**
+ * @brief 转发请求给DNS服务器，并为其设置对冲、重传与超时定时器；集群模式下域名由其他节点负责时先向该节点查询，
+ *        它的缓存未命中时由它查询DNS服务器并缓存，各节点不必各自查询同一域名
+ *        请求所在的接收缓冲区交给待答复请求表，接收队列换上池中的新缓冲区，请求不复制
+ * @param w 工作线程
+ * @param q 请求的Question，含parse_edns解析出的EDNS字段
+ * @param buf 请求报文，位于当前处理的接收缓冲区，容量为MAX_PACKET_LEN
+ * @param len 报文长度
+ * @param cli_addr 客户端地址
+ * @return 等待答复的槽下标，合并时为进行中的请求的槽；请求被丢弃时返回UINT32_MAX
+ */
+static uint32_t forward_to_server(worker_t *w, const question_t *q, unsigned char *buf, int len,
+                                  const struct sockaddr_in cli_addr) {
+    // 已有Question相同的请求在等待答复时不再转发，答复到达后一并分发
+    const uint32_t inflight = pending_find(&w->pending, q, buf);
+    if (inflight != UINT32_MAX) {
+        // 等待者已达上限时丢弃，不另行转发，同一Question的请求不会越积越多（RFC 5452）
+        if (w->pending.slots[inflight].waiter_cnt >= MAX_WAITERS) {
+            log_detailed("Too many clients waiting for the same request, drop it");
+            w->stats.waiter_overflows++;
+            return UINT32_MAX;
+        }
+        if (pending_wait(&w->pending, inflight, buf, q->udp_size, cli_addr)) {
+            log_detailed("Coalesce with an in-flight request");
+            w->stats.coalesced++;
+            return inflight;
+        }
+    }
+    unsigned char *fresh = packet_get(&w->packets);
+    if (!fresh) {
+        log_brief("Out of packet buffers, drop it");
+        w->stats.pool_exhausted++;
+        return UINT32_MAX;
+    }
+    // 其他节点代为查询的请求与后台刷新直接转发给DNS服务器，节点列表不一致时也不会在节点间循环转发
+    Header *head = (Header *) buf;
+    int peer = CLUSTER_SELF;
+    if (args.peer_cnt > 0 && !(head->z & CLUSTER_MARK) && cli_addr.sin_family != AF_UNSPEC) {
+        peer = ring_owner(&ring, q->hash);
+        if (peer != CLUSTER_SELF && now_ms() < w->peer_down_until[peer])
+            peer = CLUSTER_SELF;
+    }
+    if (peer == CLUSTER_SELF)
+        head->z &= ~CLUSTER_MARK;
+    else
+        head->z |= CLUSTER_MARK;
+    // 转发的请求总是带OPT记录并声明中继的UDP载荷大小，答复不超过该大小时DNS服务器不必截断
+    if (q->udp_size) {
+        buf[q->opt_off + 3] = args.edns_size >> 8;
+        buf[q->opt_off + 4] = (uint8_t) args.edns_size;
+    } else if (((Header *) buf)->arcount == 0 && len + OPT_LEN <= MAX_PACKET_LEN) {
+        len += write_opt(buf + len, args.edns_size, 0);
+        head->arcount = htons(1);
+    }
+    // id变换，(id,addr)->(端口,新id)
+    uint32_t gen;
+    const uint32_t this = pending_alloc(&w->pending, q, buf, len, cli_addr, &gen);
+    if (this == UINT32_MAX) {
+        log_brief("Too many pending requests, drop it");
+        w->stats.overflows++;
+        packet_put(&w->packets, fresh);
+        return UINT32_MAX;
+    }
+    w->rx.iovs[w->rx.current].iov_base = fresh;
+    // 发往负责的节点，或预期最快的DNS服务器
+    pending_slot *s = &w->pending.slots[this];
+    const int u = peer != CLUSTER_SELF ? PEER_BASE + peer : upstream_pick(&w->upstreams, NO_UPSTREAM);
+    const uint64_t now = now_us();
+    s->sent_at = now;
+    s->deadline = now / 1000 + TIMEOUT * 1000;
+    send_try(w, this, s, u, now);
+    set_retry(w, s, u, 0, now);
+    if (peer != CLUSTER_SELF)
+        w->stats.peer_queries++;
+    else
+        w->stats.forwarded++;
+    // 先到RTT的百分位则对冲，先到RTO则重传，均由定时器事件处理；发往其他节点的请求到RTO时改为转发给DNS服务器
+    uint64_t when = s->retry_at;
+    if (peer == CLUSTER_SELF && args.hedge_percentile > 0 && args.upstream_cnt > 1) {
+        const uint64_t hedge_at = (now + upstream_hedge_delay(&w->upstreams, u, args.hedge_percentile) + 999) / 1000;
+        if (hedge_at < when)
+            when = hedge_at;
+    }
+    schedule(w, this, gen, when);
+    return this;
+}
+
+/**
+ * @brief 其他节点未能答复，清除请求的标记后转发给预期最快的DNS服务器，重传时间重新按该服务器计算
+ * @param w 工作线程
+ * @param index 槽下标
+ * @param s 槽，最近一次发往其他节点
+ * @param now 当前时间，单调时钟微秒数
+ */
+static void ask_upstream(worker_t *w, const uint32_t index, pending_slot *s, const uint64_t now) {
+    // 发往该节点的报文已在之前的批中发出，可以原地修改
+    ((Header *) s->query)->z &= ~CLUSTER_MARK;
+    const int u = upstream_pick(&w->upstreams, NO_UPSTREAM);
+    send_try(w, index, s, u, now);
+    set_retry(w, s, u, 0, now);
+    w->stats.peer_failures++;
+    w->stats.forwarded++;
+}
+
+/**
+ * @brief 定时器到期时请求仍未答复：到了重传时间则重传，否则向另一台DNS服务器对冲
+ * @param w 工作线程
+ * @param index 槽下标
+ * @param gen 槽的代数
+ * @param s 槽
+ * @param now 当前时间，单调时钟毫秒数
+ */
+static void retry_to_server(worker_t *w, const uint32_t index, const uint32_t gen, pending_slot *s,
+                            const uint64_t now) {
+    if (s->tcp) {
+        // 已改经TCP查询，由TCP负责重传，只等最终超时
+        schedule(w, index, gen, s->deadline);
+        return;
+    }
+    const uint64_t now_u = now_us();
+    if (now >= s->retry_at && s->rto_upstream >= PEER_BASE) {
+        // 负责的节点RTO内没有答复，视为丢包，暂时不再向它查询
+        const int p = s->rto_upstream - PEER_BASE;
+        upstream_lost(&w->peers, p);
+        w->peer_down_until[p] = now + PEER_RETRY_MS;
+        log_detailed("Cluster peer did not answer, send to DNS server");
+        ask_upstream(w, index, s, now_u);
+    } else if (now >= s->retry_at && s->tries < MAX_TRIES) {
+        // RTO内没有答复，视为该服务器丢包，优先换一台服务器重传，等待时间指数退避
+        const int lost = s->rto_upstream;
+        upstream_lost(&w->upstreams, lost);
+        const int u = args.upstream_cnt > 1 ? upstream_pick(&w->upstreams, lost) : lost;
+        log_detailed("Retransmit request, try %d", s->tries + 1);
+        send_try(w, index, s, u, now_u);
+        set_retry(w, s, u, s->tries - 1, now_u);
+        w->stats.retransmits++;
+    } else if (s->tries == 1 && s->sent_to[0] < PEER_BASE) {
+        // 超过RTT的百分位，向另一台服务器对冲，先到的答复被采用
+        const int u = upstream_pick(&w->upstreams, s->sent_to[0]);
+        if (u != NO_UPSTREAM) {
+            log_detailed("Hedge request to another DNS server");
+            send_try(w, index, s, u, now_u);
+            w->stats.hedges++;
+        }
+    }
+    schedule(w, index, gen, s->retry_at);
+}
+
+/**
+ * @brief 以缓存中过期的答复应答一个客户端
+ * @param w 工作线程
+ * @param q 请求的Question，udp_size被改为该客户端的
+ * @param request 由客户端的id与域名拼成的请求，到Question段末尾为止
+ * @param addr 客户端地址
+ * @param udp_size 客户端OPT记录声明的UDP载荷大小，0表示请求没有OPT记录
+ * @param s 原请求的槽，查询日志按原请求的发送时间计算耗时
+ * @param now 当前时间，单调时钟毫秒数
+ * @return 是否已应答，条目已被淘汰时返回false
+ */
+static bool answer_stale(worker_t *w, question_t *q, const unsigned char *request, const struct sockaddr_in *addr,
+                         const uint16_t udp_size, const pending_slot *s, const uint64_t now) {
+    int n;
+    q->udp_size = udp_size;
+    unsigned char *out = queue_reserve(w, &w->client_q, addr);
+    if (cache_lookup(&w->cache, q, request, out, client_limit(udp_size), now, &n) == CACHE_MISS)
+        return false;
+    queue_commit(&w->client_q, n);
+    hist_add(&w->latency[LAT_UPSTREAM], now_us() - s->sent_at, 1);
+    if (w->qlog)
+        qlog_append(w->qlog, s->sent_at, addr, q->name, q->name_len, q->qtype, ((Header *) out)->rcode, QLOG_CACHE,
+                    NO_UPSTREAM);
+    w->stats.stale_answers++;
+    return true;
+}
+
+/**
+ * @brief DNS服务器答复失败或迟迟不答复时，以缓存中过期的答复应答请求的客户端与等待者（RFC 8767），
+ *        各自恢复id与域名大小写，按各自的EDNS状态构造；之后请求没有客户端，答复只用于刷新缓存
+ * @param w 工作线程
+ * @param s 槽，或pending_complete取出的请求信息，请求缓冲区仍有效
+ * @return 是否已应答；过期的条目已被淘汰时返回false，客户端与等待者不变，由调用方照常处理
+ */
+static bool serve_stale(worker_t *w, pending_slot *s) {
+    question_t q;
+    if (parse_question(s->query, s->query_len, &q) < 0)
+        return false;
+    // 转发的请求中的OPT记录可能是中继添加的，DO位以客户端请求的为准
+    q.dnssec = s->dnssec;
+    const uint64_t now = now_ms();
+    // 槽中的请求id已替换；条目只在超过可应答的时间时被淘汰，同一时刻查到一次后其余的也能查到
+    unsigned char request[sizeof(Header) + MAX_NAME_LEN + 5];
+    memcpy(request, s->query, q.end);
+    Header *head = (Header *) request;
+    if (s->addr.sin_family != AF_UNSPEC) {
+        head->id = s->id;
+        if (!answer_stale(w, &q, request, &s->addr, s->udp_size, s, now))
+            return false;
+    }
+    for (uint32_t i = s->waiters; i; i = w->pending.waiters[i - 1].next) {
+        const pending_waiter *waiter = &w->pending.waiters[i - 1];
+        head->id = waiter->id;
+        memcpy(request + sizeof(Header), waiter->name, waiter->name_len);
+        if (!answer_stale(w, &q, request, &waiter->addr, waiter->udp_size, s, now))
+            return false;
+    }
+    pending_release_waiters(&w->pending, s->waiters);
+    s->waiters = 0;
+    s->waiter_cnt = 0;
+    s->addr.sin_family = AF_UNSPEC;
+    s->stale = STALE_SERVED;
+    return true;
+}
+
+/**
+ * @brief 请求得不到答复，释放槽并答复客户端：缓存中有过期的答复时以它应答；最终超时时答复服务器失败；经TCP查询而连接断开时答复截断，
+ *        与不经TCP重新查询时相同，客户端可自行改用TCP
+ * @param w 工作线程
+ * @param index 槽下标
+ * @param gen 槽的代数
+ * @param s 槽
+ * @param truncated 是否答复截断而不是服务器失败
+ */
+static void give_up(worker_t *w, const uint32_t index, const uint32_t gen, pending_slot *s, const bool truncated) {
+    // 以过期的答复应答后客户端与等待者都已清空，下面只释放槽
+    if (s->stale == STALE_WAITING)
+        serve_stale(w, s);
+    int lost = s->rto_upstream;
+    const uint32_t waiters = s->waiters;
+    if (!pending_timeout(&w->pending, index, gen))
+        return;
+    if (!truncated) {
+        upstream_set *set = estimates_of(w, &lost);
+        upstream_lost(set, lost);
+        w->stats.timeouts++;
+    }
+    // 槽只由本线程分配，释放后请求缓冲区仍归本函数所有，原地改为只含Question的答复
+    unsigned char *reply = s->query;
+    question_t q;
+    const int len = parse_question(reply, s->query_len, &q) == 0 ? q.end : (int) sizeof(Header);
+    Header *head = (Header *) reply;
+    head->id = s->id;
+    head->qr = 1;
+    head->ra = 1;
+    head->tc = truncated;
+    head->rcode = truncated ? 0 : 2; // 2表示服务器失败
+    head->ancount = head->nscount = head->arcount = 0;
+    if (len == (int) sizeof(Header))
+        head->qdcount = 0;
+    const int name_len = len > (int) sizeof(Header) ? q.name_len : 0;
+    if (s->addr.sin_family != AF_UNSPEC) {
+        send_answer(w, reply, len, 0, len, &s->addr, s->id, reply + sizeof(Header), name_len, s->udp_size);
+        hist_add(&w->latency[LAT_UPSTREAM], now_us() - s->sent_at, 1);
+        if (w->qlog && len > (int) sizeof(Header))
+            qlog_append(w->qlog, s->sent_at, &s->addr, q.name, q.name_len, q.qtype, head->rcode, QLOG_SERVFAIL,
+                        NO_UPSTREAM);
+    }
+    // 放回的缓冲区要到处理下一批客户端请求时才会被取出，等待者引用的答复在此之前已发出
+    fan_out(w, reply, len, 0, len, waiters, s, QLOG_SERVFAIL, NO_UPSTREAM);
+    packet_put(&w->packets, reply);
+    s->query = NULL;
+}
+
+/**
+ * @brief 本地表中没有可用的答复时，先查缓存，未命中再转发给DNS服务器
+ * @param w 工作线程
+ * @param q 请求的Question，含parse_edns解析出的EDNS字段
+ * @param buf 请求报文
+ * @param len 报文长度
+ * @param cli_addr 客户端地址
+ */
+static void resolve_remote(worker_t *w, const question_t *q, unsigned char *buf, const int len,
+                           const struct sockaddr_in cli_addr) {
+    // 直接在发送队列中构造答复，未命中时不提交
+    int n;
+    unsigned char *out = queue_reserve(w, &w->client_q, &cli_addr);
+    const uint64_t now = now_ms();
+    int hit = cache_lookup(&w->cache, q, buf, out, client_limit(q->udp_size), now, &n);
+    const int shared = hit & CACHE_SHARED;
+    hit &= ~CACHE_SHARED;
+    if (hit == CACHE_STALE) {
+        // 过期的答复先不发出，照常查询，DNS服务器答复失败或超过STALE_WAIT_MS仍未答复时再以它应答；
+        // 同一Question的请求已以它应答过时，DNS服务器正迟迟不答复，直接发出
+        const uint32_t inflight = pending_find(&w->pending, q, buf);
+        if (inflight == UINT32_MAX || w->pending.slots[inflight].stale != STALE_SERVED) {
+            log_detailed("Stale cache entry, send to DNS server");
+            const uint32_t index = forward_to_server(w, q, buf, len, cli_addr);
+            if (index == UINT32_MAX)
+                return;
+            pending_slot *s = &w->pending.slots[index];
+            if (s->stale == STALE_NONE) {
+                s->stale = STALE_WAITING;
+                s->stale_at = now + STALE_WAIT_MS;
+                schedule(w, index, atomic_load_explicit(&s->gen, memory_order_relaxed), s->stale_at);
+            }
+            return;
+        }
+        w->stats.stale_answers++;
+    }
+    if (hit != CACHE_MISS) {
+        log_detailed("Cache hit, send to client");
+        queue_commit(&w->client_q, n);
+        w->stats.cache_hits++;
+        if (shared) {
+            log_detailed("Answer shared by another relay");
+            w->stats.shared_hits++;
+        }
+        w->batch_answers[LAT_CACHE]++;
+        if (w->qlog)
+            qlog_append(w->qlog, w->batch_at, &cli_addr, q->name, q->name_len, q->qtype, ((Header *) out)->rcode,
+                        QLOG_CACHE, NO_UPSTREAM);
+        // 即将过期的热门条目在后台向DNS服务器刷新，已在刷新时不重复发送
+        if (hit == CACHE_REFRESH && pending_find(&w->pending, q, buf) == UINT32_MAX) {
+            log_detailed("Refresh cache entry in background");
+            const struct sockaddr_in no_client = {.sin_family = AF_UNSPEC};
+            forward_to_server(w, q, buf, len, no_client);
+            w->stats.refreshes++;
+        }
+        return;
+    }
+    log_detailed("Send to DNS server");
+    forward_to_server(w, q, buf, len, cli_addr);
+}
+
+/**
+ * @brief 处理到期的定时器
+ * @param w 工作线程
+ */
+static void handle_timeout(worker_t *w) {
+    uint64_t expirations;
+    if (read(w->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("read timerfd failed");
+    const uint64_t now = now_ms();
+    const timer_entry *top;
+    while ((top = timer_top(&w->timers)) != NULL && top->deadline <= now) {
+        const timer_entry e = *top;
+        timer_pop(&w->timers);
+        pending_slot *s = pending_get(&w->pending, e.index, e.gen);
+        if (!s)
+            continue; // 已收到答复，槽已释放或被复用
+        if (s->stale == STALE_WAITING && e.deadline == s->stale_at) {
+            // 缓存中有过期的答复，不再让客户端等下去，请求继续用于刷新缓存
+            log_detailed("DNS server is slow, answer with stale cache entry");
+            if (!serve_stale(w, s))
+                s->stale = STALE_NONE;
+            continue;
+        }
+        if (now < s->deadline)
+            retry_to_server(w, e.index, e.gen, s, now);
+        else
+            give_up(w, e.index, e.gen, s, false);
+    }
+    // 对冲与重传的请求、失败的答复在这里产生，本轮定时器处理完后发出
+    flush_queue(w, &w->client_q);
+    for (int i = 0; i < args.upstream_ports; i++)
+        flush_queue(w, &w->server_q[i]);
+    w->armed_deadline = 0;
+    arm_timer(w);
+}
+
+/**
+ * @brief 初始化网络相关部分
+ */
+void network_init() {
+    stopfd = eventfd(0, EFD_NONBLOCK);
+    if (stopfd < 0) {
+        perror("eventfd failed");
+        exit(-1);
+    }
+    if (args.query_log && qlog_open(args.query_log, args.workers) < 0)
+        exit(-1);
+    write_opt(relay_opt, args.edns_size, 0);
+    if (args.shared_cache &&
+        shm_cache_open(&shared_cache, args.shared_cache, (size_t) args.shared_cache_size * 1024 * 1024) < 0)
+        exit(-1);
+    if (args.peer_cnt > 0)
+        ring_init(&ring, &args.cluster_self, args.peers, args.peer_cnt);
+    for (int i = 0; i < args.workers; i++)
+        workers[i] = init_worker(i);
+    log_always("Create %d udp socket(s) success", args.workers);
+}
+
+/**
+ * @brief 用本地记录的答复模板应答：报文头只需填入id、标志位与回答数，多条记录每次从不同的一条开始轮转
+ *        没有CNAME时答复由报文头、请求中的Question段与模板中的两段记录组成，不复制记录，请求带OPT记录时再附上中继的；
+ *        有CNAME时目标的记录须指向CNAME中的目标域名，其偏移随Question长度变化，复制后改写
+ * @param w 工作线程
+ * @param q 解析出的Question，含parse_edns解析出的EDNS字段
+ * @param buf 请求报文，发出前保持有效
+ * @param record 答复模板
+ * @param cli_addr 客户端地址
+ */
+static void answer_local(worker_t *w, const question_t *q, const unsigned char *buf, const local_record *record,
+                         const struct sockaddr_in *cli_addr) {
+    const int k = q->qtype == AAAA ? LOCAL_AAAA : LOCAL_A;
+    const int rr_len = q->qtype == AAAA ? 28 : 16;
+    const int total = q->qtype == CNAME ? 0 : record->rr_cnt[k];
+    const int opt_len = q->udp_size ? OPT_LEN : 0;
+    // 超出报文长度上限时截断，并设置TC位；连CNAME记录也放不下时只答复Question段
+    const int avail = client_limit(q->udp_size) - q->end - record->cname_len - opt_len;
+    const int cname_len = avail < 0 ? 0 : record->cname_len;
+    const int room = avail < 0 ? 0 : avail / rr_len;
+    const int cnt = total < room ? total : room;
+    const int first = total > 0 ? (int) (w->rotation++ % total) : 0;
+    const int head = cnt < total - first ? cnt : total - first;
+    const unsigned char *rrs = record->data + record->rr_off[k];
+    const Header *request_head = (Header *) buf;
+    Header *response_head = (Header *) queue_reserve(w, &w->client_q, cli_addr);
+    *response_head = record->header;
+    response_head->id = request_head->id;
+    response_head->opcode = request_head->opcode;
+    response_head->rd = request_head->rd;
+    response_head->tc = cnt < total || cname_len < record->cname_len;
+    response_head->ancount = htons((cname_len ? 1 : 0) + cnt);
+    queue_attach(&w->client_q, buf + sizeof(Header), q->end - sizeof(Header));
+    if (cname_len == 0) {
+        queue_attach(&w->client_q, rrs + first * rr_len, head * rr_len);
+        if (cnt > head)
+            queue_attach(&w->client_q, rrs, (cnt - head) * rr_len);
+    } else {
+        unsigned char *answer = (unsigned char *) (response_head + 1);
+        memcpy(answer, record->data, record->cname_len);
+        memcpy(answer + record->cname_len, rrs + first * rr_len, head * rr_len);
+        memcpy(answer + record->cname_len + head * rr_len, rrs, (cnt - head) * rr_len);
+        // CNAME记录的资源数据即目标域名，位于Question段之后12字节处
+        const uint16_t target = htons(0xc000 | (q->end + 12));
+        for (int i = 0; i < cnt; i++)
+            memcpy(answer + record->cname_len + i * rr_len, &target, sizeof(target));
+        queue_attach(&w->client_q, answer, record->cname_len + cnt * rr_len);
+    }
+    if (opt_len) {
+        queue_attach(&w->client_q, relay_opt, opt_len);
+        response_head->arcount = htons(1);
+    }
+    queue_commit(&w->client_q, sizeof(Header));
+}
+
+/**
+ * @brief 请求的EDNS版本高于0时答复BADVERS，OPT记录中声明中继支持的版本0（RFC 6891 6.1.3）
+ * @param w 工作线程
+ * @param q 解析出的Question
+ * @param buf 请求报文，发出前保持有效
+ * @param cli_addr 客户端地址
+ */
+static void answer_badvers(worker_t *w, const question_t *q, const unsigned char *buf,
+                           const struct sockaddr_in *cli_addr) {
+    unsigned char *out = queue_reserve(w, &w->client_q, cli_addr);
+    Header *h = (Header *) out;
+    memcpy(h, buf, sizeof(Header));
+    h->qr = 1;
+    h->aa = h->tc = 0;
+    h->ra = 1;
+    h->rcode = BADVERS & 0xf; // 低4位在报文头，高8位在OPT记录中
+    h->ancount = h->nscount = 0;
+    h->arcount = htons(1);
+    // OPT记录写在发送缓冲区的报文头之后，作为最后一段引用
+    write_opt(out + sizeof(Header), args.edns_size, BADVERS >> 4);
+    queue_attach(&w->client_q, buf + sizeof(Header), q->end - sizeof(Header));
+    queue_attach(&w->client_q, out + sizeof(Header), OPT_LEN);
+    queue_commit(&w->client_q, sizeof(Header));
+}
+
+/**
+ * @brief 处理来自客户端的消息
+ * @param w 工作线程
+ * @param buf 消息缓冲区
+ * @param len 消息长度
+ * @param cli_addr 客户端地址
+ */
+static void handle_message(worker_t *w, unsigned char *buf, const int len, struct sockaddr_in cli_addr) {
+    // 一次遍历解析Question，不分配内存
+    question_t q;
+    if (parse_question(buf, len, &q) < 0 || (((Header *) buf)->arcount && parse_edns(buf, len, &q) < 0)) {
+        log_brief("Malformed request, drop it");
+        return;
+    }
+    if (q.udp_size && q.edns_version > 0) {
+        log_brief("Unsupported EDNS version %d", q.edns_version);
+        answer_badvers(w, &q, buf, &cli_addr);
+        return;
+    }
+    if (args.debug_level >= 1) {
+        char name[MAX_NAME_LEN];
+        name_to_text(&q, name);
+        log_brief("Request name: %s", name);
+        log_brief("Request id: %d", htons(((Header *) buf)->id));
+        log_detailed("Question type: %s", type_name(q.qtype));
+    }
+    const local_record *record = find_entry(&q); // 在内存中查找name对应的答复模板
+    // find_entry的不同结果
+    if (!record) {
+        // 如果找不到，转发给DNS服务器
+        log_detailed("No local entry found");
+        resolve_remote(w, &q, buf, len, cli_addr);
+    } else if (record->blocked) {
+        // 如果找到且为0.0.0.0，屏蔽，只返回模板中的报文头
+        log_detailed("Find local entry 0.0.0.0, sheild it");
+        Header *response_head = (Header *) queue_reserve(w, &w->client_q, &cli_addr);
+        *response_head = record->header;
+        response_head->id = ((Header *) buf)->id;
+        response_head->opcode = ((Header *) buf)->opcode;
+        response_head->rd = ((Header *) buf)->rd;
+        if (q.udp_size) {
+            queue_attach(&w->client_q, relay_opt, OPT_LEN);
+            response_head->arcount = htons(1);
+        }
+        queue_commit(&w->client_q, sizeof(Header));
+        w->stats.blocked++;
+        w->batch_answers[LAT_LOCAL]++;
+        if (w->qlog)
+            qlog_append(w->qlog, w->batch_at, &cli_addr, q.name, q.name_len, q.qtype, record->header.rcode,
+                        QLOG_BLOCKED, NO_UPSTREAM);
+    } else if (q.qtype != A && q.qtype != AAAA && q.qtype != CNAME) {
+        // 本地只有地址与CNAME记录，其他类型转发给DNS服务器
+        log_detailed("%s request", type_name(q.qtype));
+        resolve_remote(w, &q, buf, len, cli_addr);
+    } else {
+        // 如果找到且不为0.0.0.0，返回给客户端
+        log_detailed("Find local entry, send to client");
+        answer_local(w, &q, buf, record, &cli_addr);
+        w->stats.local_hits++;
+        w->batch_answers[LAT_LOCAL]++;
+        if (w->qlog)
+            qlog_append(w->qlog, w->batch_at, &cli_addr, q.name, q.name_len, q.qtype, 0, QLOG_LOCAL, NO_UPSTREAM);
+    }
+}
+
+/**
+ * @brief 用答复更新DNS服务器的RTT估计，按Karn算法，同一台服务器收到过多份请求时无法确定答复对应哪一份，不采样RTT
+ * @param w 工作线程
+ * @param s 请求的槽或取出的请求信息
+ * @param from 答复来自的DNS服务器或其他节点
+ */
+static void sample_rtt(worker_t *w, const pending_slot *s, const int from) {
+    int copies = 0, last = 0;
+    for (int i = 0; i < s->tries; i++) {
+        if (s->sent_to[i] == from) {
+            copies++;
+            last = i;
+        }
+    }
+    int i = from;
+    upstream_set *set = estimates_of(w, &i);
+    if (copies == 1)
+        upstream_answered(set, i, now_us() - s->sent_at - s->sent_off[last]);
+    else
+        upstream_ambiguous(set, i);
+}
+
+/**
+ * @brief 找出答复中的OPT记录并移到最后，应答没有OPT记录的请求时可直接去掉；其中的UDP载荷大小改为中继的
+ * @param msg 答复报文，原地修改
+ * @param len 报文长度
+ * @param q 答复的Question，填写EDNS字段
+ * @return OPT记录的长度，没有或报文不合法时返回0
+ */
+static int move_opt_last(unsigned char *msg, const int len, question_t *q) {
+    if (((Header *) msg)->arcount == 0 || parse_edns(msg, len, q) < 0 || q->udp_size == 0) {
+        q->udp_size = 0;
+        return 0;
+    }
+    const int end = q->opt_off + q->opt_len;
+    if (end != len) {
+        unsigned char opt[MAX_PACKET_LEN];
+        if (q->opt_len > (int) sizeof(opt)) {
+            q->udp_size = 0;
+            return 0;
+        }
+        memcpy(opt, msg + q->opt_off, q->opt_len);
+        memmove(msg + q->opt_off, msg + end, len - end);
+        q->opt_off = len - q->opt_len;
+        memcpy(msg + q->opt_off, opt, q->opt_len);
+    }
+    msg[q->opt_off + 3] = args.edns_size >> 8;
+    msg[q->opt_off + 4] = (uint8_t) args.edns_size;
+    return q->opt_len;
+}
+
+/**
+ * @brief 把DNS服务器或其他节点的答复交给客户端与等待者并缓存，请求缓冲区放回池中
+ * @param w 工作线程
+ * @param q 答复的Question
+ * @param buf 答复报文，原地恢复客户端的id，发出前保持有效
+ * @param len 报文长度
+ * @param req 取出的请求信息
+ * @param from 答复来自的DNS服务器，或PEER_BASE加节点下标
+ */
+static void relay_answer(worker_t *w, question_t *q, unsigned char *buf, const int len, pending_slot *req,
+                         const int from) {
+    Header *head = (Header *) buf;
+    // 答复服务器失败时，缓存中有过期的答复则以它应答（RFC 8767），失败的答复不缓存，只是不再有客户端
+    if (head->rcode == 2 && req->stale == STALE_WAITING && serve_stale(w, req))
+        log_detailed("DNS server failed, answer with stale cache entry");
+    packet_put(&w->packets, req->query);
+    head->id = req->id;
+    const int opt_len = move_opt_last(buf, len, q);
+    // 按请求的CD与DO位缓存，与查找缓存时的键一致，不取决于DNS服务器是否在答复中回显
+    q->dnssec = req->dnssec;
+    // 其他节点的答复也缓存，之后同一域名的请求在本节点直接命中
+    cache_store(&w->cache, q, buf, len, now_ms());
+    const uint8_t path = from < PEER_BASE ? QLOG_UPSTREAM : QLOG_PEER;
+    const uint8_t target = (uint8_t) (from < PEER_BASE ? from : from - PEER_BASE);
+    // 后台刷新的请求没有客户端，答复只用于更新缓存；答复在接收缓冲区中，下一次接收前发出。
+    // 超过客户端可接收的长度时只发出截断的答复，完整的答复已缓存，客户端经TCP重新查询时直接命中
+    if (req->addr.sin_family != AF_UNSPEC) {
+        send_answer(w, buf, len, opt_len, q->end, &req->addr, req->id, buf + sizeof(Header), q->name_len,
+                    req->udp_size);
+        hist_add(&w->latency[LAT_UPSTREAM], now_us() - req->sent_at, 1);
+        if (w->qlog)
+            qlog_append(w->qlog, req->sent_at, &req->addr, q->name, q->name_len, q->qtype, head->rcode, path,
+                        target);
+    }
+    fan_out(w, buf, len, opt_len, q->end, req->waiters, req, QLOG_COALESCED, target);
+    if (from < PEER_BASE)
+        w->stats.responses++;
+    else
+        w->stats.peer_answers++;
+}
+
+/**
+ * @brief TCP连接的epoll事件数据：低32位是套接字，高32位是DNS服务器下标加1，与UDP套接字的事件区分
+ */
+static uint64_t tcp_event_data(const worker_t *w, const tcp_conn *c) {
+    return (uint64_t) (c - w->tcp + 1) << 32 | (uint32_t) c->fd;
+}
+
+/**
+ * @brief 更新TCP连接在epoll中关注的事件，有数据待写出或连接尚未建立时关注可写
+ * @param w 工作线程
+ * @param c 连接
+ * @param want_write 是否关注可写
+ */
+static void watch_tcp(worker_t *w, tcp_conn *c, const int want_write) {
+    if (c->want_write == want_write)
+        return;
+    struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0)};
+    ev.data.u64 = tcp_event_data(w, c);
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        perror("epoll_ctl failed");
+    c->want_write = (uint8_t) want_write;
+}
+
+/**
+ * @brief 关闭TCP连接，仍未答复的请求立即以截断的答复告知客户端
+ * @param w 工作线程
+ * @param c 连接
+ * @param backoff 再次连接前等待的毫秒数
+ */
+static void drop_tcp(worker_t *w, tcp_conn *c, const int backoff) {
+    if (c->connecting || c->outstanding > 0) {
+        log_brief("TCP connection to DNS server failed");
+        w->stats.tcp_failures++;
+        // 标记是槽下标与代数，已答复或已复用的槽代数不同，被跳过
+        const uint32_t cnt = c->tag_cnt < TCP_MAX_TAGS ? c->tag_cnt : TCP_MAX_TAGS;
+        for (uint32_t i = 0; i < cnt; i++) {
+            const uint32_t index = (uint32_t) (c->tags[i] >> 32), gen = (uint32_t) c->tags[i];
+            pending_slot *s = pending_get(&w->pending, index, gen);
+            if (s && s->tcp)
+                give_up(w, index, gen, s, true);
+        }
+        flush_queue(w, &w->client_q);
+    }
+    tcp_conn_close(c, backoff ? now_ms() + backoff : 0);
+}
+
+/**
+ * @brief 答复被截断时，把请求加入与该DNS服务器的TCP连接，连接不存在时先发起连接，本批处理完后一并写出
+ * @param w 工作线程
+ * @param u DNS服务器下标
+ * @param index 槽下标
+ * @param gen 槽的代数
+ * @param s 请求的槽
+ * @return 是否已加入，连接失败不久或待写出的数据已满时返回false
+ */
+static bool query_over_tcp(worker_t *w, const int u, const uint32_t index, const uint32_t gen,
+                           const pending_slot *s) {
+    tcp_conn *c = &w->tcp[u];
+    if (c->fd < 0) {
+        const uint64_t now = now_ms();
+        if (now < c->retry_at)
+            return false;
+        const int fd = tcp_conn_open(c, &args.upstreams[u]);
+        if (fd < 0) {
+            c->retry_at = now + TCP_RETRY_MS;
+            return false;
+        }
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT};
+        ev.data.u64 = tcp_event_data(w, c);
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            tcp_conn_close(c, now + TCP_RETRY_MS);
+            return false;
+        }
+        c->want_write = 1;
+        w->stats.tcp_connects++;
+    }
+    return tcp_conn_queue(c, s->query, s->query_len, (uint64_t) index << 32 | gen) == 0;
+}
+
+/**
+ * @brief 写出各TCP连接中本批加入的请求，多个请求合并为一次写
+ * @param w 工作线程
+ */
+static void flush_tcp(worker_t *w) {
+    for (int u = 0; u < args.upstream_cnt; u++) {
+        tcp_conn *c = &w->tcp[u];
+        if (c->fd < 0 || c->connecting || c->out_len == 0)
+            continue;
+        const int rest = tcp_conn_flush(c);
+        if (rest < 0)
+            drop_tcp(w, c, TCP_RETRY_MS);
+        else
+            watch_tcp(w, c, rest);
+    }
+}
+
+/**
+ * @brief 对消息进行分类处理，两类：1）本地请求，含其他节点代为查询的请求，2）DNS服务器或其他节点的答复
+ * @param w 工作线程
+ * @param fd 收到消息的套接字
+ * @param buf 消息缓冲区
+ * @param len 消息长度
+ * @param cli_addr 发送方地址
+ */
+static void message_classify(worker_t *w, const int fd, unsigned char *buf, const int len,
+                             const struct sockaddr_in cli_addr) {
+    // 分类处理
+    Header *head = (Header *) buf;
+    if (fd == w->udpfd) {
+        if (head->qr == 0) {
+            // 本地请求，交给handle_message处理
+            log_brief("Receive local request");
+            w->stats.received++;
+            if (head->z & CLUSTER_MARK)
+                w->stats.peer_requests++;
+            handle_message(w, buf, len, cli_addr);
+        }
+        return;
+    }
+    // 找到发送答复的DNS服务器或其他节点
+    const int from = find_target(&cli_addr);
+    question_t q;
+    if (head->qr == 0 || from < 0 || parse_question(buf, len, &q) < 0)
+        return;
+    // DNS服务器答复，转换id后返回给客户端
+    log_brief("Receive DNS server response, send to client");
+    int port = 0;
+    while (port < args.upstream_ports && w->upfds[port] != fd)
+        port++;
+    const uint32_t index = (uint32_t) port << 16 | ntohs(head->id);
+    if (head->tc && from >= PEER_BASE) {
+        // 其他节点的答复被截断，不经TCP向它重新查询，直接转发给DNS服务器；已改为转发时丢弃
+        uint32_t gen;
+        pending_slot *s = pending_match(&w->pending, index, &q, from, &gen);
+        if (s && s->rto_upstream == from) {
+            log_detailed("Truncated response from cluster peer, send to DNS server");
+            sample_rtt(w, s, from);
+            ask_upstream(w, index, s, now_us());
+        }
+        return;
+    }
+    if (head->tc && args.tcp) {
+        // 答复被截断，改经TCP向同一台服务器查询，取得完整的答复后再交给客户端并缓存；其他服务器随后的截断答复丢弃
+        uint32_t gen;
+        pending_slot *s = pending_match(&w->pending, index, &q, from, &gen);
+        if (s && s->tcp)
+            return;
+        if (s && query_over_tcp(w, from, index, gen, s)) {
+            log_detailed("Truncated response, retry over TCP");
+            sample_rtt(w, s, from);
+            s->tcp = 1;
+            s->rto_upstream = (uint8_t) from;
+            s->retry_at = s->deadline;
+            w->stats.tcp_queries++;
+            return;
+        }
+    }
+    // id变换，(端口,新id)->(id,addr)，来源与Question须与请求一致，对冲时先到的答复被采用
+    pending_slot req;
+    if (pending_complete(&w->pending, index, &q, from, &req)) {
+        sample_rtt(w, &req, from);
+        relay_answer(w, &q, buf, len, &req, from);
+    }
+}
+
+/**
+ * @brief 处理TCP连接上的一个答复：TCP的答复可乱序到达，按id与Question在各端口的槽中查找对应的请求
+ * @param w 工作线程
+ * @param u DNS服务器下标
+ * @param buf 答复报文
+ * @param len 报文长度
+ */
+static void tcp_answer(worker_t *w, const int u, unsigned char *buf, const int len) {
+    question_t q;
+    if (len < (int) sizeof(Header) || ((Header *) buf)->qr == 0 || parse_question(buf, len, &q) < 0)
+        return;
+    log_brief("Receive DNS server response over TCP, send to client");
+    const uint16_t id = ntohs(((Header *) buf)->id);
+    pending_slot req;
+    for (int port = 0; port < args.upstream_ports; port++) {
+        if (pending_complete(&w->pending, (uint32_t) port << 16 | id, &q, u, &req)) {
+            relay_answer(w, &q, buf, len, &req, u);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief 处理TCP连接的事件：确认连接建立、写出剩余的请求、读入并处理流水线上到达的全部答复
+ * @param w 工作线程
+ * @param u DNS服务器下标
+ * @param events epoll事件
+ */
+static void handle_tcp(worker_t *w, const int u, const uint32_t events) {
+    tcp_conn *c = &w->tcp[u];
+    if (c->connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        if (tcp_conn_connected(c) < 0) {
+            drop_tcp(w, c, TCP_RETRY_MS);
+            return;
+        }
+        log_detailed("TCP connection to DNS server established");
+    }
+    if (events & EPOLLOUT) {
+        const int rest = tcp_conn_flush(c);
+        if (rest < 0) {
+            drop_tcp(w, c, TCP_RETRY_MS);
+            return;
+        }
+        watch_tcp(w, c, rest);
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+    while (true) {
+        const int n = tcp_conn_read(c);
+        if (n <= 0) {
+            // DNS服务器关闭空闲连接是正常的（RFC 7766），下次需要时重新连接
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                drop_tcp(w, c, n == 0 && c->outstanding == 0 ? 0 : TCP_RETRY_MS);
+            break;
+        }
+        int len;
+        unsigned char *msg;
+        while ((msg = tcp_conn_next(c, &len)) != NULL)
+            tcp_answer(w, u, msg, len);
+        // 答复在读缓冲区中被直接引用，整理缓冲区前先发出
+        flush_queue(w, &w->client_q);
+        tcp_conn_compact(c);
+    }
+}
+
+/**
+ * @brief 用recvmmsg批量接收套接字上已到达的报文并逐个处理，处理产生的报文用sendmmsg批量发出
+ * @param w 工作线程
+ * @param fd 可读的套接字
+ */
+static void handle_readable(worker_t *w, const int fd) {
+    recv_batch *rx = &w->rx;
+    for (int round = 0; round < MAX_BATCHES_PER_EVENT; round++) {
+        for (int i = 0; i < args.batch; i++)
+            rx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        const int n = recvmmsg(fd, rx->msgs, args.batch, 0, NULL);
+        w->stats.recv_calls++;
+        w->batch_at = now_us();
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvmmsg failed");
+            break;
+        }
+        for (int k = 0; k < n; k++) {
+            unsigned char *buf = rx->iovs[k].iov_base;
+            const int recv_len = (int) rx->msgs[k].msg_len;
+            const struct sockaddr_in cli_addr = rx->addrs[k];
+            if (recv_len < (int) sizeof(Header))
+                continue; // 不足一个报文头，丢弃
+            // 解析均按报文长度检查边界，缓冲区无需清零
+            rx->current = k;
+            log_detailed("Receive message from %s:%d", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
+            if (args.debug_level == 2) {
+                log_detailed("Message details:");
+                for (int i = 0; i < recv_len; i++) {
+                    printf("%02x ", buf[i]);
+                    if ((i + 1) % 16 == 0)
+                        printf("\n");
+                }
+                printf("\n");
+            }
+            message_classify(w, fd, buf, recv_len, cli_addr);
+        }
+        // 下一次接收会覆盖缓冲区，先把本批产生的报文发出
+        flush_queue(w, &w->client_q);
+        for (int i = 0; i < args.upstream_ports; i++)
+            flush_queue(w, &w->server_q[i]);
+        flush_tcp(w);
+        // 本地与缓存应答在同一批内完成，每批只读一次时钟，按同一延迟计入直方图
+        if (w->batch_answers[LAT_LOCAL] + w->batch_answers[LAT_CACHE] > 0) {
+            const uint64_t latency = now_us() - w->batch_at;
+            for (int i = LAT_LOCAL; i <= LAT_CACHE; i++) {
+                hist_add(&w->latency[i], latency, w->batch_answers[i]);
+                w->batch_answers[i] = 0;
+            }
+        }
+        if (n < args.batch)
+            break;
+    }
+}
+
+/**
+ * @brief 工作线程的事件循环：客户端请求、DNS服务器答复、请求超时均作为epoll事件处理
+ * @param arg 工作线程
+ */
+static void *worker_loop(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        // 阻塞期间不持有本地记录表的引用，重新加载时无需等待空闲的线程
+        atomic_store(&w->epoch, 0);
+        const int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+        atomic_store(&w->epoch, atomic_load(&global_epoch));
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait failed");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+            const int tcp = (int) (events[i].data.u64 >> 32);
+            if (tcp) {
+                // 本轮中已关闭的连接的事件不再处理
+                if (w->tcp[tcp - 1].fd == fd)
+                    handle_tcp(w, tcp - 1, events[i].events); // 经TCP到达的DNS服务器答复
+            } else if (fd == w->timerfd) {
+                handle_timeout(w);
+            } else if (fd == stopfd) {
+                return NULL;
+            } else {
+                handle_readable(w, fd); // 客户端请求或DNS服务器答复
+            }
+        }
+    }
+}
+
+/**
+ * @brief 将工作线程绑定到指定的CPU核心
+ * @param w 工作线程
+ */
+static void pin_worker(const worker_t *w) {
+    const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->index % ncpu, &set);
+    if (pthread_setaffinity_np(w->tid, sizeof(set), &set))
+        log_always("Failed to pin worker %d", w->index);
+}
+
+static const char *latency_paths[LAT_KINDS] = {"local", "cache", "upstream"};
+
+/**
+ * @brief 打印各工作线程的统计信息
+ */
+static void print_stats() {
+    for (int i = 0; i < args.workers; i++) {
+        const stats_t *s = &workers[i]->stats;
+        log_always("Worker %d: received %lu, local %lu, cached %lu, blocked %lu, forwarded %lu, responses %lu, "
+                   "timeouts %lu, overflows %lu, coalesced %lu, waiter overflows %lu, refreshes %lu, stale %lu", i,
+                   s->received, s->local_hits, s->cache_hits, s->blocked, s->forwarded, s->responses, s->timeouts,
+                   s->overflows, s->coalesced, s->waiter_overflows, s->refreshes, s->stale_answers);
+        // 每个客户端请求平均消耗的收发系统调用，包括转发与接收DNS服务器答复
+        log_always("Worker %d: recv calls %lu, send calls %lu, send drops %lu, syscalls/query %.3f, hedges %lu, "
+                   "retransmits %lu", i, s->recv_calls, s->send_calls, s->send_drops,
+                   s->received ? (double) (s->recv_calls + s->send_calls) / s->received : 0.0, s->hedges,
+                   s->retransmits);
+        log_always("Worker %d: packet buffers %u, free %u, exhausted %lu", i, workers[i]->packets.cap,
+                   workers[i]->packets.free_cnt, s->pool_exhausted);
+        log_always("Worker %d: tcp queries %lu, tcp connects %lu, tcp failures %lu", i, s->tcp_queries,
+                   s->tcp_connects, s->tcp_failures);
+        if (args.shared_cache)
+            log_always("Worker %d: shared cache hits %lu", i, s->shared_hits);
+        if (args.peer_cnt > 0)
+            log_always("Worker %d: peer queries %lu, peer answers %lu, peer failures %lu, peer requests %lu", i,
+                       s->peer_queries, s->peer_answers, s->peer_failures, s->peer_requests);
+        for (int j = 0; j < args.peer_cnt; j++) {
+            const upstream_t *u = &workers[i]->peers.up[j];
+            log_always("Worker %d: peer %s:%d, sent %lu, answered %lu, lost %lu, srtt %.3f ms", i,
+                       inet_ntoa(args.peers[j].sin_addr), ntohs(args.peers[j].sin_port), u->sent, u->answered,
+                       u->lost, u->srtt / 1000);
+        }
+        for (int j = 0; j < args.upstream_cnt; j++) {
+            const upstream_t *u = &workers[i]->upstreams.up[j];
+            log_always("Worker %d: server %s:%d, sent %lu, answered %lu, lost %lu, srtt %.3f ms, rto %.3f ms, "
+                       "loss %.1f%%", i, inet_ntoa(args.upstreams[j].sin_addr), ntohs(args.upstreams[j].sin_port),
+                       u->sent, u->answered, u->lost, u->srtt / 1000,
+                       (double) upstream_rto(&workers[i]->upstreams, j) / 1000, u->loss * 100);
+        }
+        for (int k = 0; k < LAT_KINDS; k++) {
+            const latency_hist *h = &workers[i]->latency[k];
+            if (h->total > 0)
+                log_always("Worker %d: %s latency p50 %lu us, p99 %lu us, p99.9 %lu us, mean %.1f us", i,
+                           latency_paths[k], hist_quantile(h, 0.5), hist_quantile(h, 0.99), hist_quantile(h, 0.999),
+                           (double) h->sum / h->total);
+        }
+    }
+}
+
+typedef struct {
+    const char *name; // 指标名
+    const char *help; // 说明
+    size_t off; // 在stats_t中的偏移
+} counter_desc; // 由stats_t导出的计数器
+
+static const counter_desc counters[] = {
+    {"dnsrelay_queries_total", "Client queries received.", offsetof(stats_t, received)},
+    {"dnsrelay_local_answers_total", "Queries answered from local records.", offsetof(stats_t, local_hits)},
+    {"dnsrelay_cache_answers_total", "Queries answered from the cache.", offsetof(stats_t, cache_hits)},
+    {"dnsrelay_shared_cache_answers_total", "Cache answers taken from the shared-memory cache.",
+     offsetof(stats_t, shared_hits)},
+    {"dnsrelay_blocked_total", "Queries refused by a 0.0.0.0 record.", offsetof(stats_t, blocked)},
+    {"dnsrelay_forwarded_total", "Queries forwarded to a DNS server.", offsetof(stats_t, forwarded)},
+    {"dnsrelay_upstream_responses_total", "DNS server answers relayed to clients.", offsetof(stats_t, responses)},
+    {"dnsrelay_upstream_timeouts_total", "Queries answered with SERVFAIL after the final timeout.",
+     offsetof(stats_t, timeouts)},
+    {"dnsrelay_overflows_total", "Queries dropped because the pending table was full.", offsetof(stats_t, overflows)},
+    {"dnsrelay_coalesced_total", "Queries merged into an identical in-flight query.", offsetof(stats_t, coalesced)},
+    {"dnsrelay_waiter_overflows_total", "Queries dropped because too many clients were waiting for the same query.",
+     offsetof(stats_t, waiter_overflows)},
+    {"dnsrelay_refreshes_total", "Background cache refreshes.", offsetof(stats_t, refreshes)},
+    {"dnsrelay_stale_answers_total", "Queries answered with an expired cache entry because the DNS server failed.",
+     offsetof(stats_t, stale_answers)},
+    {"dnsrelay_hedges_total", "Hedged queries sent.", offsetof(stats_t, hedges)},
+    {"dnsrelay_retransmits_total", "Retransmitted queries.", offsetof(stats_t, retransmits)},
+    {"dnsrelay_recv_calls_total", "Receive syscalls.", offsetof(stats_t, recv_calls)},
+    {"dnsrelay_send_calls_total", "Send syscalls.", offsetof(stats_t, send_calls)},
+    {"dnsrelay_send_drops_total", "Datagrams dropped because the send buffer was full.", offsetof(stats_t, send_drops)},
+    {"dnsrelay_packet_pool_exhausted_total", "Queries dropped because no packet buffer was free.",
+     offsetof(stats_t, pool_exhausted)},
+    {"dnsrelay_tcp_queries_total", "Truncated answers re-queried over TCP.", offsetof(stats_t, tcp_queries)},
+    {"dnsrelay_tcp_connects_total", "TCP connections opened to DNS servers.", offsetof(stats_t, tcp_connects)},
+    {"dnsrelay_tcp_failures_total", "TCP connections that failed or closed with queries outstanding.",
+     offsetof(stats_t, tcp_failures)},
+    {"dnsrelay_peer_queries_total", "Cache misses sent to the cluster node owning the name.",
+     offsetof(stats_t, peer_queries)},
+    {"dnsrelay_peer_answers_total", "Cluster node answers relayed to clients.", offsetof(stats_t, peer_answers)},
+    {"dnsrelay_peer_failures_total", "Queries sent upstream after the owning node failed to answer.",
+     offsetof(stats_t, peer_failures)},
+    {"dnsrelay_peer_requests_total", "Queries received from other cluster nodes.", offsetof(stats_t, peer_requests)},
+};
+
+// Prometheus直方图的桶上界，微秒
+static const uint64_t latency_bounds[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                          100000, 250000, 500000, 1000000, 2500000};
+
+/**
+ * @brief 读取其他线程写的计数，只需读到某个时刻的值，不要求与其他计数一致
+ */
+static uint64_t read_counter(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 汇总各工作线程的计数与直方图，以Prometheus文本格式输出，在指标服务线程中调用
+ * @param out 输出
+ */
+static void write_metrics(FILE *out) {
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        uint64_t sum = 0;
+        for (int i = 0; i < args.workers; i++)
+            sum += read_counter((const uint64_t *) ((const char *) &workers[i]->stats + counters[c].off));
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counters[c].name, counters[c].help,
+                counters[c].name, counters[c].name, sum);
+    }
+    // 各DNS服务器的计数与平滑RTT，RTT取有样本的线程的平均
+    static const struct {
+        const char *name, *help;
+        size_t off;
+    } per_server[] = {
+        {"dnsrelay_upstream_sent_total", "Queries sent to each DNS server, including retries and hedges.",
+         offsetof(upstream_t, sent)},
+        {"dnsrelay_upstream_answered_total", "Queries each DNS server answered first.", offsetof(upstream_t, answered)},
+        {"dnsrelay_upstream_lost_total", "Queries to each DNS server not answered in time.", offsetof(upstream_t, lost)},
+    };
+    char labels[MAX_UPSTREAMS][INET_ADDRSTRLEN + 8];
+    for (int j = 0; j < args.upstream_cnt; j++) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &args.upstreams[j].sin_addr, ip, sizeof(ip));
+        snprintf(labels[j], sizeof(labels[j]), "%s:%d", ip, ntohs(args.upstreams[j].sin_port));
+    }
+    for (size_t c = 0; c < sizeof(per_server) / sizeof(per_server[0]); c++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", per_server[c].name, per_server[c].help, per_server[c].name);
+        for (int j = 0; j < args.upstream_cnt; j++) {
+            uint64_t sum = 0;
+            for (int i = 0; i < args.workers; i++)
+                sum += read_counter((const uint64_t *) ((const char *) &workers[i]->upstreams.up[j] + per_server[c].off));
+            fprintf(out, "%s{server=\"%s\"} %lu\n", per_server[c].name, labels[j], sum);
+        }
+    }
+    fprintf(out, "# HELP dnsrelay_upstream_srtt_seconds Smoothed RTT of each DNS server.\n"
+                 "# TYPE dnsrelay_upstream_srtt_seconds gauge\n");
+    for (int j = 0; j < args.upstream_cnt; j++) {
+        double srtt = 0;
+        int n = 0;
+        for (int i = 0; i < args.workers; i++) {
+            const double v = workers[i]->upstreams.up[j].srtt;
+            if (v > 0) {
+                srtt += v;
+                n++;
+            }
+        }
+        fprintf(out, "dnsrelay_upstream_srtt_seconds{server=\"%s\"} %g\n", labels[j], n ? srtt / n / 1e6 : 0);
+    }
+    uint64_t in_use = 0;
+    for (int i = 0; i < args.workers; i++)
+        in_use += workers[i]->packets.cap - __atomic_load_n(&workers[i]->packets.free_cnt, __ATOMIC_RELAXED);
+    fprintf(out, "# HELP dnsrelay_packet_buffers_in_use Packet buffers held by receive queues and pending queries.\n"
+                 "# TYPE dnsrelay_packet_buffers_in_use gauge\ndnsrelay_packet_buffers_in_use %lu\n", in_use);
+    // 合并各线程的直方图，再折算为Prometheus的累积桶
+    fprintf(out, "# HELP dnsrelay_response_latency_seconds Time from receiving a query to queueing its answer.\n"
+                 "# TYPE dnsrelay_response_latency_seconds histogram\n");
+    for (int k = 0; k < LAT_KINDS; k++) {
+        static latency_hist merged;
+        memset(&merged, 0, sizeof(merged));
+        for (int i = 0; i < args.workers; i++)
+            hist_merge(&merged, &workers[i]->latency[k]);
+        const int bound_cnt = sizeof(latency_bounds) / sizeof(latency_bounds[0]);
+        uint64_t cumulative = 0;
+        int bucket = 0;
+        for (int b = 0; b < bound_cnt; b++) {
+            while (bucket < HIST_BUCKETS && hist_upper(bucket) <= latency_bounds[b])
+                cumulative += merged.counts[bucket++];
+            fprintf(out, "dnsrelay_response_latency_seconds_bucket{path=\"%s\",le=\"%g\"} %lu\n", latency_paths[k],
+                    (double) latency_bounds[b] / 1e6, cumulative);
+        }
+        uint64_t total = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++)
+            total += merged.counts[i];
+        fprintf(out, "dnsrelay_response_latency_seconds_bucket{path=\"%s\",le=\"+Inf\"} %lu\n"
+                     "dnsrelay_response_latency_seconds_sum{path=\"%s\"} %g\n"
+                     "dnsrelay_response_latency_seconds_count{path=\"%s\"} %lu\n",
+                latency_paths[k], total, latency_paths[k], (double) merged.sum / 1e6, latency_paths[k], total);
+    }
+}
+
+/**
+ * @brief 等待所有工作线程都不再引用替换前的本地记录表（RCU的宽限期）
+ *
+ * 替换记录表后递增全局纪元，工作线程每轮事件处理开始时记录看到的纪元、阻塞前清零。
+ * 某线程的纪元为0或不小于新纪元，说明它之后的查找只会看到新表。
+ */
+static void synchronize_workers() {
+    const uint64_t epoch = atomic_fetch_add(&global_epoch, 1) + 1;
+    for (int i = 0; i < args.workers; i++) {
+        uint64_t seen;
+        while ((seen = atomic_load(&workers[i]->epoch)) != 0 && seen < epoch)
+            usleep(1000);
+    }
+}
+
+/**
+ * @brief 重新加载本地文件，旧表在宽限期结束后释放，工作线程全程不加锁、不暂停
+ */
+static void reload() {
+    table_t *old = reload_file();
+    if (old) {
+        synchronize_workers();
+        table_free(old);
+    }
+}
+
+/**
+ * @brief 主处理函数，启动工作线程，主线程等待信号
+ */
+void main_process() {
+    // 工作线程不处理信号，统一由主线程等待
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    qlog_start();
+    if (args.metrics_socket && metrics_start(args.metrics_socket, write_metrics) < 0)
+        exit(-1);
+    for (int i = 0; i < args.workers; i++) {
+        if (pthread_create(&workers[i]->tid, NULL, worker_loop, workers[i])) {
+            perror("pthread_create failed");
+            exit(-1);
+        }
+        if (args.workers > 1)
+            pin_worker(workers[i]);
+    }
+    log_always("DNS relay is running with %d worker(s)...", args.workers);
+    int sig;
+    // SIGHUP重新加载本地文件，SIGINT与SIGTERM退出
+    while (sigwait(&set, &sig) == 0 && sig == SIGHUP)
+        reload();
+    metrics_stop();
+    // 通知所有工作线程退出
+    const uint64_t one = 1;
+    if (write(stopfd, &one, sizeof(one)) < 0)
+        perror("write eventfd failed");
+    for (int i = 0; i < args.workers; i++)
+        pthread_join(workers[i]->tid, NULL);
+    qlog_stop();
+    print_stats();
+}
@@ -0,0 +1,26 @@
+/**
+ * @file packet_pool.c
+ * @brief 报文缓冲区池
+ */
+#include "../include/packet_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief 一次分配全部缓冲区，内存页在首次使用时才真正占用
+ * @param p 缓冲区池
+ * @param count 缓冲区数
+ */
+void packet_pool_init(packet_pool *p, const uint32_t count) {
+    p->base = aligned_alloc(64, (size_t) count * MAX_PACKET_LEN);
+    p->free = malloc(count * sizeof(unsigned char *));
+    if (!p->base || !p->free) {
+        perror("malloc failed");
+        exit(-1);
+    }
+    // 低地址的缓冲区在栈顶，先被取出
+    for (uint32_t i = 0; i < count; i++)
+        p->free[i] = p->base + (size_t) (count - 1 - i) * MAX_PACKET_LEN;
+    p->free_cnt = count;
+    p->cap = count;
+}
@@ -0,0 +1,199 @@
+/**
+ * @file querylog.c
+ * @brief 二进制查询日志：工作线程只把定长记录写入自己的环形缓冲区，格式化与写文件都交给后台写线程
+ */
+#include "../include/querylog.h"
+#include "../include/logs.h"
+#include "../include/timer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int log_fd = -1; // 查询日志文件
+static qlog_ring **rings; // 各工作线程的环形缓冲区
+static int ring_cnt;
+static pthread_t writer;
+static _Atomic int running; // 写线程是否继续运行
+
+/**
+ * @brief 打开查询日志文件，文件为空时写入文件头，并为每个工作线程分配环形缓冲区
+ * @param path 文件路径
+ * @param workers 工作线程数
+ * @return 成功返回0
+ */
+int qlog_open(const char *path, const int workers) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    struct stat st;
+    if (log_fd < 0 || fstat(log_fd, &st) < 0) {
+        perror("open query log failed");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        qlog_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, QLOG_MAGIC, sizeof(h.magic));
+        h.version = QLOG_VERSION;
+        h.record_size = sizeof(qlog_record);
+        if (write(log_fd, &h, sizeof(h)) != sizeof(h)) {
+            perror("write query log failed");
+            return -1;
+        }
+    }
+    rings = calloc(workers, sizeof(qlog_ring *));
+    if (!rings) {
+        perror("calloc failed");
+        return -1;
+    }
+    for (int i = 0; i < workers; i++) {
+        rings[i] = aligned_alloc(64, sizeof(qlog_ring));
+        if (!rings[i]) {
+            perror("aligned_alloc failed");
+            return -1;
+        }
+        atomic_init(&rings[i]->head, 0);
+        atomic_init(&rings[i]->tail, 0);
+        atomic_init(&rings[i]->dropped, 0);
+        rings[i]->worker = i;
+    }
+    ring_cnt = workers;
+    return 0;
+}
+
+/**
+ * @brief 工作线程的环形缓冲区
+ * @param worker 工作线程编号
+ * @return 环形缓冲区，未开启查询日志时返回NULL
+ */
+qlog_ring *qlog_ring_of(const int worker) {
+    return rings ? rings[worker] : NULL;
+}
+
+/**
+ * @brief 追加一条记录，环满时丢弃并计数，工作线程从不等待写线程
+ * @param r 环形缓冲区
+ * @param arrived 收到请求时的单调时钟微秒数
+ * @param client 客户端地址
+ * @param name 线上格式的域名
+ * @param name_len 域名长度，含结尾的0
+ * @param qtype 请求类型
+ * @param rcode 答复的RCODE
+ * @param path 答复的来源
+ * @param upstream 答复的DNS服务器下标
+ */
+void qlog_append(qlog_ring *r, const uint64_t arrived, const struct sockaddr_in *client, const unsigned char *name,
+                 const int name_len, const uint16_t qtype, const uint8_t rcode, const uint8_t path,
+                 const uint8_t upstream) {
+    const uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == QLOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    qlog_record *rec = &r->slots[head & (QLOG_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const uint64_t latency = now_us() - arrived;
+    rec->time_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - latency;
+    rec->latency_us = latency > UINT32_MAX ? UINT32_MAX : (uint32_t) latency;
+    rec->client_addr = client->sin_addr.s_addr;
+    rec->client_port = client->sin_port;
+    rec->qtype = qtype;
+    rec->rcode = rcode;
+    rec->path = path;
+    rec->worker = (uint8_t) r->worker;
+    rec->upstream = upstream;
+    rec->name_len = (uint8_t) name_len;
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+    memcpy(rec->name, name, name_len < QLOG_NAME_LEN ? name_len : QLOG_NAME_LEN);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief 把环形缓冲区中已写入的记录直接写入文件
+ * @param r 环形缓冲区
+ * @return 写出的记录数
+ */
+static uint64_t drain(qlog_ring *r) {
+    const uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    const uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head == tail)
+        return 0;
+    // 只写到环的末尾，绕回的部分下一轮再写
+    const uint64_t start = tail & (QLOG_RING_SIZE - 1);
+    const uint64_t n = head - tail < QLOG_RING_SIZE - start ? head - tail : QLOG_RING_SIZE - start;
+    const char *p = (const char *) &r->slots[start];
+    size_t left = n * sizeof(qlog_record);
+    while (left > 0) {
+        const ssize_t w = write(log_fd, p, left);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write query log failed");
+            break; // 写失败的记录丢弃，不阻塞工作线程
+        }
+        p += w;
+        left -= w;
+    }
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    return n;
+}
+
+/**
+ * @brief 写线程：轮流清空各环形缓冲区，都为空时等待一会
+ */
+static void *writer_loop(void *arg) {
+    (void) arg;
+    while (atomic_load(&running)) {
+        uint64_t written = 0;
+        for (int i = 0; i < ring_cnt; i++)
+            written += drain(rings[i]);
+        if (written == 0) {
+            const struct timespec ts = {0, QLOG_FLUSH_MS * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+    // 工作线程已退出，写出剩余的记录
+    for (int i = 0; i < ring_cnt; i++) {
+        while (drain(rings[i]) > 0) {
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 启动写线程，未开启查询日志时什么也不做
+ */
+void qlog_start() {
+    if (!rings)
+        return;
+    atomic_store(&running, 1);
+    if (pthread_create(&writer, NULL, writer_loop, NULL)) {
+        perror("pthread_create failed");
+        exit(-1);
+    }
+}
+
+/**
+ * @brief 停止写线程并关闭文件，须在工作线程退出后调用
+ */
+void qlog_stop() {
+    if (!rings)
+        return;
+    atomic_store(&running, 0);
+    pthread_join(writer, NULL);
+    for (int i = 0; i < ring_cnt; i++) {
+        const uint64_t dropped = atomic_load(&rings[i]->dropped);
+        if (dropped > 0)
+            log_always("Worker %d: %lu query log records dropped", i, dropped);
+        free(rings[i]);
+    }
+    free(rings);
+    rings = NULL;
+    if (close(log_fd) < 0)
+        perror("close query log failed");
+}
@@ -0,0 +1,225 @@
+/**
+ * @file shm_cache.c
+ * @brief 共享内存答复缓存：每个槽一个顺序锁，写者用CAS把序号改为奇数并写入加锁时间后独占该槽，写完再用CAS加1；
+ *        读者在序号前后两次读到相同的偶数时，读到的内容才是完整的，否则重试或视为未命中；
+ *        写者在持有槽时异常退出会使序号停在奇数，加锁超过SHM_STUCK_MS后下一个写者把序号加2接管该槽，
+ *        被接管的写者若仍在运行，发布时CAS失败，放弃这次写入
+ */
+#include "../include/shm_cache.h"
+#include "../include/logs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief 桶中的第way个槽
+ */
+static shm_slot *slot_at(const shm_cache *c, const uint32_t hash, const int way) {
+    return (shm_slot *) (c->slots + ((hash & c->mask) * SHM_WAYS + way) * SHM_SLOT_SIZE);
+}
+
+/**
+ * @brief 顺序锁中的序号
+ */
+static uint32_t lock_seq(const uint64_t lock) {
+    return (uint32_t) lock;
+}
+
+/**
+ * @brief 槽中的答复是否与Question相同，读者调用时结果须经顺序锁确认
+ */
+static int same_key(const shm_slot *s, const question_t *q, const uint32_t hash) {
+    return s->hash == hash && s->qtype == q->qtype && s->qclass == q->qclass && s->dnssec == q->dnssec &&
+           s->name_len == q->name_len && memcmp(s->data, q->name, q->name_len) == 0;
+}
+
+/**
+ * @brief 打开共享内存缓存，不存在时按指定大小创建；已存在时沿用其大小，布局不一致时拒绝使用
+ * @param c 缓存
+ * @param name 共享内存的名称，可省略开头的/
+ * @param size 创建时的大小，单位字节，槽占用的部分取不超过它的最多的2的幂个桶
+ * @return 成功返回0
+ */
+int shm_cache_open(shm_cache *c, const char *name, const size_t size) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    const int created = fd >= 0;
+    if (!created && errno == EEXIST)
+        fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_open failed");
+        return -1;
+    }
+    uint64_t buckets = 1;
+    size_t total;
+    if (created) {
+        while (buckets * 2 * SHM_WAYS * SHM_SLOT_SIZE <= size)
+            buckets *= 2;
+        total = SHM_HEADER_LEN + buckets * SHM_WAYS * SHM_SLOT_SIZE;
+        // 新增的部分由内核填0，所有槽的序号为0，即空槽
+        if (ftruncate(fd, (off_t) total) < 0) {
+            perror("ftruncate failed");
+            close(fd);
+            shm_unlink(path);
+            return -1;
+        }
+    } else {
+        // 其他进程刚创建时可能还没设置大小
+        struct stat st;
+        for (int i = 0;; i++) {
+            if (fstat(fd, &st) < 0) {
+                perror("fstat failed");
+                close(fd);
+                return -1;
+            }
+            if (st.st_size >= SHM_HEADER_LEN)
+                break;
+            if (i == SHM_WAIT_MS) {
+                log_always("Shared cache %s is not initialized", path);
+                close(fd);
+                return -1;
+            }
+            usleep(1000);
+        }
+        total = (size_t) st.st_size;
+    }
+    void *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap failed");
+        return -1;
+    }
+    shm_header *h = base;
+    if (created) {
+        h->version = SHM_VERSION;
+        h->slot_size = SHM_SLOT_SIZE;
+        h->ways = SHM_WAYS;
+        h->buckets = buckets;
+        atomic_store_explicit(&h->magic, SHM_MAGIC, memory_order_release);
+    } else {
+        for (int i = 0; i < SHM_WAIT_MS && atomic_load_explicit(&h->magic, memory_order_acquire) == 0; i++)
+            usleep(1000);
+        buckets = h->buckets;
+        if (atomic_load_explicit(&h->magic, memory_order_acquire) != SHM_MAGIC || h->version != SHM_VERSION ||
+            h->slot_size != SHM_SLOT_SIZE || h->ways != SHM_WAYS || buckets == 0 || (buckets & (buckets - 1)) ||
+            SHM_HEADER_LEN + buckets * SHM_WAYS * SHM_SLOT_SIZE > total) {
+            log_always("Incompatible shared cache %s, remove it or use another name", path);
+            munmap(base, total);
+            return -1;
+        }
+    }
+    c->header = h;
+    c->slots = (unsigned char *) base + SHM_HEADER_LEN;
+    c->mask = buckets - 1;
+    c->size = total;
+    log_always("Shared cache %s %s: %lu slots, %zu MB", path, created ? "created" : "attached",
+               buckets * SHM_WAYS, total >> 20);
+    return 0;
+}
+
+/**
+ * @brief 取出与Question匹配的答复，不加锁；读到正在写的槽时重试，仍读不到完整的内容时视为未命中
+ * @param c 缓存
+ * @param q 请求的Question
+ * @param hash (qname, qtype, qclass, dnssec)的哈希
+ * @param msg 输出答复报文，至少SHM_SLOT_SIZE字节
+ * @param e 输出答复的长度与时间
+ * @return 命中返回0，否则返回-1
+ */
+int shm_cache_get(const shm_cache *c, const question_t *q, const uint32_t hash, unsigned char *msg,
+                  shm_entry *e) {
+    const int cap = SHM_SLOT_SIZE - (int) sizeof(shm_slot) - q->name_len;
+    for (int way = 0; way < SHM_WAYS; way++) {
+        const shm_slot *s = slot_at(c, hash, way);
+        for (int t = 0; t < SHM_READ_TRIES; t++) {
+            const uint64_t lock = atomic_load_explicit(&s->lock, memory_order_acquire);
+            if (lock_seq(lock) == 0)
+                break;
+            if (lock_seq(lock) & 1)
+                continue;
+            // 先复制再确认，序号变了说明期间被改写，复制的内容作废
+            const int match = same_key(s, q, hash);
+            const int len = s->len;
+            if (match && len <= cap) {
+                memcpy(msg, s->data + q->name_len, len);
+                e->len = (uint16_t) len;
+                e->opt_len = s->opt_len;
+                e->stored = s->stored;
+                e->expire = s->expire;
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&s->lock, memory_order_relaxed) != lock)
+                continue;
+            if (!match)
+                break;
+            if (len <= cap && e->opt_len <= len)
+                return 0;
+            break;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 存入答复：替换同一Question的槽，否则用空槽，都没有时替换最早过期的槽；槽正被其他进程写时放弃，只是少缓存一次，
+ *        加锁已超过SHM_STUCK_MS时视为写者已异常退出，接管该槽；自己的锁写完前被接管时不发布
+ * @param c 缓存
+ * @param q 答复的Question
+ * @param hash (qname, qtype, qclass, dnssec)的哈希
+ * @param msg 答复报文，OPT记录如有则在最后
+ * @param e 答复的长度与时间，存入时间即当前时间
+ */
+void shm_cache_put(shm_cache *c, const question_t *q, const uint32_t hash, const unsigned char *msg,
+                   const shm_entry *e) {
+    if ((int) sizeof(shm_slot) + q->name_len + e->len > SHM_SLOT_SIZE)
+        return;
+    shm_slot *victim = NULL;
+    uint64_t victim_expire = 0;
+    for (int way = 0; way < SHM_WAYS; way++) {
+        shm_slot *s = slot_at(c, hash, way);
+        const uint32_t seq = lock_seq(atomic_load_explicit(&s->lock, memory_order_relaxed));
+        // 其他进程可能正在写，读到的字段只用于挑选槽，不要求一致
+        if (seq != 0 && same_key(s, q, hash)) {
+            victim = s;
+            break;
+        }
+        const uint64_t expire = seq == 0 ? 0 : s->expire;
+        if (!victim || expire < victim_expire) {
+            victim = s;
+            victim_expire = expire;
+        }
+    }
+    uint64_t lock = atomic_load_explicit(&victim->lock, memory_order_acquire);
+    const uint32_t seq = lock_seq(lock);
+    // 加锁时间与奇数序号在同一个字中，看到的总是当前持有者的；按32位回绕相减，加锁时间晚于当前时间时不算超时
+    if ((seq & 1) && (int32_t) ((uint32_t) e->stored - (uint32_t) (lock >> 32)) < SHM_STUCK_MS)
+        return;
+    // 接管时加2，序号仍为奇数，读者继续视其为正在写
+    const uint32_t locked_seq = seq + ((seq & 1) ? 2 : 1);
+    const uint64_t locked = (uint64_t) (uint32_t) e->stored << 32 | locked_seq;
+    if (!atomic_compare_exchange_strong_explicit(&victim->lock, &lock, locked, memory_order_acq_rel,
+                                                 memory_order_relaxed))
+        return;
+    atomic_thread_fence(memory_order_release);
+    victim->hash = hash;
+    victim->qtype = q->qtype;
+    victim->qclass = q->qclass;
+    victim->dnssec = q->dnssec;
+    victim->len = e->len;
+    victim->opt_len = e->opt_len;
+    victim->name_len = (uint8_t) q->name_len;
+    victim->stored = e->stored;
+    victim->expire = e->expire;
+    memcpy(victim->data, q->name, q->name_len);
+    memcpy(victim->data + q->name_len, msg, e->len);
+    ((Header *) (victim->data + q->name_len))->id = 0;
+    // 写的过程中被接管时锁已不是自己的，放弃这次写入，由接管者发布它写入的内容
+    uint64_t expected = locked;
+    atomic_compare_exchange_strong_explicit(&victim->lock, &expected, (uint64_t) (locked_seq + 1),
+                                            memory_order_release, memory_order_relaxed);
+}
@@ -0,0 +1,326 @@
+/**
+ * @file suffix_trie.c
+ * @brief 域名后缀规则的字典树：标签逆序插入，相同标签只存一份，子节点连续存放并排序，查找时二分
+ */
+#include "../include/suffix_trie.h"
+#include "../include/consts.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAP 1024
+
+typedef struct trie_rule {
+    uint32_t first; // 第一个标签偏移在label_offs中的下标
+    uint32_t seq; // 在文件中的顺序，后缀重复时保留先出现的规则
+    uint32_t value; // 规则的值
+    uint8_t n; // 标签数
+} trie_rule; // 构建时的一条规则
+
+/**
+ * @brief 按需扩大数组容量
+ * @return 成功返回0
+ */
+static int reserve(void **arr, uint32_t *cap, const uint32_t need, const size_t size) {
+    if (need <= *cap)
+        return 0;
+    uint32_t n = *cap ? *cap : INITIAL_CAP;
+    while (n < need)
+        n *= 2;
+    void *p = realloc(*arr, (size_t) n * size);
+    if (!p) {
+        perror("realloc failed");
+        return -1;
+    }
+    *arr = p;
+    *cap = n;
+    return 0;
+}
+
+/**
+ * @brief 初始化构建器
+ * @return 成功返回0
+ */
+int trie_builder_init(trie_builder *b) {
+    memset(b, 0, sizeof(trie_builder));
+    b->intern = calloc(INITIAL_CAP, sizeof(uint32_t));
+    b->intern_mask = INITIAL_CAP - 1;
+    // 偏移0留给根节点
+    if (!b->intern || reserve((void **) &b->labels, &b->labels_cap, 1, 1) < 0)
+        return -1;
+    b->labels[0] = 0;
+    b->labels_len = 1;
+    return 0;
+}
+
+/**
+ * @brief 释放构建器，未初始化完或已生成字典树的构建器也可以释放
+ */
+void trie_builder_free(trie_builder *b) {
+    free(b->labels);
+    free(b->rules);
+    free(b->label_offs);
+    free(b->intern);
+    memset(b, 0, sizeof(trie_builder));
+}
+
+/**
+ * @brief 比较两个标签，先比较长度再比较字节，查找时按同样的顺序二分
+ */
+static int label_cmp(const unsigned char *a, const uint8_t a_len, const unsigned char *b, const uint8_t b_len) {
+    if (a_len != b_len)
+        return a_len < b_len ? -1 : 1;
+    return memcmp(a, b, a_len);
+}
+
+/**
+ * @brief 将标签存入标签区，已存在时返回原有的偏移
+ * @return 标签偏移，失败返回0
+ */
+static uint32_t intern_label(trie_builder *b, const unsigned char *label, const uint8_t len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ label[i]) * 16777619u;
+    uint32_t i = h & b->intern_mask;
+    while (b->intern[i] != 0) {
+        const unsigned char *l = b->labels + b->intern[i] - 1;
+        if (label_cmp(l + 1, l[0], label, len) == 0)
+            return b->intern[i] - 1;
+        i = (i + 1) & b->intern_mask;
+    }
+    if (reserve((void **) &b->labels, &b->labels_cap, b->labels_len + len + 1, 1) < 0)
+        return 0;
+    const uint32_t off = b->labels_len;
+    b->labels[off] = len;
+    memcpy(b->labels + off + 1, label, len);
+    b->labels_len += len + 1;
+    b->intern[i] = off + 1;
+    // 装载因子超过1/2时扩容
+    if (++b->intern_cnt * 2 > b->intern_mask + 1) {
+        const uint32_t n = (b->intern_mask + 1) * 2;
+        uint32_t *intern = calloc(n, sizeof(uint32_t));
+        if (!intern) {
+            perror("calloc failed");
+            return 0;
+        }
+        for (uint32_t j = 0; j <= b->intern_mask; j++) {
+            if (b->intern[j] == 0)
+                continue;
+            const unsigned char *l = b->labels + b->intern[j] - 1;
+            uint32_t k = 2166136261u;
+            for (int m = 1; m <= l[0]; m++)
+                k = (k ^ l[m]) * 16777619u;
+            k &= n - 1;
+            while (intern[k] != 0)
+                k = (k + 1) & (n - 1);
+            intern[k] = b->intern[j];
+        }
+        free(b->intern);
+        b->intern = intern;
+        b->intern_mask = n - 1;
+    }
+    return off;
+}
+
+/**
+ * @brief 加入一条规则
+ * @param b 构建器
+ * @param suffix 后缀，不含开头的“*.”，如ads.example.com
+ * @param value 规则的值
+ * @return 成功返回0，后缀不合法返回-1，内存不足返回-2
+ */
+int trie_builder_add(trie_builder *b, const char *suffix, const uint32_t value) {
+    unsigned char name[MAX_NAME_LEN];
+    const unsigned char *labels[MAX_LABELS];
+    uint8_t lens[MAX_LABELS];
+    const size_t len = strlen(suffix);
+    if (len == 0 || len >= MAX_NAME_LEN)
+        return -1;
+    // 转为小写并切分标签
+    int n = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        name[i] = (unsigned char) tolower(suffix[i]);
+        if (suffix[i] != '.' && suffix[i] != '\0')
+            continue;
+        const size_t label_len = i - start;
+        if (label_len == 0 && suffix[i] == '\0' && n > 0)
+            break; // 末尾的点
+        if (label_len == 0 || label_len > 63 || n == MAX_LABELS)
+            return -1;
+        labels[n] = name + start;
+        lens[n++] = (uint8_t) label_len;
+        start = i + 1;
+    }
+    if (reserve((void **) &b->rules, &b->rule_cap, b->rule_cnt + 1, sizeof(trie_rule)) < 0 ||
+        reserve((void **) &b->label_offs, &b->label_offs_cap, b->label_offs_len + n, sizeof(uint32_t)) < 0)
+        return -2;
+    trie_rule *r = &b->rules[b->rule_cnt];
+    r->first = b->label_offs_len;
+    r->seq = b->rule_cnt;
+    r->value = value;
+    r->n = n;
+    // 逆序保存，从顶级域开始
+    for (int i = n - 1; i >= 0; i--) {
+        const uint32_t off = intern_label(b, labels[i], lens[i]);
+        if (off == 0)
+            return -2;
+        b->label_offs[b->label_offs_len++] = off;
+    }
+    b->rule_cnt++;
+    return 0;
+}
+
+/**
+ * @brief 比较两条规则的逆序标签序列，前缀相同时短的在前，完全相同时按文件中的顺序
+ */
+static int rule_cmp(const void *x, const void *y, void *arg) {
+    const trie_builder *b = arg;
+    const trie_rule *r1 = x, *r2 = y;
+    const int n = r1->n < r2->n ? r1->n : r2->n;
+    for (int i = 0; i < n; i++) {
+        const uint32_t o1 = b->label_offs[r1->first + i], o2 = b->label_offs[r2->first + i];
+        if (o1 == o2)
+            continue; // 标签已去重，偏移相同即标签相同
+        const unsigned char *l1 = b->labels + o1, *l2 = b->labels + o2;
+        return label_cmp(l1 + 1, l1[0], l2 + 1, l2[0]);
+    }
+    if (r1->n != r2->n)
+        return r1->n < r2->n ? -1 : 1;
+    return r1->seq < r2->seq ? -1 : r1->seq > r2->seq;
+}
+
+/**
+ * @brief 由已排序的一组规则生成某节点的子树，这组规则的前depth个标签都相同
+ * @param b 构建器
+ * @param trie 字典树
+ * @param lo 这组规则的起始下标
+ * @param hi 这组规则的结束下标
+ * @param depth 节点深度
+ * @param node 节点下标
+ */
+static void build_node(const trie_builder *b, suffix_trie *trie, uint32_t lo, const uint32_t hi, const int depth,
+                       const uint32_t node) {
+    // 恰好以该节点结尾的规则排在最前，取文件中最先出现的一条
+    if (lo < hi && b->rules[lo].n == depth) {
+        trie->nodes[node].has_rule = 1;
+        trie->nodes[node].value = b->rules[lo].value;
+        while (lo < hi && b->rules[lo].n == depth)
+            lo++;
+    }
+    // 其余规则按第depth个标签分组，每组对应一个子节点
+    uint32_t groups = 0;
+    for (uint32_t i = lo; i < hi; i++) {
+        if (i == lo || b->label_offs[b->rules[i].first + depth] != b->label_offs[b->rules[i - 1].first + depth])
+            groups++;
+    }
+    const uint32_t first = trie->node_cnt;
+    trie->nodes[node].first_child = first;
+    trie->nodes[node].child_cnt = groups;
+    trie->node_cnt += groups;
+    uint32_t child = first;
+    for (uint32_t i = lo; i < hi;) {
+        const uint32_t label = b->label_offs[b->rules[i].first + depth];
+        uint32_t j = i + 1;
+        while (j < hi && b->label_offs[b->rules[j].first + depth] == label)
+            j++;
+        memset(&trie->nodes[child], 0, sizeof(trie_node));
+        trie->nodes[child].label_off = label;
+        build_node(b, trie, i, j, depth + 1, child);
+        child++;
+        i = j;
+    }
+}
+
+/**
+ * @brief 生成字典树并释放构建器
+ * @param b 构建器
+ * @param trie 生成的字典树
+ * @return 成功返回0
+ */
+int trie_build(trie_builder *b, suffix_trie *trie) {
+    memset(trie, 0, sizeof(suffix_trie));
+    int ret = 0;
+    if (b->rule_cnt > 0) {
+        qsort_r(b->rules, b->rule_cnt, sizeof(trie_rule), rule_cmp, b);
+        // 节点数不超过标签总数加根节点
+        trie->nodes = malloc(((size_t) b->label_offs_len + 1) * sizeof(trie_node));
+        if (trie->nodes) {
+            memset(&trie->nodes[0], 0, sizeof(trie_node));
+            trie->node_cnt = 1;
+            build_node(b, trie, 0, b->rule_cnt, 0, 0);
+            trie_node *nodes = realloc(trie->nodes, (size_t) trie->node_cnt * sizeof(trie_node));
+            if (nodes)
+                trie->nodes = nodes;
+            trie->labels = b->labels;
+            trie->labels_len = b->labels_len;
+            b->labels = NULL;
+        } else {
+            perror("malloc failed");
+            ret = -1;
+        }
+    }
+    trie_builder_free(b);
+    return ret;
+}
+
+/**
+ * @brief 检查从文件映射的字典树：每个节点的标签在标签区内，子节点在节点数组内；规则的值由调用方检查
+ * @param trie 字典树，节点数为0时视为没有规则
+ * @return 合法返回1
+ */
+int trie_valid(const suffix_trie *trie) {
+    for (uint32_t i = 0; i < trie->node_cnt; i++) {
+        const trie_node *node = &trie->nodes[i];
+        if (node->label_off >= trie->labels_len ||
+            (uint64_t) node->label_off + 1 + trie->labels[node->label_off] > trie->labels_len ||
+            (uint64_t) node->first_child + node->child_cnt > trie->node_cnt)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief 查找最长的匹配规则，规则*.x只匹配x的子域名
+ * @param trie 字典树
+ * @param name 线上格式的域名，已转为小写
+ * @param label_offs 各标签的长度字节在name中的偏移，从左到右
+ * @param n 标签数
+ * @param value 匹配时输出规则的值
+ * @return 是否匹配
+ */
+int trie_lookup(const suffix_trie *trie, const unsigned char *name, const uint8_t *label_offs, const int n,
+                uint32_t *value) {
+    if (!trie->nodes)
+        return 0;
+    const trie_node *node = &trie->nodes[0];
+    int found = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        const unsigned char *label = name + label_offs[i];
+        // 在有序的子节点中二分查找
+        uint32_t lo = node->first_child, hi = lo + node->child_cnt;
+        const trie_node *next = NULL;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            const unsigned char *l = trie->labels + trie->nodes[mid].label_off;
+            const int c = label_cmp(l + 1, l[0], label + 1, label[0]);
+            if (c == 0) {
+                next = &trie->nodes[mid];
+                break;
+            }
+            if (c < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (!next)
+            break;
+        node = next;
+        if (node->has_rule && i > 0) {
+            *value = node->value;
+            found = 1;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,176 @@
+/**
+ * @file tcp_conn.c
+ * @brief 与DNS服务器的持久TCP连接，只负责建立连接、分帧与缓冲，事件注册与答复的处理由工作线程完成
+ */
+#include "../include/tcp_conn.h"
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * @brief 初始化为未连接，缓冲区在首次连接时才分配
+ * @param c 连接
+ */
+void tcp_conn_init(tcp_conn *c) {
+    memset(c, 0, sizeof(tcp_conn));
+    c->fd = -1;
+}
+
+/**
+ * @brief 发起非阻塞连接，连接建立前加入的报文先缓存，建立后一并写出
+ * @param c 连接
+ * @param addr DNS服务器地址
+ * @return 套接字，失败返回-1
+ */
+int tcp_conn_open(tcp_conn *c, const struct sockaddr_in *addr) {
+    if (!c->out && !(c->out = malloc(TCP_OUT_CAP))) {
+        perror("malloc failed");
+        return -1;
+    }
+    if (!c->in && !(c->in = malloc(TCP_IN_CAP))) {
+        perror("malloc failed");
+        return -1;
+    }
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    // 报文已在一批处理结束时合并写出，不需要Nagle算法再等待
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect failed");
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    c->connecting = 1;
+    c->out_len = c->in_len = c->in_off = 0;
+    c->outstanding = c->tag_cnt = 0;
+    return fd;
+}
+
+/**
+ * @brief 连接可写时确认非阻塞connect的结果
+ * @param c 连接
+ * @return 连接已建立返回0，失败返回-1
+ */
+int tcp_conn_connected(tcp_conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        return -1;
+    c->connecting = 0;
+    return 0;
+}
+
+/**
+ * @brief 把一个报文加上两字节长度后加入待写出的数据，不立即写出
+ * @param c 连接
+ * @param msg 报文
+ * @param len 报文长度
+ * @param tag 请求的标记，连接断开前可由tags取回
+ * @return 成功返回0，待写出的数据已满返回-1
+ */
+int tcp_conn_queue(tcp_conn *c, const unsigned char *msg, const int len, const uint64_t tag) {
+    if (c->out_len + 2 + len > TCP_OUT_CAP)
+        return -1;
+    c->out[c->out_len] = (unsigned char) (len >> 8);
+    c->out[c->out_len + 1] = (unsigned char) len;
+    memcpy(c->out + c->out_len + 2, msg, len);
+    c->out_len += 2 + len;
+    c->outstanding++;
+    c->tags[c->tag_cnt++ % TCP_MAX_TAGS] = tag;
+    return 0;
+}
+
+/**
+ * @brief 尽量写出待写出的数据，写不完的部分留到可写时再写
+ * @param c 连接
+ * @return 全部写出返回0，还有剩余返回1，连接出错返回-1
+ */
+int tcp_conn_flush(tcp_conn *c) {
+    if (c->connecting)
+        return c->out_len > 0;
+    uint32_t sent = 0;
+    while (sent < c->out_len) {
+        const ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    return c->out_len > 0;
+}
+
+/**
+ * @brief 读入已到达的数据，追加在未取出的数据之后
+ * @param c 连接
+ * @return 读入的字节数，对方关闭连接返回0，出错返回-1并设置errno
+ */
+int tcp_conn_read(tcp_conn *c) {
+    ssize_t n;
+    do {
+        n = recv(c->fd, c->in + c->in_len, TCP_IN_CAP - c->in_len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        c->in_len += n;
+    return (int) n;
+}
+
+/**
+ * @brief 取出下一个完整的报文，报文在下一次tcp_conn_compact之前保持有效，可原地修改
+ * @param c 连接
+ * @param len 输出报文长度
+ * @return 报文，数据不足一个报文时返回NULL
+ */
+unsigned char *tcp_conn_next(tcp_conn *c, int *len) {
+    const uint32_t avail = c->in_len - c->in_off;
+    if (avail < 2)
+        return NULL;
+    const int n = c->in[c->in_off] << 8 | c->in[c->in_off + 1];
+    if (avail < 2 + (uint32_t) n)
+        return NULL;
+    unsigned char *msg = c->in + c->in_off + 2;
+    c->in_off += 2 + n;
+    if (c->outstanding > 0)
+        c->outstanding--;
+    *len = n;
+    return msg;
+}
+
+/**
+ * @brief 丢弃已取出的报文，把不完整的报文移到缓冲区开头
+ * @param c 连接
+ */
+void tcp_conn_compact(tcp_conn *c) {
+    memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+    c->in_len -= c->in_off;
+    c->in_off = 0;
+}
+
+/**
+ * @brief 关闭连接，丢弃未写出与未取出的数据，缓冲区保留供重新连接使用
+ * @param c 连接
+ * @param retry_at 在此之前不再尝试连接，单调时钟毫秒数
+ */
+void tcp_conn_close(tcp_conn *c, const uint64_t retry_at) {
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->connecting = c->want_write = 0;
+    c->out_len = c->in_len = c->in_off = 0;
+    c->outstanding = c->tag_cnt = 0;
+    c->retry_at = retry_at;
+}
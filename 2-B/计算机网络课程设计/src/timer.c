@@ -0,0 +1,98 @@
+/**
+ * @file timer.c
+ * @brief 基于最小堆的定时器
+ */
+#include "../include/timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * @brief 获取当前单调时钟毫秒数
+ */
+uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 获取当前单调时钟微秒数，用于测量RTT
+ */
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 交换堆中两个条目
+ */
+static void swap(timer_entry *a, timer_entry *b) {
+    const timer_entry t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/**
+ * @brief 加入定时器
+ * @param h 定时器堆
+ * @param deadline 到期时间
+ * @param index 槽下标
+ * @param gen 槽的代数
+ */
+void timer_push(timer_heap *h, const uint64_t deadline, const uint32_t index, const uint32_t gen) {
+    if (h->size == h->capacity) {
+        // 堆满时容量翻倍
+        const uint32_t capacity = h->capacity ? h->capacity * 2 : 1024;
+        timer_entry *heap = realloc(h->heap, capacity * sizeof(timer_entry));
+        if (!heap) {
+            perror("realloc failed");
+            exit(-1);
+        }
+        h->heap = heap;
+        h->capacity = capacity;
+    }
+    // 上浮
+    uint32_t i = h->size++;
+    h->heap[i].deadline = deadline;
+    h->heap[i].index = index;
+    h->heap[i].gen = gen;
+    while (i > 0 && h->heap[(i - 1) / 2].deadline > h->heap[i].deadline) {
+        swap(&h->heap[(i - 1) / 2], &h->heap[i]);
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * @brief 最早到期的定时器
+ * @param h 定时器堆
+ * @return 堆顶条目，堆空时返回NULL
+ */
+const timer_entry *timer_top(const timer_heap *h) {
+    return h->size ? &h->heap[0] : NULL;
+}
+
+/**
+ * @brief 删除最早到期的定时器
+ * @param h 定时器堆
+ */
+void timer_pop(timer_heap *h) {
+    if (h->size == 0)
+        return;
+    h->heap[0] = h->heap[--h->size];
+    // 下沉
+    uint32_t i = 0;
+    for (;;) {
+        const uint32_t l = i * 2 + 1, r = i * 2 + 2;
+        uint32_t min = i;
+        if (l < h->size && h->heap[l].deadline < h->heap[min].deadline)
+            min = l;
+        if (r < h->size && h->heap[r].deadline < h->heap[min].deadline)
+            min = r;
+        if (min == i)
+            break;
+        swap(&h->heap[min], &h->heap[i]);
+        i = min;
+    }
+}
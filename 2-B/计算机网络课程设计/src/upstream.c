@@ -0,0 +1,175 @@
+/**
+ * @file upstream.c
+ * @brief 上游DNS服务器的选择：按RTT与丢包率估计预期耗时，取最小者；超过RTT的某个百分位仍未答复时向另一台服务器对冲；
+ * 重传超时按RFC 6298由SRTT与RTTVAR计算
+ */
+#include "../include/upstream.h"
+#include "../include/consts.h"
+#include <string.h>
+
+#define RTT_ALPHA 0.125 // RTT平均的权重，与TCP的SRTT相同
+#define RTT_BETA 0.25 // RTT平均偏差的权重，与TCP的RTTVAR相同
+#define LOSS_ALPHA 0.05 // 丢包率平均的权重
+#define EXPLORE_INTERVAL 64 // 每隔这么多次选择轮流探测一台服务器，保持估计的时效
+#define HIST_DECAY 1024 // 样本数达到该值时直方图减半
+#define MIN_HIST_SAMPLES 32 // 样本不足时使用默认的对冲等待时间
+#define DEFAULT_HEDGE_DELAY 200000 // 默认对冲等待时间，单位微秒
+#define BUCKET_BASE 64 // 第0个桶的上界，单位微秒
+
+/**
+ * @brief 初始化
+ * @param s 服务器集合
+ * @param cnt 服务器数
+ */
+void upstream_init(upstream_set *s, const int cnt) {
+    memset(s, 0, sizeof(upstream_set));
+    s->cnt = cnt;
+}
+
+/**
+ * @brief 预期耗时：平均RTT加上丢包时等待超时的代价
+ */
+static double expected_cost(const upstream_t *u) {
+    return u->srtt + u->loss * TIMEOUT * 1000000.0;
+}
+
+/**
+ * @brief 选择预期最快的服务器，尚无样本的服务器优先，每隔一段时间轮流探测一台
+ * @param s 服务器集合
+ * @param exclude 不选择的服务器，NO_UPSTREAM表示不排除
+ * @return 服务器下标，没有可选的服务器时返回NO_UPSTREAM
+ */
+int upstream_pick(upstream_set *s, const int exclude) {
+    const uint64_t n = s->picks++;
+    if (n % EXPLORE_INTERVAL == EXPLORE_INTERVAL - 1) {
+        const int i = (int) (n / EXPLORE_INTERVAL % s->cnt);
+        if (i != exclude)
+            return i;
+    }
+    int best = NO_UPSTREAM;
+    for (int i = 0; i < s->cnt; i++) {
+        if (i == exclude)
+            continue;
+        if (best == NO_UPSTREAM || expected_cost(&s->up[i]) < expected_cost(&s->up[best]))
+            best = i;
+    }
+    return best;
+}
+
+/**
+ * @brief RTT所在的桶，桶i的上界为BUCKET_BASE * 2^(i/2)
+ */
+static int bucket_of(const uint64_t rtt_us) {
+    int i = 0;
+    uint64_t bound = BUCKET_BASE;
+    while (i < RTT_BUCKETS - 1) {
+        if (rtt_us <= bound)
+            return i;
+        // 先乘根号2，再乘根号2，即为下一个2的幂
+        if (i % 2 == 0 && rtt_us <= bound * 1414 / 1000)
+            return i + 1;
+        bound *= 2;
+        i += 2;
+    }
+    return RTT_BUCKETS - 1;
+}
+
+/**
+ * @brief 桶的上界，单位微秒
+ */
+static uint64_t bucket_bound(const int i) {
+    const uint64_t bound = (uint64_t) BUCKET_BASE << (i / 2);
+    return i % 2 ? bound * 1414 / 1000 : bound;
+}
+
+/**
+ * @brief 记录一次答复
+ * @param s 服务器集合
+ * @param i 服务器下标
+ * @param rtt_us 从发出请求到收到答复的时间，单位微秒
+ */
+void upstream_answered(upstream_set *s, const int i, const uint64_t rtt_us) {
+    upstream_t *u = &s->up[i];
+    u->answered++;
+    const double r = (double) rtt_us;
+    if (u->srtt == 0) {
+        u->srtt = r;
+        u->rttvar = r / 2;
+    } else {
+        const double diff = u->srtt > r ? u->srtt - r : r - u->srtt;
+        u->rttvar += RTT_BETA * (diff - u->rttvar);
+        u->srtt += RTT_ALPHA * (r - u->srtt);
+    }
+    if (u->srtt == 0)
+        u->srtt = 1; // 0表示尚无样本
+    u->loss -= LOSS_ALPHA * u->loss;
+    u->hist[bucket_of(rtt_us)]++;
+    if (++u->samples >= HIST_DECAY) {
+        u->samples = 0;
+        for (int b = 0; b < RTT_BUCKETS; b++) {
+            u->hist[b] /= 2;
+            u->samples += u->hist[b];
+        }
+    }
+}
+
+/**
+ * @brief 记录一次答复，但请求重传过，无法确定答复对应哪一次发送，按Karn算法不更新RTT
+ * @param s 服务器集合
+ * @param i 服务器下标
+ */
+void upstream_ambiguous(upstream_set *s, const int i) {
+    upstream_t *u = &s->up[i];
+    u->answered++;
+    u->loss -= LOSS_ALPHA * u->loss;
+}
+
+/**
+ * @brief 记录一次超时
+ * @param s 服务器集合
+ * @param i 服务器下标
+ */
+void upstream_lost(upstream_set *s, const int i) {
+    upstream_t *u = &s->up[i];
+    u->lost++;
+    u->loss += LOSS_ALPHA * (1 - u->loss);
+}
+
+/**
+ * @brief 对冲请求的等待时间：该服务器RTT的指定百分位
+ * @param s 服务器集合
+ * @param i 服务器下标
+ * @param percentile 百分位，1-99
+ * @return 等待时间，单位微秒
+ */
+uint64_t upstream_hedge_delay(const upstream_set *s, const int i, const int percentile) {
+    const upstream_t *u = &s->up[i];
+    if (u->samples < MIN_HIST_SAMPLES)
+        return DEFAULT_HEDGE_DELAY;
+    const uint64_t target = ((uint64_t) u->samples * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < RTT_BUCKETS; b++) {
+        seen += u->hist[b];
+        if (seen >= target)
+            return bucket_bound(b);
+    }
+    return bucket_bound(RTT_BUCKETS - 1);
+}
+
+/**
+ * @brief 重传超时：SRTT加4倍RTTVAR，限制在MIN_RTO与MAX_RTO之间
+ * @param s 服务器集合
+ * @param i 服务器下标
+ * @return 重传超时，单位微秒
+ */
+uint64_t upstream_rto(const upstream_set *s, const int i) {
+    const upstream_t *u = &s->up[i];
+    if (u->srtt == 0)
+        return INITIAL_RTO;
+    const double rto = u->srtt + 4 * u->rttvar;
+    if (rto < MIN_RTO)
+        return MIN_RTO;
+    if (rto > MAX_RTO)
+        return MAX_RTO;
+    return (uint64_t) rto;
+}
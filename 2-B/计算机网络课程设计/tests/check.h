@@ -0,0 +1,80 @@
+/**
+ * @file check.h
+ * @brief 测试用的断言宏与构造DNS报文的辅助函数，各测试程序共用；断言失败时输出位置并计数，不中止后续检查
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "../include/dns_parser.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+static int check_failures = 0; // 失败的断言数
+
+// 断言条件成立，失败时输出文件、行号与条件
+#define CHECK(cond) do { \
+                        if (!(cond)) { \
+                            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+                            check_failures++; \
+                        } \
+                    } while (0)
+
+// 断言两个整数相等，失败时一并输出两边的值
+#define CHECK_EQ(a, b) do { \
+                           const long long check_a_ = (long long) (a), check_b_ = (long long) (b); \
+                           if (check_a_ != check_b_) { \
+                               fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, \
+                                       __LINE__, #a, #b, check_a_, check_b_); \
+                               check_failures++; \
+                           } \
+                       } while (0)
+
+/**
+ * @brief 测试程序的返回值，有断言失败时为1
+ */
+static inline int check_result(const char *name) {
+    if (check_failures)
+        fprintf(stderr, "%s: %d check(s) failed\n", name, check_failures);
+    else
+        printf("%s: all checks passed\n", name);
+    return check_failures ? 1 : 0;
+}
+
+/**
+ * @brief 构造只含一个Question的请求，域名保留给定的大小写
+ * @param msg 输出报文
+ * @param id 请求的id
+ * @param name 点分形式的域名
+ * @param qtype 请求类型
+ * @param udp_size 附上OPT记录时声明的UDP载荷大小，0表示不带OPT记录
+ * @return 报文长度
+ */
+static inline int build_query(unsigned char *msg, const uint16_t id, const char *name, const uint16_t qtype,
+                              const uint16_t udp_size) {
+    Header *h = (Header *) msg;
+    memset(h, 0, sizeof(Header));
+    h->id = htons(id);
+    h->rd = 1;
+    h->qdcount = htons(1);
+    int len = (int) sizeof(Header);
+    len += text_to_name(name, msg + len);
+    msg[len++] = qtype >> 8;
+    msg[len++] = (uint8_t) qtype;
+    msg[len++] = 0;
+    msg[len++] = 1;
+    if (udp_size) {
+        len += write_opt(msg + len, udp_size, 0);
+        h->arcount = htons(1);
+    }
+    return len;
+}
+
+/**
+ * @brief 读出报文中偏移处的32位大端整数
+ */
+static inline uint32_t read_u32(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+#endif
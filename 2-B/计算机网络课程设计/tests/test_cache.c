@@ -0,0 +1,303 @@
+/**
+ * @file test_cache.c
+ * @brief 答复缓存的测试：TTL随缓存时间递减、过期后的保留与淘汰、否定答复按SOA缓存、热门条目预取、
+ *        按客户端的EDNS状态增删OPT记录、超出客户端可接收长度时的截断，以及CD、DO位不同的请求不共用答复
+ */
+#include "../include/args_handler.h"
+#include "../include/cache.h"
+#include "../include/packet_pool.h"
+#include "check.h"
+#include <stdlib.h>
+
+arguments args; // cache依赖的全局参数，这里只用到调试等级
+
+#define RELAY_EDNS_SIZE 1232 // 缓存为请求附上的OPT记录声明的UDP载荷大小
+#define MAX_STALE 60 // 过期后保留的秒数
+
+/**
+ * @brief 在报文末尾追加一条资源记录，域名为指向Question的指针
+ * @return 追加后的报文长度
+ */
+static int append_rr(unsigned char *msg, int len, const uint16_t type, const uint32_t ttl, const void *rdata,
+                     const uint16_t rdlength) {
+    const unsigned char fixed[] = {0xc0, 0x0c, type >> 8, (uint8_t) type, 0, 1, ttl >> 24, (uint8_t) (ttl >> 16),
+                                   (uint8_t) (ttl >> 8), (uint8_t) ttl, rdlength >> 8, (uint8_t) rdlength};
+    memcpy(msg + len, fixed, sizeof(fixed));
+    memcpy(msg + len + sizeof(fixed), rdata, rdlength);
+    return len + (int) sizeof(fixed) + rdlength;
+}
+
+/**
+ * @brief 由请求构造DNS服务器的肯定答复：cnt条A记录，TTL依次为ttl、ttl+1……，可选地在最后附上OPT记录
+ * @return 答复长度
+ */
+static int build_answer(unsigned char *msg, const char *name, const int cnt, const uint32_t ttl,
+                        const uint16_t udp_size) {
+    int len = build_query(msg, 0x1111, name, A, 0);
+    Header *h = (Header *) msg;
+    h->qr = 1;
+    h->ra = 1;
+    for (int i = 0; i < cnt; i++) {
+        const unsigned char addr[4] = {10, 0, (uint8_t) (i >> 8), (uint8_t) i};
+        len = append_rr(msg, len, A, ttl + i, addr, sizeof(addr));
+    }
+    h->ancount = htons(cnt);
+    if (udp_size) {
+        len += write_opt(msg + len, udp_size, 0);
+        h->arcount = htons(1);
+    }
+    return len;
+}
+
+/**
+ * @brief 解析答复或请求的Question与OPT记录，与中继处理收到的报文时相同
+ */
+static question_t parse(const unsigned char *msg, const int len) {
+    question_t q;
+    memset(&q, 0, sizeof(q));
+    CHECK_EQ(parse_question(msg, len, &q), 0);
+    CHECK_EQ(parse_edns(msg, len, &q), 0);
+    return q;
+}
+
+/**
+ * @brief 查找缓存，构造的答复写入out
+ */
+static int lookup(answer_cache *c, const char *name, const uint16_t qtype, const uint16_t id,
+                  const uint16_t udp_size, const int limit, const uint64_t now, unsigned char *out, int *len) {
+    unsigned char request[MAX_MSG_LEN];
+    const int request_len = build_query(request, id, name, qtype, udp_size);
+    const question_t q = parse(request, request_len);
+    return cache_lookup(c, &q, request, out, limit, now, len);
+}
+
+/**
+ * @brief 肯定答复按最小的TTL缓存，应答时TTL减去已缓存的秒数，id与域名大小写取自请求
+ */
+static void test_ttl() {
+    answer_cache c;
+    cache_init(&c, 1 << 20, MAX_STALE, RELAY_EDNS_SIZE, NULL);
+    unsigned char msg[MAX_PACKET_LEN], out[MAX_PACKET_LEN];
+    const int len = build_answer(msg, "www.example.com", 2, 300, 0);
+    question_t q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 1000);
+
+    int n;
+    CHECK_EQ(lookup(&c, "WWW.Example.COM", A, 0x4242, 0, MAX_MSG_LEN, 1000 + 10000, out, &n), CACHE_FRESH);
+    CHECK_EQ(n, len);
+    CHECK_EQ(ntohs(((Header *) out)->id), 0x4242);
+    CHECK(memcmp(out + sizeof(Header), "\3WWW\7Example\3COM", 16) == 0);
+    const question_t r = parse(out, n);
+    CHECK_EQ(read_u32(out + r.end + 6), 290);
+    CHECK_EQ(read_u32(out + r.end + 16 + 6), 291);
+
+    // 其他类型与域名不命中
+    CHECK_EQ(lookup(&c, "www.example.com", AAAA, 1, 0, MAX_MSG_LEN, 2000, out, &n), CACHE_MISS);
+    CHECK_EQ(lookup(&c, "ww.example.com", A, 1, 0, MAX_MSG_LEN, 2000, out, &n), CACHE_MISS);
+
+    // 过期后在MAX_STALE秒内保留，TTL为STALE_TTL，由调用方决定何时使用；之后淘汰
+    const uint64_t expire = 1000 + 300 * 1000;
+    CHECK_EQ(lookup(&c, "www.example.com", A, 1, 0, MAX_MSG_LEN, expire - 1, out, &n), CACHE_FRESH);
+    CHECK_EQ(read_u32(out + r.end + 6), 1);
+    CHECK_EQ(lookup(&c, "www.example.com", A, 1, 0, MAX_MSG_LEN, expire, out, &n), CACHE_STALE);
+    CHECK_EQ(read_u32(out + r.end + 6), STALE_TTL);
+    CHECK_EQ(read_u32(out + r.end + 16 + 6), STALE_TTL);
+    CHECK_EQ(lookup(&c, "www.example.com", A, 1, 0, MAX_MSG_LEN, expire + MAX_STALE * 1000, out, &n), CACHE_MISS);
+    CHECK_EQ(c.count, 0);
+}
+
+/**
+ * @brief 否定答复按RFC 2308取SOA记录的TTL与MINIMUM字段的较小值；没有SOA的否定答复与SERVFAIL不缓存
+ */
+static void test_negative() {
+    answer_cache c;
+    cache_init(&c, 1 << 20, 0, RELAY_EDNS_SIZE, NULL);
+    unsigned char msg[MAX_PACKET_LEN], out[MAX_PACKET_LEN];
+    int len = build_query(msg, 0x2222, "nx.example.com", A, 0);
+    Header *h = (Header *) msg;
+    h->qr = 1;
+    h->rcode = 3;
+    // SOA的MNAME与RNAME都是根，随后是serial、refresh、retry、expire与minimum
+    unsigned char soa[22] = {0};
+    soa[21] = 60;
+    len = append_rr(msg, len, SOA, 3600, soa, sizeof(soa));
+    h->nscount = htons(1);
+    question_t q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+
+    int n;
+    CHECK_EQ(lookup(&c, "nx.example.com", A, 7, 0, MAX_MSG_LEN, 30000, out, &n), CACHE_FRESH);
+    CHECK_EQ(((Header *) out)->rcode, 3);
+    CHECK_EQ(read_u32(out + q.end + 6), 3600 - 30); // SOA记录的TTL同样减去已缓存的秒数
+    // 条目在MINIMUM的60秒后过期，max_stale为0时过期即淘汰
+    CHECK_EQ(lookup(&c, "nx.example.com", A, 7, 0, MAX_MSG_LEN, 59000, out, &n), CACHE_FRESH);
+    CHECK_EQ(lookup(&c, "nx.example.com", A, 7, 0, MAX_MSG_LEN, 60000, out, &n), CACHE_MISS);
+
+    // 没有SOA的NXDOMAIN
+    len = build_query(msg, 0x2222, "nosoa.example.com", A, 0);
+    h->qr = 1;
+    h->rcode = 3;
+    q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+    CHECK_EQ(lookup(&c, "nosoa.example.com", A, 7, 0, MAX_MSG_LEN, 1000, out, &n), CACHE_MISS);
+
+    // SERVFAIL
+    len = build_answer(msg, "fail.example.com", 1, 300, 0);
+    h->rcode = 2;
+    q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+    CHECK_EQ(lookup(&c, "fail.example.com", A, 7, 0, MAX_MSG_LEN, 1000, out, &n), CACHE_MISS);
+}
+
+/**
+ * @brief 一个TTL内命中HOT_HITS次以上的条目，剩余TTL不足PREFETCH_PERCENT时提示预取，冷门条目不提示
+ */
+static void test_prefetch() {
+    answer_cache c;
+    cache_init(&c, 1 << 20, MAX_STALE, RELAY_EDNS_SIZE, NULL);
+    unsigned char msg[MAX_PACKET_LEN], out[MAX_PACKET_LEN];
+    int len = build_answer(msg, "hot.example.com", 1, 100, 0);
+    question_t q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+    len = build_answer(msg, "cold.example.com", 1, 100, 0);
+    q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+
+    int n;
+    for (int i = 0; i < HOT_HITS - 1; i++)
+        CHECK_EQ(lookup(&c, "hot.example.com", A, 1, 0, MAX_MSG_LEN, 1000, out, &n), CACHE_FRESH);
+    CHECK_EQ(lookup(&c, "hot.example.com", A, 1, 0, MAX_MSG_LEN, 50000, out, &n), CACHE_FRESH);
+    CHECK_EQ(lookup(&c, "hot.example.com", A, 1, 0, MAX_MSG_LEN, 95000, out, &n), CACHE_REFRESH);
+    CHECK_EQ(lookup(&c, "cold.example.com", A, 1, 0, MAX_MSG_LEN, 95000, out, &n), CACHE_FRESH);
+}
+
+/**
+ * @brief 请求没有OPT记录时去掉答复中的，有时保留答复中的或附上缓存的OPT记录，且OPT记录在最后
+ */
+static void test_edns() {
+    answer_cache c;
+    cache_init(&c, 1 << 20, MAX_STALE, RELAY_EDNS_SIZE, NULL);
+    unsigned char msg[MAX_PACKET_LEN], out[MAX_PACKET_LEN];
+    int n;
+
+    // 存入带OPT记录的答复，请求也带OPT记录
+    unsigned char request[MAX_MSG_LEN];
+    const int request_len = build_query(request, 1, "opt.example.com", A, 4096);
+    question_t rq = parse(request, request_len);
+    int len = build_answer(msg, "opt.example.com", 1, 300, 4000);
+    question_t q = parse(msg, len);
+    CHECK_EQ(q.udp_size, 4000);
+    cache_store(&c, &q, msg, len, 0);
+    CHECK_EQ(cache_lookup(&c, &rq, request, out, RELAY_EDNS_SIZE, 1000, &n), CACHE_FRESH);
+    CHECK_EQ(n, len);
+    CHECK_EQ(ntohs(((Header *) out)->arcount), 1);
+    question_t r = parse(out, n);
+    CHECK_EQ(r.udp_size, 4000);
+    CHECK_EQ(r.opt_off + r.opt_len, n);
+
+    CHECK_EQ(lookup(&c, "opt.example.com", A, 1, 0, MAX_MSG_LEN, 1000, out, &n), CACHE_FRESH);
+    CHECK_EQ(n, len - OPT_LEN);
+    CHECK_EQ(ntohs(((Header *) out)->arcount), 0);
+    r = parse(out, n);
+    CHECK_EQ(r.udp_size, 0);
+
+    // 答复没有OPT记录而请求有时附上缓存的OPT记录，声明中继的UDP载荷大小
+    len = build_answer(msg, "plain.example.com", 1, 300, 0);
+    q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+    CHECK_EQ(lookup(&c, "plain.example.com", A, 1, 1232, RELAY_EDNS_SIZE, 1000, out, &n), CACHE_FRESH);
+    CHECK_EQ(n, len + OPT_LEN);
+    r = parse(out, n);
+    CHECK_EQ(r.udp_size, RELAY_EDNS_SIZE);
+    CHECK_EQ(r.opt_off, len);
+}
+
+/**
+ * @brief 答复超过客户端可接收的长度时只返回设置了TC位的Question段，带OPT记录的请求附上缓存的不带选项的OPT记录
+ */
+static void test_truncation() {
+    answer_cache c;
+    cache_init(&c, 1 << 20, MAX_STALE, RELAY_EDNS_SIZE, NULL);
+    unsigned char msg[MAX_PACKET_LEN], out[MAX_PACKET_LEN];
+    // 40条A记录约700字节，超过没有OPT记录时的512字节
+    const int len = build_answer(msg, "big.example.com", 40, 300, 4000);
+    question_t q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+
+    int n;
+    CHECK_EQ(lookup(&c, "big.example.com", A, 9, 0, MAX_MSG_LEN, 1000, out, &n), CACHE_FRESH);
+    CHECK_EQ(n, q.end);
+    const Header *h = (const Header *) out;
+    CHECK_EQ(h->tc, 1);
+    CHECK_EQ(ntohs(h->id), 9);
+    CHECK_EQ(ntohs(h->ancount), 0);
+    CHECK_EQ(ntohs(h->arcount), 0);
+
+    CHECK_EQ(lookup(&c, "big.example.com", A, 9, 600, 600, 1000, out, &n), CACHE_FRESH);
+    CHECK_EQ(n, q.end + OPT_LEN);
+    CHECK_EQ(h->tc, 1);
+    CHECK_EQ(ntohs(h->arcount), 1);
+    const question_t r = parse(out, n);
+    CHECK_EQ(r.udp_size, RELAY_EDNS_SIZE);
+
+    // 可接收的长度足够时返回完整的答复
+    CHECK_EQ(lookup(&c, "big.example.com", A, 9, 1232, RELAY_EDNS_SIZE, 1000, out, &n), CACHE_FRESH);
+    CHECK_EQ(n, len);
+    CHECK_EQ(h->tc, 0);
+    CHECK_EQ(ntohs(h->ancount), 40);
+}
+
+/**
+ * @brief 在报文中设置DNSSEC标志：CD位在报文头，DO位在末尾的OPT记录中
+ */
+static void set_dnssec(unsigned char *msg, const int len, const uint8_t dnssec) {
+    if (dnssec & DNSSEC_CD)
+        ((Header *) msg)->z |= HEADER_CD;
+    if (dnssec & DNSSEC_DO)
+        msg[len - OPT_LEN + 7] |= 0x80;
+}
+
+/**
+ * @brief 按请求的CD、DO位分别缓存：要求DNSSEC记录的答复不交给未要求的客户端，反之亦然
+ */
+static void test_dnssec() {
+    answer_cache c;
+    cache_init(&c, 1 << 20, 0, RELAY_EDNS_SIZE, NULL);
+    unsigned char msg[MAX_PACKET_LEN], out[MAX_PACKET_LEN], request[MAX_MSG_LEN];
+    int len = build_answer(msg, "signed.example.com", 1, 300, 1232);
+    set_dnssec(msg, len, DNSSEC_DO);
+    question_t q = parse(msg, len);
+    CHECK_EQ(q.dnssec, DNSSEC_DO);
+    cache_store(&c, &q, msg, len, 0);
+
+    int n;
+    CHECK_EQ(lookup(&c, "signed.example.com", A, 1, 1232, RELAY_EDNS_SIZE, 1000, out, &n), CACHE_MISS);
+    CHECK_EQ(lookup(&c, "signed.example.com", A, 1, 0, MAX_MSG_LEN, 1000, out, &n), CACHE_MISS);
+    static const uint8_t variants[] = {DNSSEC_DO, DNSSEC_CD, DNSSEC_CD | DNSSEC_DO};
+    for (int i = 0; i < 3; i++) {
+        const int request_len = build_query(request, 2, "signed.example.com", A, 1232);
+        set_dnssec(request, request_len, variants[i]);
+        const question_t rq = parse(request, request_len);
+        CHECK_EQ(rq.dnssec, variants[i]);
+        CHECK_EQ(cache_lookup(&c, &rq, request, out, RELAY_EDNS_SIZE, 1000, &n),
+                 variants[i] == DNSSEC_DO ? CACHE_FRESH : CACHE_MISS);
+    }
+
+    // 不要求DNSSEC记录的答复同样不交给要求的客户端
+    len = build_answer(msg, "signed.example.com", 2, 300, 1232);
+    q = parse(msg, len);
+    cache_store(&c, &q, msg, len, 0);
+    CHECK_EQ(c.count, 2);
+    CHECK_EQ(lookup(&c, "signed.example.com", A, 3, 1232, RELAY_EDNS_SIZE, 1000, out, &n), CACHE_FRESH);
+    CHECK_EQ(ntohs(((Header *) out)->ancount), 2);
+}
+
+int main() {
+    test_ttl();
+    test_negative();
+    test_prefetch();
+    test_edns();
+    test_truncation();
+    test_dnssec();
+    return check_result("test_cache");
+}
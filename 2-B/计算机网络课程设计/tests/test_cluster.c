@@ -0,0 +1,124 @@
+/**
+ * @file test_cluster.c
+ * @brief 一致性哈希环的测试：节点列表相同的各节点对每个域名选出同一个负责节点，与配置的顺序无关；
+ *        各节点负责的域名大致均匀；加入一个节点只把部分域名移给新节点，其余域名的负责节点不变
+ */
+#include "../include/args_handler.h"
+#include "../include/cluster.h"
+#include "check.h"
+
+arguments args; // 与其他模块共用的全局参数，这里不使用
+
+#define NAMES 30000 // 测试的域名哈希数
+#define NODES 4 // 测试用的节点数，最后一个用于测试加入节点
+
+static struct sockaddr_in nodes[NODES];
+
+static struct sockaddr_in node_addr(const char *ip, const uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    return addr;
+}
+
+/**
+ * @brief 第i个域名的哈希，ring_owner会再混合一次，相邻的值即可
+ */
+static uint32_t name_hash(const int i) {
+    return (uint32_t) i * 2654435761u;
+}
+
+/**
+ * @brief 以nodes[self]为本节点、按order给出的顺序列出其他节点构造环
+ * @param order 其他节点在nodes中的下标
+ * @param peers 输出其他节点的地址，ring_owner返回的下标指向它
+ */
+static void build_ring(hash_ring *r, const int self, const int *order, const int cnt, struct sockaddr_in *peers) {
+    for (int i = 0; i < cnt; i++)
+        peers[i] = nodes[order[i]];
+    ring_init(r, &nodes[self], peers, cnt);
+}
+
+/**
+ * @brief 负责该哈希的节点在nodes中的下标
+ */
+static int owner_node(const hash_ring *r, const int self, const int *order, const uint32_t hash) {
+    const int member = ring_owner(r, hash);
+    return member == CLUSTER_SELF ? self : order[member];
+}
+
+/**
+ * @brief 只有本节点时全部由本节点负责
+ */
+static void test_single() {
+    hash_ring r;
+    ring_init(&r, &nodes[0], NULL, 0);
+    CHECK_EQ(r.cnt, CLUSTER_VNODES);
+    int others = 0;
+    for (int i = 0; i < NAMES; i++)
+        others += ring_owner(&r, name_hash(i)) != CLUSTER_SELF;
+    CHECK_EQ(others, 0);
+}
+
+/**
+ * @brief 三个节点各自以自己为本节点、以不同的顺序列出其他节点，对每个域名选出同一个节点；各节点负责的份额大致相同
+ */
+static void test_agreement() {
+    static const int orders[3][2] = {{1, 2}, {2, 0}, {0, 1}};
+    static const int reversed[2] = {2, 1};
+    hash_ring rings[3], r0_reversed;
+    struct sockaddr_in peers[3][2], peers_reversed[2];
+    for (int n = 0; n < 3; n++)
+        build_ring(&rings[n], n, orders[n], 2, peers[n]);
+    build_ring(&r0_reversed, 0, reversed, 2, peers_reversed);
+
+    int share[3] = {0}, disagreements = 0;
+    for (int i = 0; i < NAMES; i++) {
+        const uint32_t h = name_hash(i);
+        const int owner = owner_node(&rings[0], 0, orders[0], h);
+        share[owner]++;
+        for (int n = 1; n < 3; n++)
+            disagreements += owner_node(&rings[n], n, orders[n], h) != owner;
+        disagreements += owner_node(&r0_reversed, 0, reversed, h) != owner;
+    }
+    CHECK_EQ(disagreements, 0);
+    // 每个节点64个虚拟节点，份额偏离1/3不会太多
+    for (int n = 0; n < 3; n++)
+        CHECK(share[n] > NAMES / 5 && share[n] < NAMES / 2);
+}
+
+/**
+ * @brief 加入第四个节点后，负责节点改变的域名都改由新节点负责，移动的份额接近1/4
+ */
+static void test_join() {
+    static const int before_order[2] = {1, 2}, after_order[3] = {1, 2, 3};
+    hash_ring before, after;
+    struct sockaddr_in before_peers[2], after_peers[3];
+    build_ring(&before, 0, before_order, 2, before_peers);
+    build_ring(&after, 0, after_order, 3, after_peers);
+    int moved = 0, elsewhere = 0;
+    for (int i = 0; i < NAMES; i++) {
+        const uint32_t h = name_hash(i);
+        const int old_owner = owner_node(&before, 0, before_order, h);
+        const int new_owner = owner_node(&after, 0, after_order, h);
+        if (old_owner == new_owner)
+            continue;
+        moved++;
+        elsewhere += new_owner != 3;
+    }
+    CHECK_EQ(elsewhere, 0);
+    CHECK(moved > NAMES / 8 && moved < NAMES * 2 / 5);
+}
+
+int main() {
+    nodes[0] = node_addr("127.0.0.1", 5300);
+    nodes[1] = node_addr("10.0.0.2", 53);
+    nodes[2] = node_addr("10.0.0.3", 53);
+    nodes[3] = node_addr("10.0.0.4", 53);
+    test_single();
+    test_agreement();
+    test_join();
+    return check_result("test_cluster");
+}
@@ -0,0 +1,330 @@
+/**
+ * @file test_local_table.c
+ * @brief 本地记录表的测试：后缀字典树的最长匹配与精确匹配优先，答复模板的构造与去重、多地址合并与CNAME模板，文本文件的加载与查找，预编译记录库的写出、映射与损坏时的拒绝，
+ *        以及重新加载失败（包括内存不足）时保留当前记录表
+ */
+#include "../include/args_handler.h"
+#include "../include/file_reader.h"
+#include "../include/suffix_trie.h"
+#include "check.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+arguments args; // file_reader依赖的全局参数，这里只用到调试等级与记录文件路径
+
+static int fail_after = -1; // 再成功分配多少次后让分配失败，-1表示不注入失败
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+/**
+ * @brief 链接时替换malloc等函数，按fail_after注入分配失败
+ */
+static int inject_failure() {
+    if (fail_after < 0)
+        return 0;
+    return fail_after-- == 0;
+}
+
+void *__wrap_malloc(const size_t size) {
+    return inject_failure() ? NULL : __real_malloc(size);
+}
+
+void *__wrap_calloc(const size_t n, const size_t size) {
+    return inject_failure() ? NULL : __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, const size_t size) {
+    return inject_failure() ? NULL : __real_realloc(p, size);
+}
+
+static const char *records_text =
+        "1.1.1.1 exact.example.com\n"
+        "1.1.1.1 twin.example.com\n"
+        "0.0.0.0 blocked.test\n"
+        "2.2.2.2 *.example.com\n"
+        "3.3.3.3 *.deep.example.com\n"
+        "0.0.0.0 *.ads.example.com\n"
+        "\n"
+        "not-an-address broken.test\n"
+        "5.5.5.5 other.test\n"
+        "4.4.4.4 multi.test\n"
+        "4.4.4.5 multi.test\n"
+        "4.4.4.4 multi.test\n"
+        "::1 multi.test\n"
+        "CNAME multi.test alias.test\n"
+        "CNAME elsewhere.org outside.test\n";
+
+/**
+ * @brief 按点分形式的域名构造Question，与解析请求时得到的相同
+ */
+static question_t question(const char *name, const uint16_t qtype) {
+    unsigned char msg[MAX_MSG_LEN];
+    const int len = build_query(msg, 1, name, qtype, 0);
+    question_t q;
+    CHECK_EQ(parse_question(msg, len, &q), 0);
+    return q;
+}
+
+/**
+ * @brief 模板中第i条A记录的地址的最后一个字节
+ */
+static int a_last_byte(const local_record *r, const int i) {
+    return r->data[r->rr_off[LOCAL_A] + i * 16 + 15];
+}
+
+/**
+ * @brief 单独测试字典树：规则*.x只匹配x的子域名，多条规则取最长的，大小写不敏感
+ */
+static void test_trie() {
+    trie_builder b;
+    CHECK_EQ(trie_builder_init(&b), 0);
+    CHECK_EQ(trie_builder_add(&b, "example.com", 1), 0);
+    CHECK_EQ(trie_builder_add(&b, "Deep.Example.com", 2), 0);
+    CHECK_EQ(trie_builder_add(&b, "example.com", 3), 0); // 重复的后缀保留先出现的
+    CHECK(trie_builder_add(&b, "bad..com", 4) < 0);
+    suffix_trie trie;
+    CHECK_EQ(trie_build(&b, &trie), 0);
+    CHECK(trie_valid(&trie));
+
+    uint32_t value = 0;
+    question_t q = question("www.example.com", A);
+    CHECK(trie_lookup(&trie, q.name, q.label_offs, q.label_cnt, &value));
+    CHECK_EQ(value, 1);
+    q = question("a.b.DEEP.example.com", A);
+    CHECK(trie_lookup(&trie, q.name, q.label_offs, q.label_cnt, &value));
+    CHECK_EQ(value, 2);
+    q = question("deep.example.com", A);
+    CHECK(trie_lookup(&trie, q.name, q.label_offs, q.label_cnt, &value));
+    CHECK_EQ(value, 1);
+    q = question("example.com", A);
+    CHECK(!trie_lookup(&trie, q.name, q.label_offs, q.label_cnt, &value));
+    q = question("example.org", A);
+    CHECK(!trie_lookup(&trie, q.name, q.label_offs, q.label_cnt, &value));
+    q = question("notexample.com", A);
+    CHECK(!trie_lookup(&trie, q.name, q.label_offs, q.label_cnt, &value));
+    free(trie.nodes);
+    free(trie.labels);
+}
+
+/**
+ * @brief 检查当前记录表的查找结果
+ */
+static void check_lookups() {
+    question_t q = question("Exact.Example.COM", A);
+    const local_record *exact = find_entry(&q);
+    CHECK(exact != NULL);
+    if (exact) {
+        CHECK_EQ(exact->rr_cnt[LOCAL_A], 1);
+        CHECK_EQ(a_last_byte(exact, 0), 1);
+        CHECK(!exact->blocked);
+        CHECK_EQ(exact->cname_len, 0);
+        CHECK_EQ(exact->rr_cnt[LOCAL_AAAA], 0);
+    }
+    // 内容相同的模板只存一份
+    q = question("twin.example.com", A);
+    CHECK(find_entry(&q) == exact);
+    // 第一行为0.0.0.0的域名只有拦截标记，没有地址记录
+    q = question("blocked.test", A);
+    const local_record *blocked = find_entry(&q);
+    CHECK(blocked != NULL);
+    if (blocked) {
+        CHECK(blocked->blocked);
+        CHECK_EQ(blocked->rr_cnt[LOCAL_A], 0);
+    }
+
+    // 后缀规则匹配子域名，最长的规则优先；不匹配规则本身
+    q = question("www.example.com", A);
+    const local_record *r = find_entry(&q);
+    CHECK(r != NULL && a_last_byte(r, 0) == 2);
+    q = question("x.y.deep.example.com", A);
+    r = find_entry(&q);
+    CHECK(r != NULL && a_last_byte(r, 0) == 3);
+    q = question("example.com", A);
+    CHECK(find_entry(&q) == NULL);
+    q = question("tracker.ads.example.com", A);
+    r = find_entry(&q);
+    CHECK(r != NULL && r->blocked);
+
+    q = question("other.test", A);
+    r = find_entry(&q);
+    CHECK(r != NULL && a_last_byte(r, 0) == 5);
+    q = question("broken.test", A);
+    CHECK(find_entry(&q) == NULL);
+    q = question("missing.example.org", A);
+    CHECK(find_entry(&q) == NULL);
+
+    // 同一域名的多行合并为一个模板，重复的地址只保留一条
+    q = question("multi.test", A);
+    const local_record *multi = find_entry(&q);
+    CHECK(multi != NULL);
+    if (multi) {
+        CHECK(!multi->blocked);
+        CHECK_EQ(multi->cname_len, 0);
+        CHECK_EQ(multi->rr_cnt[LOCAL_A], 2);
+        CHECK_EQ(multi->rr_cnt[LOCAL_AAAA], 1);
+        CHECK_EQ(a_last_byte(multi, 0), 4);
+        CHECK_EQ(a_last_byte(multi, 1), 5);
+    }
+
+    // CNAME的目标是本地的地址记录时一并带上，否则只有CNAME记录
+    q = question("alias.test", A);
+    r = find_entry(&q);
+    CHECK(r != NULL);
+    if (r) {
+        CHECK(r->cname_len > 0);
+        CHECK_EQ(r->rr_cnt[LOCAL_A], 2);
+        CHECK_EQ(r->rr_cnt[LOCAL_AAAA], 1);
+    }
+    q = question("outside.test", A);
+    r = find_entry(&q);
+    CHECK(r != NULL);
+    if (r) {
+        CHECK(r->cname_len > 0);
+        CHECK_EQ(r->rr_cnt[LOCAL_A], 0);
+    }
+}
+
+/**
+ * @brief 加载记录文件并替换当前记录表
+ */
+static table_t *load(const char *path) {
+    table_t *t = malloc(sizeof(table_t));
+    if (!t || table_load(t, path) < 0) {
+        free(t);
+        return NULL;
+    }
+    atomic_store(&table, t);
+    return t;
+}
+
+/**
+ * @brief 文本文件与由它生成的预编译记录库得到相同的查找结果；截断或改坏的记录库被拒绝
+ */
+static void test_table(const char *dir) {
+    char text_path[256], db_path[256], bad_path[256];
+    snprintf(text_path, sizeof(text_path), "%s/records.txt", dir);
+    snprintf(db_path, sizeof(db_path), "%s/records.db", dir);
+    snprintf(bad_path, sizeof(bad_path), "%s/bad.db", dir);
+    FILE *file = fopen(text_path, "w");
+    CHECK(file != NULL);
+    if (!file)
+        return;
+    fputs(records_text, file);
+    fclose(file);
+
+    table_t *t = load(text_path);
+    CHECK(t != NULL);
+    if (!t)
+        return;
+    const uint32_t count = t->count;
+    CHECK_EQ(count, 7);
+    check_lookups();
+    CHECK_EQ(table_save(t, db_path), 0);
+    table_free(t);
+
+    t = load(db_path);
+    CHECK(t != NULL && t->map_base != NULL);
+    if (!t)
+        return;
+    check_lookups();
+
+    // 记录数超过槽数减1时查找无法结束，须拒绝
+    const size_t size = t->map_len;
+    unsigned char *copy = malloc(size);
+    memcpy(copy, t->map_base, size);
+    db_header *h = (db_header *) copy;
+    table_free(t);
+    h->count = h->mask + 1;
+    file = fopen(bad_path, "wb");
+    fwrite(copy, 1, size, file);
+    fclose(file);
+    table_t bad;
+    CHECK(table_load(&bad, bad_path) < 0);
+
+    // 槽中的模板偏移越界
+    h->count = count;
+    entry_slot *slots = (entry_slot *) (copy + h->slots_off);
+    for (uint32_t i = 0; i <= h->mask; i++) {
+        if (slots[i].name_off != 0) {
+            slots[i].record_off = h->pool_len;
+            break;
+        }
+    }
+    file = fopen(bad_path, "wb");
+    fwrite(copy, 1, size, file);
+    fclose(file);
+    CHECK(table_load(&bad, bad_path) < 0);
+
+    // 截断的文件
+    file = fopen(bad_path, "wb");
+    fwrite(copy, 1, size / 2, file);
+    fclose(file);
+    CHECK(table_load(&bad, bad_path) < 0);
+    free(copy);
+    unlink(text_path);
+    unlink(db_path);
+    unlink(bad_path);
+}
+
+/**
+ * @brief 重新加载失败时返回NULL且当前记录表不变；依次让加载中的每一次分配失败，都不退出进程、不替换记录表，
+ *        足够大的文件使哈希表、字节区与模板索引都要扩容
+ */
+static void test_reload(const char *dir) {
+    char path[256], missing[256];
+    snprintf(path, sizeof(path), "%s/reload.txt", dir);
+    snprintf(missing, sizeof(missing), "%s/missing.txt", dir);
+    FILE *file = fopen(path, "w");
+    CHECK(file != NULL);
+    if (!file)
+        return;
+    for (int i = 0; i < 4000; i++)
+        fprintf(file, "10.0.%d.%d host%d.reload.test\n", i / 250, i % 250 + 1, i);
+    fputs("2.2.2.2 *.wild.reload.test\n", file);
+    fclose(file);
+
+    args.local_file_addr = path;
+    load_file();
+    table_t *current = atomic_load(&table);
+    args.local_file_addr = missing;
+    CHECK(reload_file() == NULL);
+    CHECK(atomic_load(&table) == current);
+
+    args.local_file_addr = path;
+    table_t *old = NULL;
+    int failures = 0;
+    for (int k = 0; !old && k < 1000; k++) {
+        fail_after = k;
+        old = reload_file();
+        fail_after = -1;
+        if (!old) {
+            failures++;
+            CHECK(atomic_load(&table) == current);
+        }
+    }
+    CHECK(old == current);
+    CHECK(failures > 10);
+    table_free(old);
+    question_t q = question("host3999.reload.test", A);
+    const local_record *r = find_entry(&q);
+    CHECK(r != NULL && a_last_byte(r, 0) == 250);
+    q = question("x.wild.reload.test", A);
+    r = find_entry(&q);
+    CHECK(r != NULL && a_last_byte(r, 0) == 2);
+    unlink(path);
+}
+
+int main() {
+    char dir[] = "/tmp/dnsrelay-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp failed");
+        return 1;
+    }
+    test_trie();
+    test_table(dir);
+    test_reload(dir);
+    rmdir(dir);
+    return check_result("test_local_table");
+}
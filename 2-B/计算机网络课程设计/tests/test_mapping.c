@@ -0,0 +1,226 @@
+/**
+ * @file test_mapping.c
+ * @brief 待答复请求表的测试：槽的代数标记、答复的来源与Question核对、答复与超时的竞争，
+ *        以及相同请求的合并与等待者的记录
+ */
+#include "../include/args_handler.h"
+#include "../include/mapping.h"
+#include "check.h"
+#include <stdlib.h>
+
+arguments args; // mapping依赖的全局参数，这里只用到调试等级
+
+/**
+ * @brief 一个客户端的请求报文与解析出的Question
+ */
+typedef struct {
+    unsigned char msg[MAX_MSG_LEN];
+    int len;
+    question_t q;
+} request;
+
+/**
+ * @brief 构造请求并解析，dnssec为DNSSEC_CD与DNSSEC_DO的组合，设置DO位时附上OPT记录
+ */
+static void make_flagged_request(request *r, const uint16_t id, const char *name, const uint16_t qtype,
+                                 const uint8_t dnssec, const uint8_t rd) {
+    r->len = build_query(r->msg, id, name, qtype, dnssec & DNSSEC_DO ? 1232 : 0);
+    Header *h = (Header *) r->msg;
+    h->rd = rd;
+    if (dnssec & DNSSEC_CD)
+        h->z |= HEADER_CD;
+    if (dnssec & DNSSEC_DO)
+        r->msg[r->len - OPT_LEN + 7] |= 0x80;
+    memset(&r->q, 0, sizeof(r->q));
+    CHECK_EQ(parse_question(r->msg, r->len, &r->q), 0);
+    CHECK_EQ(parse_edns(r->msg, r->len, &r->q), 0);
+    CHECK_EQ(r->q.dnssec, dnssec);
+}
+
+static void make_request(request *r, const uint16_t id, const char *name, const uint16_t qtype) {
+    make_flagged_request(r, id, name, qtype, 0, 1);
+}
+
+static struct sockaddr_in client(const uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+/**
+ * @brief 分配的槽代数为奇数，请求id替换为槽下标；释放后旧代数取不到槽，答复只能被接受一次
+ */
+static void test_generation(pending_table *t) {
+    request r;
+    make_request(&r, 0x1234, "www.Example.com", A);
+    uint32_t gen;
+    const uint32_t index = pending_alloc(t, &r.q, r.msg, r.len, client(5000), &gen);
+    CHECK(index != UINT32_MAX);
+    CHECK_EQ(gen % 2, 1);
+    CHECK_EQ(ntohs(((Header *) r.msg)->id), (uint16_t) index);
+    pending_slot *s = pending_get(t, index, gen);
+    CHECK(s != NULL);
+    if (!s)
+        return;
+    CHECK_EQ(s->id, htons(0x1234));
+    CHECK(pending_get(t, index, gen + 1) == NULL);
+    s->sent_to[0] = 0;
+    s->tries = 1;
+
+    // 答复来自未发往过的服务器、类型不同、或哈希相同而域名不同时都不接受
+    uint32_t match_gen;
+    CHECK(pending_match(t, index, &r.q, 1, &match_gen) == NULL);
+    request other;
+    make_request(&other, 1, "www.example.com", AAAA);
+    CHECK(pending_match(t, index, &other.q, 0, &match_gen) == NULL);
+    make_request(&other, 1, "www.example.org", A);
+    other.q.hash = r.q.hash;
+    CHECK(pending_match(t, index, &other.q, 0, &match_gen) == NULL);
+    CHECK(pending_match(t, index, &r.q, 0, &match_gen) == s);
+    CHECK_EQ(match_gen, gen);
+
+    // 答复的域名大小写与请求不同时照常接受
+    make_request(&other, 1, "WWW.EXAMPLE.COM", A);
+    pending_slot out;
+    CHECK(pending_complete(t, index, &other.q, 0, &out));
+    CHECK_EQ(out.id, htons(0x1234));
+    CHECK_EQ(ntohs(out.addr.sin_port), 5000);
+    CHECK(out.query == r.msg);
+    CHECK_EQ(out.query_len, r.len);
+    CHECK_EQ(out.tries, 1);
+    CHECK(pending_get(t, index, gen) == NULL);
+    CHECK_EQ(pending_find(t, &r.q, r.msg), UINT32_MAX);
+
+    // 重复的答复与迟到的超时都不再释放槽
+    CHECK(!pending_complete(t, index, &r.q, 0, &out));
+    CHECK(!pending_timeout(t, index, gen));
+}
+
+/**
+ * @brief 超时先于答复时答复被丢弃；槽被复用后旧定时器不释放新请求
+ */
+static void test_timeout(pending_table *t) {
+    request r;
+    make_request(&r, 7, "slow.example.com", A);
+    uint32_t gen;
+    const uint32_t index = pending_alloc(t, &r.q, r.msg, r.len, client(5001), &gen);
+    CHECK(index != UINT32_MAX);
+    pending_slot *s = pending_get(t, index, gen);
+    s->sent_to[0] = 2;
+    s->tries = 1;
+    CHECK(pending_timeout(t, index, gen));
+    CHECK(!pending_timeout(t, index, gen));
+    pending_slot out;
+    CHECK(!pending_complete(t, index, &r.q, 2, &out));
+    CHECK_EQ(pending_find(t, &r.q, r.msg), UINT32_MAX);
+
+    // 表只有一个端口时，释放的槽排在空闲链表头，下一次分配复用它
+    request next;
+    make_request(&next, 8, "next.example.com", A);
+    uint32_t next_gen;
+    const uint32_t reused = pending_alloc(t, &next.q, next.msg, next.len, client(5002), &next_gen);
+    CHECK_EQ(reused, index);
+    CHECK_EQ(next_gen, gen + 2);
+    CHECK(!pending_timeout(t, index, gen));
+    CHECK(pending_get(t, index, next_gen) != NULL);
+    CHECK(pending_timeout(t, reused, next_gen));
+}
+
+/**
+ * @brief 相同Question的请求合并到进行中的请求，等待者保留各自的id、地址、EDNS与域名大小写；
+ *        CD、DO或RD位不同的请求不合并
+ */
+static void test_coalescing(pending_table *t) {
+    request first;
+    make_request(&first, 100, "cdn.example.com", A);
+    uint32_t gen;
+    const uint32_t index = pending_alloc(t, &first.q, first.msg, first.len, client(6000), &gen);
+    CHECK(index != UINT32_MAX);
+
+    request same, other_type, other_name;
+    make_request(&same, 101, "CDN.example.COM", A);
+    make_request(&other_type, 102, "cdn.example.com", AAAA);
+    make_request(&other_name, 103, "cdn.example.net", A);
+    CHECK_EQ(pending_find(t, &same.q, same.msg), index);
+    CHECK_EQ(pending_find(t, &other_type.q, other_type.msg), UINT32_MAX);
+    CHECK_EQ(pending_find(t, &other_name.q, other_name.msg), UINT32_MAX);
+    request flagged;
+    make_flagged_request(&flagged, 104, "cdn.example.com", A, DNSSEC_CD, 1);
+    CHECK_EQ(pending_find(t, &flagged.q, flagged.msg), UINT32_MAX);
+    make_flagged_request(&flagged, 105, "cdn.example.com", A, DNSSEC_DO, 1);
+    CHECK_EQ(pending_find(t, &flagged.q, flagged.msg), UINT32_MAX);
+    make_flagged_request(&flagged, 106, "cdn.example.com", A, 0, 0);
+    CHECK_EQ(pending_find(t, &flagged.q, flagged.msg), UINT32_MAX);
+
+    static const char *names[] = {"CDN.example.com", "cdn.EXAMPLE.com", "cDn.ExAmPlE.cOm"};
+    request waiters[3];
+    for (int i = 0; i < 3; i++) {
+        make_request(&waiters[i], (uint16_t) (200 + i), names[i], A);
+        CHECK(pending_wait(t, index, waiters[i].msg, (uint16_t) (i == 1 ? 1232 : 0), client(7000 + i)));
+    }
+    pending_slot *s = pending_get(t, index, gen);
+    CHECK(s != NULL);
+    if (!s)
+        return;
+    CHECK_EQ(s->waiter_cnt, 3);
+
+    // 等待者链表按加入的逆序排列
+    int cnt = 0;
+    for (uint32_t w = s->waiters; w; w = t->waiters[w - 1].next, cnt++) {
+        const pending_waiter *waiter = &t->waiters[w - 1];
+        const int i = 2 - cnt;
+        CHECK_EQ(ntohs(waiter->id), 200 + i);
+        CHECK_EQ(ntohs(waiter->addr.sin_port), 7000 + i);
+        CHECK_EQ(waiter->udp_size, i == 1 ? 1232 : 0);
+        CHECK_EQ(waiter->name_len, waiters[i].q.name_len);
+        CHECK(memcmp(waiter->name, waiters[i].msg + sizeof(Header), waiter->name_len) == 0);
+    }
+    CHECK_EQ(cnt, 3);
+
+    // 答复取出等待者链表，释放后等待者可再次使用
+    s->sent_to[0] = 0;
+    s->tries = 1;
+    pending_slot out;
+    CHECK(pending_complete(t, index, &first.q, 0, &out));
+    CHECK(out.waiters != 0);
+    const uint32_t capacity = t->waiter_cap;
+    pending_release_waiters(t, out.waiters);
+    CHECK_EQ(pending_find(t, &same.q, same.msg), UINT32_MAX);
+
+    const uint32_t again = pending_alloc(t, &same.q, same.msg, same.len, client(6001), &gen);
+    CHECK(again != UINT32_MAX);
+    CHECK_EQ(pending_get(t, again, gen)->waiter_cnt, 0);
+    CHECK_EQ(pending_get(t, again, gen)->waiters, 0);
+    for (int i = 0; i < 3; i++)
+        CHECK(pending_wait(t, again, waiters[i].msg, 0, client(7000 + i)));
+    CHECK_EQ(t->waiter_cap, capacity);
+    CHECK(pending_timeout(t, again, gen));
+
+    // 以DO位查询的请求只与同样设置DO位的请求合并
+    request signed_first, signed_same;
+    make_flagged_request(&signed_first, 300, "signed.example.com", A, DNSSEC_DO, 1);
+    make_flagged_request(&signed_same, 301, "Signed.Example.com", A, DNSSEC_DO, 1);
+    const uint32_t signed_index = pending_alloc(t, &signed_first.q, signed_first.msg, signed_first.len,
+                                                client(6002), &gen);
+    CHECK(signed_index != UINT32_MAX);
+    CHECK_EQ(pending_find(t, &signed_same.q, signed_same.msg), signed_index);
+    make_request(&same, 302, "signed.example.com", A);
+    CHECK_EQ(pending_find(t, &same.q, same.msg), UINT32_MAX);
+    CHECK(pending_timeout(t, signed_index, gen));
+}
+
+int main() {
+    pending_table t;
+    memset(&t, 0, sizeof(t));
+    pending_init(&t, 1);
+    test_generation(&t);
+    test_timeout(&t);
+    test_coalescing(&t);
+    free(t.slots);
+    free(t.inflight);
+    free(t.waiters);
+    return check_result("test_mapping");
+}
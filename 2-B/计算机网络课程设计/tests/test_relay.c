@@ -0,0 +1,317 @@
+/**
+ * @file test_relay.c
+ * @brief 中继的端到端测试：在本机启动dnsrelay-stub与dnsrelay，经UDP验证本地记录的轮转、
+ *        超出客户端载荷大小时的截断、EDNS载荷大小的协商与BADVERS、上游答复截断时改经TCP取得完整的答复，
+ *        以及相同请求合并后各自的id与域名大小写和指标中的合并计数
+ *        用法：test_relay <dnsrelay路径> <dnsrelay-stub路径>
+ */
+#include "../include/packet_pool.h"
+#include "check.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BIG_RECORDS 32 // big.test的A记录数，不带EDNS时放不进512字节
+#define RELAY_EDNS_SIZE 1400 // 中继以-e声明的UDP载荷大小
+#define REPLY_WAIT_MS 3000 // 等待一个答复的时间
+#define COALESCED 4 // 合并测试中同时发出的请求数
+#define STUB_RECORDS 8 // dnsrelay-stub对A记录请求返回的记录数
+#define STUB_UDP_LIMIT 100 // dnsrelay-stub经UDP答复的长度上限，STUB_RECORDS条记录放不下，答复被截断
+#define STUB_DELAY_MS 300 // 上游答复的延迟，使后续相同的请求能合并到第一个
+#define PROBE_WAIT_MS (2 * STUB_DELAY_MS) // 等待进程启动时每次探测等待答复的时间
+
+static uint16_t relay_port, stub_port;
+static char metrics_path[100]; // 不超过sockaddr_un.sun_path的长度
+
+/**
+ * @brief 启动子进程
+ */
+static pid_t spawn(char *const argv[]) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+        execv(argv[0], argv);
+        perror("execv failed");
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * @brief 向本机端口发送请求，等待id相同的答复
+ * @return 答复长度，超时返回-1
+ */
+static int exchange(const uint16_t port, const unsigned char *query, const int len, unsigned char *reply,
+                    const int wait_ms) {
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(fd, query, len, 0, (struct sockaddr *) &addr, sizeof(addr));
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int n = -1;
+    while (poll(&pfd, 1, wait_ms) > 0) {
+        n = (int) recv(fd, reply, MAX_PACKET_LEN, 0);
+        if (n >= (int) sizeof(Header) && memcmp(reply, query, 2) == 0)
+            break;
+        n = -1;
+    }
+    close(fd);
+    return n;
+}
+
+/**
+ * @brief 查询中继，返回答复长度
+ */
+static int ask(const char *name, const uint16_t id, const uint16_t udp_size, unsigned char *reply) {
+    unsigned char query[MAX_MSG_LEN];
+    const int len = build_query(query, id, name, A, udp_size);
+    return exchange(relay_port, query, len, reply, REPLY_WAIT_MS);
+}
+
+/**
+ * @brief 反复查询直到端口答复，等待进程启动
+ */
+static int wait_ready(const uint16_t port, const char *name) {
+    unsigned char query[MAX_MSG_LEN], reply[MAX_PACKET_LEN];
+    const int len = build_query(query, 1, name, A, 0);
+    for (int i = 0; i < 10; i++) {
+        if (exchange(port, query, len, reply, PROBE_WAIT_MS) > 0)
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief 答复中第i条回答记录的地址，回答均为Question之后的A记录，域名为指针
+ */
+static uint32_t answer_addr(const unsigned char *reply, const int question_end, const int i) {
+    return read_u32(reply + question_end + i * 16 + 12);
+}
+
+/**
+ * @brief 本地的多条A记录依次从不同的地址开始返回，每次都返回全部地址
+ */
+static void test_rotation() {
+    unsigned char reply[MAX_PACKET_LEN];
+    const int question_end = (int) sizeof(Header) + 10 + 4;
+    uint32_t firsts[3];
+    for (int k = 0; k < 3; k++) {
+        const int len = ask("rot.test", (uint16_t) (10 + k), 0, reply);
+        CHECK_EQ(len, question_end + 3 * 16);
+        if (len != question_end + 3 * 16)
+            return;
+        const Header *h = (Header *) reply;
+        CHECK_EQ(ntohs(h->ancount), 3);
+        CHECK_EQ(h->rcode, 0);
+        uint32_t sum = 0;
+        for (int i = 0; i < 3; i++)
+            sum += answer_addr(reply, question_end, i) & 0xff;
+        CHECK_EQ(sum, 1 + 2 + 3);
+        firsts[k] = answer_addr(reply, question_end, 0);
+        // 轮转只改变起点，地址的循环顺序不变
+        CHECK_EQ(answer_addr(reply, question_end, 1) & 0xff, (firsts[k] & 0xff) % 3 + 1);
+    }
+    CHECK(firsts[0] != firsts[1] && firsts[1] != firsts[2] && firsts[0] != firsts[2]);
+}
+
+/**
+ * @brief 不带EDNS的客户端只收到512字节内能放下的记录并被置TC位；带EDNS的收到全部记录，
+ *        OPT记录声明中继的载荷大小；EDNS版本高于0时答复BADVERS
+ */
+static void test_truncation_and_edns() {
+    unsigned char reply[MAX_PACKET_LEN];
+    const int question_end = (int) sizeof(Header) + 10 + 4;
+    int len = ask("big.test", 20, 0, reply);
+    const Header *h = (Header *) reply;
+    CHECK(len > 0 && len <= MAX_MSG_LEN);
+    CHECK_EQ(h->tc, 1);
+    CHECK_EQ(ntohs(h->ancount), (MAX_MSG_LEN - question_end) / 16);
+    CHECK_EQ(ntohs(h->arcount), 0);
+
+    len = ask("big.test", 21, 4096, reply);
+    CHECK_EQ(len, question_end + BIG_RECORDS * 16 + OPT_LEN);
+    CHECK_EQ(h->tc, 0);
+    CHECK_EQ(ntohs(h->ancount), BIG_RECORDS);
+    CHECK_EQ(ntohs(h->arcount), 1);
+    if (len == question_end + BIG_RECORDS * 16 + OPT_LEN) {
+        const unsigned char *opt = reply + len - OPT_LEN;
+        CHECK_EQ(opt[0], 0);
+        CHECK_EQ(opt[1] << 8 | opt[2], OPT);
+        CHECK_EQ(opt[3] << 8 | opt[4], RELAY_EDNS_SIZE);
+    }
+
+    // 客户端声明的载荷大小不足以放下全部记录时按其大小截断
+    len = ask("big.test", 22, 520, reply);
+    CHECK(len > 0 && len <= 520);
+    CHECK_EQ(h->tc, 1);
+    CHECK_EQ(ntohs(h->arcount), 1);
+
+    unsigned char query[MAX_MSG_LEN];
+    len = build_query(query, 23, "big.test", A, 4096);
+    query[len - OPT_LEN + 6] = 1; // EDNS版本
+    len = exchange(relay_port, query, len, reply, REPLY_WAIT_MS);
+    CHECK_EQ(len, question_end + OPT_LEN);
+    CHECK_EQ(h->rcode, BADVERS & 0xf);
+    CHECK_EQ(ntohs(h->ancount), 0);
+    if (len == question_end + OPT_LEN)
+        CHECK_EQ(reply[len - OPT_LEN + 5], BADVERS >> 4);
+}
+
+/**
+ * @brief 读出中继指标中某项各工作线程的合计
+ */
+static long metric(const char *name) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", metrics_path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+    FILE *in = fdopen(fd, "r");
+    char line[512];
+    long total = 0;
+    const size_t name_len = strlen(name);
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, name, name_len) == 0 && (line[name_len] == ' ' || line[name_len] == '{'))
+            total += strtol(strrchr(line, ' ') + 1, NULL, 10);
+    }
+    fclose(in);
+    return total;
+}
+
+/**
+ * @brief 上游答复之前到达的相同请求合并为一次转发，每个客户端收到带自己的id与域名大小写的答复
+ */
+static void test_coalescing() {
+    static const char *names[COALESCED] = {"co.test", "CO.test", "co.TEST", "Co.TeSt"};
+    const long before = metric("dnsrelay_coalesced_total");
+    CHECK(before >= 0);
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(relay_port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    unsigned char queries[COALESCED][MAX_MSG_LEN];
+    int lens[COALESCED];
+    for (int i = 0; i < COALESCED; i++) {
+        lens[i] = build_query(queries[i], (uint16_t) (0x100 + i), names[i], A, 0);
+        sendto(fd, queries[i], lens[i], 0, (struct sockaddr *) &addr, sizeof(addr));
+    }
+    int got[COALESCED] = {0};
+    unsigned char reply[MAX_PACKET_LEN];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    for (int k = 0; k < COALESCED && poll(&pfd, 1, REPLY_WAIT_MS) > 0; k++) {
+        const int len = (int) recv(fd, reply, sizeof(reply), 0);
+        const int i = (reply[0] << 8 | reply[1]) - 0x100;
+        CHECK(i >= 0 && i < COALESCED);
+        if (i < 0 || i >= COALESCED)
+            continue;
+        got[i]++;
+        const Header *h = (Header *) reply;
+        CHECK_EQ(h->rcode, 0);
+        CHECK_EQ(ntohs(h->ancount), STUB_RECORDS);
+        CHECK(len > lens[i] && memcmp(reply + sizeof(Header), queries[i] + sizeof(Header),
+                                      lens[i] - sizeof(Header)) == 0);
+    }
+    close(fd);
+    for (int i = 0; i < COALESCED; i++)
+        CHECK_EQ(got[i], 1);
+    CHECK_EQ(metric("dnsrelay_coalesced_total") - before, COALESCED - 1);
+}
+
+/**
+ * @brief 上游经UDP的答复被截断时，中继改经TCP向同一服务器查询，客户端收到完整的答复，不带TC位；
+ *        完整的答复已缓存，再次查询不经TCP
+ */
+static void test_tcp() {
+    unsigned char reply[MAX_PACKET_LEN];
+    const int question_end = (int) sizeof(Header) + 10 + 4;
+    const long before = metric("dnsrelay_tcp_queries_total");
+    CHECK(before >= 0);
+    for (int k = 0; k < 2; k++) {
+        const int len = ask("tcp.test", (uint16_t) (30 + k), 0, reply);
+        const Header *h = (Header *) reply;
+        CHECK_EQ(len, question_end + STUB_RECORDS * 16);
+        CHECK_EQ(h->tc, 0);
+        CHECK_EQ(h->rcode, 0);
+        CHECK_EQ(ntohs(h->ancount), STUB_RECORDS);
+        if (len != question_end + STUB_RECORDS * 16)
+            continue;
+        // dnsrelay-stub返回连续的地址
+        for (int i = 1; i < STUB_RECORDS; i++)
+            CHECK_EQ(answer_addr(reply, question_end, i), answer_addr(reply, question_end, 0) + i);
+    }
+    CHECK_EQ(metric("dnsrelay_tcp_queries_total") - before, 1);
+}
+
+/**
+ * @brief 写出本地记录文件
+ */
+static int write_records(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return -1;
+    for (int i = 1; i <= 3; i++)
+        fprintf(file, "10.0.0.%d rot.test\n", i);
+    for (int i = 0; i < BIG_RECORDS; i++)
+        fprintf(file, "10.1.0.%d big.test\n", i);
+    fclose(file);
+    return 0;
+}
+
+int main(const int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <dnsrelay> <dnsrelay-stub>\n", argv[0]);
+        return 2;
+    }
+    char dir[] = "/tmp/dnsrelay-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp failed");
+        return 2;
+    }
+    char records_path[128];
+    snprintf(records_path, sizeof(records_path), "%s/records.txt", dir);
+    snprintf(metrics_path, sizeof(metrics_path), "%s/metrics.sock", dir);
+    if (write_records(records_path) < 0) {
+        perror("write records failed");
+        return 2;
+    }
+    // 按进程号选择端口，并行运行的测试不会冲突
+    relay_port = (uint16_t) (20000 + getpid() % 20000 * 2);
+    stub_port = relay_port + 1;
+    char relay_port_arg[8], stub_port_arg[8], server_arg[32], edns_arg[8], delay_arg[8], records_arg[8],
+            limit_arg[8];
+    snprintf(relay_port_arg, sizeof(relay_port_arg), "%d", relay_port);
+    snprintf(stub_port_arg, sizeof(stub_port_arg), "%d", stub_port);
+    snprintf(server_arg, sizeof(server_arg), "127.0.0.1:%d", stub_port);
+    snprintf(edns_arg, sizeof(edns_arg), "%d", RELAY_EDNS_SIZE);
+    snprintf(delay_arg, sizeof(delay_arg), "%d", STUB_DELAY_MS);
+    snprintf(records_arg, sizeof(records_arg), "%d", STUB_RECORDS);
+    snprintf(limit_arg, sizeof(limit_arg), "%d", STUB_UDP_LIMIT);
+
+    char *stub_argv[] = {argv[2], "-p", stub_port_arg, "-D", delay_arg, "-c", records_arg, "-u", limit_arg, NULL};
+    char *relay_argv[] = {argv[1], "-j", "1", "-P", relay_port_arg, "-s", server_arg, "-e", edns_arg,
+                          "-M", metrics_path, records_path, NULL};
+    const pid_t stub = spawn(stub_argv);
+    const pid_t relay = spawn(relay_argv);
+    if (wait_ready(stub_port, "ready.test") < 0 || wait_ready(relay_port, "rot.test") < 0) {
+        fprintf(stderr, "relay or stub did not start\n");
+        check_failures++;
+    } else {
+        test_rotation();
+        test_truncation_and_edns();
+        test_tcp();
+        test_coalescing();
+    }
+    kill(relay, SIGTERM);
+    kill(stub, SIGTERM);
+    waitpid(relay, NULL, 0);
+    waitpid(stub, NULL, 0);
+    unlink(records_path);
+    unlink(metrics_path);
+    rmdir(dir);
+    return check_result("test_relay");
+}
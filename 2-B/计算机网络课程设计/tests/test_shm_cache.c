@@ -0,0 +1,247 @@
+/**
+ * @file test_shm_cache.c
+ * @brief 共享内存答复缓存的测试：存取与id清零、序号停在奇数的槽超时后被接管、加锁时间晚于当前时间时不接管、
+ *        写者在写的过程中被接管时不再发布，以及两个写者争用同一个槽时读者只读到完整的答复、序号只增不减、
+ *        写完后没有槽停在奇数
+ */
+#include "../include/args_handler.h"
+#include "../include/shm_cache.h"
+#include "check.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+arguments args; // shm_cache依赖的全局参数，这里只用到调试等级
+
+#define ANSWER_LEN 600 // 测试答复的长度，复制的字节较多，争用时写者更容易交错
+#define RACE_PUTS 200000 // 争用测试中每个写者存入的次数
+#define WRITERS 2 // 争用同一个槽的写者数
+
+static shm_cache cache;
+static question_t question; // 所有答复共用的Question，存入同一个桶
+static _Atomic int writers_done; // 已写完的写者数
+static _Atomic uint64_t fake_now; // 接管测试中写者共用的时钟，每次存入前进SHM_STUCK_MS
+static int use_fake_clock; // 是否用fake_now代替单调时钟
+static unsigned char *guarded; // 被保护的页，第一个写者复制到这里时触发SIGSEGV
+static size_t page_size;
+static uint64_t slow_locked_at; // 第一个写者加锁的时间
+
+/**
+ * @brief 单调时钟毫秒数，与中继存入缓存时用的时钟相同
+ */
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 构造答复：Question之后的字节都是marker，读者据此判断读到的答复是否完整
+ * @return 答复长度
+ */
+static int make_answer(unsigned char *msg, const uint8_t marker) {
+    const int len = build_query(msg, 0x1111, "race.example.com", A, 0);
+    ((Header *) msg)->qr = 1;
+    memset(msg + len, marker, ANSWER_LEN - len);
+    return ANSWER_LEN;
+}
+
+/**
+ * @brief 读到的答复是否是某个写者存入的完整答复
+ */
+static int intact(const unsigned char *msg, const shm_entry *e) {
+    if (e->len != ANSWER_LEN || ((const Header *) msg)->id != 0)
+        return 0;
+    for (int i = question.end + 1; i < ANSWER_LEN; i++) {
+        if (msg[i] != msg[question.end])
+            return 0;
+    }
+    return msg[question.end] != 0;
+}
+
+/**
+ * @brief 问题所在的桶中第way个槽的顺序锁
+ */
+static _Atomic uint64_t *lock_of(const int way) {
+    return &((shm_slot *) (cache.slots + ((question.hash & cache.mask) * SHM_WAYS + way) * SHM_SLOT_SIZE))->lock;
+}
+
+static void put(const uint8_t marker, const uint64_t now) {
+    unsigned char msg[ANSWER_LEN];
+    const shm_entry e = {.stored = now, .expire = now + 60000, .len = (uint16_t) make_answer(msg, marker)};
+    shm_cache_put(&cache, &question, question.hash, msg, &e);
+}
+
+static int get(unsigned char *msg, shm_entry *e) {
+    return shm_cache_get(&cache, &question, question.hash, msg, e);
+}
+
+/**
+ * @brief 存入的答复原样取出，id清零；类型不同的Question不命中
+ */
+static void test_put_get() {
+    unsigned char msg[SHM_SLOT_SIZE];
+    shm_entry e;
+    CHECK(get(msg, &e) < 0);
+    put(1, 1000);
+    CHECK_EQ(get(msg, &e), 0);
+    CHECK(intact(msg, &e));
+    CHECK_EQ(msg[question.end], 1);
+    CHECK_EQ(e.stored, 1000);
+    CHECK_EQ(e.expire, 61000);
+    question_t other = question;
+    other.qtype = AAAA;
+    CHECK(shm_cache_get(&cache, &other, other.hash, msg, &e) < 0);
+}
+
+/**
+ * @brief 写者异常退出后序号停在奇数：读者视为未命中；加锁不到SHM_STUCK_MS或加锁时间晚于当前时间时不接管，
+ *        超过后接管并发布新的答复
+ */
+static void test_stuck_writer() {
+    _Atomic uint64_t *lock = lock_of(0);
+    const uint32_t seq = (uint32_t) atomic_load(lock);
+    CHECK(seq != 0 && seq % 2 == 0);
+    atomic_store(lock, (uint64_t) 5000 << 32 | (seq + 1));
+    unsigned char msg[SHM_SLOT_SIZE];
+    shm_entry e;
+    CHECK(get(msg, &e) < 0);
+
+    put(2, 5000 + SHM_STUCK_MS - 1);
+    CHECK_EQ(atomic_load(lock), (uint64_t) 5000 << 32 | (seq + 1));
+    put(2, 4990);
+    CHECK_EQ(atomic_load(lock), (uint64_t) 5000 << 32 | (seq + 1));
+
+    put(3, 5000 + SHM_STUCK_MS);
+    CHECK_EQ(atomic_load(lock), seq + 4);
+    CHECK_EQ(get(msg, &e), 0);
+    CHECK(intact(msg, &e));
+    CHECK_EQ(msg[question.end], 3);
+}
+
+/**
+ * @brief 第一个写者复制答复到一半时进入这里：恢复页的权限，由第二个写者在SHM_STUCK_MS后接管该槽并写完，
+ *        之后第一个写者继续复制
+ */
+static void on_fault(int sig) {
+    (void) sig;
+    mprotect(guarded, page_size, PROT_READ | PROT_WRITE);
+    put(6, slow_locked_at + SHM_STUCK_MS);
+}
+
+/**
+ * @brief 写者加锁后迟迟未写完，被第二个写者接管：接管者的答复发布后，第一个写者的CAS失败，不再把序号改回自己的，
+ *        之后序号仍只增不减
+ */
+static void test_takeover_during_write() {
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    unsigned char *pages = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(pages != MAP_FAILED);
+    if (pages == MAP_FAILED)
+        return;
+    // 答复的前半在可读的页，后半在被保护的页
+    unsigned char *msg = pages + page_size - ANSWER_LEN / 2;
+    make_answer(msg, 5);
+    guarded = pages + page_size;
+    mprotect(guarded, page_size, PROT_NONE);
+    struct sigaction sa = {.sa_handler = on_fault}, old;
+    sigaction(SIGSEGV, &sa, &old);
+
+    _Atomic uint64_t *lock = lock_of(0);
+    const uint32_t seq = (uint32_t) atomic_load(lock);
+    slow_locked_at = 20000;
+    const shm_entry e = {.stored = slow_locked_at, .expire = slow_locked_at + 60000, .len = ANSWER_LEN};
+    shm_cache_put(&cache, &question, question.hash, msg, &e);
+    sigaction(SIGSEGV, &old, NULL);
+    munmap(pages, 2 * page_size);
+    // 第一个写者加锁为seq+1，第二个写者接管为seq+3并发布为seq+4，第一个写者不再发布seq+2
+    CHECK_EQ(atomic_load(lock), seq + 4);
+    unsigned char out[SHM_SLOT_SIZE];
+    shm_entry got;
+    CHECK_EQ(get(out, &got), 0);
+}
+
+/**
+ * @brief 写者反复存入同一Question的答复，内容随次数变化
+ */
+static void *writer(void *arg) {
+    const int id = (int) (intptr_t) arg;
+    for (int i = 0; i < RACE_PUTS; i++) {
+        const uint64_t now = use_fake_clock ? atomic_fetch_add(&fake_now, SHM_STUCK_MS) : monotonic_ms();
+        put((uint8_t) (16 * (id + 1) + i % 16), now);
+    }
+    atomic_fetch_add(&writers_done, 1);
+    return NULL;
+}
+
+/**
+ * @brief 多个写者争用同一个槽，读者在写的同时检查：各槽的序号只增不减；check_content时读到的答复都是完整的。
+ *        写完后桶中没有槽停在奇数，最后的答复可以读出
+ * @param check_content 是否检查答复完整，写者频繁互相接管时两个写者可能同时写一个槽，不检查
+ * @return 读者命中的次数
+ */
+static long race(const int check_content) {
+    pthread_t threads[WRITERS];
+    atomic_store(&writers_done, 0);
+    for (int i = 0; i < WRITERS; i++)
+        pthread_create(&threads[i], NULL, writer, (void *) (intptr_t) i);
+    uint32_t last[SHM_WAYS] = {0};
+    long hits = 0, regressions = 0, torn = 0;
+    unsigned char msg[SHM_SLOT_SIZE];
+    shm_entry e;
+    while (atomic_load(&writers_done) < WRITERS) {
+        for (int way = 0; way < SHM_WAYS; way++) {
+            const uint32_t seq = (uint32_t) atomic_load(lock_of(way));
+            if (seq < last[way])
+                regressions++;
+            last[way] = seq;
+        }
+        if (get(msg, &e) == 0) {
+            hits++;
+            if (check_content && !intact(msg, &e))
+                torn++;
+        }
+    }
+    for (int i = 0; i < WRITERS; i++)
+        pthread_join(threads[i], NULL);
+    CHECK_EQ(regressions, 0);
+    CHECK_EQ(torn, 0);
+    for (int way = 0; way < SHM_WAYS; way++)
+        CHECK_EQ((uint32_t) atomic_load(lock_of(way)) % 2, 0);
+    CHECK_EQ(get(msg, &e), 0);
+    CHECK(intact(msg, &e));
+    return hits;
+}
+
+/**
+ * @brief 两个写者争用同一个槽：按真实时钟时不会互相接管，读者只读到完整的答复；
+ *        按每次前进SHM_STUCK_MS的时钟时每个锁都像已超时，写者频繁互相接管，被接管的写者不得再发布
+ */
+static void test_race() {
+    use_fake_clock = 0;
+    CHECK(race(1) > 0);
+    use_fake_clock = 1;
+    atomic_store(&fake_now, monotonic_ms());
+    race(0);
+}
+
+int main() {
+    char name[64];
+    snprintf(name, sizeof(name), "/dnsrelay-test-%d", (int) getpid());
+    if (shm_cache_open(&cache, name, 1 << 20) < 0)
+        return 1;
+    unsigned char msg[ANSWER_LEN];
+    const int len = make_answer(msg, 1);
+    memset(&question, 0, sizeof(question));
+    CHECK_EQ(parse_question(msg, len, &question), 0);
+    test_put_get();
+    test_stuck_writer();
+    test_takeover_during_write();
+    test_race();
+    munmap(cache.header, cache.size);
+    shm_unlink(name);
+    return check_result("test_shm_cache");
+}